@@ -1,4 +1,13 @@
 {
+  "variables": {
+    # Profile guided optimisation: "generate" builds an instrumented binding
+    # writing profiles to `pgo_dir`; "use" optimises with those profiles.  See
+    # `tools/pgo-build.sh`.
+    "pgo%": "",
+    "pgo_dir%": "/tmp/node-mapserv-pgo",
+    # Link time optimisation
+    "lto%": "false"
+  },
   "targets": [
     {
       "target_name": "bindings",
@@ -6,6 +15,19 @@
         "src/node-mapserv.cpp",
         "src/map.cpp",
         "src/error.cpp",
+        "src/projcache.cpp",
+        "src/pixmaps.cpp",
+        "src/compress.cpp",
+        "src/trace.cpp",
+        "src/slowlog.cpp",
+        "src/profile.cpp",
+        "src/tiles.cpp",
+        "src/rendercache.cpp",
+        "src/perfcounters.cpp",
+        "src/features.cpp",
+        "src/overrides.cpp",
+        "src/variants.cpp",
+        "src/analyze.cpp",
         "src/node-mapservutil.c"
       ],
       "include_dirs": [
@@ -30,13 +52,25 @@
             '<!@(python tools/config.py --ldflags)'
           ],
           'libraries': [
-            '<!@(python tools/config.py --libraries)'
+            '<!@(python tools/config.py --libraries)',
+            '-lsqlite3'
           ],
           'cflags': [
             '<!@(python tools/config.py --cflags)',
             '-Wall'
           ]
         }],
+        ['OS=="linux" and pgo=="generate"', {
+          'cflags': ['-fprofile-generate', '-fprofile-dir=<(pgo_dir)'],
+          'ldflags': ['-fprofile-generate']
+        }],
+        ['OS=="linux" and pgo=="use"', {
+          'cflags': ['-fprofile-use', '-fprofile-dir=<(pgo_dir)', '-fprofile-correction']
+        }],
+        ['OS=="linux" and lto=="true"', {
+          'cflags': ['-flto'],
+          'ldflags': ['-flto', '-O3']
+        }],
         ['OS=="win"', {
             "variables": {
                 'ms_buildkit%': 'Z:/PATH/TO/MAPSERVER_BUILDKIT',
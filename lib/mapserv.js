@@ -34,6 +34,8 @@
  */
 
 var bindings,
+    fs = require('fs'),         // for writing traces
+    os = require('os'),         // for the temporary directory
     path = require('path'),     // for file path manipulations
     url = require('url');       // for url parsing
 
@@ -119,6 +121,179 @@ function createCGIEnvironment(req, vars) {
     return env;
 }
 
+/**
+ * Create a Node HTTP request handler serving a map
+ *
+ * The returned function has the signature `handler(req, res)` and can be
+ * passed directly to `http.createServer`.  The CGI environment is built
+ * natively by `Map.handle` from the request, avoiding the creation of an
+ * intermediate environment object.  `options` is passed to `Map.handle` and
+ * can contain the following properties:
+ *
+ * - `vars`: CGI variables overriding those derived from the request
+ * - `compression`, `compressionLevel`, `compressionThreshold`: as accepted by
+ *   `Map.mapserv`
+ * - `onError`: a function called with any error generated by Mapserver, which
+ *   defaults to `console.error`
+ *
+ * The response is sent with the status set by Mapserver, or 200.  If no
+ * response was generated, or `Map.handle` throws (e.g. because the map has
+ * been disposed), a plain 500 error is sent without any details.  Invalid
+ * options throw a `TypeError` when the handler is created rather than
+ * failing every request.
+ */
+function createHandler(map, options) {
+    options = options || {};
+
+    if (!(map instanceof bindings.Map)) {
+        throw new TypeError('`map` must be a `Map`');
+    }
+    if (options.vars !== undefined && (options.vars === null || typeof(options.vars) != 'object')) {
+        throw new TypeError('`vars` must be an object');
+    }
+    if (options.onError !== undefined && typeof(options.onError) != 'function') {
+        throw new TypeError('`onError` must be a function');
+    }
+    if (options.compressionLevel !== undefined
+        && (typeof(options.compressionLevel) != 'number' || options.compressionLevel % 1
+            || options.compressionLevel < 1 || options.compressionLevel > 9)) {
+        throw new TypeError('`compressionLevel` must be an integer between 1 and 9');
+    }
+    if (options.compressionThreshold !== undefined
+        && (typeof(options.compressionThreshold) != 'number' || options.compressionThreshold % 1
+            || options.compressionThreshold < 0)) {
+        throw new TypeError('`compressionThreshold` must be a non-negative integer');
+    }
+
+    var onError = options.onError || console.error;
+
+    // the error details stay on the server as they may reveal file paths and
+    // configuration
+    function fail(res, err) {
+        onError(err);
+        res.writeHead(500, {'Content-Type': 'text/plain'});
+        res.end('Internal Server Error');
+    }
+
+    return function handler(req, res) {
+        var chunks = [],
+            length = 0;
+
+        req.on('data', function onData(chunk) {
+            chunks.push(chunk);
+            length += chunk.length;
+        });
+
+        req.on('end', function onEnd() {
+            var body = length ? Buffer.concat(chunks, length) : null;
+
+            try {
+                map.handle(req, body, options, function onResponse(err, response) {
+                    var headers = {},
+                        key;
+
+                    if (!response || !response.data) {
+                        return fail(res, err || new Error('Mapserver generated no response'));
+                    }
+                    if (err) {
+                        onError(err);
+                    }
+
+                    for (key in response.headers) {
+                        headers[key] = response.headers[key][0];
+                    }
+                    res.writeHead(response.status || 200, headers);
+                    res.end(response.data);
+                });
+            } catch (err) {
+                fail(res, err);
+            }
+        });
+    };
+}
+
+/**
+ * Request tracing
+ *
+ * When enabled the lifecycle of every `mapserv` and `handle` request is
+ * recorded in per thread ring buffers.  The result can be exported in the
+ * Chrome trace event format for viewing in `chrome://tracing` or Perfetto.
+ */
+var tracing = (function () {
+    var listener = null,
+        signal = null;
+
+    return {
+        /**
+         * Start recording requests
+         *
+         * If `options.signal` is set (e.g. to `'SIGUSR2'`) the trace is
+         * written to `options.path` whenever the process receives that
+         * signal.  The path defaults to `mapserv-trace-<pid>.json` in the
+         * temporary directory.
+         */
+        enable: function enable(options) {
+            options = options || {};
+            tracing.disable();
+            bindings.traceEnable(true);
+
+            if (options.signal) {
+                var file = options.path || path.join(os.tmpdir(), 'mapserv-trace-' + process.pid + '.json');
+                signal = options.signal;
+                listener = function onSignal() {
+                    fs.writeFile(file, bindings.traceDump());
+                };
+                process.on(signal, listener);
+            }
+        },
+
+        /// Stop recording requests
+        disable: function disable() {
+            bindings.traceEnable(false);
+            if (listener) {
+                process.removeListener(signal, listener);
+                listener = signal = null;
+            }
+        },
+
+        /// Discard the requests recorded so far
+        clear: function clear() {
+            bindings.traceClear();
+        },
+
+        /**
+         * Export the trace
+         *
+         * The trace is returned as a JSON string or, if `file` is given,
+         * written to that file before `callback(err)` is called.
+         */
+        dump: function dump(file, callback) {
+            var json = bindings.traceDump();
+            if (!file) {
+                return json;
+            }
+            fs.writeFile(file, json, callback);
+        }
+    };
+}());
+
+/**
+ * Slow request capture
+ *
+ * Requests taking longer than a threshold are recorded with the context
+ * needed to reproduce them.  See the README for details.
+ */
+var slowRequests = {
+    configure: bindings.slowLogConfigure,
+    drain: bindings.slowLogDrain
+};
+
 module.exports.Map = bindings.Map;
 module.exports.versions = bindings.versions;
+module.exports.projectionCacheStats = bindings.projectionCacheStats;
+module.exports.memoryUsage = bindings.memoryUsage;
+module.exports.composite = bindings.composite;
 module.exports.createCGIEnvironment = createCGIEnvironment;
+module.exports.createHandler = createHandler;
+module.exports.tracing = tracing;
+module.exports.slowRequests = slowRequests;
@@ -0,0 +1,360 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file analyze.cpp
+ * @brief This defines the search of a map for slow configuration.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "analyze.hpp"
+#include "maptree.h"
+
+using std::string;
+
+/// Layers with more features than this should be limited by scale
+#define UNBOUNDED_FEATURES 100000
+
+/// Rasters wider or taller than this benefit from tiling and overviews
+#define LARGE_RASTER 2048
+
+/// The maximum number of TIFF directories read
+#define TIFF_MAX_DIRECTORIES 64
+
+/// Does a file exist?
+static bool fileExists(const string &path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+}
+
+/// Does a path end with an extension, ignoring case?
+static bool hasExtension(const string &path, const char *extension) {
+  size_t length = strlen(extension);
+  return path.length() > length && strcasecmp(path.c_str() + path.length() - length, extension) == 0;
+}
+
+/// Resolve the path of a layer data file as Mapserver does
+static string dataPath(mapObj *map, const char *data) {
+  char path[MS_MAXPATHLEN];
+
+  if (!msBuildPath3(path, map->mappath, map->shapepath, data)) {
+    return data;
+  }
+  return path;
+}
+
+/// Add a finding about a layer
+static Finding& addFinding(std::vector<Finding> &findings, layerObj *layer, const char *type,
+                           const char *severity, const string &message, const string &path) {
+  Finding finding;
+
+  finding.layer = layer->name ? layer->name : "";
+  finding.type = type;
+  finding.severity = severity;
+  finding.message = message;
+  finding.path = path;
+  finding.features = -1;
+  finding.attempted = false;
+  finding.fixed = false;
+  findings.push_back(finding);
+  return findings.back();
+}
+
+/**
+ * @brief The layout of a TIFF file relevant to drawing it
+ */
+struct TiffLayout {
+  /// The size of the full resolution image
+  uint32_t width, height;
+  /// Is the full resolution image tiled?
+  bool tiled;
+  /// The number of directories after the first, usually overviews
+  int overviews;
+};
+
+/// Read an unsigned integer of a TIFF file in its byte order
+static uint32_t tiffValue(const unsigned char *bytes, int size, bool big_endian) {
+  uint32_t value = 0;
+  for (int i = 0; i < size; ++i) {
+    value |= static_cast<uint32_t>(bytes[big_endian ? i : size - 1 - i]) << (8 * (size - 1 - i));
+  }
+  return value;
+}
+
+/**
+ * @details Only the directory entries of a classic TIFF are read: BigTIFF
+ * and other formats are left alone.
+ *
+ * @return `false` if the file is not a readable classic TIFF.
+ */
+static bool readTiffLayout(const string &path, TiffLayout *layout) {
+  FILE *file = fopen(path.c_str(), "rb");
+  unsigned char header[8], entry[12], bytes[4];
+  bool big_endian, valid = false;
+  uint32_t offset;
+
+  if (!file) {
+    return false;
+  }
+
+  memset(layout, 0, sizeof(TiffLayout));
+  if (fread(header, 1, 8, file) != 8
+      || !((header[0] == 'I' && header[1] == 'I') || (header[0] == 'M' && header[1] == 'M'))) {
+    fclose(file);
+    return false;
+  }
+  big_endian = (header[0] == 'M');
+  if (tiffValue(header + 2, 2, big_endian) != 42) {
+    fclose(file);
+    return false;
+  }
+  offset = tiffValue(header + 4, 4, big_endian);
+
+  for (int directory = 0; offset && directory < TIFF_MAX_DIRECTORIES; ++directory) {
+    if (fseek(file, offset, SEEK_SET) != 0 || fread(bytes, 1, 2, file) != 2) {
+      break;
+    }
+
+    uint32_t entries = tiffValue(bytes, 2, big_endian);
+    for (uint32_t i = 0; directory == 0 && i < entries; ++i) {
+      if (fread(entry, 1, 12, file) != 12) {
+        break;
+      }
+
+      uint32_t tag = tiffValue(entry, 2, big_endian), type = tiffValue(entry + 2, 2, big_endian);
+      uint32_t value = (type == 3) ? tiffValue(entry + 8, 2, big_endian) : tiffValue(entry + 8, 4, big_endian);
+      switch (tag) {
+      case 256:                 // ImageWidth
+        layout->width = value;
+        break;
+      case 257:                 // ImageLength
+        layout->height = value;
+        break;
+      case 322:                 // TileWidth
+        layout->tiled = true;
+        break;
+      }
+    }
+
+    if (directory == 0) {
+      valid = true;
+    } else {
+      layout->overviews++;
+    }
+
+    if (fseek(file, offset + 2 + entries * 12, SEEK_SET) != 0 || fread(bytes, 1, 4, file) != 4) {
+      break;
+    }
+    offset = tiffValue(bytes, 4, big_endian);
+  }
+
+  fclose(file);
+  return valid;
+}
+
+/**
+ * @details The index is written to a temporary file which then replaces
+ * any existing index, so that requests never read a partial index.
+ *
+ * @return `false`, setting `error`, if the index could not be built.
+ */
+static bool buildIndex(const string &shapefile, const string &index, string &error) {
+  string temporary = index + ".tmp";
+  shapefileObj shp;
+  treeObj *tree;
+
+  if (msShapefileOpen(&shp, const_cast<char *>("rb"), const_cast<char *>(shapefile.c_str()), MS_TRUE) == -1) {
+    error = "The shapefile could not be opened";
+    return false;
+  }
+
+  // a depth of 0 lets Mapserver choose one from the number of shapes
+  tree = msCreateTree(&shp, 0);
+  msShapefileClose(&shp);
+  if (!tree) {
+    error = "The index could not be created";
+    return false;
+  }
+
+  bool written = (msWriteTree(tree, const_cast<char *>(temporary.c_str()), MS_NEW_LSB_ORDER) == MS_TRUE);
+  msDestroyTree(tree);
+  if (!written || rename(temporary.c_str(), index.c_str()) != 0) {
+    remove(temporary.c_str());
+    error = "The index could not be written";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @details The index of a shapefile sits beside it with the extension
+ * `.qix`, which is how Mapserver finds it.
+ */
+static void analyzeShapefile(layerObj *layer, const string &path, bool fix,
+                             std::vector<Finding> &findings, long *features) {
+  string base = hasExtension(path, ".shp") ? path.substr(0, path.length() - 4) : path;
+  shapefileObj shp;
+
+  *features = -1;
+  if (!fileExists(base + ".shp") && !fileExists(base + ".SHP")) {
+    addFinding(findings, layer, "missing-data", "warning",
+               "The shapefile does not exist", path);
+    return;
+  }
+
+  if (msShapefileOpen(&shp, const_cast<char *>("rb"), const_cast<char *>(path.c_str()), MS_FALSE) != -1) {
+    *features = shp.numshapes;
+    msShapefileClose(&shp);
+  }
+
+  if (fileExists(base + MS_INDEX_EXTENSION)) {
+    return;
+  }
+
+  Finding &finding = addFinding(findings, layer, "missing-index", "warning",
+                                "The shapefile has no quadtree index, so every shape is read to find those in the "
+                                "extent: create one with `shptree` or `analyze({fix: true})`", path);
+  finding.features = *features;
+  if (fix) {
+    finding.attempted = true;
+    finding.fixed = buildIndex(path, base + MS_INDEX_EXTENSION, finding.error);
+    msResetErrorList();
+  }
+}
+
+/// Inspect a raster file, which is only possible for classic TIFFs
+static void analyzeRaster(layerObj *layer, const string &path, std::vector<Finding> &findings) {
+  TiffLayout layout;
+
+  if (!fileExists(path)) {
+    addFinding(findings, layer, "missing-data", "warning", "The raster does not exist", path);
+    return;
+  }
+  if (!(hasExtension(path, ".tif") || hasExtension(path, ".tiff")) || !readTiffLayout(path, &layout)) {
+    return;
+  }
+  if (layout.width <= LARGE_RASTER && layout.height <= LARGE_RASTER) {
+    return;
+  }
+
+  if (!layout.tiled) {
+    addFinding(findings, layer, "raster-tiling", "warning",
+               "The raster is stored in strips, so drawing a small area reads whole rows of it: "
+               "rewrite it with `gdal_translate -co TILED=YES`", path);
+  }
+  if (!layout.overviews && !fileExists(path + ".ovr")) {
+    addFinding(findings, layer, "raster-overviews", "warning",
+               "The raster has no overviews, so drawing it at small scales reads it at full "
+               "resolution: create them with `gdaladdo`", path);
+  }
+}
+
+/// Are all the features of a layer limited to large scales?
+static bool scaleLimited(layerObj *layer) {
+  if (layer->maxscaledenom > 0) {
+    return true;
+  }
+  for (int i = 0; i < layer->numclasses; ++i) {
+    if (layer->_class[i]->maxscaledenom <= 0) {
+      return false;
+    }
+  }
+  return layer->numclasses > 0;
+}
+
+/**
+ * @details Each layer is inspected in turn:
+ *
+ * - Shapefiles, and shapefile tile indexes, without a `.qix` quadtree index
+ *   (`missing-index`).  If `fix` is set the index is built.
+ * - Layers whose data does not exist (`missing-data`).
+ * - Large TIFF rasters stored in strips (`raster-tiling`) or without internal
+ *   or `.ovr` overviews (`raster-overviews`).
+ * - Shapefile layers of more than `UNBOUNDED_FEATURES` features drawn at
+ *   every scale (`unbounded-scale`).
+ * - Shapefile layers with an attribute `FILTER`, which is evaluated against
+ *   every feature in the extent as shapefiles have no attribute indexes
+ *   (`attribute-filter`).
+ *
+ * Data paths containing runtime substitutions cannot be resolved and are
+ * skipped, as are database connections, which would have to be queried.
+ * This runs in a worker thread and does not alter `map`.
+ *
+ * @param map The map to inspect.
+ *
+ * @param fix Should missing shapefile indexes be built?
+ *
+ * @param findings Populated with the problems found.
+ */
+void AnalyzeMap(mapObj *map, bool fix, std::vector<Finding> &findings) {
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+    long features = -1;
+
+    if (layer->type == MS_LAYER_RASTER) {
+      if (layer->data && *layer->data && !layer->tileindex && !strchr(layer->data, '%')) {
+        analyzeRaster(layer, dataPath(map, layer->data), findings);
+      }
+      continue;
+    }
+
+    if (layer->connectiontype == MS_TILED_SHAPEFILE && layer->tileindex
+        && msGetLayerIndex(map, layer->tileindex) == -1 && !strchr(layer->tileindex, '%')) {
+      long tiles;
+      analyzeShapefile(layer, dataPath(map, layer->tileindex), fix, findings, &tiles);
+    }
+
+    if (layer->connectiontype == MS_SHAPEFILE && layer->data && *layer->data
+        && !strchr(layer->data, '%')) {
+      analyzeShapefile(layer, dataPath(map, layer->data), fix, findings, &features);
+    }
+
+    if (layer->connectiontype != MS_SHAPEFILE && layer->connectiontype != MS_TILED_SHAPEFILE) {
+      continue;
+    }
+
+    if (features > UNBOUNDED_FEATURES && !scaleLimited(layer)) {
+      char message[256];
+
+      snprintf(message, sizeof(message),
+               "The layer draws all of its %ld features at every scale: set MAXSCALEDENOM on the "
+               "layer or its classes", features);
+      addFinding(findings, layer, "unbounded-scale", "warning", message, "").features = features;
+    }
+
+    if (layer->filter.string && *layer->filter.string) {
+      addFinding(findings, layer, "attribute-filter", "info",
+                 "The FILTER is evaluated against the attributes of every feature in the extent, "
+                 "as shapefiles have no attribute indexes: consider splitting the data by the "
+                 "filtered attribute", "");
+    }
+  }
+}
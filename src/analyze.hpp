@@ -0,0 +1,74 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_ANALYZE_H__
+#define __NODE_MAPSERV_ANALYZE_H__
+
+/**
+ * @file analyze.hpp
+ * @brief This declares the search of a map for slow configuration.
+ *
+ * Many slow maps are slow because of how their data is configured rather
+ * than how much of it there is: shapefiles without a quadtree index, rasters
+ * without overviews or tiling, large layers drawn at every scale and filters
+ * evaluated against every feature.  The layers of a map are inspected for
+ * these without drawing them.
+ */
+
+// Standard headers
+#include <string>
+#include <vector>
+
+// Mapserver headers
+#include "mapserver.h"
+
+/// A configuration problem that slows drawing a map
+struct Finding {
+  /// The name of the layer, or empty if it has none
+  std::string layer;
+  /// The kind of problem e.g. `missing-index`
+  std::string type;
+  /// `warning` or `info`
+  std::string severity;
+  /// A description of the problem and its remedy
+  std::string message;
+  /// The data file concerned, or empty
+  std::string path;
+  /// The number of features in the data, or -1 if unknown
+  long features;
+  /// Was a fix attempted?
+  bool attempted;
+  /// Was the problem fixed?
+  bool fixed;
+  /// Why the fix failed, or empty
+  std::string error;
+};
+
+/// Inspect the layers of a map, building missing shapefile indexes if `fix`
+void AnalyzeMap(mapObj *map, bool fix, std::vector<Finding> &findings);
+
+#endif  /* __NODE_MAPSERV_ANALYZE_H__ */
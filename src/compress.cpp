@@ -0,0 +1,220 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file compress.cpp
+ * @brief This defines functions for compressing mapserv responses.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "mapserver.h"
+#include "compress.hpp"
+
+/**
+ * @details This parses a comma separated list of codings with optional
+ * quality values, e.g. `gzip;q=1.0, deflate;q=0.5`, returning the acceptable
+ * coding with the highest quality.  `gzip` is preferred when qualities are
+ * equal and is used to satisfy the `*` wildcard.
+ *
+ * @param accept_encoding The header value, or `NULL`.
+ */
+ContentEncoding NegotiateEncoding(const char *accept_encoding) {
+  ContentEncoding best = ENCODING_IDENTITY;
+  double best_q = 0;
+  const char *p = accept_encoding;
+
+  if (!p) {
+    return ENCODING_IDENTITY;
+  }
+
+  while (*p) {
+    const char *start, *end;
+    ContentEncoding encoding = ENCODING_IDENTITY;
+    double q = 1;
+
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    start = p;
+    while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+    end = p;
+
+    // parameters e.g. `;q=0.5`
+    while (*p && *p != ',') {
+      if (*p == ';') {
+        const char *param = p + 1;
+        while (*param == ' ' || *param == '\t') param++;
+        if ((*param == 'q' || *param == 'Q') && param[1] == '=') {
+          q = atof(param + 2);
+        }
+      }
+      p++;
+    }
+
+    size_t length = end - start;
+    if ((length == 4 && !strncasecmp(start, "gzip", 4))
+        || (length == 6 && !strncasecmp(start, "x-gzip", 6))
+        || (length == 1 && *start == '*')) {
+      encoding = ENCODING_GZIP;
+    } else if (length == 7 && !strncasecmp(start, "deflate", 7)) {
+      encoding = ENCODING_DEFLATE;
+    }
+
+    if (encoding != ENCODING_IDENTITY && q > 0
+        && (q > best_q || (q == best_q && encoding == ENCODING_GZIP))) {
+      best = encoding;
+      best_q = q;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * @param encoding The content coding.
+ *
+ * @return The header value or `NULL` for `ENCODING_IDENTITY`.
+ */
+const char* EncodingName(ContentEncoding encoding) {
+  switch (encoding) {
+  case ENCODING_GZIP:
+    return "gzip";
+  case ENCODING_DEFLATE:
+    return "deflate";
+  default:
+    return NULL;
+  }
+}
+
+/**
+ * @details Text, XML, JSON and javascript content types are compressible.
+ * Image formats are already compressed and are left alone, with the
+ * exception of SVG.
+ *
+ * @param content_type The content type, possibly including parameters.
+ */
+bool IsCompressible(const char *content_type) {
+  static const char *types[] = {
+    "application/xml",
+    "application/json",
+    "application/javascript",
+    "application/x-javascript",
+    "application/vnd.ogc.se_xml",
+    "application/vnd.ogc.wms_xml",
+    "application/vnd.ogc.gml",
+    "application/vnd.geo+json",
+    "image/svg+xml",
+    NULL
+  };
+
+  if (!content_type) {
+    return false;
+  }
+
+  size_t length = strcspn(content_type, "; ");
+  if (length >= 5 && !strncasecmp(content_type, "text/", 5)) {
+    return true;
+  }
+  if (length >= 4 && !strncasecmp(content_type + length - 4, "+xml", 4)) {
+    return true;
+  }
+  for (int i = 0; types[i]; ++i) {
+    if (strlen(types[i]) == length && !strncasecmp(content_type, types[i], length)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @details Small responses are compressed thoroughly as doing so is cheap,
+ * whereas large responses favour speed so the worker thread is not tied up.
+ *
+ * @param size The uncompressed size in bytes.
+ */
+int CompressionLevel(size_t size) {
+  if (size < 256 * 1024) {
+    return 6;
+  } else if (size < 4 * 1024 * 1024) {
+    return 4;
+  }
+  return 1;
+}
+
+/**
+ * @details `ENCODING_GZIP` produces a gzip stream and `ENCODING_DEFLATE` a
+ * zlib stream, as expected by the HTTP `deflate` coding.
+ *
+ * @param data The data to compress.
+ *
+ * @param size The size of `data` in bytes.
+ *
+ * @param encoding The content coding.
+ *
+ * @param level The zlib compression level.
+ *
+ * @param compressed_size Set to the size of the compressed data.
+ *
+ * @return The compressed data, to be freed with `msFree`, or `NULL` if
+ * compression failed or did not reduce the size of the data.
+ */
+unsigned char* Compress(const unsigned char *data, size_t size,
+                        ContentEncoding encoding, int level,
+                        size_t *compressed_size) {
+  z_stream stream;
+  int window_bits = (encoding == ENCODING_GZIP) ? 15 + 16 : 15;
+  unsigned char *output;
+  size_t bound;
+
+  if (encoding == ENCODING_IDENTITY) {
+    return NULL;
+  }
+
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+
+  bound = deflateBound(&stream, size) + 18; // allow for the gzip wrapper
+  output = (unsigned char *) msSmallMalloc(bound);
+
+  stream.next_in = const_cast<Bytef *>(data);
+  stream.avail_in = size;
+  stream.next_out = output;
+  stream.avail_out = bound;
+
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END || stream.total_out >= size) {
+    deflateEnd(&stream);
+    msFree(output);
+    return NULL;
+  }
+
+  *compressed_size = stream.total_out;
+  deflateEnd(&stream);
+  return output;
+}
@@ -0,0 +1,70 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_COMPRESS_H__
+#define __NODE_MAPSERV_COMPRESS_H__
+
+/**
+ * @file compress.hpp
+ * @brief This declares functions for compressing mapserv responses.
+ *
+ * Text responses such as GML, GeoJSON, capabilities documents and HTML
+ * templates compress well.  These functions allow them to be compressed in
+ * the worker thread that generated them, before they are passed to Node.
+ */
+
+// Standard headers
+#include <stddef.h>
+
+/// The default minimum response size in bytes worth compressing
+#define COMPRESSION_THRESHOLD 1024
+
+/// The content codings that a response can be compressed with
+enum ContentEncoding {
+  ENCODING_IDENTITY = 0,
+  ENCODING_GZIP,
+  ENCODING_DEFLATE
+};
+
+/// Choose a content coding from an `Accept-Encoding` header value
+ContentEncoding NegotiateEncoding(const char *accept_encoding);
+
+/// Get the `Content-Encoding` header value for a content coding
+const char* EncodingName(ContentEncoding encoding);
+
+/// Check whether a content type is worth compressing
+bool IsCompressible(const char *content_type);
+
+/// Choose a compression level appropriate to the size of the data
+int CompressionLevel(size_t size);
+
+/// Compress data into a buffer allocated with `msSmallMalloc`
+unsigned char* Compress(const unsigned char *data, size_t size,
+                        ContentEncoding encoding, int level,
+                        size_t *compressed_size);
+
+#endif  /* __NODE_MAPSERV_COMPRESS_H__ */
@@ -90,6 +90,11 @@ public:
   /// Convert the error to a V8 exception
   Handle<Value> toV8Error();
 
+  /// Get the error message
+  const std::string& getMessage() const {
+    return message;
+  }
+
 private:
 
   /// The Mapserver error code
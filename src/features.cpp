@@ -0,0 +1,599 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file features.cpp
+ * @brief This defines the `FeatureLayer` class.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include "features.hpp"
+
+/// The state of a layer bound to features, held in its `layerinfo`
+struct BoundFeatures {
+  /// The features drawn by the layer
+  const FeatureLayer *features;
+  /// The shape type of the features
+  int type;
+  /// The number of features
+  size_t count;
+  /// Is the layer open?
+  bool open;
+  /// The next feature to be read by `NextShape`
+  size_t next;
+  /// The extent selected by `WhichShapes`
+  rectObj rect;
+};
+
+/// Get the shape type drawn by a layer type, or `MS_SHAPE_NULL`
+static int shapeType(int type) {
+  switch (type) {
+  case MS_LAYER_POINT:
+    return MS_SHAPE_POINT;
+  case MS_LAYER_LINE:
+    return MS_SHAPE_LINE;
+  case MS_LAYER_POLYGON:
+    return MS_SHAPE_POLYGON;
+  default:
+    return MS_SHAPE_NULL;
+  }
+}
+
+/// Get the bounds of a feature, returning `false` if it has no vertices
+static bool featureBounds(const BoundFeatures *state, size_t feature, rectObj *bounds) {
+  const std::vector<double> &coordinates = state->features->coordinates;
+  const FeatureLayer *features = state->features;
+  size_t first_part, last_part;
+  bool found = false;
+
+  features->FeatureParts(state->type, feature, &first_part, &last_part);
+  for (size_t part = first_part; part < last_part; ++part) {
+    size_t first, last;
+
+    features->PartVertices(state->type, part, &first, &last);
+    for (size_t i = first; i < last; ++i) {
+      double x = coordinates[i * 2], y = coordinates[i * 2 + 1];
+
+      if (!found) {
+        bounds->minx = bounds->maxx = x;
+        bounds->miny = bounds->maxy = y;
+        found = true;
+        continue;
+      }
+      if (x < bounds->minx) bounds->minx = x;
+      if (x > bounds->maxx) bounds->maxx = x;
+      if (y < bounds->miny) bounds->miny = y;
+      if (y > bounds->maxy) bounds->maxy = y;
+    }
+  }
+  return found;
+}
+
+/// Populate a shape with a feature and the attributes the layer requires
+static void featureShape(layerObj *layer, const BoundFeatures *state, size_t feature, shapeObj *shape) {
+  const FeatureLayer *features = state->features;
+  const int *columns = static_cast<const int *>(layer->iteminfo);
+  size_t first_part, last_part;
+
+  shape->type = state->type;
+  features->FeatureParts(state->type, feature, &first_part, &last_part);
+  for (size_t part = first_part; part < last_part; ++part) {
+    size_t first, last;
+    lineObj line;
+
+    features->PartVertices(state->type, part, &first, &last);
+    if (first == last) {
+      continue;
+    }
+
+    line.numpoints = last - first;
+    line.point = static_cast<pointObj *>(msSmallMalloc(line.numpoints * sizeof(pointObj)));
+    for (size_t i = first; i < last; ++i) {
+      pointObj *point = &(line.point[i - first]);
+      point->x = features->coordinates[i * 2];
+      point->y = features->coordinates[i * 2 + 1];
+#ifdef USE_POINT_Z_M
+      point->z = 0;
+      point->m = 0;
+#endif
+    }
+    msAddLineDirectly(shape, &line);
+  }
+  msComputeBounds(shape);
+
+  shape->index = feature;
+  shape->resultindex = -1;
+  if (layer->numitems > 0) {
+    shape->numvalues = layer->numitems;
+    shape->values = static_cast<char **>(msSmallMalloc(sizeof(char *) * layer->numitems));
+    for (int i = 0; i < layer->numitems; ++i) {
+      int column = columns ? columns[i] : -1;
+      shape->values[i] = (column < 0) ? msStrdup("") : features->columns[column].Value(feature);
+    }
+  }
+}
+
+static int featureOpen(layerObj *layer) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+
+  if (!state) {
+    msSetError(MS_MISCERR, "The features of layer '%s' have been released", "featureOpen()",
+               layer->name ? layer->name : "");
+    return MS_FAILURE;
+  }
+  state->open = true;
+  return MS_SUCCESS;
+}
+
+static int featureIsOpen(layerObj *layer) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+  return (state && state->open) ? MS_TRUE : MS_FALSE;
+}
+
+static int featureWhichShapes(layerObj *layer, rectObj rect, int isQuery) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+
+  state->next = 0;
+  state->rect = rect;
+  return state->count ? MS_SUCCESS : MS_DONE;
+}
+
+static int featureNextShape(layerObj *layer, shapeObj *shape) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+  rectObj bounds;
+
+  // test the bounds before building a shape so unseen features cost little
+  while (state->next < state->count) {
+    size_t feature = state->next++;
+
+    if (featureBounds(state, feature, &bounds) && msRectOverlap(&bounds, &(state->rect)) == MS_TRUE) {
+      featureShape(layer, state, feature, shape);
+      return MS_SUCCESS;
+    }
+  }
+  return MS_DONE;
+}
+
+static int featureGetShape(layerObj *layer, shapeObj *shape, resultObj *record) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+
+  if (record->shapeindex < 0 || static_cast<size_t>(record->shapeindex) >= state->count) {
+    msSetError(MS_MISCERR, "Invalid feature index: %ld", "featureGetShape()", record->shapeindex);
+    return MS_FAILURE;
+  }
+  featureShape(layer, state, record->shapeindex, shape);
+  return MS_SUCCESS;
+}
+
+static int featureClose(layerObj *layer) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+
+  if (state) {
+    state->open = false;
+  }
+  return MS_SUCCESS;
+}
+
+static int featureInitItemInfo(layerObj *layer) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+  int *columns;
+
+  msFree(layer->iteminfo);
+  layer->iteminfo = NULL;
+  if (!state || layer->numitems <= 0) {
+    return MS_SUCCESS;
+  }
+
+  // map the items required by the layer to attribute columns
+  columns = static_cast<int *>(msSmallMalloc(sizeof(int) * layer->numitems));
+  for (int i = 0; i < layer->numitems; ++i) {
+    columns[i] = -1;
+    for (size_t c = 0; c < state->features->columns.size(); ++c) {
+      if (strcasecmp(layer->items[i], state->features->columns[c].name.c_str()) == 0) {
+        columns[i] = c;
+        break;
+      }
+    }
+  }
+  layer->iteminfo = columns;
+  return MS_SUCCESS;
+}
+
+static void featureFreeItemInfo(layerObj *layer) {
+  msFree(layer->iteminfo);
+  layer->iteminfo = NULL;
+}
+
+static int featureGetItems(layerObj *layer) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+  const std::vector<FeatureColumn> &columns = state->features->columns;
+
+  layer->numitems = columns.size();
+  layer->items = static_cast<char **>(msSmallMalloc(sizeof(char *) * (columns.size() + 1)));
+  for (size_t i = 0; i < columns.size(); ++i) {
+    layer->items[i] = msStrdup(columns[i].name.c_str());
+  }
+  layer->items[columns.size()] = NULL;
+
+  return featureInitItemInfo(layer);
+}
+
+static int featureGetExtent(layerObj *layer, rectObj *extent) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+  bool found = false;
+  rectObj bounds;
+
+  for (size_t feature = 0; feature < state->count; ++feature) {
+    if (!featureBounds(state, feature, &bounds)) {
+      continue;
+    }
+    if (!found) {
+      *extent = bounds;
+      found = true;
+      continue;
+    }
+    msMergeRect(extent, &bounds);
+  }
+
+  if (!found) {
+    msSetError(MS_MISCERR, "The layer '%s' has no features", "featureGetExtent()",
+               layer->name ? layer->name : "");
+    return MS_FAILURE;
+  }
+  return MS_SUCCESS;
+}
+
+static int featureGetNumFeatures(layerObj *layer) {
+  BoundFeatures *state = static_cast<BoundFeatures *>(layer->layerinfo);
+  return state->count;
+}
+
+/// Get the data, type and length of a typed array
+static bool typedArray(Handle<Value> value, ExternalArrayType *type, void **data, int *length) {
+  if (!value->IsObject()) {
+    return false;
+  }
+
+  Local<Object> object = value->ToObject();
+  if (!object->HasIndexedPropertiesInExternalArrayData()) {
+    return false;
+  }
+  *type = object->GetIndexedPropertiesExternalArrayDataType();
+  *data = object->GetIndexedPropertiesExternalArrayData();
+  *length = object->GetIndexedPropertiesExternalArrayDataLength();
+  return true;
+}
+
+/// Copy the elements of a typed array
+template <typename T, typename U>
+static void copyArray(const void *data, int length, std::vector<U> &values) {
+  const T *elements = static_cast<const T *>(data);
+  values.assign(elements, elements + length);
+}
+
+/// Copy a typed array of any numeric type
+static bool copyNumbers(Handle<Value> value, std::vector<double> &numbers) {
+  ExternalArrayType type;
+  void *data;
+  int length;
+
+  if (!typedArray(value, &type, &data, &length)) {
+    return false;
+  }
+
+  switch (type) {
+  case kExternalByteArray:
+    copyArray<int8_t>(data, length, numbers);
+    break;
+  case kExternalUnsignedByteArray:
+  case kExternalPixelArray:
+    copyArray<uint8_t>(data, length, numbers);
+    break;
+  case kExternalShortArray:
+    copyArray<int16_t>(data, length, numbers);
+    break;
+  case kExternalUnsignedShortArray:
+    copyArray<uint16_t>(data, length, numbers);
+    break;
+  case kExternalIntArray:
+    copyArray<int32_t>(data, length, numbers);
+    break;
+  case kExternalUnsignedIntArray:
+    copyArray<uint32_t>(data, length, numbers);
+    break;
+  case kExternalFloatArray:
+    copyArray<float>(data, length, numbers);
+    break;
+  case kExternalDoubleArray:
+    copyArray<double>(data, length, numbers);
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+/// Copy a `Uint32Array` of ascending indexes starting at 0
+static bool copyIndexes(Handle<Value> value, std::vector<uint32_t> &indexes) {
+  ExternalArrayType type;
+  void *data;
+  int length;
+
+  if (!typedArray(value, &type, &data, &length) || type != kExternalUnsignedIntArray) {
+    return false;
+  }
+
+  copyArray<uint32_t>(data, length, indexes);
+  if (!indexes.empty() && indexes[0] != 0) {
+    return false;
+  }
+  for (size_t i = 1; i < indexes.size(); ++i) {
+    if (indexes[i] < indexes[i - 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+char* FeatureColumn::Value(size_t index) const {
+  char number[32];
+
+  if (!numeric) {
+    return msStrdup(strings[index].c_str());
+  }
+  snprintf(number, sizeof(number), "%.15g", numbers[index]);
+  return msStrdup(number);
+}
+
+size_t FeatureLayer::Parts(int type) const {
+  if (!parts.empty()) {
+    return parts.size();
+  }
+  if (type == MS_SHAPE_POINT) {
+    return Vertices();
+  }
+  return Vertices() ? 1 : 0;
+}
+
+size_t FeatureLayer::Count(int type) const {
+  return features.empty() ? Parts(type) : features.size();
+}
+
+void FeatureLayer::FeatureParts(int type, size_t feature, size_t *first, size_t *last) const {
+  if (features.empty()) {
+    *first = feature;
+    *last = feature + 1;
+    return;
+  }
+  *first = features[feature];
+  *last = (feature + 1 < features.size()) ? features[feature + 1] : Parts(type);
+}
+
+void FeatureLayer::PartVertices(int type, size_t part, size_t *first, size_t *last) const {
+  if (!parts.empty()) {
+    *first = parts[part];
+    *last = (part + 1 < parts.size()) ? parts[part + 1] : Vertices();
+  } else if (type == MS_SHAPE_POINT) {
+    *first = part;
+    *last = part + 1;
+  } else {
+    *first = 0;
+    *last = Vertices();
+  }
+}
+
+/**
+ * @details This is called in the main thread when a request is made.  The
+ * typed arrays are copied so they can be reused as soon as the request has
+ * been made.  `value` is an object literal keyed by layer name whose values
+ * are object literals with the following properties:
+ *
+ * - `coordinates`: a `Float64Array` of `x, y` pairs (required)
+ * - `parts`: a `Uint32Array` of the first vertex of each part (optional)
+ * - `features`: a `Uint32Array` of the first part of each feature (optional)
+ * - `attributes`: an object literal of attribute names to typed arrays of
+ *   numbers or arrays of strings, each holding a value per feature (optional)
+ *
+ * @param value The `features` option, which may be undefined.
+ *
+ * @param layers Populated with the features of each layer.
+ *
+ * @return `NULL` on success, otherwise a message describing the invalid
+ * option.
+ */
+const char* FeatureLayer::Parse(Handle<Value> value, std::vector<FeatureLayer> &layers) {
+  if (value->IsUndefined()) {
+    return NULL;
+  }
+  if (!value->IsObject()) {
+    return "`features` must be an object of layer names to features";
+  }
+
+  Local<Object> object = value->ToObject();
+  const Local<Array> names = object->GetPropertyNames();
+  layers.resize(names->Length());
+  for (uint32_t i = 0; i < names->Length(); ++i) {
+    FeatureLayer &layer = layers[i];
+    Local<Value> spec = object->Get(names->Get(i));
+
+    if (!spec->IsObject()) {
+      return "the features of a layer must be an object";
+    }
+    layer.name = *String::Utf8Value(names->Get(i)->ToString());
+
+    Local<Object> properties = spec->ToObject();
+    ExternalArrayType type;
+    void *data;
+    int length;
+    if (!typedArray(properties->Get(String::NewSymbol("coordinates")), &type, &data, &length)
+        || type != kExternalDoubleArray || length % 2) {
+      return "`coordinates` must be a Float64Array of x, y pairs";
+    }
+    copyArray<double>(data, length, layer.coordinates);
+
+    if (properties->Has(String::NewSymbol("parts"))) {
+      if (!copyIndexes(properties->Get(String::NewSymbol("parts")), layer.parts)
+          || (!layer.parts.empty() && layer.parts.back() > layer.Vertices())) {
+        return "`parts` must be a Uint32Array of ascending vertex indexes starting at 0";
+      }
+    }
+
+    if (properties->Has(String::NewSymbol("features"))) {
+      if (!copyIndexes(properties->Get(String::NewSymbol("features")), layer.features)) {
+        return "`features` must be a Uint32Array of ascending part indexes starting at 0";
+      }
+    }
+
+    if (properties->Has(String::NewSymbol("attributes"))) {
+      Local<Value> attributes = properties->Get(String::NewSymbol("attributes"));
+      if (!attributes->IsObject()) {
+        return "`attributes` must be an object of names to arrays";
+      }
+
+      Local<Object> columns = attributes->ToObject();
+      const Local<Array> keys = columns->GetPropertyNames();
+      layer.columns.resize(keys->Length());
+      for (uint32_t c = 0; c < keys->Length(); ++c) {
+        FeatureColumn &column = layer.columns[c];
+        Local<Value> values = columns->Get(keys->Get(c));
+
+        column.name = *String::Utf8Value(keys->Get(c)->ToString());
+        column.numeric = copyNumbers(values, column.numbers);
+        if (column.numeric) {
+          continue;
+        }
+        if (!values->IsArray()) {
+          return "`attributes` must be an object of names to typed arrays or arrays";
+        }
+
+        Local<Array> strings = Local<Array>::Cast(values);
+        column.strings.reserve(strings->Length());
+        for (uint32_t s = 0; s < strings->Length(); ++s) {
+          column.strings.push_back(*String::Utf8Value(strings->Get(s)->ToString()));
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @details This must be called in the thread that will use the map, after
+ * it has been updated for the request and before it is drawn.  The data
+ * source of each layer named in `layers` is replaced by the features, which
+ * must outlive the binding.  Features are in the projection of the layer.
+ * `Unbind` must be called before the map is freed.
+ *
+ * @param map The map whose layers are bound.
+ *
+ * @param layers The features of each layer.
+ *
+ * @param routine The routine reported in errors.
+ *
+ * @return `false`, setting a Mapserver error, if a layer does not exist or
+ * cannot draw its features.
+ */
+bool FeatureLayer::Bind(mapObj *map, const std::vector<FeatureLayer> &layers, const char *routine) {
+  for (std::vector<FeatureLayer>::const_iterator it = layers.begin(); it != layers.end(); ++it) {
+    int index = msGetLayerIndex(map, const_cast<char *>(it->name.c_str()));
+    if (index < 0) {
+      msSetError(MS_MISCERR, "Features were passed for the unknown layer '%s'", routine, it->name.c_str());
+      return false;
+    }
+
+    layerObj *layer = GET_LAYER(map, index);
+    int type = shapeType(layer->type);
+    if (type == MS_SHAPE_NULL) {
+      msSetError(MS_MISCERR, "The layer '%s' cannot draw features", routine, it->name.c_str());
+      return false;
+    }
+
+    size_t count = it->Count(type);
+    if (!it->features.empty() && it->features.back() > it->Parts(type)) {
+      msSetError(MS_MISCERR, "The features of layer '%s' refer to missing parts", routine, it->name.c_str());
+      return false;
+    }
+    for (std::vector<FeatureColumn>::const_iterator column = it->columns.begin();
+         column != it->columns.end(); ++column) {
+      if (column->Length() != count) {
+        msSetError(MS_MISCERR, "The attribute '%s' of layer '%s' does not have one value per feature",
+                   routine, column->name.c_str(), it->name.c_str());
+        return false;
+      }
+    }
+
+    // replace the data source of the layer
+    msLayerClose(layer);
+    freeFeatureList(layer->features);
+    layer->features = NULL;
+    layer->currentfeature = NULL;
+    if (msConnectLayer(layer, MS_INLINE, NULL) != MS_SUCCESS) {
+      return false;
+    }
+
+    BoundFeatures *state = new BoundFeatures();
+    state->features = &(*it);
+    state->type = type;
+    state->count = count;
+    state->open = false;
+    state->next = 0;
+    layer->layerinfo = state;
+
+    layer->vtable->LayerOpen = featureOpen;
+    layer->vtable->LayerIsOpen = featureIsOpen;
+    layer->vtable->LayerWhichShapes = featureWhichShapes;
+    layer->vtable->LayerNextShape = featureNextShape;
+    layer->vtable->LayerGetShape = featureGetShape;
+    layer->vtable->LayerClose = featureClose;
+    layer->vtable->LayerInitItemInfo = featureInitItemInfo;
+    layer->vtable->LayerFreeItemInfo = featureFreeItemInfo;
+    layer->vtable->LayerGetItems = featureGetItems;
+    layer->vtable->LayerGetExtent = featureGetExtent;
+    layer->vtable->LayerGetNumFeatures = featureGetNumFeatures;
+  }
+  return true;
+}
+
+/**
+ * @details This must be called in the thread that called `Bind`.  Layers
+ * that were not bound are left alone.
+ *
+ * @param map The map whose layers were bound.
+ */
+void FeatureLayer::Unbind(mapObj *map) {
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+
+    if (layer->vtable && layer->vtable->LayerIsOpen == featureIsOpen) {
+      msLayerClose(layer);
+      delete static_cast<BoundFeatures *>(layer->layerinfo);
+      layer->layerinfo = NULL;
+    }
+  }
+}
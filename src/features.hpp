@@ -0,0 +1,128 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_FEATURES_H__
+#define __NODE_MAPSERV_FEATURES_H__
+
+/**
+ * @file features.hpp
+ * @brief This declares the in-memory feature layers.
+ */
+
+// Standard headers
+#include <string>
+#include <vector>
+
+// Node headers
+#include <v8.h>
+#include <node.h>
+
+// Mapserver headers
+#include "mapserver.h"
+
+using namespace v8;
+
+/**
+ * @brief An attribute of the features in a `FeatureLayer`
+ *
+ * A column holds either numbers or strings, one per feature.
+ */
+struct FeatureColumn {
+  /// The attribute name
+  std::string name;
+  /// Does the column hold numbers?
+  bool numeric;
+  /// The values of a numeric column
+  std::vector<double> numbers;
+  /// The values of a string column
+  std::vector<std::string> strings;
+
+  /// Get the number of values
+  size_t Length() const {
+    return numeric ? numbers.size() : strings.size();
+  }
+
+  /// Get a value formatted for Mapserver, allocated with `msStrdup`
+  char* Value(size_t index) const;
+};
+
+/**
+ * @brief Features passed from javascript to be drawn by a layer of a map
+ *
+ * The features are copied out of javascript typed arrays when a request is
+ * made.  When the request runs the layer of the same name is bound to them:
+ * its data source is replaced by one reading shapes straight from these
+ * arrays, so no features are parsed or written to disk.
+ *
+ * Vertices are stored as `x, y` pairs in `coordinates`.  `parts` holds the
+ * index of the first vertex of each part and `features` the index of the
+ * first part of each feature.  Without `parts` each vertex of a point layer
+ * is a part and the vertices of other layers form a single part.  Without
+ * `features` each part is a feature.
+ */
+class FeatureLayer {
+public:
+
+  /// The name of the layer drawing the features
+  std::string name;
+  /// The vertex coordinates
+  std::vector<double> coordinates;
+  /// The first vertex of each part
+  std::vector<uint32_t> parts;
+  /// The first part of each feature
+  std::vector<uint32_t> features;
+  /// The feature attributes
+  std::vector<FeatureColumn> columns;
+
+  /// Copy the `features` option of a request
+  static const char* Parse(Handle<Value> value, std::vector<FeatureLayer> &layers);
+
+  /// Bind the layers of a map to features
+  static bool Bind(mapObj *map, const std::vector<FeatureLayer> &layers, const char *routine);
+
+  /// Release the features bound to the layers of a map
+  static void Unbind(mapObj *map);
+
+  /// Get the number of vertices
+  size_t Vertices() const {
+    return coordinates.size() / 2;
+  }
+
+  /// Get the number of parts for a shape type
+  size_t Parts(int type) const;
+
+  /// Get the number of features for a shape type
+  size_t Count(int type) const;
+
+  /// Get the range of parts making up a feature
+  void FeatureParts(int type, size_t feature, size_t *first, size_t *last) const;
+
+  /// Get the range of vertices making up a part
+  void PartVertices(int type, size_t part, size_t *first, size_t *last) const;
+};
+
+#endif  /* __NODE_MAPSERV_FEATURES_H__ */
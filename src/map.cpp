@@ -30,10 +30,92 @@
  * @brief This defines the primary `Map` class.
  */
 
+#include <stdlib.h>
+#include <math.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <limits.h>
+#include <vector>
 #include "map.hpp"
+#include "maptime.h"
 #include "node-mapservutil.h"
 
+/// Record the time and counted events since the last phase of a timed or
+/// counted mapserv request
+#define TIME_PHASE(NAME)                                                \
+  do {                                                                  \
+    if (mark) {                                                         \
+      trace_time_t now = traceNow();                                    \
+      if (trace_id) {                                                   \
+        traceSpan(NAME, trace_id, mark, now);                           \
+      }                                                                 \
+      baton->phases.push_back(pair<const char *, trace_time_t>(NAME, now - mark)); \
+      mark = now;                                                       \
+    }                                                                   \
+    if (counting) {                                                     \
+      PerfSample sample, delta;                                         \
+      PerfCounters::Read(&sample);                                      \
+      PerfCounters::Delta(counted, sample, &delta);                     \
+      baton->counters.push_back(pair<const char *, PerfSample>(NAME, delta)); \
+      counted = sample;                                                 \
+    }                                                                   \
+  } while (0)
+
+/// Record time spent blocked within the next phase of a timed or counted
+/// mapserv request.  The wait is reported as a phase of its own but remains
+/// part of the enclosing phase, whose start is unchanged, and no trace span
+/// is written as the lock records its own.  The counters are not read during
+/// the wait, so an empty sample keeps the counted phases in step with the
+/// timed ones and any events remain part of the enclosing phase.
+#define WAIT_PHASE(NAME, DURATION)                                      \
+  do {                                                                  \
+    if (mark) {                                                         \
+      baton->phases.push_back(pair<const char *, trace_time_t>(NAME, DURATION)); \
+    }                                                                   \
+    if (counting) {                                                     \
+      PerfSample idle;                                                  \
+      PerfCounters::Delta(counted, counted, &idle);                     \
+      baton->counters.push_back(pair<const char *, PerfSample>(NAME, idle)); \
+    }                                                                   \
+  } while (0)
+
+/// How long a `warm` request with the `spread` option waits for its siblings
+/// to occupy the other worker threads before proceeding regardless (in
+/// nanoseconds)
+#define WARM_WAIT_NS 2000000000ULL
+
+/// How long `warm` keeps queuing requests for worker threads that have not
+/// yet been warmed before reporting the map as not ready (in nanoseconds)
+#define WARM_DEADLINE_NS 30000000000ULL
+
+/// How long `warm` waits between rounds of requests (in milliseconds)
+#define WARM_RETRY_MS 10
+
+/// The number of rendered tiles that can wait to be written before `seed`
+/// stops rendering until the writer catches up
+#define SEED_QUEUE_SIZE 512
+
+/// The maximum number of passes drawing the layers of a `render` request
+#define MAX_LAYER_PASSES 64
+
+/// The number of pixels aimed for in each band of a `render` drawn in bands
+/// because it exceeds its `bandThreshold`
+#define BAND_PIXELS 4194304
+
+/// The default number of rows of overlap drawn above and below each band
+#define BAND_BUFFER 64
+
+/// The maximum number of bands a `render` request can be drawn in
+#define MAX_BANDS 1024
+
+/// The half circumference of the earth in spherical mercator metres
+#define MERCATOR_EXTENT 20037508.342789244
+
 Persistent<FunctionTemplate> Map::map_template;
+int64_t Map::maps_external = 0;
+int64_t Map::responses_external = 0;
+int Map::live_maps = 0;
 
 /**
  * @defgroup map_response Properties of the mapserv response object
@@ -67,10 +149,21 @@ void Map::Init(Handle<Object> target) {
   headers_symbol = NODE_PSYMBOL("headers");
 
   NODE_SET_PROTOTYPE_METHOD(map_template, "mapserv", MapservAsync);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "handle", HandleAsync);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "render", RenderAsync);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "warm", WarmAsync);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "analyze", AnalyzeAsync);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "seed", SeedAsync);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "configureCache", ConfigureCache);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "invalidate", Invalidate);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "dispose", Dispose);
+  NODE_SET_PROTOTYPE_METHOD(map_template, "memoryUsage", MemoryUsage);
   NODE_SET_METHOD(map_template, "FromFile", FromFileAsync);
   NODE_SET_METHOD(map_template, "FromString", FromStringAsync);
 
   target->Set(String::NewSymbol("Map"), map_template->GetFunction());
+  NODE_SET_METHOD(target, "memoryUsage", ProcessMemoryUsage);
+  NODE_SET_METHOD(target, "composite", CompositeAsync);
 }
 
 /**
@@ -93,6 +186,9 @@ Handle<Value> Map::New(const Arguments& args) {
 
   Map* self = new Map((mapObj *)map->Value());
   self->Wrap(args.This());
+
+  // let the garbage collector know how much memory the map holds
+  V8::AdjustAmountOfExternalAllocatedMemory(self->external);
   return scope.Close(args.This());
 }
 
@@ -282,6 +378,7 @@ void Map::FromStringWork(uv_work_t *req) {
  *
  * - `data`: a `Buffer` object representing the response body
  * - `headers`: the HTTP headers as an object literal
+ * - `status`: the HTTP status code, if Mapserver set one
  *
  * `args` should contain the following parameters:
  *
@@ -291,15 +388,28 @@ void Map::FromStringWork(uv_work_t *req) {
  * @param body The optional string or buffer object representing the body of an
  * HTTP request.
  *
+ * @param options An optional object literal with the boolean property
+ * `compression` enabling compression of text responses, and the integer
+ * properties `compressionLevel` and `compressionThreshold`.  The boolean
+ * properties `profile` and `counters` add per layer timings and per phase
+ * performance counters to the response.  The `features` property binds
+ * features held in typed arrays to layers, as described by
+ * `FeatureLayer::Parse`.  The body must be specified (or be `null`) when
+ * options are passed.
+ *
  * @param callback A function that is called on error or when the
  * resource has been created. It should have the signature
  * `callback(err, resource)`.
  */
 Handle<Value> Map::MapservAsync(const Arguments& args) {
   HandleScope scope;
+  trace_time_t start = (trace_enabled || SlowLog::Enabled()) ? traceNow() : 0;
   string body;
   Local<Object> env;
+  Local<Object> options;
   Local<Function> callback;
+  MapservOptions parsed;
+  std::vector<FeatureLayer> features;
 
   switch (args.Length()) {
   case 2:
@@ -307,6 +417,7 @@ Handle<Value> Map::MapservAsync(const Arguments& args) {
     ASSIGN_FUN_ARG(1, callback);
     break;
   case 3:
+  case 4:
     ASSIGN_OBJ_ARG(0, env);
 
     if (args[1]->IsString()) {
@@ -318,13 +429,25 @@ Handle<Value> Map::MapservAsync(const Arguments& args) {
       THROW_CSTR_ERROR(TypeError, "Argument 1 must be one of a string; buffer; null; undefined");
     }
 
-    ASSIGN_FUN_ARG(2, callback);
+    if (args.Length() == 4) {
+      ASSIGN_OBJ_ARG(2, options);
+
+      const char *message = ParseOptions(options, &parsed, &features);
+      if (message) {
+        THROW_CSTR_ERROR(TypeError, message);
+      }
+    }
+
+    ASSIGN_FUN_ARG(args.Length() - 1, callback);
     break;
   default:
-    THROW_CSTR_ERROR(Error, "usage: Map.mapserv(env, [body], callback)");
+    THROW_CSTR_ERROR(Error, "usage: Map.mapserv(env, [body], [options], callback)");
   }
 
   Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  if (self->disposed) {
+    THROW_CSTR_ERROR(Error, "The map has been disposed");
+  }
   MapBaton *baton = new MapBaton();
 
   baton->request.data = baton;
@@ -333,6 +456,10 @@ Handle<Value> Map::MapservAsync(const Arguments& args) {
   baton->map = self->map;
   baton->error = NULL;
   baton->body = body;
+  baton->options = parsed;
+  baton->features.swap(features);
+  baton->content_encoding = NULL;
+  baton->status = 0;
 
   // Convert the environment object to a `std::map`
   const Local<Array> properties = env->GetPropertyNames();
@@ -345,16 +472,336 @@ Handle<Value> Map::MapservAsync(const Arguments& args) {
                       );
   }
 
-  self->Ref(); // increment reference count so map is not garbage collected
+  QueueMapserv(baton, start);
+
+  return Undefined();
+}
+
+/**
+ * @details This queues a mapserv request created by `mapserv` or `handle`
+ * for processing in the thread pool, tracing it if tracing is enabled.
+ *
+ * @param baton The request context.
+ *
+ * @param start The time at which the request was received, or 0 if the
+ * request is not to be timed.
+ */
+void Map::QueueMapserv(MapBaton *baton, trace_time_t start) {
+  baton->trace_id = 0;
+  baton->received = start;
+  baton->queued = baton->started = 0;
+  if (start) {
+    baton->queued = traceNow();
+  }
+  if (trace_enabled && start) {
+    baton->trace_id = traceNewRequest();
+    traceSpan("receive", baton->trace_id, start, baton->queued);
+  }
+
+  baton->self->Ref(); // increment reference count so map is not garbage collected
 
   uv_queue_work(uv_default_loop(),
                 &baton->request,
                 MapservWork,
                 (uv_after_work_cb) MapservAfter);
+}
+
+/**
+ * @details This records a request that has exceeded the slow request
+ * threshold in the `SlowLog`, together with the context required to
+ * reproduce it.
+ *
+ * @param baton The request context.
+ *
+ * @param now The time at which the request completed.
+ */
+void Map::LogSlowRequest(MapBaton *baton, trace_time_t now) {
+  SlowRequest *request = new SlowRequest();
+  struct mstimeval time;
+  mapObj *map = baton->self->map;
+
+  msGettimeofday(&time, NULL);
+  request->time = time.tv_sec * 1000.0 + time.tv_usec / 1000.0;
+  request->duration = (now - baton->received) / 1e6;
+  request->queued = (baton->started - baton->queued) / 1e6;
+  for (size_t i = 0; i < baton->phases.size(); ++i) {
+    request->phases.push_back(pair<string, double>(baton->phases[i].first, baton->phases[i].second / 1e6));
+  }
+  request->map_name = map->name ? map->name : "";
+  request->map_path = map->mappath ? map->mappath : "";
+  request->env = baton->env;
+  request->body = baton->body;
+  request->content_type = baton->content_type ? baton->content_type : "";
+  request->output_size = baton->buffer ? baton->buffer->size : 0;
+  if (baton->error) {
+    request->error = baton->error->getMessage();
+  }
+
+  SlowLog::Record(request);
+}
+
+/**
+ * @details This parses the options accepted by `mapserv` and `handle`.
+ *
+ * @param options The javascript options object.
+ *
+ * @param parsed Populated with the options.
+ *
+ * @param features Populated with the features passed for layers.
+ *
+ * @return `NULL` on success, otherwise a message describing the invalid
+ * option.
+ */
+const char* Map::ParseOptions(Local<Object> options, MapservOptions *parsed,
+                              std::vector<FeatureLayer> *features) {
+  if (options->Has(String::NewSymbol("compression"))) {
+    parsed->compress = options->Get(String::NewSymbol("compression"))->BooleanValue();
+  }
+  if (options->Has(String::NewSymbol("profile"))) {
+    parsed->profile = options->Get(String::NewSymbol("profile"))->BooleanValue();
+  }
+  if (options->Has(String::NewSymbol("counters"))) {
+    parsed->counters = options->Get(String::NewSymbol("counters"))->BooleanValue();
+  }
+  if (options->Has(String::NewSymbol("compressionLevel"))) {
+    Local<Value> value = options->Get(String::NewSymbol("compressionLevel"));
+    if (!value->IsNumber() || value->Int32Value() < 1 || value->Int32Value() > 9) {
+      return "`compressionLevel` must be an integer between 1 and 9";
+    }
+    parsed->compression_level = value->Int32Value();
+  }
+  if (options->Has(String::NewSymbol("compressionThreshold"))) {
+    Local<Value> value = options->Get(String::NewSymbol("compressionThreshold"));
+    if (!value->IsNumber() || value->Int32Value() < 0) {
+      return "`compressionThreshold` must be a non-negative integer";
+    }
+    parsed->compression_threshold = value->Int32Value();
+  }
+  return FeatureLayer::Parse(options->Get(String::NewSymbol("features")), *features);
+}
+
+/**
+ * @details This is the asynchronous method used to generate a mapserv
+ * response directly from a Node `http.ServerRequest`.  It is equivalent to
+ * calling `mapserv` with the environment returned by `createCGIEnvironment`
+ * but the CGI environment is built natively, without creating an
+ * intermediate javascript object.
+ *
+ * `args` should contain the following parameters:
+ *
+ * @param req The `http.ServerRequest` object.
+ *
+ * @param body The request body as a buffer, or `null`.
+ *
+ * @param options An object literal accepting the same properties as the
+ * `mapserv` options, together with `vars`: an object literal of CGI variables
+ * overriding those derived from the request.
+ *
+ * @param callback A function that is called on error or when the response
+ * has been created. It should have the signature `callback(err, response)`.
+ */
+Handle<Value> Map::HandleAsync(const Arguments& args) {
+  HandleScope scope;
+  trace_time_t start = (trace_enabled || SlowLog::Enabled()) ? traceNow() : 0;
+  string body;
+  MapservOptions parsed;
+  std::vector<FeatureLayer> features;
+
+  if (args.Length() != 4) {
+    THROW_CSTR_ERROR(Error, "usage: Map.handle(req, body, options, callback)");
+  }
+  REQ_OBJ_ARG(0, req);
+  if (Buffer::HasInstance(args[1])) {
+    Local<Object> buffer = args[1]->ToObject();
+    body = string(Buffer::Data(buffer), Buffer::Length(buffer));
+  } else if (args[1]->IsString()) {
+    body = *String::Utf8Value(args[1]->ToString());
+  } else if (!args[1]->IsNull() && !args[1]->IsUndefined()) {
+    THROW_CSTR_ERROR(TypeError, "Argument 1 must be one of a string; buffer; null; undefined");
+  }
+  REQ_OBJ_ARG(2, options);
+  REQ_FUN_ARG(3, callback);
+
+  const char *message = ParseOptions(options, &parsed, &features);
+  if (message) {
+    THROW_CSTR_ERROR(TypeError, message);
+  }
+
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  if (self->disposed) {
+    THROW_CSTR_ERROR(Error, "The map has been disposed");
+  }
+  MapBaton *baton = new MapBaton();
+
+  baton->request.data = baton;
+  baton->self = self;
+  baton->callback = Persistent<Function>::New(callback);
+  baton->map = self->map;
+  baton->error = NULL;
+  baton->body = body;
+  baton->options = parsed;
+  baton->features.swap(features);
+  baton->content_encoding = NULL;
+  baton->status = 0;
+
+  CreateEnvironment(req, baton->env);
+
+  Local<Value> vars = options->Get(String::NewSymbol("vars"));
+  if (vars->IsObject()) {
+    Local<Object> object = vars->ToObject();
+    const Local<Array> properties = object->GetPropertyNames();
+    const uint32_t length = properties->Length();
+    for (uint32_t i = 0; i < length; ++i) {
+      const Local<Value> key = properties->Get(i);
+      baton->env[*String::Utf8Value(key->ToString())] = *String::Utf8Value(object->Get(key)->ToString());
+    }
+  }
+
+  QueueMapserv(baton, start);
 
   return Undefined();
 }
 
+/**
+ * @details This decodes URL percent escapes in place.
+ */
+static void percentDecode(string &value) {
+  string decoded;
+
+  decoded.reserve(value.size());
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '%' && i + 2 < value.size()
+        && isxdigit(value[i + 1]) && isxdigit(value[i + 2])) {
+      char hex[3] = { value[i + 1], value[i + 2], 0 };
+      decoded += static_cast<char>(strtol(hex, NULL, 16));
+      i += 2;
+    } else {
+      decoded += value[i];
+    }
+  }
+  value.swap(decoded);
+}
+
+/**
+ * @details This removes `.` and `..` segments and duplicate slashes from an
+ * absolute path.
+ */
+static string normalisePath(const string &path) {
+  std::vector<string> segments;
+  string result;
+  size_t start = 0;
+
+  while (start <= path.size()) {
+    size_t end = path.find('/', start);
+    if (end == string::npos) {
+      end = path.size();
+    }
+
+    string segment = path.substr(start, end - start);
+    if (segment == "..") {
+      if (!segments.empty()) {
+        segments.pop_back();
+      }
+    } else if (!segment.empty() && segment != ".") {
+      segments.push_back(segment);
+    }
+    start = end + 1;
+  }
+
+  for (std::vector<string>::iterator it = segments.begin(); it != segments.end(); ++it) {
+    result += "/" + *it;
+  }
+  return result.empty() ? "/" : result;
+}
+
+/**
+ * @details This populates `env` with the CGI variables for a Node
+ * `http.ServerRequest`, mirroring `createCGIEnvironment` in `lib/mapserv.js`.
+ * Unlike that function the query string is passed to Mapserver without being
+ * decoded, as the CGI specification requires: Mapserver decodes it itself.
+ *
+ * @param req The `http.ServerRequest` object.
+ *
+ * @param env The environment to populate.
+ */
+void Map::CreateEnvironment(Local<Object> req, std::map<string, string> &env) {
+  string url = *String::Utf8Value(req->Get(String::NewSymbol("url"))->ToString());
+  string pathname, query;
+  size_t mark = url.find('?');
+  char cwd[4096];
+  size_t cwd_size = sizeof(cwd);
+
+  if (mark == string::npos) {
+    pathname = url;
+  } else {
+    pathname = url.substr(0, mark);
+    query = url.substr(mark + 1);
+  }
+
+  // discard the scheme and authority of an absolute URL
+  size_t scheme = pathname.find("://");
+  if (scheme != string::npos && pathname.find('/') > scheme) {
+    size_t slash = pathname.find('/', scheme + 3);
+    pathname = (slash == string::npos) ? "" : pathname.substr(slash);
+  }
+  percentDecode(pathname);
+  if (pathname.empty()) {
+    pathname = "/";
+  }
+
+  env["SERVER_SOFTWARE"] = "Node.js";
+  env["GATEWAY_INTERFACE"] = "CGI/1.1";
+  env["SERVER_PROTOCOL"] = string("HTTP/") + *String::Utf8Value(req->Get(String::NewSymbol("httpVersion"))->ToString());
+  env["REQUEST_METHOD"] = *String::Utf8Value(req->Get(String::NewSymbol("method"))->ToString());
+  env["PATH_INFO"] = pathname;
+  if (uv_cwd(cwd, cwd_size).code == UV_OK) {
+    env["PATH_TRANSLATED"] = normalisePath(string(cwd) + "/" + pathname);
+  }
+  env["SCRIPT_NAME"] = "/";
+  env["QUERY_STRING"] = query;
+
+  Local<Value> connection = req->Get(String::NewSymbol("connection"));
+  if (connection->IsObject()) {
+    Local<Value> address = connection->ToObject()->Get(String::NewSymbol("remoteAddress"));
+    if (address->IsString()) {
+      env["REMOTE_ADDR"] = *String::Utf8Value(address);
+    }
+  }
+
+  Local<Value> value = req->Get(String::NewSymbol("headers"));
+  if (!value->IsObject()) {
+    return;
+  }
+  Local<Object> headers = value->ToObject();
+  const Local<Array> properties = headers->GetPropertyNames();
+  const uint32_t length = properties->Length();
+  for (uint32_t i = 0; i < length; ++i) {
+    const Local<Value> key = properties->Get(i);
+    string name = *String::Utf8Value(key->ToString());
+    string header = *String::Utf8Value(headers->Get(key)->ToString());
+
+    if (name == "host") {
+      size_t colon = header.find(':');
+      env["SERVER_NAME"] = header.substr(0, colon);
+      if (colon != string::npos) {
+        env["SERVER_PORT"] = header.substr(colon + 1);
+      }
+    } else if (name == "content-length") {
+      env["CONTENT_LENGTH"] = header;
+    } else if (name == "content-type") {
+      env["CONTENT_TYPE"] = header;
+    } else if (name == "authorization") {
+      env["AUTH_TYPE"] = header.substr(0, header.find(' '));
+    } else {
+      string variable = "HTTP_";
+      for (string::iterator it = name.begin(); it != name.end(); ++it) {
+        variable += (*it == '-') ? '_' : toupper(*it);
+      }
+      env[variable] = header;
+    }
+  }
+}
+
 /**
  * @details This is called by `MapservAsync` and runs in a different thread to
  * that function.  It performs the actual work of interacting with
@@ -371,6 +818,18 @@ void Map::MapservWork(uv_work_t *req) {
   MapBaton *baton = static_cast<MapBaton*>(req->data);
   mapservObj* mapserv = NULL;
   bool reportError = false;     // flag an error as worthy of reporting
+  trace_time_t trace_id = baton->trace_id, mark = 0, parser_wait = 0;
+  PerfSample counted;
+  bool counting = baton->options.counters && PerfCounters::Read(&counted);
+
+  if (baton->received) {
+    mark = traceNow();
+    baton->started = mark;
+  }
+  if (trace_id) {
+    traceAsyncSpan("queued", trace_id, baton->queued, mark);
+    traceSetRequest(trace_id);
+  }
 
   if (msDebugInitFromEnv() != MS_SUCCESS) {
     reportError = true;
@@ -395,29 +854,53 @@ void Map::MapservWork(uv_work_t *req) {
     reportError = true;
     goto get_output;
   }
+  TIME_PHASE("loadParams");
 
   // Copy the map into the mapservObj for this request
-  if(!LoadMap(mapserv, baton->map)) {
+  uv_rwlock_rdlock(&baton->self->lock);
+  if(!LoadMap(mapserv, baton->self, &parser_wait)) {
+    uv_rwlock_rdunlock(&baton->self->lock);
+    reportError = true;
+    goto get_output;
+  }
+  uv_rwlock_rdunlock(&baton->self->lock);
+  if (parser_wait) {
+    // report waiting for the parser lock as well as loading the map
+    WAIT_PHASE("waitParserLock", parser_wait);
+  }
+  if (!FeatureLayer::Bind(mapserv->map, baton->features, "Map::MapservWork()")) {
     reportError = true;
     goto get_output;
   }
+  if (baton->options.profile) {
+    LayerProfiler::Attach(mapserv->map);
+  }
+  TIME_PHASE("loadMap");
 
   // Execute the request
   if(msCGIDispatchRequest(mapserv) != MS_SUCCESS) {
     reportError = true;
     goto get_output;
   }
+  TIME_PHASE("dispatch");
 
  get_output:
-  // Get the content type. If headers other than content-type need to be
-  // retrieved it may be best to use something along the lines of
-  // <https://github.com/joyent/http-parser>.
+  // Get the status set by a failed request and the content type. If other
+  // headers need to be retrieved it may be best to use something along the
+  // lines of <https://github.com/joyent/http-parser>.
+  baton->status = stripStdoutBufferStatus();
   baton->content_type = msIO_stripStdoutBufferContentType();
   msIO_stripStdoutBufferContentHeaders();
   
   // Get the buffered output
   baton->buffer = msIO_getStdoutBufferBytes();
 
+  // Compress it here rather than in another trip through the thread pool
+  if (baton->options.compress && baton->buffer && IsCompressible(baton->content_type)) {
+    CompressResponse(baton);
+  }
+  TIME_PHASE("output");
+
  handle_error:
   // handle any unhandled errors
   errorObj *error = msGetErrorObj();
@@ -429,10 +912,25 @@ void Map::MapservWork(uv_work_t *req) {
     msResetErrorList();         // clear all handled errors
   }
 
+  if (mark && SlowLog::IsSlow(mark - baton->received)) {
+    LogSlowRequest(baton, mark);
+  }
+
   // clean up
+  if (mapserv && mapserv->map) {
+    if (baton->options.profile) {
+      LayerProfiler::Detach(mapserv->map, baton->profile);
+    }
+    FeatureLayer::Unbind(mapserv->map);
+    DetachMap(baton->self, mapserv->map);
+  }
   msFreeMapServObj(mapserv);
   msIO_resetHandlers();
   msDebugCleanup();
+  if (trace_id) {
+    traceSpan("cleanup", trace_id, mark, traceNow());
+    traceSetRequest(0);
+  }
   return;
 }
 
@@ -450,6 +948,7 @@ void Map::MapservAfter(uv_work_t *req) {
   MapBaton *baton = static_cast<MapBaton*>(req->data);
   Map *self = baton->self;
   gdBuffer *buffer = baton->buffer;
+  trace_time_t start = baton->trace_id ? traceNow() : 0;
 
   Handle<Value> argv[2];
 
@@ -461,33 +960,17 @@ void Map::MapservAfter(uv_work_t *req) {
   }
 
   // convert the http_response to a javascript object
-  Local<Object> result = Object::New();
-
-  // Add the content-type to the headers object.  This object mirrors the
-  // HTTP headers structure and creates an API that allows for the addition
-  // of other headers in the future.
-  Local<Object> headers = Object::New();
-  if (baton->content_type) {
-    Local<Array> values = Array::New(1);
-
-    values->Set(0, String::New(baton->content_type));
-    headers->Set(String::New("Content-Type"), values);
+  Local<Object> response = CreateResponse(baton->content_type, buffer, baton->content_encoding);
+  if (baton->status) {
+    response->Set(String::NewSymbol("status"), Integer::New(baton->status));
   }
-  result->Set(headers_symbol, headers);
-
-  // set the response data as a Node Buffer object. This is zero-copied from
-  // mapserver and free'd when the buffer is garbage collected.
-  if (buffer && buffer->data) {
-    result->Set(data_symbol,
-                Buffer::New((char *)buffer->data, buffer->size, FreeBuffer, NULL)->handle_);
-
-    // add the content-length header
-    Local<Array> values = Array::New(1);
-    values->Set(0, Uint32::New(buffer->size));
-    headers->Set(String::New("Content-Length"), values);
+  if (baton->options.profile) {
+    response->Set(String::NewSymbol("profile"), CreateProfile(baton->profile));
   }
-
-  argv[1] = result;
+  if (!baton->counters.empty()) {
+    response->Set(String::NewSymbol("counters"), CreateCounters(baton->counters));
+  }
+  argv[1] = response;
 
   // pass the results to the user specified callback function
   TryCatch try_catch;
@@ -496,6 +979,10 @@ void Map::MapservAfter(uv_work_t *req) {
     FatalException(try_catch);
   }
 
+  if (baton->trace_id) {
+    traceSpan("callback", baton->trace_id, start, traceNow());
+  }
+
   // clean up
   if (buffer) {
     delete baton->buffer;
@@ -514,77 +1001,3698 @@ void Map::MapservAfter(uv_work_t *req) {
 }
 
 /**
- * @details This is a callback passed to the mapserver `loadParams` function.
- * It is called whenever mapserver needs to retrieve a CGI environment
- * variable.  The environment variables are retrieved from the `env` javascript
- * object literal that the client passed into the `mapserv` method.
+ * @details This converts the layer timings collected by a profiled request
+ * into an array of object literals, with times in milliseconds. It must be
+ * called within a `HandleScope`.
+ *
+ * @param profiles The layer timings.
  */
-char* Map::GetEnv(const char *name, void* thread_context) {
-  std::map<string, string> *env = static_cast<std::map<string, string> *>(thread_context);
-  std::map<string, string>::iterator it = env->find(std::string(name));
+Local<Array> Map::CreateProfile(const std::vector<LayerProfile> &profiles) {
+  Local<Array> result = Array::New(profiles.size());
 
-  if (it != env->end()) {
-    return const_cast<char *>(it->second.c_str());
-  } else {
-    return NULL;
+  for (size_t i = 0; i < profiles.size(); ++i) {
+    const LayerProfile &profile = profiles[i];
+    Local<Object> layer = Object::New();
+
+    layer->Set(String::NewSymbol("layer"), String::New(profile.name.c_str()));
+    layer->Set(String::NewSymbol("index"), Integer::New(profile.index));
+    layer->Set(String::NewSymbol("opens"), Integer::New(profile.opens));
+    layer->Set(String::NewSymbol("open"), Number::New(profile.open / 1e6));
+    layer->Set(String::NewSymbol("whichShapes"), Number::New(profile.which_shapes / 1e6));
+    layer->Set(String::NewSymbol("fetch"), Number::New(profile.fetch / 1e6));
+    layer->Set(String::NewSymbol("features"), Integer::New(profile.features));
+    layer->Set(String::NewSymbol("draw"), Number::New(profile.draw / 1e6));
+    layer->Set(String::NewSymbol("close"), Number::New(profile.close / 1e6));
+    layer->Set(String::NewSymbol("labels"), Integer::New(profile.labels));
+    layer->Set(String::NewSymbol("labelsPlaced"), Integer::New(profile.labels_placed));
+    result->Set(i, layer);
   }
+
+  return result;
 }
 
 /**
- * @details This code is largely copied from the PHP MapScript module. It is
- * used to retrieve the buffered mapserver STDOUT data.
+ * @details This converts the performance counters read around each phase of
+ * a mapserv request into an array of object literals.  Counters that are not
+ * available are omitted.  It must be called within a `HandleScope`.
+ *
+ * @param counters The events counted in each phase.
  */
-Map::gdBuffer* Map::msIO_getStdoutBufferBytes(void) {
-  msIOContext *ctx = msIO_getHandler( (FILE *) "stdout" );
-  msIOBuffer  *buf;
-  gdBuffer *gdBuf;
-
-  if( ctx == NULL || ctx->write_channel == MS_FALSE 
-      || strcmp(ctx->label,"buffer") != 0 )
-    {
-      msSetError( MS_MISCERR, "Can't identify msIO buffer.",
-                  "Map::msIO_getStdoutBufferBytes" );
-      return NULL;
-    }
-
-  buf = (msIOBuffer *) ctx->cbData;
+Local<Array> Map::CreateCounters(const std::vector< pair<const char *, PerfSample> > &counters) {
+  Local<Array> result = Array::New(counters.size());
 
-  gdBuf = new gdBuffer();
-  gdBuf->data = buf->data;
-  gdBuf->size = buf->data_offset;
-  gdBuf->owns_data = MS_TRUE;
+  for (size_t i = 0; i < counters.size(); ++i) {
+    const PerfSample &sample = counters[i].second;
+    Local<Object> phase = Object::New();
 
-  /* we are seizing ownership of the buffer contents */
-  buf->data_offset = 0;
-  buf->data_len = 0;
-  buf->data = NULL;
+    phase->Set(String::NewSymbol("phase"), String::New(counters[i].first));
+    for (int event = 0; event < PERF_EVENT_COUNT; ++event) {
+      if (sample.valid[event]) {
+        phase->Set(String::NewSymbol(PerfCounters::Name((PerfEvent) event)),
+                   Number::New(sample.values[event]));
+      }
+    }
+    result->Set(i, phase);
+  }
 
-  return gdBuf;
+  return result;
 }
 
 /**
- * @details This creates a `mapObj` primed for use with a `mapservObj`.
+ * @details This converts mapserver output to the javascript object literal
+ * passed to clients as a response. It must be called within a `HandleScope`.
+ *
+ * @param content_type The Content-Type of the output, or `NULL`.
+ *
+ * @param buffer The output, or `NULL`.  The data is zero-copied into a `Buffer`
+ * and free'd when the buffer is garbage collected.
+ *
+ * @param content_encoding The Content-Encoding of the output, or `NULL` if it
+ * is not compressed.
  */
-mapObj* Map::LoadMap(mapservObj *mapserv, mapObj *src) {
-  mapObj* map = msNewMapObj();
+Local<Object> Map::CreateResponse(const char *content_type, gdBuffer *buffer,
+                                  const char *content_encoding) {
+  Local<Object> result = Object::New();
 
-  if (!map) {
-    return NULL;
+  // Add the content-type to the headers object.  This object mirrors the
+  // HTTP headers structure and creates an API that allows for the addition
+  // of other headers in the future.
+  Local<Object> headers = Object::New();
+  if (content_type) {
+    Local<Array> values = Array::New(1);
+
+    values->Set(0, String::New(content_type));
+    headers->Set(String::New("Content-Type"), values);
   }
+  if (content_encoding) {
+    Local<Array> values = Array::New(1);
 
-  // updating alters the state of the map, so work on a copy
-  if (msCopyMap(map, src) != MS_SUCCESS) {
-    msFreeMap(map);
-    return NULL;
+    values->Set(0, String::New(content_encoding));
+    headers->Set(String::New("Content-Encoding"), values);
+
+    values = Array::New(1);
+    values->Set(0, String::New("Accept-Encoding"));
+    headers->Set(String::New("Vary"), values);
   }
-  mapserv->map = map;
+  result->Set(headers_symbol, headers);
 
-  // delegate to the helper function
-  if (updateMap(mapserv, map) != MS_SUCCESS) {
-    msFreeMap(map);
-    mapserv->map = NULL;
-    return NULL;
+  // set the response data as a Node Buffer object. This is zero-copied from
+  // mapserver and free'd when the buffer is garbage collected.
+  if (buffer && buffer->data) {
+    result->Set(data_symbol,
+                Buffer::New((char *)buffer->data, buffer->size, FreeBuffer,
+                            reinterpret_cast<void *>((intptr_t) buffer->size))->handle_);
+
+    // Node only reports the buffers it allocates itself to the garbage
+    // collector
+    responses_external += buffer->size;
+    V8::AdjustAmountOfExternalAllocatedMemory(buffer->size);
+
+    // add the content-length header
+    Local<Array> values = Array::New(1);
+    values->Set(0, Uint32::New(buffer->size));
+    headers->Set(String::New("Content-Length"), values);
   }
 
-  return map;
+  return result;
+}
+
+/**
+ * @details This creates the response to a `render` request for raw output.
+ * The pixels are zero-copied to a `Buffer` which frees the image when it is
+ * garbage collected.  The returned object literal has the properties:
+ *
+ * - `data`: a `Buffer` of `height` rows of `width` pixels, each pixel being
+ *   four bytes in RGBA order
+ * - `width`, `height`: the image size in pixels
+ * - `stride`: the number of bytes between the start of each row
+ * - `premultiplied`: whether the colour is premultiplied by alpha
+ *
+ * @param raw The pixels of the rendered image.
+ *
+ * @param mode The raw output requested.
+ */
+Local<Object> Map::CreateRawResponse(RawImage *raw, RawOutput mode) {
+  Local<Object> result = Object::New();
+
+  result->Set(data_symbol,
+              Buffer::New((char *)raw->pixels, raw->size, FreeRawImage, raw)->handle_);
+  result->Set(String::NewSymbol("width"), Integer::New(raw->image->width));
+  result->Set(String::NewSymbol("height"), Integer::New(raw->image->height));
+  result->Set(String::NewSymbol("stride"), Integer::New(raw->stride));
+  result->Set(String::NewSymbol("premultiplied"), Boolean::New(mode == RAW_PREMULTIPLIED));
+
+  responses_external += raw->size;
+  V8::AdjustAmountOfExternalAllocatedMemory(raw->size);
+
+  return result;
+}
+
+/**
+ * @details The renderers hold pixels with premultiplied alpha in their own
+ * channel order (BGRA for AGG and Cairo on little endian machines), so the
+ * pixels are reordered to RGBA in place, and optionally unpremultiplied, to
+ * avoid copying them.  This runs in the thread that rendered the image.
+ *
+ * @param image The rendered image.
+ *
+ * @param premultiplied Should the colour be left premultiplied by alpha?
+ *
+ * @param routine The routine reported in errors.
+ *
+ * @return The pixels, owning `image`, or `NULL` setting a Mapserver error if
+ * the renderer does not expose RGBA pixels.
+ */
+Map::RawImage* Map::ExtractPixels(imageObj *image, bool premultiplied, const char *routine) {
+  rendererVTableObj *renderer = MS_IMAGE_RENDERER(image);
+  rasterBufferObj buffer;
+
+  if (!MS_RENDERER_PLUGIN(image->format) || !renderer->getRasterBufferHandle
+      || renderer->getRasterBufferHandle(image, &buffer) != MS_SUCCESS
+      || buffer.type != MS_BUFFER_BYTE_RGBA || buffer.data.rgba.pixel_step != 4) {
+    msSetError(MS_MISCERR, "The output format does not expose RGBA pixels", routine);
+    return NULL;
+  }
+
+  rgbaArrayObj *rgba = &(buffer.data.rgba);
+  const int r = rgba->r - rgba->pixels, g = rgba->g - rgba->pixels,
+    b = rgba->b - rgba->pixels, a = rgba->a - rgba->pixels;
+  const bool ordered = (r == 0 && g == 1 && b == 2 && a == 3);
+
+  for (unsigned int y = 0; y < buffer.height && (!ordered || !premultiplied); ++y) {
+    unsigned char *pixel = rgba->pixels + y * rgba->row_step;
+
+    for (unsigned int x = 0; x < buffer.width; ++x, pixel += 4) {
+      unsigned char red = pixel[r], green = pixel[g], blue = pixel[b], alpha = pixel[a];
+
+      if (!premultiplied && alpha && alpha < 255) {
+        red = MS_MIN(255, (red * 255 + alpha / 2) / alpha);
+        green = MS_MIN(255, (green * 255 + alpha / 2) / alpha);
+        blue = MS_MIN(255, (blue * 255 + alpha / 2) / alpha);
+      }
+      pixel[0] = red;
+      pixel[1] = green;
+      pixel[2] = blue;
+      pixel[3] = alpha;
+    }
+  }
+
+  RawImage *raw = new RawImage();
+  raw->image = image;
+  raw->pixels = rgba->pixels;
+  raw->stride = rgba->row_step;
+  raw->size = (size_t) rgba->row_step * buffer.height;
+  return raw;
+}
+
+/**
+ * @details This replaces the buffered output of a mapserv request with a
+ * compressed copy if the client accepts a supported content coding (as
+ * specified by the `HTTP_ACCEPT_ENCODING` environment variable) and the
+ * output is large enough to be worth compressing.  The compression level is
+ * chosen according to the size of the output unless one was specified.
+ *
+ * @param baton The request context.
+ */
+void Map::CompressResponse(MapBaton *baton) {
+  gdBuffer *buffer = baton->buffer;
+  std::map<string, string>::iterator it = baton->env.find("HTTP_ACCEPT_ENCODING");
+  ContentEncoding encoding;
+  unsigned char *data;
+  size_t size;
+
+  if (it == baton->env.end() || !buffer->data
+      || buffer->size < baton->options.compression_threshold) {
+    return;
+  }
+
+  encoding = NegotiateEncoding(it->second.c_str());
+  if (encoding == ENCODING_IDENTITY) {
+    return;
+  }
+
+  data = Compress(buffer->data, buffer->size, encoding,
+                  baton->options.compression_level ? baton->options.compression_level : CompressionLevel(buffer->size),
+                  &size);
+  if (!data) {
+    return;                     // send the output uncompressed
+  }
+
+  msFree(buffer->data);
+  buffer->data = data;
+  buffer->size = size;
+  baton->content_encoding = EncodingName(encoding);
+}
+
+/**
+ * @details This is a callback passed to the mapserver `loadParams` function.
+ * It is called whenever mapserver needs to retrieve a CGI environment
+ * variable.  The environment variables are retrieved from the `env` javascript
+ * object literal that the client passed into the `mapserv` method.
+ */
+char* Map::GetEnv(const char *name, void* thread_context) {
+  std::map<string, string> *env = static_cast<std::map<string, string> *>(thread_context);
+  std::map<string, string>::iterator it = env->find(std::string(name));
+
+  if (it != env->end()) {
+    return const_cast<char *>(it->second.c_str());
+  } else {
+    return NULL;
+  }
+}
+
+/**
+ * @details This code is largely copied from the PHP MapScript module. It is
+ * used to retrieve the buffered mapserver STDOUT data.
+ */
+Map::gdBuffer* Map::msIO_getStdoutBufferBytes(void) {
+  msIOContext *ctx = msIO_getHandler( (FILE *) "stdout" );
+  msIOBuffer  *buf;
+  gdBuffer *gdBuf;
+
+  if( ctx == NULL || ctx->write_channel == MS_FALSE 
+      || strcmp(ctx->label,"buffer") != 0 )
+    {
+      msSetError( MS_MISCERR, "Can't identify msIO buffer.",
+                  "Map::msIO_getStdoutBufferBytes" );
+      return NULL;
+    }
+
+  buf = (msIOBuffer *) ctx->cbData;
+
+  gdBuf = new gdBuffer();
+  gdBuf->data = buf->data;
+  gdBuf->size = buf->data_offset;
+  gdBuf->owns_data = MS_TRUE;
+
+  /* we are seizing ownership of the buffer contents */
+  buf->data_offset = 0;
+  buf->data_len = 0;
+  buf->data = NULL;
+
+  return gdBuf;
+}
+
+/**
+ * @details This creates a `mapObj` primed for use with a `mapservObj`.  The
+ * symbols, fonts, projections and compiled expressions of `self` are shared
+ * with the copy unless the request could alter them.  The caller is responsible for holding a read
+ * lock on `self` and for calling `DetachMap` before the copy is freed.
+ *
+ * Requests customising the map in the same way as earlier requests are
+ * copied from a variant prepared by `LoadVariant`; others are prepared by
+ * `PrepareMap`.
+ *
+ * @param mapserv The request.
+ *
+ * @param self The map to copy.
+ *
+ * @param wait Incremented by the time spent waiting for the parser lock.
+ */
+mapObj* Map::LoadMap(mapservObj *mapserv, Map *self, trace_time_t *wait) {
+  bool share = !requestAltersResources(mapserv->request);
+  int projections = requestAltersProjections(mapserv->request);
+  mapObj *map = NULL;
+  string key;
+
+  if (share && self->skeleton
+      && self->variants.Key(self->map, mapserv->request, key)
+      && LoadVariant(mapserv, self, key, projections, wait, &map)) {
+    return map;
+  }
+
+  // updating alters the state of the map, so work on a copy
+  if (!(map = PrepareMap(mapserv, self, share, projections, wait))) {
+    return NULL;
+  }
+  mapserv->map = map;
+
+  // use the compiled expressions that the request has left unchanged
+  shareMapExpressions(map, self->map);
+
+  return map;
+}
+
+/**
+ * @details The map is copied and updated for the request by `updateMap`.
+ * URL overrides addressing classes are applied by an `OverrideProgram`,
+ * compiled the first time the overrides are seen, so that repeated overrides
+ * do not wait for Mapserver's parser lock.  Other overrides, and those that
+ * do not compile, are applied by `updateMap` under the lock.
+ *
+ * @param mapserv The request.
+ *
+ * @param self The map to copy.
+ *
+ * @param share Should the symbols and fonts be shared?
+ *
+ * @param projections The projections that must not be shared.
+ *
+ * @param wait Incremented by the time spent waiting for the parser lock.
+ *
+ * @return The copy, or `NULL` with a Mapserver error set.
+ */
+mapObj* Map::PrepareMap(mapservObj *mapserv, Map *self, bool share, int projections, trace_time_t *wait) {
+  bool overridden = false;
+  string key;
+
+  mapObj* map = CopyMap(self, share, projections);
+
+  if (!map) {
+    return NULL;
+  }
+
+  if (OverrideProgram::Key(map, mapserv->request, key)) {
+    const OverrideProgram *program = NULL;
+    OverrideProgram *unkept = NULL;
+
+    if (!self->overrides.Get(key, &program)) {
+      mapObj *scratch = CopyMap(self, share, projections);
+
+      if (scratch) {
+        OverrideProgram *compiled = OverrideProgram::Compile(scratch, mapserv->request, wait);
+
+        FreeMap(self, scratch);
+        msResetErrorList();     // `updateMap` reports overrides that fail
+        if (!self->overrides.Put(key, compiled)) {
+          unkept = compiled;    // used for this request only
+        }
+        program = compiled;
+      }
+    }
+
+    if (program) {
+      overridden = (program->Apply(map) == MS_SUCCESS);
+    }
+    delete unkept;
+
+    if (program && !overridden) {
+      FreeMap(self, map);
+      return NULL;
+    }
+  }
+
+  // delegate to the helper function
+  if (updateMap(mapserv, map, !overridden, wait) != MS_SUCCESS) {
+    FreeMap(self, map);
+    return NULL;
+  }
+
+  return map;
+}
+
+/**
+ * @details A variant is prepared the second time its key is seen, with
+ * private projections so that it can be freed by any thread and without the
+ * cookies of the request, which are forwarded to each copy instead.  The
+ * request is then copied from the skeleton of the variant.
+ *
+ * @param mapserv The request.
+ *
+ * @param self The map.
+ *
+ * @param key The key of the variant, from `VariantCache::Key`.
+ *
+ * @param projections The projections of the copy that must not be shared.
+ *
+ * @param wait Incremented by the time spent waiting for the parser lock.
+ *
+ * @param map Set to the copy, or `NULL` with a Mapserver error set if the
+ * copy failed.
+ *
+ * @return `false` if there is no variant to copy.
+ */
+bool Map::LoadVariant(mapservObj *mapserv, Map *self, const string &key, int projections,
+                      trace_time_t *wait, mapObj **map) {
+  std::vector<MapVariant*> unused;
+  bool prepare;
+  MapVariant *variant = self->variants.Acquire(key, &prepare);
+
+  if (!variant && prepare) {
+    char *cookies = mapserv->request->httpcookiedata;
+    mapObj *prepared;
+
+    mapserv->request->httpcookiedata = NULL;
+    prepared = PrepareMap(mapserv, self, true,
+                          NODE_MAPSERV_MAP_PROJECTION | NODE_MAPSERV_LAYER_PROJECTIONS, wait);
+    mapserv->request->httpcookiedata = cookies;
+
+    if (prepared) {
+      variant = new MapVariant();
+      variant->key = key;
+      variant->map = prepared;
+      variant->skeleton = createMapSkeleton(prepared);
+      variant->size = EstimateMapSize(prepared);
+      if (variant->skeleton) {
+        variant = self->variants.Add(variant, unused);
+      } else {
+        unused.push_back(variant);
+        variant = NULL;
+      }
+    }
+    msResetErrorList();         // errors are reported when the request is prepared itself
+  }
+
+  if (variant) {
+    *map = CopyMap(self, true, projections, variant->skeleton);
+    self->variants.Release(variant, unused);
+    if (*map) {
+      mapserv->map = *map;
+      updateMapCookies(mapserv, *map);
+      shareMapExpressions(*map, self->map);
+    }
+  }
+
+  FreeVariants(self, unused);
+  return variant != NULL;
+}
+
+/**
+ * @details This frees variants no longer cached or referenced.
+ *
+ * @param self The map the variants were prepared from.
+ *
+ * @param variants The variants to free.
+ */
+void Map::FreeVariants(Map *self, std::vector<MapVariant*> &variants) {
+  for (size_t i = 0; i < variants.size(); ++i) {
+    MapVariant *variant = variants[i];
+
+    freeMapSkeleton(variant->skeleton);
+    FreeMap(self, variant->map);
+    delete variant;
+  }
+  variants.clear();
+}
+
+/**
+ * @details When `share` is `true` the copy is made from the skeleton of
+ * `self`, skipping the symbol set and font set, and then references those of
+ * `self` directly.  Symbols are only duplicated where rendering alters them.
+ * The projections are then attached from the projection cache of the current
+ * thread, except for those flagged in `projections` which are initialised
+ * privately.  Only the layers that `source` shares with `self` have their
+ * projections attached.  Every copy loads its symbol images from the
+ * `PixmapCache`.  The caller is responsible for holding a read lock on
+ * `self` for the duration of the call.
+ *
+ * @param self The map to copy.
+ *
+ * @param share Should the symbols and fonts be shared?
+ *
+ * @param projections The projections that must not be shared, as returned
+ * by `requestAltersProjections`.
+ *
+ * @param source A skeleton to copy when sharing instead of that of `self`,
+ * such as that of a variant of `self`.
+ *
+ * @return The copy, or `NULL` on failure.
+ */
+mapObj* Map::CopyMap(Map *self, bool share, int projections, mapObj *source) {
+  mapObj* map = msNewMapObj();
+
+  if (!map) {
+    return NULL;
+  }
+
+  share = share && self->skeleton;
+  if (msCopyMap(map, share ? (source ? source : self->skeleton) : self->map) != MS_SUCCESS
+      || (share && shareMapResources(map, self->map) != MS_SUCCESS)) {
+    FreeMap(self, map);
+    return NULL;
+  }
+
+  if (share) {
+    bool cache = !(projections & NODE_MAPSERV_MAP_PROJECTION);
+    int status = ProjectionCache::Attach(&(map->projection), &(self->map->projection), cache);
+
+    // a variant's skeleton need not have the same layers as `self`
+    int layers = MS_MIN(map->numlayers, self->map->numlayers);
+    cache = !(projections & NODE_MAPSERV_LAYER_PROJECTIONS);
+    for (int i = 0; status == MS_SUCCESS && i < layers; ++i) {
+      status = ProjectionCache::Attach(&(GET_LAYER(map, i)->projection),
+                                       &(GET_LAYER(self->map, i)->projection),
+                                       cache);
+    }
+
+    if (status != MS_SUCCESS) {
+      FreeMap(self, map);
+      return NULL;
+    }
+  }
+
+  PixmapCache::Attach(map);
+  return map;
+}
+
+/**
+ * @details This detaches any resources, compiled expressions and cached
+ * projections shared with `self`.  It must be called in the thread that created the copy.
+ *
+ * @param self The map from which `map` was copied.
+ *
+ * @param map The copy to detach.
+ */
+void Map::DetachMap(Map *self, mapObj *map) {
+  unshareMapResources(map, self->map);
+  unshareMapExpressions(map, self->map);
+
+  ProjectionCache::Detach(&(map->projection));
+  for (int i = 0; i < map->numlayers; ++i) {
+    ProjectionCache::Detach(&(GET_LAYER(map, i)->projection));
+  }
+}
+
+/**
+ * @details This detaches any resources shared with `self` before freeing
+ * the copy.
+ *
+ * @param self The map from which `map` was copied.
+ *
+ * @param map The copy to free.
+ */
+void Map::FreeMap(Map *self, mapObj *map) {
+  DetachMap(self, map);
+  msFreeMap(map);
+}
+
+/**
+ * @details This is the asynchronous method used to warm up a map before it
+ * starts serving requests.  Mapserver opens data sources, spatial indexes,
+ * symbol images and fonts lazily, so the first requests served by each worker
+ * thread are slower than those that follow.  This issues one work request per
+ * thread in the libuv thread pool, each of which:
+ *
+ * - opens every layer and selects the shapes in its full extent, which reads
+ *   spatial indexes such as shapefile `.qix` files;
+ * - optionally renders a small sample of the map at each scale that a layer
+ *   is configured to be visible at.
+ *
+ * In addition pixmap symbol images are decoded once for all requests, and
+ * SVG symbol and font files are read into the operating system cache.
+ *
+ * The result passed to the callback is an object literal with the following
+ * properties:
+ *
+ * - `threads`: the number of worker threads that were warmed
+ * - `layers`: the number of layers that were opened
+ * - `symbols`: the number of symbol images that were decoded or read
+ * - `fonts`: the number of font files that were read
+ * - `scales`: the number of scales at which a sample was rendered
+ * - `failed`: an array of the names of layers that could not be opened
+ * - `ready`: whether every worker thread was warmed
+ *
+ * `args` should contain the following parameters:
+ *
+ * @param options An optional object literal with the boolean property
+ * `render` requesting that samples be rendered, the integer property `size`
+ * setting the width and height of each sample in pixels and the boolean
+ * property `spread` requesting that each request hold its thread for up to
+ * `WARM_WAIT_NS` until its siblings occupy the others, which stalls any other
+ * work queued meanwhile.  Without `spread` requests go to whichever threads
+ * are free, so further rounds of requests are queued until every thread has
+ * been warmed or `WARM_DEADLINE_NS` has passed.
+ *
+ * @param callback A function that is called on error or when the map has
+ * been warmed. It should have the signature `callback(err, result)`.
+ */
+Handle<Value> Map::WarmAsync(const Arguments& args) {
+  HandleScope scope;
+  Local<Object> options;
+  Local<Function> callback;
+  bool render = false, spread = false;
+  int size = 256;
+
+  switch (args.Length()) {
+  case 1:
+    ASSIGN_FUN_ARG(0, callback);
+    break;
+  case 2:
+    ASSIGN_OBJ_ARG(0, options);
+    ASSIGN_FUN_ARG(1, callback);
+
+    if (options->Has(String::NewSymbol("render"))) {
+      render = options->Get(String::NewSymbol("render"))->BooleanValue();
+    }
+    if (options->Has(String::NewSymbol("spread"))) {
+      spread = options->Get(String::NewSymbol("spread"))->BooleanValue();
+    }
+    if (options->Has(String::NewSymbol("size"))) {
+      Local<Value> value = options->Get(String::NewSymbol("size"));
+      if (!value->IsNumber() || value->Int32Value() < 1) {
+        THROW_CSTR_ERROR(TypeError, "`size` must be a positive integer");
+      }
+      size = value->Int32Value();
+    }
+    break;
+  default:
+    THROW_CSTR_ERROR(Error, "usage: Map.warm([options], callback)");
+  }
+
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  if (self->disposed) {
+    THROW_CSTR_ERROR(Error, "The map has been disposed");
+  }
+  WarmBaton *baton = new WarmBaton();
+  int threads = ThreadPoolSize();
+
+  baton->self = self;
+  baton->callback = Persistent<Function>::New(callback);
+  baton->map = self->map;
+  baton->error = NULL;
+  baton->render = render;
+  baton->spread = spread;
+  baton->size = size;
+  baton->threads = threads;
+  baton->deadline = uv_hrtime() + WARM_DEADLINE_NS;
+  baton->preloaded = false;
+  baton->symbols = 0;
+  baton->fonts = 0;
+  baton->scales = 0;
+  uv_mutex_init(&baton->mutex);
+  uv_cond_init(&baton->cond);
+  uv_timer_init(uv_default_loop(), &baton->timer);
+  baton->timer.data = baton;
+
+  self->Ref(); // increment reference count so map is not garbage collected
+
+  WarmQueue(baton);
+
+  return Undefined();
+}
+
+/**
+ * @details One request is queued per worker thread.  This runs in the main
+ * thread, when no requests from a previous round are still executing.
+ *
+ * @param baton The context shared by the requests.
+ */
+void Map::WarmQueue(WarmBaton *baton) {
+  baton->started = 0;
+  baton->pending = baton->threads;
+
+  for (int i = 0; i < baton->threads; ++i) {
+    WarmRequest *request = new WarmRequest();
+    request->request.data = request;
+    request->baton = baton;
+
+    uv_queue_work(uv_default_loop(),
+                  &request->request,
+                  WarmWork,
+                  (uv_after_work_cb) WarmAfter);
+  }
+}
+
+/**
+ * @details This is started by `WarmAfter` when a round of requests has left
+ * some worker threads cold.
+ *
+ * @param handle The timer of the warming context.
+ *
+ * @param status Unused.
+ */
+void Map::WarmRetry(uv_timer_t *handle, int status) {
+  WarmQueue(static_cast<WarmBaton*>(handle->data));
+}
+
+/**
+ * @details This is called by `WarmAsync` and runs in a different thread to
+ * that function.  With the `spread` option each request waits until its
+ * siblings have started executing so that every request occupies a different
+ * worker thread: the wait is bounded so the pool cannot deadlock if it is busy
+ * with other work.  A request landing on a thread that has already been
+ * warmed returns straight away.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::WarmWork(uv_work_t *req) {
+  /* No HandleScope! This is run in a separate thread: *No* contact
+     should be made with the Node/V8 world here. */
+
+  WarmRequest *request = static_cast<WarmRequest*>(req->data);
+  WarmBaton *baton = request->baton;
+  Map *self = baton->self;
+  mapObj *map = NULL;
+  bool first, seen;
+
+  uv_mutex_lock(&baton->mutex);
+  first = !baton->preloaded;
+  baton->preloaded = true;
+  if (++baton->started == baton->threads) {
+    uv_cond_broadcast(&baton->cond);
+  }
+  uint64_t deadline = uv_hrtime() + WARM_WAIT_NS;
+  while (baton->spread && baton->started < baton->threads) {
+    uint64_t now = uv_hrtime();
+    if (now >= deadline || uv_cond_timedwait(&baton->cond, &baton->mutex, deadline - now) != 0) {
+      break;                    // the other threads are busy: carry on
+    }
+  }
+  seen = !baton->thread_ids.insert(uv_thread_self()).second;
+  uv_mutex_unlock(&baton->mutex);
+
+  if (seen) {
+    return;                     // this thread has already been warmed
+  }
+
+  // The operating system cache is shared by all threads so symbol and font
+  // files only need reading once.
+  if (first) {
+    int symbols, fonts;
+
+    uv_rwlock_rdlock(&self->lock);
+    symbols = PreloadSymbols(self->map);
+    fonts = PreloadFonts(self->map);
+    uv_rwlock_rdunlock(&self->lock);
+
+    uv_mutex_lock(&baton->mutex);
+    baton->symbols = symbols;
+    baton->fonts = fonts;
+    uv_mutex_unlock(&baton->mutex);
+  }
+
+  uv_rwlock_rdlock(&self->lock);
+  map = CopyMap(self, true);
+  if (map) {
+    shareMapExpressions(map, self->map);
+  }
+  uv_rwlock_rdunlock(&self->lock);
+
+  if (!map) {
+    uv_mutex_lock(&baton->mutex);
+    if (!baton->error) {
+      errorObj *error = msGetErrorObj();
+      if (!error || error->code == MS_NOERR) {
+        baton->error = new MapserverError("Could not copy map", "Map::WarmWork()");
+      } else {
+        baton->error = new MapserverError(error);
+      }
+    }
+    uv_mutex_unlock(&baton->mutex);
+    msResetErrorList();
+    return;
+  }
+
+  WarmLayers(map, baton);
+  if (baton->render) {
+    WarmScales(map, baton);
+  }
+
+  FreeMap(self, map);
+  msResetErrorList();
+  return;
+}
+
+/**
+ * @details This opens each layer and selects the shapes intersecting its
+ * full extent, which is where data sources open their files, connections
+ * and spatial indexes.  Raster layers are only read when drawn, so they are
+ * drawn at the full extent instead.  Layers retrieving data from remote
+ * services are skipped.
+ *
+ * @param map The map whose layers are to be opened.
+ *
+ * @param baton The context in which the outcome is recorded.
+ */
+void Map::WarmLayers(mapObj *map, WarmBaton *baton) {
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+    bool opened = false;
+
+    if (layer->connectiontype == MS_WMS || layer->connectiontype == MS_WFS) {
+      continue;
+    }
+
+    if (layer->type == MS_LAYER_RASTER) {
+      opened = WarmRaster(map, layer, baton->size);
+    } else if (msLayerOpen(layer) == MS_SUCCESS) {
+      rectObj extent = map->extent;
+
+#ifdef USE_PROJ
+      if (layer->project && msProjectionsDiffer(&(map->projection), &(layer->projection))) {
+        msProjectRect(&(map->projection), &(layer->projection), &extent);
+      }
+#endif
+
+      if (msLayerWhichItems(layer, MS_FALSE, NULL) == MS_SUCCESS
+          && msLayerWhichShapes(layer, extent, MS_FALSE) != MS_FAILURE) {
+        opened = true;          // MS_DONE means no shapes: that's fine
+      }
+      msLayerClose(layer);
+    }
+
+    uv_mutex_lock(&baton->mutex);
+    if (opened) {
+      baton->layers.insert(layer->name ? layer->name : "");
+    } else if (layer->name) {
+      baton->failed.insert(layer->name);
+    }
+    uv_mutex_unlock(&baton->mutex);
+    msResetErrorList();
+  }
+}
+
+/**
+ * @details The layer is drawn on its own into an image `size` pixels square,
+ * which opens its datasets (or tile index) through GDAL and reads the
+ * overviews needed at that size.  The extent and size of the map are
+ * restored afterwards.
+ *
+ * @param map The map owning the layer.
+ *
+ * @param layer The raster layer to draw.
+ *
+ * @param size The width and height of the image in pixels.
+ *
+ * @return `true` if the layer was drawn.
+ */
+bool Map::WarmRaster(mapObj *map, layerObj *layer, int size) {
+  rectObj extent = map->extent;
+  int width = map->width, height = map->height;
+  bool drawn = false;
+
+  map->width = map->height = size;
+
+  imageObj *image = msPrepareImage(map, MS_FALSE);
+  if (image) {
+    drawn = (msDrawRasterLayer(map, layer, image) == MS_SUCCESS);
+    msFreeImage(image);
+  }
+
+  map->extent = extent;
+  map->width = width;
+  map->height = height;
+  return drawn;
+}
+
+/**
+ * @details A sample is drawn at one representative scale for each distinct
+ * scale range configured on the layers and their classes, together with the
+ * map's full extent.  Drawing loads everything else that is opened lazily,
+ * such as raster datasets and glyphs in the renderer's font cache.
+ *
+ * @param map The map to draw.  Its extent and size are altered.
+ *
+ * @param baton The context in which the outcome is recorded.
+ */
+void Map::WarmScales(mapObj *map, WarmBaton *baton) {
+  std::set<double> scales;
+  double inches = map->resolution * msInchesPerUnit(map->units, 0);
+  pointObj center;
+
+  center.x = (map->extent.minx + map->extent.maxx) / 2;
+  center.y = (map->extent.miny + map->extent.maxy) / 2;
+
+  // choose a scale inside each configured scale range
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+    double minscale = layer->minscaledenom, maxscale = layer->maxscaledenom;
+
+    for (int j = 0; j <= layer->numclasses; ++j) {
+      if (j) {
+        minscale = layer->_class[j-1]->minscaledenom;
+        maxscale = layer->_class[j-1]->maxscaledenom;
+      }
+
+      if (minscale > 0 && maxscale > 0) {
+        scales.insert(sqrt(minscale * maxscale));
+      } else if (maxscale > 0) {
+        scales.insert(maxscale / 2);
+      } else if (minscale > 0) {
+        scales.insert(minscale * 2);
+      }
+    }
+  }
+
+  int rendered = 0;
+  rectObj full = map->extent;
+  map->width = map->height = baton->size;
+
+  // a scale of zero represents the full extent
+  scales.insert(0);
+  for (std::set<double>::iterator it = scales.begin(); it != scales.end(); ++it) {
+    if (*it > 0 && inches > 0) {
+      double half = (*it / inches) * baton->size / 2; // half the extent width
+      map->extent.minx = center.x - half;
+      map->extent.maxx = center.x + half;
+      map->extent.miny = center.y - half;
+      map->extent.maxy = center.y + half;
+    } else {
+      map->extent = full;
+    }
+
+    imageObj *image = msDrawMap(map, MS_FALSE);
+    if (image) {
+      msFreeImage(image);
+      rendered++;
+    } else {
+      // a map that cannot be drawn is not ready to serve requests
+      uv_mutex_lock(&baton->mutex);
+      if (!baton->error) {
+        errorObj *error = msGetErrorObj();
+        if (!error || error->code == MS_NOERR) {
+          baton->error = new MapserverError("Could not draw map", "Map::WarmScales()");
+        } else {
+          baton->error = new MapserverError(error);
+        }
+      }
+      uv_mutex_unlock(&baton->mutex);
+    }
+    msResetErrorList();
+  }
+
+  uv_mutex_lock(&baton->mutex);
+  if (rendered > baton->scales) {
+    baton->scales = rendered;
+  }
+  uv_mutex_unlock(&baton->mutex);
+}
+
+/**
+ * @details Pixmap symbol images are decoded into the `PixmapCache`, from
+ * which every request copy then loads them.  SVG symbols are rendered by
+ * each request that draws them, so their files are read to ensure they are
+ * in the operating system cache by then.
+ *
+ * @param map The map owning the symbol set.
+ *
+ * @return The number of symbol images decoded or read.
+ */
+int Map::PreloadSymbols(mapObj *map) {
+  int count = PixmapCache::Preload(map);
+
+  for (int i = 0; i < map->symbolset.numsymbols; ++i) {
+    symbolObj *symbol = map->symbolset.symbol[i];
+    if (symbol && symbol->type == MS_SYMBOL_SVG && ReadFile(symbol->full_pixmap_path)) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * @details Font files are opened by the renderer when text is first drawn;
+ * reading them here ensures they are in the operating system cache by then.
+ *
+ * @param map The map owning the font set.
+ *
+ * @return The number of font files read.
+ */
+int Map::PreloadFonts(mapObj *map) {
+  int count = 0;
+  const char *key = msFirstKeyFromHashTable(&(map->fontset.fonts));
+
+  while (key) {
+    if (ReadFile(msLookupHashTable(&(map->fontset.fonts), key))) {
+      count++;
+    }
+    key = msNextKeyFromHashTable(&(map->fontset.fonts), key);
+  }
+
+  return count;
+}
+
+/**
+ * @details The contents of the file are discarded.
+ *
+ * @param path The file path, which may be `NULL`.
+ *
+ * @return `true` if the file could be read.
+ */
+bool Map::ReadFile(const char *path) {
+  char buffer[65536];
+  FILE *file = path ? fopen(path, "rb") : NULL;
+
+  if (!file) {
+    return false;
+  }
+
+  while (fread(buffer, 1, sizeof(buffer), file) == sizeof(buffer));
+  fclose(file);
+  return true;
+}
+
+/**
+ * @details This is set by `WarmAsync` to run after each `WarmWork` request
+ * has finished.  Once the last request of a round has finished, another
+ * round is started after `WARM_RETRY_MS` if some worker threads are still
+ * cold and `WARM_DEADLINE_NS` has not passed.  Otherwise the outcome is
+ * returned via the original callback.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::WarmAfter(uv_work_t *req) {
+  HandleScope scope;
+
+  WarmRequest *request = static_cast<WarmRequest*>(req->data);
+  WarmBaton *baton = request->baton;
+  delete request;
+
+  if (--baton->pending) {
+    return;                     // there are still threads being warmed
+  }
+  if (!baton->error
+      && baton->thread_ids.size() < (size_t) baton->threads
+      && uv_hrtime() < baton->deadline) {
+    uv_timer_start(&baton->timer, WarmRetry, WARM_RETRY_MS, 0);
+    return;                     // try the cold threads again
+  }
+
+  Handle<Value> argv[2];
+
+  if (baton->error) {
+    argv[0] = baton->error->toV8Error();
+    argv[1] = Undefined();
+    delete baton->error;        // we've finished with it
+  } else {
+    Local<Object> result = Object::New();
+    Local<Array> failed = Array::New(baton->failed.size());
+    uint32_t i = 0;
+
+    for (std::set<string>::iterator it = baton->failed.begin(); it != baton->failed.end(); ++it) {
+      failed->Set(i++, String::New(it->c_str()));
+    }
+
+    result->Set(String::NewSymbol("threads"), Integer::New(baton->thread_ids.size()));
+    result->Set(String::NewSymbol("layers"), Integer::New(baton->layers.size()));
+    result->Set(String::NewSymbol("symbols"), Integer::New(baton->symbols));
+    result->Set(String::NewSymbol("fonts"), Integer::New(baton->fonts));
+    result->Set(String::NewSymbol("scales"), Integer::New(baton->scales));
+    result->Set(String::NewSymbol("failed"), failed);
+    result->Set(String::NewSymbol("ready"),
+                Boolean::New(baton->thread_ids.size() == (size_t) baton->threads));
+
+    argv[0] = Undefined();
+    argv[1] = result;
+  }
+
+  // pass the results to the user specified callback function
+  TryCatch try_catch;
+  baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  uv_close((uv_handle_t*) &baton->timer, WarmClose);
+}
+
+/**
+ * @param handle The timer of the warming context.
+ */
+void Map::WarmClose(uv_handle_t *handle) {
+  WarmBaton *baton = static_cast<WarmBaton*>(handle->data);
+
+  uv_cond_destroy(&baton->cond);
+  uv_mutex_destroy(&baton->mutex);
+  baton->callback.Dispose();
+  baton->self->Unref(); // decrement the map reference so it can be garbage collected
+  delete baton;
+}
+
+/**
+ * @details This is the asynchronous method used to inspect the layers of a
+ * map for configuration that slows drawing it, such as shapefiles without a
+ * quadtree index.  The callback receives an array of findings, each an
+ * object with the following properties:
+ *
+ * - `layer`: the name of the layer concerned
+ * - `type`: the kind of problem e.g. `missing-index`
+ * - `severity`: either `warning` or `info`
+ * - `message`: a description of the problem and its remedy
+ * - `path`: the data file concerned, if any
+ * - `features`: the number of features in the data, if known
+ * - `fixed`: whether the problem was fixed, if a fix was attempted
+ * - `error`: why the fix failed, if it did
+ *
+ * `args` should contain the following parameters:
+ *
+ * @param options An optional object literal with the boolean property `fix`
+ * requesting that missing shapefile indexes be built beside the data.
+ *
+ * @param callback A function that is called on error or when the map has
+ * been analysed. It should have the signature `callback(err, findings)`.
+ */
+Handle<Value> Map::AnalyzeAsync(const Arguments& args) {
+  HandleScope scope;
+  Local<Object> options;
+  Local<Function> callback;
+  bool fix = false;
+
+  switch (args.Length()) {
+  case 1:
+    ASSIGN_FUN_ARG(0, callback);
+    break;
+  case 2:
+    ASSIGN_OBJ_ARG(0, options);
+    ASSIGN_FUN_ARG(1, callback);
+
+    if (options->Has(String::NewSymbol("fix"))) {
+      fix = options->Get(String::NewSymbol("fix"))->BooleanValue();
+    }
+    break;
+  default:
+    THROW_CSTR_ERROR(Error, "usage: Map.analyze([options], callback)");
+  }
+
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  if (self->disposed) {
+    THROW_CSTR_ERROR(Error, "The map has been disposed");
+  }
+  AnalyzeBaton *baton = new AnalyzeBaton();
+
+  baton->request.data = baton;
+  baton->self = self;
+  baton->callback = Persistent<Function>::New(callback);
+  baton->map = self->map;
+  baton->error = NULL;
+  baton->fix = fix;
+
+  self->Ref(); // increment reference count so map is not garbage collected
+
+  uv_queue_work(uv_default_loop(),
+                &baton->request,
+                AnalyzeWork,
+                (uv_after_work_cb) AnalyzeAfter);
+
+  return Undefined();
+}
+
+/**
+ * @details This is called by `AnalyzeAsync` and runs in a different thread
+ * to that function.  Building an index only adds a file beside the data, so
+ * the map is merely read locked.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::AnalyzeWork(uv_work_t *req) {
+  /* No HandleScope! This is run in a separate thread: *No* contact
+     should be made with the Node/V8 world here. */
+
+  AnalyzeBaton *baton = static_cast<AnalyzeBaton*>(req->data);
+
+  uv_rwlock_rdlock(&baton->self->lock);
+  AnalyzeMap(baton->map, baton->fix, baton->findings);
+  uv_rwlock_rdunlock(&baton->self->lock);
+
+  msResetErrorList();
+  return;
+}
+
+/**
+ * @details This is set by `AnalyzeAsync` to run after `AnalyzeWork` has
+ * finished, passing the findings to the original callback.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::AnalyzeAfter(uv_work_t *req) {
+  HandleScope scope;
+
+  AnalyzeBaton *baton = static_cast<AnalyzeBaton*>(req->data);
+  Local<Array> findings = Array::New(baton->findings.size());
+  Handle<Value> argv[2];
+
+  for (uint32_t i = 0; i < baton->findings.size(); ++i) {
+    const Finding &finding = baton->findings[i];
+    Local<Object> result = Object::New();
+
+    result->Set(String::NewSymbol("layer"), String::New(finding.layer.c_str()));
+    result->Set(String::NewSymbol("type"), String::New(finding.type.c_str()));
+    result->Set(String::NewSymbol("severity"), String::New(finding.severity.c_str()));
+    result->Set(String::NewSymbol("message"), String::New(finding.message.c_str()));
+    if (!finding.path.empty()) {
+      result->Set(String::NewSymbol("path"), String::New(finding.path.c_str()));
+    }
+    if (finding.features >= 0) {
+      result->Set(String::NewSymbol("features"), Number::New(finding.features));
+    }
+    if (finding.attempted) {
+      result->Set(String::NewSymbol("fixed"), Boolean::New(finding.fixed));
+    }
+    if (!finding.error.empty()) {
+      result->Set(String::NewSymbol("error"), String::New(finding.error.c_str()));
+    }
+    findings->Set(i, result);
+  }
+
+  argv[0] = Undefined();
+  argv[1] = findings;
+
+  // pass the results to the user specified callback function
+  TryCatch try_catch;
+  baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  // clean up
+  baton->callback.Dispose();
+  baton->self->Unref(); // decrement the map reference so it can be garbage collected
+  delete baton;
+  return;
+}
+
+/**
+ * @details libuv uses four threads unless newer versions are told otherwise
+ * using the `UV_THREADPOOL_SIZE` environment variable.
+ */
+int Map::ThreadPoolSize() {
+  const char *value = getenv("UV_THREADPOOL_SIZE");
+  int size = value ? atoi(value) : 0;
+
+  if (size < 1) {
+    size = 4;
+  } else if (size > 128) {
+    size = 128;
+  }
+  return size;
+}
+
+/// Read an optional integer property, returning `false` if it is invalid
+static bool integerOption(Local<Object> options, const char *name, int min, int max, int *value) {
+  if (!options->Has(String::NewSymbol(name))) {
+    return true;
+  }
+
+  Local<Value> option = options->Get(String::NewSymbol(name));
+  if (!option->IsNumber() || option->NumberValue() != option->Int32Value()
+      || option->Int32Value() < min || option->Int32Value() > max) {
+    return false;
+  }
+  *value = option->Int32Value();
+  return true;
+}
+
+/**
+ * @details This is the asynchronous method used to render an image of the
+ * map directly, without marshalling the request through CGI parameters.  The
+ * response is the same object literal passed to `mapserv` callbacks.
+ *
+ * `args` should contain the following parameters:
+ *
+ * @param options An object literal with the following properties:
+ * - `bbox`: an array of `[minx, miny, maxx, maxy]` (required)
+ * - `width`, `height`: the image size in pixels (required)
+ * - `srs`: the projection of `bbox` e.g. `EPSG:3857` (optional)
+ * - `layers`: an array of layer or group names to draw (optional)
+ * - `format`: an output format name or mime type (optional)
+ * - `transparent`: a boolean (optional)
+ * - `features`: features to draw in place of the data of layers, as
+ *   described by `FeatureLayer::Parse` (optional)
+ * - `raw`: `rgba` or `premultiplied` to return the pixels of the image
+ *   rather than encoding it, as described by `CreateRawResponse` (optional)
+ * - `parallel`: the number of threads drawing the layers, as described by
+ *   `RenderParallel` (default 1)
+ * - `bands`: the number of bands of rows the image is drawn in, as described
+ *   by `RenderBanded` (default 1)
+ * - `bandThreshold`: the number of pixels above which the image is drawn in
+ *   enough bands for every thread, when `bands` is not given (optional)
+ * - `bandBuffer`: the rows of overlap drawn around each band (default
+ *   `BAND_BUFFER`)
+ *
+ * @param callback A function that is called on error or when the image has
+ * been rendered. It should have the signature `callback(err, response)`.
+ */
+Handle<Value> Map::RenderAsync(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() != 2) {
+    THROW_CSTR_ERROR(Error, "usage: Map.render(options, callback)");
+  }
+  REQ_OBJ_ARG(0, options);
+  REQ_FUN_ARG(1, callback);
+
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  if (self->disposed) {
+    THROW_CSTR_ERROR(Error, "The map has been disposed");
+  }
+  RenderBaton *baton = new RenderBaton();
+
+  const char *message = ParseRenderOptions(options, baton);
+  if (message) {
+    delete baton;
+    THROW_CSTR_ERROR(TypeError, message);
+  }
+
+  int parallel = 1;
+  if (options->Has(String::NewSymbol("parallel"))) {
+    Local<Value> value = options->Get(String::NewSymbol("parallel"));
+    if (!value->IsNumber() || value->Int32Value() < 1 || value->Int32Value() > MAX_LAYER_PASSES) {
+      delete baton;
+      THROW_CSTR_ERROR(TypeError, "`parallel` must be an integer between 1 and 64");
+    }
+    parallel = value->Int32Value();
+  }
+  if (parallel > 1) {
+    RenderParallel(self, baton, parallel, callback);
+    return Undefined();
+  }
+
+  // images are only drawn in bands when the client asks for it
+  int bands = 1, buffer = BAND_BUFFER, threshold = 0;
+  if (!integerOption(options, "bandThreshold", 0, INT_MAX, &threshold)) {
+    delete baton;
+    THROW_CSTR_ERROR(TypeError, "`bandThreshold` must be a non-negative integer");
+  }
+  double pixels = (double) baton->width * baton->height;
+  if (threshold && pixels > threshold) {
+    bands = (int) MS_MIN(ceil(pixels / BAND_PIXELS), MAX_BANDS);
+    if (bands < ThreadPoolSize()) {
+      bands = ThreadPoolSize();
+    }
+  }
+  if (!integerOption(options, "bands", 1, MAX_BANDS, &bands)) {
+    delete baton;
+    THROW_CSTR_ERROR(TypeError, "`bands` must be an integer between 1 and 1024");
+  }
+  if (!integerOption(options, "bandBuffer", 0, 4096, &buffer)) {
+    delete baton;
+    THROW_CSTR_ERROR(TypeError, "`bandBuffer` must be an integer between 0 and 4096");
+  }
+  if (bands > baton->height / 2) {
+    bands = baton->height / 2;
+  }
+  if (bands > 1) {
+    RenderBanded(self, baton, bands, buffer, callback);
+    return Undefined();
+  }
+
+  baton->request.data = baton;
+  baton->self = self;
+  baton->callback = Persistent<Function>::New(callback);
+  baton->map = self->map;
+  baton->error = NULL;
+  baton->content_type = NULL;
+  baton->buffer = NULL;
+  baton->generation = 0;
+  baton->raw_image = NULL;
+  baton->pass = 0;
+  baton->passes = 0;
+
+  self->Ref(); // increment reference count so map is not garbage collected
+
+  uv_queue_work(uv_default_loop(),
+                &baton->request,
+                RenderWork,
+                (uv_after_work_cb) RenderAfter);
+
+  return Undefined();
+}
+
+/**
+ * @details This parses the options accepted by `render`, which are
+ * described by `RenderAsync`.
+ *
+ * @param options The javascript options object.
+ *
+ * @param baton Populated with the options.
+ *
+ * @return `NULL` on success, otherwise a message describing the invalid
+ * option.
+ */
+const char* Map::ParseRenderOptions(Local<Object> options, RenderBaton *baton) {
+  Local<Value> bbox = options->Get(String::NewSymbol("bbox"));
+  if (!bbox->IsArray() || Local<Array>::Cast(bbox)->Length() != 4) {
+    return "`bbox` must be an array of four numbers";
+  }
+  for (uint32_t i = 0; i < 4; ++i) {
+    Local<Value> value = Local<Array>::Cast(bbox)->Get(i);
+    if (!value->IsNumber()) {
+      return "`bbox` must be an array of four numbers";
+    }
+    baton->bbox[i] = value->NumberValue();
+    if (baton->bbox[i] - baton->bbox[i] != 0) {
+      return "`bbox` must contain finite numbers"; // infinite or NaN
+    }
+  }
+
+  Local<Value> width = options->Get(String::NewSymbol("width"));
+  Local<Value> height = options->Get(String::NewSymbol("height"));
+  if (!width->IsNumber() || width->Int32Value() < 1
+      || !height->IsNumber() || height->Int32Value() < 1) {
+    return "`width` and `height` must be positive integers";
+  }
+  baton->width = width->Int32Value();
+  baton->height = height->Int32Value();
+
+  if (options->Has(String::NewSymbol("srs"))) {
+    baton->srs = *String::Utf8Value(options->Get(String::NewSymbol("srs"))->ToString());
+  }
+
+  const char *message = ParseLayers(options, baton);
+  if (message) {
+    return message;
+  }
+
+  if (options->Has(String::NewSymbol("format"))) {
+    baton->format = *String::Utf8Value(options->Get(String::NewSymbol("format"))->ToString());
+  }
+
+  baton->transparent = MS_NOOVERRIDE;
+  if (options->Has(String::NewSymbol("transparent"))) {
+    baton->transparent = options->Get(String::NewSymbol("transparent"))->BooleanValue() ? MS_TRUE : MS_FALSE;
+  }
+
+  baton->raw = RAW_NONE;
+  if (options->Has(String::NewSymbol("raw"))) {
+    string raw = *String::Utf8Value(options->Get(String::NewSymbol("raw"))->ToString());
+    if (raw == "rgba") {
+      baton->raw = RAW_RGBA;
+    } else if (raw == "premultiplied") {
+      baton->raw = RAW_PREMULTIPLIED;
+    } else {
+      return "`raw` must be one of 'rgba'; 'premultiplied'";
+    }
+  }
+
+  return FeatureLayer::Parse(options->Get(String::NewSymbol("features")), baton->features);
+}
+
+/**
+ * @details This parses the `layers` property of `render` options, leaving
+ * the layer status defined by the map in place when it is absent.
+ *
+ * @param options The javascript options object.
+ *
+ * @param baton Populated with the layers.
+ *
+ * @return `NULL` on success, otherwise a message describing the invalid
+ * option.
+ */
+const char* Map::ParseLayers(Local<Object> options, RenderBaton *baton) {
+  baton->all_layers = true;
+  if (options->Has(String::NewSymbol("layers"))) {
+    Local<Value> layers = options->Get(String::NewSymbol("layers"));
+    if (!layers->IsArray()) {
+      return "`layers` must be an array of strings";
+    }
+    Local<Array> names = Local<Array>::Cast(layers);
+    for (uint32_t i = 0; i < names->Length(); ++i) {
+      baton->layers.insert(string(*String::Utf8Value(names->Get(i)->ToString())));
+    }
+    baton->all_layers = false;
+  }
+
+  return NULL;
+}
+
+/**
+ * @details This is called by `RenderAsync` and runs in a different thread to
+ * that function.  The extent, size, projection, layers and output format are
+ * set on a copy of the map which is then drawn and saved to a buffer.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::RenderWork(uv_work_t *req) {
+  /* No HandleScope! This is run in a separate thread: *No* contact
+     should be made with the Node/V8 world here. */
+
+  RenderBaton *baton = static_cast<RenderBaton*>(req->data);
+  Map *self = baton->self;
+  mapObj *map = NULL;
+  imageObj *image = NULL;
+  unsigned char *data;
+  int size = 0;
+
+  // images of features passed with the request are not worth caching, nor
+  // are pixels which are not encoded
+  if (self->cache.Enabled() && baton->features.empty() && baton->raw == RAW_NONE) {
+    size_t cached_size;
+    string content_type;
+
+    baton->key = RenderKey(baton);
+    baton->generation = self->cache.Generation();
+    if (self->cache.Get(baton->key, &data, &cached_size, content_type)) {
+      baton->buffer = new gdBuffer();
+      baton->buffer->data = data;
+      baton->buffer->size = cached_size;
+      baton->buffer->owns_data = MS_TRUE;
+      baton->content_type = msStrdup(content_type.c_str());
+      return;
+    }
+  }
+
+  if (msDebugInitFromEnv() != MS_SUCCESS) {
+    goto handle_error;
+  }
+
+  if (!(image = RenderImage(baton, &map, "Map::RenderWork()"))) {
+    goto handle_error;
+  }
+
+  if (baton->raw != RAW_NONE) {
+    baton->raw_image = ExtractPixels(image, baton->raw == RAW_PREMULTIPLIED, "Map::RenderWork()");
+    if (baton->raw_image) {
+      image = NULL;             // the pixels now own the image
+    }
+    goto handle_error;          // there is nothing to encode or cache
+  }
+
+  data = msSaveImageBuffer(image, &size, map->outputformat);
+  if (!data) {
+    goto handle_error;
+  }
+
+  baton->buffer = new gdBuffer();
+  baton->buffer->data = data;
+  baton->buffer->size = size;
+  baton->buffer->owns_data = MS_TRUE;
+  baton->content_type = msStrdup(MS_IMAGE_MIME_TYPE(map->outputformat));
+
+  if (!baton->key.empty()) {
+    std::set<string> drawn;
+    rectObj extent;
+
+    for (int i = 0; i < map->numlayers; ++i) {
+      layerObj *layer = GET_LAYER(map, i);
+      if (msLayerIsVisible(map, layer)) {
+        if (layer->name) drawn.insert(layer->name);
+        if (layer->group) drawn.insert(layer->group);
+      }
+    }
+
+    extent.minx = baton->bbox[0];
+    extent.miny = baton->bbox[1];
+    extent.maxx = baton->bbox[2];
+    extent.maxy = baton->bbox[3];
+    self->cache.Put(baton->key, data, size, baton->content_type, baton->srs,
+                    extent, drawn, baton->generation);
+  }
+
+ handle_error:
+  errorObj *error = msGetErrorObj();
+  bool rendered = baton->buffer || baton->raw_image;
+  if (!rendered && error && error->code != MS_NOERR) {
+    baton->error = new MapserverError(error);
+  } else if (!rendered) {
+    baton->error = new MapserverError("The map could not be rendered", "Map::RenderWork()");
+  }
+
+  // clean up
+  if (image) {
+    msFreeImage(image);
+  }
+  if (map) {
+    FeatureLayer::Unbind(map);
+    FreeMap(self, map);
+  }
+  msResetErrorList();
+  msDebugCleanup();
+  return;
+}
+
+/**
+ * @details This copies the map of a `render` request, sets the extent,
+ * size, projection, layers, features and output format of the request on
+ * the copy and draws it.  It runs in a worker thread.
+ *
+ * @param baton The request.
+ *
+ * @param copy Set to the copy of the map, which the caller must free with
+ * `FeatureLayer::Unbind` and `FreeMap` whether or not drawing succeeded.
+ *
+ * @param routine The routine reported in errors.
+ *
+ * @return The image, or `NULL` with a Mapserver error set.
+ */
+imageObj* Map::RenderImage(RenderBaton *baton, mapObj **copy, const char *routine) {
+  mapObj *map;
+
+  uv_rwlock_rdlock(&baton->self->lock);
+  map = *copy = CopyMap(baton->self, true, baton->srs.empty() ? 0 : NODE_MAPSERV_MAP_PROJECTION);
+  if (map) {
+    shareMapExpressions(map, baton->self->map);
+  }
+  uv_rwlock_rdunlock(&baton->self->lock);
+
+  if (!map) {
+    return NULL;
+  }
+
+  if (baton->width > map->maxsize || baton->height > map->maxsize) {
+    msSetError(MS_WEBERR, "Image size out of range.", routine);
+    return NULL;
+  }
+  map->width = baton->width;
+  map->height = baton->height;
+
+  map->extent.minx = baton->bbox[0];
+  map->extent.miny = baton->bbox[1];
+  map->extent.maxx = baton->bbox[2];
+  map->extent.maxy = baton->bbox[3];
+
+#ifdef USE_PROJ
+  if (!baton->srs.empty()) {
+    if (msLoadProjectionString(&(map->projection), baton->srs.c_str()) != 0) {
+      return NULL;
+    }
+    map->units = GetMapserverUnitUsingProj(&(map->projection));
+  }
+#endif
+
+  if (!baton->all_layers && !SelectLayers(map, baton->layers, routine)) {
+    return NULL;
+  }
+
+  if (!FeatureLayer::Bind(map, baton->features, routine)) {
+    return NULL;
+  }
+
+  if (!SelectFormat(map, baton->format, baton->transparent, routine)) {
+    return NULL;
+  }
+
+  if (!baton->passes) {
+    return msDrawMap(map, MS_FALSE);
+  }
+
+  // draw a single pass, restoring the classes altered by the pass afterwards
+  std::vector< pair<int *, int> > altered;
+  imageObj *image;
+
+  SelectLayerPass(map, baton->pass, baton->passes, altered);
+  image = msDrawMap(map, MS_FALSE);
+  for (size_t i = altered.size(); i > 0; --i) {
+    *(altered[i - 1].first) = altered[i - 1].second; // a count may be altered twice
+  }
+  return image;
+}
+
+/**
+ * @details This draws the layers of a single `render` request on several
+ * threads.  The visible layers are split in draw order into `passes`
+ * consecutive runs, each drawn without labels by a separate work request,
+ * while a final pass draws only the labels of all layers so that they are
+ * placed together, as Mapserver's label cache would.  The passes are then
+ * composited in order with the labels on top.
+ *
+ * A layer that cannot be drawn in parallel, such as a labelled point layer
+ * whose markers its labels must avoid, is drawn whole in the label pass along
+ * with every layer after it, so that the layer order is kept.
+ *
+ * @param self The map to draw.
+ *
+ * @param options The parsed request, which is freed.
+ *
+ * @param passes The number of passes drawing layers.
+ *
+ * @param callback The function called with the image.
+ */
+void Map::RenderParallel(Map *self, RenderBaton *options, int passes, Local<Function> callback) {
+  CompositeBaton *baton = CreateRenderComposite(options);
+
+  // the label pass is the last
+  for (int pass = 0; pass <= passes; ++pass) {
+    CompositePart *part = CreatePart(baton, self);
+
+    part->pass = pass;
+    part->passes = passes;
+    part->features = options->features;
+  }
+  delete options;
+
+  QueueComposite(baton, callback);
+}
+
+/**
+ * @details This draws a single large `render` request as horizontal bands of
+ * rows on several threads, using the whole thread pool.  Each band is drawn
+ * with `buffer` rows of overlap above and below it and only its own rows are
+ * stitched into the output image as soon as it is drawn.  The output is then
+ * encoded once, so the whole image is still held in memory and must fit
+ * within the `MAXSIZE` of the map: banding shortens the render but does not
+ * bound its peak memory.
+ *
+ * The overlap lets features crossing the edge of a band be drawn on both
+ * sides of it, but each band places its labels independently: labels and
+ * symbols near a seam that extend beyond the overlap, or that collide with
+ * labels outside it, can be drawn differently than in one image.
+ *
+ * The bands are cut from the extent as fitted to the image by Mapserver, so
+ * their cell size matches that of the whole image.
+ *
+ * @param self The map to draw.
+ *
+ * @param options The parsed request, which is freed.
+ *
+ * @param bands The number of bands, at most half the image height.
+ *
+ * @param buffer The rows of overlap drawn around each band.
+ *
+ * @param callback The function called with the image.
+ */
+void Map::RenderBanded(Map *self, RenderBaton *options, int bands, int buffer, Local<Function> callback) {
+  CompositeBaton *baton = CreateRenderComposite(options);
+  int height = options->height;
+  rectObj extent;
+  double cellsize;
+
+  baton->banded = true;
+  uv_mutex_init(&baton->mutex);
+
+  extent.minx = options->bbox[0];
+  extent.miny = options->bbox[1];
+  extent.maxx = options->bbox[2];
+  extent.maxy = options->bbox[3];
+  cellsize = msAdjustExtent(&extent, options->width, height);
+
+  for (int band = 0; band < bands; ++band) {
+    CompositePart *part = CreatePart(baton, self);
+    int first = height * band / bands, last = height * (band + 1) / bands;
+    int top = first > buffer ? first - buffer : 0;
+    int bottom = last + buffer < height ? last + buffer : height;
+
+    // Mapserver extents run between the centres of the outer pixels
+    part->bbox[0] = extent.minx;
+    part->bbox[1] = extent.maxy - (bottom - 1) * cellsize;
+    part->bbox[2] = extent.maxx;
+    part->bbox[3] = extent.maxy - top * cellsize;
+    part->height = bottom - top;
+    part->transparent = options->transparent;
+    part->top = first;
+    part->skip = first - top;
+    part->rows = last - first;
+    part->features = options->features;
+  }
+  delete options;
+
+  QueueComposite(baton, callback);
+}
+
+/**
+ * @details The extent, size and output options of a `render` request are
+ * copied to a new composite drawing it in several parts.
+ *
+ * @param options The parsed request.
+ *
+ * @return The composite, without parts.
+ */
+Map::CompositeBaton* Map::CreateRenderComposite(RenderBaton *options) {
+  CompositeBaton *baton = new CompositeBaton();
+
+  baton->options.bbox[0] = options->bbox[0];
+  baton->options.bbox[1] = options->bbox[1];
+  baton->options.bbox[2] = options->bbox[2];
+  baton->options.bbox[3] = options->bbox[3];
+  baton->options.width = options->width;
+  baton->options.height = options->height;
+  baton->options.srs = options->srs;
+  baton->options.all_layers = options->all_layers;
+  baton->options.layers = options->layers;
+  baton->options.format = options->format;
+  baton->options.transparent = options->transparent;
+  baton->options.raw = options->raw;
+  baton->banded = false;
+
+  return baton;
+}
+
+/**
+ * @details The visibility of every layer, and its `REQUIRES` and
+ * `LABELREQUIRES` expressions, are evaluated first so that layers switched
+ * off by a pass do not hide the layers that depend on them.  The expressions
+ * are then removed, and the labels of layers failing `LABELREQUIRES` are
+ * suppressed in every pass.  Pass `passes` is the label pass.
+ *
+ * The layers are drawn in the same order as by `msDrawMap`.  The leading run
+ * of visible layers that can be drawn in parallel is split between the
+ * passes, while the first layer that cannot and every layer after it are
+ * drawn whole in the label pass, on top of the others and in order.  Layers
+ * that cannot be drawn in parallel are those with the metadata `parallel`
+ * set to `false`, those with labels that bypass the label cache and labelled
+ * point and annotation layers, whose markers their labels must be placed
+ * around.  The numbers of labels and styles of classes are zeroed to
+ * suppress them, `altered` recording the original values to be restored
+ * before the map is freed.
+ *
+ * @param map The copy of the map to draw the pass on.
+ *
+ * @param pass The pass to draw.
+ *
+ * @param passes The number of passes drawing layers.
+ *
+ * @param altered Populated with the counts that were altered.
+ */
+void Map::SelectLayerPass(mapObj *map, int pass, int passes, std::vector< pair<int *, int> > &altered) {
+  std::vector<layerObj *> layers, labels, whole, unlabelled;
+
+  // visibility depends on the scale, which is otherwise calculated when drawing
+  msAdjustExtent(&(map->extent), map->width, map->height);
+  msCalculateScale(map->extent, map->units, map->width, map->height, map->resolution, &(map->scaledenom));
+
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, map->layerorder ? map->layerorder[i] : i);
+    const char *parallel = msLookupHashTable(&(layer->metadata), "parallel");
+    bool labelled = false;
+
+    if (!msLayerIsVisible(map, layer)
+        || (layer->requires && msEvalContext(map, layer, layer->requires) == MS_FALSE)) {
+      continue;
+    }
+    for (int c = 0; c < layer->numclasses; ++c) {
+      labelled = labelled || layer->_class[c]->numlabels > 0;
+    }
+    if (labelled && layer->labelrequires
+        && msEvalContext(map, layer, layer->labelrequires) == MS_FALSE) {
+      unlabelled.push_back(layer);
+      labelled = false;
+    }
+
+    if (!whole.empty()
+        || (parallel && strcasecmp(parallel, "false") == 0)
+        || (labelled && layer->labelcache == MS_OFF)
+        || (labelled && (layer->type == MS_LAYER_POINT || layer->type == MS_LAYER_ANNOTATION))) {
+      whole.push_back(layer);   // drawn in order after the parallel layers
+      continue;
+    }
+    layers.push_back(layer);
+    if (labelled) {
+      labels.push_back(layer);
+    }
+  }
+
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+
+    layer->status = MS_OFF;
+    msFree(layer->requires);
+    layer->requires = NULL;
+    msFree(layer->labelrequires);
+    layer->labelrequires = NULL;
+  }
+
+  for (size_t i = 0; i < unlabelled.size(); ++i) {
+    for (int c = 0; c < unlabelled[i]->numclasses; ++c) {
+      classObj *klass = unlabelled[i]->_class[c];
+      altered.push_back(pair<int *, int>(&(klass->numlabels), klass->numlabels));
+      klass->numlabels = 0;
+    }
+  }
+
+  if (pass == passes) {
+    for (size_t i = 0; i < labels.size(); ++i) {
+      labels[i]->status = MS_ON;
+      for (int c = 0; c < labels[i]->numclasses; ++c) {
+        classObj *klass = labels[i]->_class[c];
+        altered.push_back(pair<int *, int>(&(klass->numstyles), klass->numstyles));
+        klass->numstyles = 0;
+      }
+    }
+    for (size_t i = 0; i < whole.size(); ++i) {
+      whole[i]->status = MS_ON;
+    }
+    return;
+  }
+
+  size_t first = layers.size() * pass / passes, last = layers.size() * (pass + 1) / passes;
+  for (size_t i = first; i < last; ++i) {
+    layers[i]->status = MS_ON;
+    for (int c = 0; c < layers[i]->numclasses; ++c) {
+      classObj *klass = layers[i]->_class[c];
+      altered.push_back(pair<int *, int>(&(klass->numlabels), klass->numlabels));
+      klass->numlabels = 0;
+    }
+  }
+}
+
+/**
+ * @details This is set by `RenderAsync` to run after `RenderWork` has
+ * finished, passing the response generated by the latter to the original
+ * callback.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::RenderAfter(uv_work_t *req) {
+  HandleScope scope;
+
+  RenderBaton *baton = static_cast<RenderBaton*>(req->data);
+  Handle<Value> argv[2];
+
+  if (baton->error) {
+    argv[0] = baton->error->toV8Error();
+    argv[1] = Undefined();
+    delete baton->error;        // we've finished with it
+  } else if (baton->raw_image) {
+    argv[0] = Undefined();
+    argv[1] = CreateRawResponse(baton->raw_image, baton->raw);
+  } else {
+    argv[0] = Undefined();
+    argv[1] = CreateResponse(baton->content_type, baton->buffer, NULL);
+  }
+
+  // pass the results to the user specified callback function
+  TryCatch try_catch;
+  baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  // clean up
+  if (baton->buffer) {
+    delete baton->buffer;
+  }
+  if (baton->content_type) {
+    msFree(baton->content_type);
+  }
+  baton->callback.Dispose();
+  baton->self->Unref(); // decrement the map reference so it can be garbage collected
+  delete baton;
+  return;
+}
+
+/**
+ * @details This is the asynchronous function used to draw several maps at
+ * the same extent and size and blend them into a single image, such as a
+ * basemap, a thematic map and an annotation map.  Each part is drawn by a
+ * separate work request so the parts are drawn in parallel by the thread
+ * pool.  Once all are drawn their pixels are alpha composited in order, bottom
+ * first, and the result is encoded once in the output format of the bottom
+ * part.  The response is the same as that of `render`.
+ *
+ * `args` should contain the following parameters:
+ *
+ * @param parts An array of object literals with the following properties:
+ * - `map`: the `Map` to draw (required)
+ * - `layers`: an array of layer or group names to draw (optional)
+ * - `opacity`: a number between 0 and 1 (default 1)
+ * - `features`: features to draw in place of the data of layers (optional)
+ *
+ * @param options An object literal accepting the `bbox`, `width`, `height`,
+ * `srs`, `layers`, `format`, `transparent` and `raw` options of `render`,
+ * `layers` applying to parts that do not name their own.  All parts above
+ * the bottom one are drawn transparent.
+ *
+ * @param callback A function that is called on error or when the image has
+ * been composited. It should have the signature `callback(err, response)`.
+ */
+Handle<Value> Map::CompositeAsync(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() != 3 || !args[0]->IsArray()) {
+    THROW_CSTR_ERROR(Error, "usage: mapserv.composite(parts, options, callback)");
+  }
+  Local<Array> parts = Local<Array>::Cast(args[0]);
+  REQ_OBJ_ARG(1, options);
+  REQ_FUN_ARG(2, callback);
+
+  if (parts->Length() == 0) {
+    THROW_CSTR_ERROR(TypeError, "`parts` must contain at least one part");
+  }
+
+  CompositeBaton *baton = new CompositeBaton();
+  const char *message = ParseRenderOptions(options, &baton->options);
+
+  baton->banded = false;
+
+  for (uint32_t i = 0; !message && i < parts->Length(); ++i) {
+    Local<Value> value = parts->Get(i);
+    if (!value->IsObject()) {
+      message = "each part must be an object";
+      break;
+    }
+
+    Local<Object> spec = value->ToObject();
+    Local<Value> map = spec->Get(String::NewSymbol("map"));
+    if (!map->IsObject() || !map_template->HasInstance(map)) {
+      message = "the `map` of each part must be a `Map`";
+      break;
+    }
+    Map *self = ObjectWrap::Unwrap<Map>(map->ToObject());
+    if (self->disposed) {
+      message = "the `map` of a part has been disposed";
+      break;
+    }
+
+    CompositePart *part = CreatePart(baton, self);
+    if (spec->Has(String::NewSymbol("layers"))) {
+      part->layers.clear();
+      if ((message = ParseLayers(spec, part))) {
+        break;
+      }
+    }
+    if ((message = FeatureLayer::Parse(spec->Get(String::NewSymbol("features")), part->features))) {
+      break;
+    }
+
+    if (spec->Has(String::NewSymbol("opacity"))) {
+      Local<Value> opacity = spec->Get(String::NewSymbol("opacity"));
+      if (!opacity->IsNumber() || opacity->NumberValue() < 0 || opacity->NumberValue() > 1) {
+        message = "`opacity` must be a number between 0 and 1";
+        break;
+      }
+      part->opacity = opacity->NumberValue();
+    }
+  }
+
+  if (!message && !baton->options.features.empty()) {
+    message = "`features` must be passed with the part drawing them";
+  }
+
+  if (message) {
+    for (size_t i = 0; i < baton->parts.size(); ++i) {
+      delete baton->parts[i];
+    }
+    delete baton;
+    THROW_CSTR_ERROR(TypeError, message);
+  }
+
+  QueueComposite(baton, callback);
+
+  return Undefined();
+}
+
+/**
+ * @details The part is added to `baton` and drawn with the options of the
+ * composite: the bottom part keeps the requested transparency and all others
+ * are drawn transparent.
+ *
+ * @param baton The composite the part belongs to.
+ *
+ * @param self The map drawn by the part.
+ *
+ * @return The part.
+ */
+Map::CompositePart* Map::CreatePart(CompositeBaton *baton, Map *self) {
+  CompositePart *part = new CompositePart();
+
+  part->request.data = part;
+  part->self = self;
+  part->map = self->map;
+  part->error = NULL;
+  part->composite = baton;
+  part->opacity = 1;
+  part->pixels.data.rgba.pixels = NULL;
+  part->drawn = false;
+  part->top = 0;
+  part->skip = 0;
+  part->rows = 0;
+  part->raw = RAW_NONE;
+  part->raw_image = NULL;
+  part->content_type = NULL;
+  part->buffer = NULL;
+  part->generation = 0;
+  part->pass = 0;
+  part->passes = 0;
+
+  // every part is drawn at the same extent and size
+  memcpy(part->bbox, baton->options.bbox, sizeof(part->bbox));
+  part->width = baton->options.width;
+  part->height = baton->options.height;
+  part->srs = baton->options.srs;
+  part->format = baton->options.format;
+  part->transparent = baton->parts.empty() ? baton->options.transparent : MS_TRUE;
+  part->all_layers = baton->options.all_layers;
+  part->layers = baton->options.layers;
+
+  baton->parts.push_back(part);
+  return part;
+}
+
+/**
+ * @details This takes a reference on the map of each part and queues the
+ * parts for drawing in the thread pool.
+ *
+ * @param baton The composite, whose parts have been created.
+ *
+ * @param callback The function called with the composite.
+ */
+void Map::QueueComposite(CompositeBaton *baton, Local<Function> callback) {
+  baton->request.data = baton;
+  baton->callback = Persistent<Function>::New(callback);
+  baton->map = NULL;
+  baton->error = NULL;
+  baton->pending = baton->parts.size();
+  baton->format = NULL;
+  baton->resolution = MS_DEFAULT_RESOLUTION;
+  baton->defresolution = MS_DEFAULT_RESOLUTION;
+  baton->content_type = NULL;
+  baton->buffer = NULL;
+  baton->raw_image = NULL;
+  baton->image = NULL;
+
+  for (size_t i = 0; i < baton->parts.size(); ++i) {
+    CompositePart *part = baton->parts[i];
+
+    part->self->Ref(); // increment reference count so map is not garbage collected
+    uv_queue_work(uv_default_loop(),
+                  &part->request,
+                  CompositePartWork,
+                  (uv_after_work_cb) CompositePartAfter);
+  }
+}
+
+/**
+ * @details This is called by `CompositeAsync` for each part and runs in a
+ * different thread to that function.  The part is drawn on a copy of its map
+ * and its pixels are copied so the image and map can be freed by the thread
+ * that created them.  The output format and resolution of the bottom part
+ * are kept for creating the composite.  The bands of a banded `render` are
+ * instead stitched into the output image by `StitchBand`.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::CompositePartWork(uv_work_t *req) {
+  /* No HandleScope! This is run in a separate thread: *No* contact
+     should be made with the Node/V8 world here. */
+
+  CompositePart *part = static_cast<CompositePart*>(req->data);
+  CompositeBaton *baton = part->composite;
+  mapObj *map = NULL;
+  imageObj *image = NULL;
+  rendererVTableObj *renderer;
+  rasterBufferObj buffer;
+
+  if (msDebugInitFromEnv() != MS_SUCCESS) {
+    goto handle_error;
+  }
+
+  // the bands are within the size limit even when the whole image is not
+  if (baton->banded) {
+    uv_rwlock_rdlock(&part->self->lock);
+    bool oversize = baton->options.width > part->self->map->maxsize
+      || baton->options.height > part->self->map->maxsize;
+    uv_rwlock_rdunlock(&part->self->lock);
+
+    if (oversize) {
+      msSetError(MS_WEBERR, "Image size out of range.", "Map::CompositePartWork()");
+      goto handle_error;
+    }
+  }
+
+  if (!(image = RenderImage(part, &map, "Map::CompositePartWork()"))) {
+    goto handle_error;
+  }
+
+  renderer = MS_IMAGE_RENDERER(image);
+  if (!MS_RENDERER_PLUGIN(image->format) || !renderer->getRasterBufferHandle
+      || renderer->getRasterBufferHandle(image, &buffer) != MS_SUCCESS
+      || buffer.type != MS_BUFFER_BYTE_RGBA) {
+    msSetError(MS_MISCERR, "The output format does not expose RGBA pixels", "Map::CompositePartWork()");
+    goto handle_error;
+  }
+
+  if (baton->banded) {
+    part->drawn = StitchBand(part, map, &buffer);
+    goto handle_error;          // the band itself is not kept
+  }
+
+  if (baton->parts[0] == part) {
+    baton->format = msCloneOutputFormat(map->outputformat);
+    baton->resolution = map->resolution;
+    baton->defresolution = map->defresolution;
+  }
+
+  // copy the pixels, rebasing the channel pointers onto the copy
+  {
+    rgbaArrayObj *rgba = &(buffer.data.rgba);
+    size_t size = (size_t) rgba->row_step * buffer.height;
+    unsigned char *pixels = static_cast<unsigned char *>(msSmallMalloc(size));
+
+    memcpy(pixels, rgba->pixels, size);
+    part->pixels = buffer;
+    part->pixels.data.rgba.pixels = pixels;
+    part->pixels.data.rgba.r = pixels + (rgba->r - rgba->pixels);
+    part->pixels.data.rgba.g = pixels + (rgba->g - rgba->pixels);
+    part->pixels.data.rgba.b = pixels + (rgba->b - rgba->pixels);
+    part->pixels.data.rgba.a = rgba->a ? pixels + (rgba->a - rgba->pixels) : NULL;
+    part->drawn = true;
+  }
+
+ handle_error:
+  errorObj *error = msGetErrorObj();
+  if (!part->drawn) {
+    if (error && error->code != MS_NOERR) {
+      part->error = new MapserverError(error);
+    } else {
+      part->error = new MapserverError("The map could not be rendered", "Map::CompositePartWork()");
+    }
+  }
+
+  // clean up
+  if (image) {
+    msFreeImage(image);
+  }
+  if (map) {
+    FeatureLayer::Unbind(map);
+    FreeMap(part->self, map);
+  }
+  msResetErrorList();
+  msDebugCleanup();
+  return;
+}
+
+/**
+ * @details The rows of the band that are not overlap are blended onto the
+ * output image, which is created by the first band to be drawn with a copy
+ * of its output format.  Blending onto the transparent output image copies
+ * the pixels.  It runs in a worker thread.
+ *
+ * @param part The band.
+ *
+ * @param map The copy of the map the band was drawn with.
+ *
+ * @param buffer The pixels of the band.
+ *
+ * @return `false`, setting a Mapserver error, if the band could not be
+ * stitched.
+ */
+bool Map::StitchBand(CompositePart *part, mapObj *map, rasterBufferObj *buffer) {
+  CompositeBaton *baton = part->composite;
+  rasterBufferObj band = *buffer;
+  rgbaArrayObj *rgba = &(band.data.rgba);
+  size_t offset = (size_t) rgba->row_step * part->skip;
+  bool stitched = false;
+
+  // view only the kept rows
+  band.height = part->rows;
+  rgba->pixels += offset;
+  rgba->r += offset;
+  rgba->g += offset;
+  rgba->b += offset;
+  if (rgba->a) {
+    rgba->a += offset;
+  }
+
+  uv_mutex_lock(&baton->mutex);
+  if (!baton->image) {
+    baton->format = msCloneOutputFormat(map->outputformat);
+    baton->resolution = map->resolution;
+    baton->defresolution = map->defresolution;
+    baton->image = msImageCreate(baton->options.width, baton->options.height, baton->format,
+                                 NULL, NULL, map->resolution, map->defresolution, NULL);
+  }
+  if (baton->image) {
+    rendererVTableObj *renderer = MS_IMAGE_RENDERER(baton->image);
+
+    if (!renderer->mergeRasterBuffer) {
+      msSetError(MS_MISCERR, "The output format cannot blend images", "Map::StitchBand()");
+    } else {
+      stitched = renderer->mergeRasterBuffer(baton->image, &band, 1, 0, 0, 0, part->top,
+                                             band.width, band.height) == MS_SUCCESS;
+    }
+  }
+  uv_mutex_unlock(&baton->mutex);
+
+  return stitched;
+}
+
+/**
+ * @details This is set by `CompositeAsync` to run after each
+ * `CompositePartWork` has finished.  When the last part has been drawn the
+ * parts are queued for compositing, or the first error is passed to the
+ * callback.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::CompositePartAfter(uv_work_t *req) {
+  HandleScope scope;
+
+  CompositePart *part = static_cast<CompositePart*>(req->data);
+  CompositeBaton *baton = part->composite;
+
+  if (--baton->pending > 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < baton->parts.size(); ++i) {
+    if (baton->parts[i]->error) {
+      Handle<Value> argv[1] = { baton->parts[i]->error->toV8Error() };
+
+      TryCatch try_catch;
+      baton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+      if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+      }
+      FreeComposite(baton);
+      return;
+    }
+  }
+
+  uv_queue_work(uv_default_loop(),
+                &baton->request,
+                CompositeWork,
+                (uv_after_work_cb) CompositeAfter);
+}
+
+/**
+ * @details This is queued by `CompositePartAfter` and runs in a different
+ * thread to that function.  The parts are blended onto a transparent image
+ * using the renderer of the bottom part, which then encodes the result.  The
+ * bands of a banded `render` have already been stitched into the image.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::CompositeWork(uv_work_t *req) {
+  /* No HandleScope! This is run in a separate thread: *No* contact
+     should be made with the Node/V8 world here. */
+
+  CompositeBaton *baton = static_cast<CompositeBaton*>(req->data);
+  const RenderBaton &options = baton->options;
+  imageObj *image = NULL;
+  rendererVTableObj *renderer;
+  unsigned char *data;
+  int size = 0;
+
+  if (baton->banded) {
+    image = baton->image;
+    baton->image = NULL;
+  } else {
+    image = msImageCreate(options.width, options.height, baton->format, NULL, NULL,
+                          baton->resolution, baton->defresolution, NULL);
+    if (!image) {
+      goto handle_error;
+    }
+
+    renderer = MS_IMAGE_RENDERER(image);
+    if (!MS_RENDERER_PLUGIN(image->format) || !renderer->mergeRasterBuffer) {
+      msSetError(MS_MISCERR, "The output format cannot blend images", "Map::CompositeWork()");
+      goto handle_error;
+    }
+
+    for (size_t i = 0; i < baton->parts.size(); ++i) {
+      CompositePart *part = baton->parts[i];
+
+      if (renderer->mergeRasterBuffer(image, &(part->pixels), part->opacity,
+                                      0, 0, 0, 0, options.width, options.height) != MS_SUCCESS) {
+        goto handle_error;
+      }
+    }
+  }
+
+  if (options.raw != RAW_NONE) {
+    baton->raw_image = ExtractPixels(image, options.raw == RAW_PREMULTIPLIED, "Map::CompositeWork()");
+    if (baton->raw_image) {
+      image = NULL;             // the pixels now own the image
+    }
+    goto handle_error;          // there is nothing to encode
+  }
+
+  data = msSaveImageBuffer(image, &size, image->format);
+  if (!data) {
+    goto handle_error;
+  }
+
+  baton->buffer = new gdBuffer();
+  baton->buffer->data = data;
+  baton->buffer->size = size;
+  baton->buffer->owns_data = MS_TRUE;
+  baton->content_type = msStrdup(MS_IMAGE_MIME_TYPE(image->format));
+
+ handle_error:
+  errorObj *error = msGetErrorObj();
+  bool composited = baton->buffer || baton->raw_image;
+  if (!composited && error && error->code != MS_NOERR) {
+    baton->error = new MapserverError(error);
+  } else if (!composited) {
+    baton->error = new MapserverError("The maps could not be composited", "Map::CompositeWork()");
+  }
+
+  // clean up
+  if (image) {
+    msFreeImage(image);
+  }
+  msResetErrorList();
+  return;
+}
+
+/**
+ * @details This is set by `CompositePartAfter` to run after `CompositeWork`
+ * has finished, passing the composite to the original callback.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::CompositeAfter(uv_work_t *req) {
+  HandleScope scope;
+
+  CompositeBaton *baton = static_cast<CompositeBaton*>(req->data);
+  Handle<Value> argv[2];
+
+  if (baton->error) {
+    argv[0] = baton->error->toV8Error();
+    argv[1] = Undefined();
+  } else if (baton->raw_image) {
+    argv[0] = Undefined();
+    argv[1] = CreateRawResponse(baton->raw_image, baton->options.raw);
+  } else {
+    argv[0] = Undefined();
+    argv[1] = CreateResponse(baton->content_type, baton->buffer, NULL);
+  }
+
+  // pass the results to the user specified callback function
+  TryCatch try_catch;
+  baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  FreeComposite(baton);
+  return;
+}
+
+/**
+ * @details This frees the parts, errors and output of a composite and
+ * releases the references held on the maps it drew.  It runs in the main
+ * thread.
+ *
+ * @param baton The composite to free.
+ */
+void Map::FreeComposite(CompositeBaton *baton) {
+  for (size_t i = 0; i < baton->parts.size(); ++i) {
+    CompositePart *part = baton->parts[i];
+
+    msFree(part->pixels.data.rgba.pixels);
+    if (part->error) {
+      delete part->error;
+    }
+    part->self->Unref(); // decrement the map reference so it can be garbage collected
+    delete part;
+  }
+
+  if (baton->error) {
+    delete baton->error;
+  }
+  if (baton->image) {
+    msFreeImage(baton->image);
+  }
+  if (baton->banded) {
+    uv_mutex_destroy(&baton->mutex);
+  }
+  if (baton->format) {
+    msFreeOutputFormat(baton->format);
+  }
+  if (baton->buffer) {
+    delete baton->buffer;
+  }
+  if (baton->content_type) {
+    msFree(baton->content_type);
+  }
+  baton->callback.Dispose();
+  delete baton;
+}
+
+/**
+ * @details Layers whose name or group is in `layers` are switched on and
+ * all others are switched off, except those with `STATUS DEFAULT`.
+ *
+ * @param map The map whose layers are to be selected.
+ *
+ * @param layers The layer names or groups.
+ *
+ * @param routine The routine reported in errors.
+ *
+ * @return `false`, setting a Mapserver error, if a name matches no layer.
+ */
+bool Map::SelectLayers(mapObj *map, const std::set<string> &layers, const char *routine) {
+  std::set<string> unmatched = layers;
+
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+    bool requested = (layer->name && layers.count(layer->name))
+      || (layer->group && layers.count(layer->group));
+
+    if (requested) {
+      if (layer->name) unmatched.erase(layer->name);
+      if (layer->group) unmatched.erase(layer->group);
+    }
+    if (layer->status != MS_DEFAULT) {
+      layer->status = requested ? MS_ON : MS_OFF;
+    }
+  }
+
+  if (!unmatched.empty()) {
+    msSetError(MS_WEBERR, "Invalid layer: %s", routine, unmatched.begin()->c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @param map The map whose output format is to be set.
+ *
+ * @param format An output format name or mime type, or empty to keep the
+ * current format.
+ *
+ * @param transparent `MS_TRUE`, `MS_FALSE` or `MS_NOOVERRIDE`.
+ *
+ * @param routine The routine reported in errors.
+ *
+ * @return `false`, setting a Mapserver error, if the format is not supported.
+ */
+bool Map::SelectFormat(mapObj *map, const string &format, int transparent, const char *routine) {
+  if (!format.empty()) {
+    outputFormatObj *selected = msSelectOutputFormat(map, format.c_str());
+
+    if (!selected) {
+      msSetError(MS_WEBERR, "Unsupported output format: %s", routine, format.c_str());
+      return false;
+    }
+    msApplyOutputFormat(&(map->outputformat), selected, transparent, MS_NOOVERRIDE, MS_NOOVERRIDE);
+  } else if (transparent != MS_NOOVERRIDE && map->outputformat) {
+    msApplyOutputFormat(&(map->outputformat), map->outputformat, transparent, MS_NOOVERRIDE, MS_NOOVERRIDE);
+  }
+  return true;
+}
+
+/// Read an optional array of four numbers, returning `false` if it is invalid
+static bool extentOption(Local<Object> options, const char *name, double *extent) {
+  if (!options->Has(String::NewSymbol(name))) {
+    return true;
+  }
+
+  Local<Value> option = options->Get(String::NewSymbol(name));
+  if (!option->IsArray() || Local<Array>::Cast(option)->Length() != 4) {
+    return false;
+  }
+  for (uint32_t i = 0; i < 4; ++i) {
+    Local<Value> value = Local<Array>::Cast(option)->Get(i);
+    if (!value->IsNumber()) {
+      return false;
+    }
+    extent[i] = value->NumberValue();
+    if (extent[i] - extent[i] != 0) {
+      return false;             // infinite or NaN
+    }
+  }
+  return (extent[0] < extent[2] && extent[1] < extent[3]);
+}
+
+/**
+ * @details This is the asynchronous method used to seed a tile cache.  The
+ * tiles in an extent are rendered over a range of zoom levels by one work
+ * request per thread in the libuv thread pool.  Neighbouring tiles are drawn
+ * together as a metatile which is then cut into tiles, reducing the number of
+ * times data is read and keeping labels consistent across tile boundaries.
+ * The tiles are written by a single separate thread, in one transaction per
+ * batch when writing to MBTiles.
+ *
+ * The progress passed to the `progress` function, and the result passed to
+ * the callback, is an object literal with the following properties:
+ *
+ * - `total`: the number of tiles in the extent
+ * - `rendered`: the number of tiles rendered so far
+ * - `skipped`: the number of existing tiles that were skipped
+ * - `stored`: the number of tiles written so far
+ * - `elapsed`: the time since seeding started in milliseconds
+ * - `tilesPerSecond`: the rate at which tiles have been stored
+ *
+ * `args` should contain the following parameters:
+ *
+ * @param options An object literal with the following properties:
+ * - `maxzoom`: the last zoom level to seed (required)
+ * - `minzoom`: the first zoom level to seed (default 0)
+ * - `bbox`: the extent to seed in the projection of the grid (default the
+ *   extent of the grid)
+ * - `grid`: an object literal with the `srs`, `extent` and `tileSize` of the
+ *   tile grid (default the spherical mercator grid used by web maps)
+ * - `metatile`: the width and height of metatiles in tiles (default 4)
+ * - `buffer`: the number of pixels rendered around metatiles (default 0)
+ * - `layers`: an array of layer or group names to draw (optional)
+ * - `format`: an output format name or mime type (optional)
+ * - `mbtiles`: the path of an MBTiles file to write to, or
+ * - `directory`: the path of a directory to write `z/x/y` tiles to
+ * - `skipExisting`: should tiles that are already stored be skipped?
+ * - `progress`: a function called with the progress from time to time
+ *
+ * @param callback A function that is called on error or when the tiles have
+ * been seeded. It should have the signature `callback(err, result)`.
+ */
+Handle<Value> Map::SeedAsync(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() != 2) {
+    THROW_CSTR_ERROR(Error, "usage: Map.seed(options, callback)");
+  }
+  REQ_OBJ_ARG(0, options);
+  REQ_FUN_ARG(1, callback);
+
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  if (self->disposed) {
+    THROW_CSTR_ERROR(Error, "The map has been disposed");
+  }
+  TileGrid grid;
+  double bbox[4];
+  int minzoom = 0, maxzoom = -1, metatile = 4, buffer = 0;
+
+  grid.srs = "EPSG:3857";
+  grid.extent[0] = grid.extent[1] = -MERCATOR_EXTENT;
+  grid.extent[2] = grid.extent[3] = MERCATOR_EXTENT;
+  grid.tile_size = 256;
+
+  if (options->Has(String::NewSymbol("grid"))) {
+    Local<Value> value = options->Get(String::NewSymbol("grid"));
+    if (!value->IsObject()) {
+      THROW_CSTR_ERROR(TypeError, "`grid` must be an object");
+    }
+    Local<Object> definition = value->ToObject();
+    if (definition->Has(String::NewSymbol("srs"))) {
+      grid.srs = *String::Utf8Value(definition->Get(String::NewSymbol("srs"))->ToString());
+    }
+    if (!extentOption(definition, "extent", grid.extent)) {
+      THROW_CSTR_ERROR(TypeError, "`grid.extent` must be an array of four numbers");
+    }
+    if (!integerOption(definition, "tileSize", 1, 4096, &(grid.tile_size))) {
+      THROW_CSTR_ERROR(TypeError, "`grid.tileSize` must be an integer between 1 and 4096");
+    }
+  }
+
+  memcpy(bbox, grid.extent, sizeof(bbox));
+  if (!extentOption(options, "bbox", bbox)) {
+    THROW_CSTR_ERROR(TypeError, "`bbox` must be an array of four numbers");
+  }
+  if (!options->Has(String::NewSymbol("maxzoom"))
+      || !integerOption(options, "maxzoom", 0, 30, &maxzoom)
+      || !integerOption(options, "minzoom", 0, maxzoom, &minzoom)) {
+    THROW_CSTR_ERROR(TypeError, "`minzoom` and `maxzoom` must be integers between 0 and 30");
+  }
+  if (!integerOption(options, "metatile", 1, 16, &metatile)) {
+    THROW_CSTR_ERROR(TypeError, "`metatile` must be an integer between 1 and 16");
+  }
+  if (!integerOption(options, "buffer", 0, 1024, &buffer)) {
+    THROW_CSTR_ERROR(TypeError, "`buffer` must be an integer between 0 and 1024");
+  }
+
+  bool mbtiles = options->Has(String::NewSymbol("mbtiles"));
+  if (mbtiles == options->Has(String::NewSymbol("directory"))) {
+    THROW_CSTR_ERROR(TypeError, "one of `mbtiles` or `directory` must be given");
+  }
+  string path = *String::Utf8Value(options->Get(String::NewSymbol(mbtiles ? "mbtiles" : "directory"))->ToString());
+
+  Local<Value> progress = options->Get(String::NewSymbol("progress"));
+  if (!progress->IsUndefined() && !progress->IsFunction()) {
+    THROW_CSTR_ERROR(TypeError, "`progress` must be a function");
+  }
+
+  SeedBaton *baton = new SeedBaton();
+
+  baton->all_layers = true;
+  if (options->Has(String::NewSymbol("layers"))) {
+    Local<Value> layers = options->Get(String::NewSymbol("layers"));
+    if (!layers->IsArray()) {
+      delete baton;
+      THROW_CSTR_ERROR(TypeError, "`layers` must be an array of strings");
+    }
+    Local<Array> names = Local<Array>::Cast(layers);
+    for (uint32_t i = 0; i < names->Length(); ++i) {
+      baton->layers.insert(string(*String::Utf8Value(names->Get(i)->ToString())));
+    }
+    baton->all_layers = false;
+  }
+
+  if (options->Has(String::NewSymbol("format"))) {
+    baton->format = *String::Utf8Value(options->Get(String::NewSymbol("format"))->ToString());
+  }
+
+  // Find the format in this thread so that the tile extension is known up front
+  outputFormatObj *format = NULL;
+  string extension;
+  uv_rwlock_rdlock(&self->lock);
+  if (baton->format.empty()) {
+    format = self->map->outputformat;
+  } else {
+    for (int i = 0; i < self->map->numoutputformats && !format; ++i) {
+      outputFormatObj *candidate = self->map->outputformatlist[i];
+      if ((candidate->name && strcasecmp(candidate->name, baton->format.c_str()) == 0)
+          || (candidate->mimetype && strcasecmp(candidate->mimetype, baton->format.c_str()) == 0)) {
+        format = candidate;
+      }
+    }
+  }
+  if (format) {
+    extension = format->extension ? format->extension : "png";
+  }
+  if (self->map->name) {
+    baton->metadata["name"] = self->map->name;
+  }
+  uv_rwlock_rdunlock(&self->lock);
+
+  if (!format) {
+    delete baton;
+    THROW_CSTR_ERROR(Error, "Unsupported output format");
+  }
+
+  char value[128];
+  baton->metadata["format"] = (extension == "jpeg") ? "jpg" : extension;
+  snprintf(value, sizeof(value), "%d", minzoom);
+  baton->metadata["minzoom"] = value;
+  snprintf(value, sizeof(value), "%d", maxzoom);
+  baton->metadata["maxzoom"] = value;
+  if (grid.srs == "EPSG:3857" || grid.srs == "EPSG:4326") {
+    double bounds[4];
+
+    memcpy(bounds, bbox, sizeof(bounds));
+    if (grid.srs == "EPSG:3857") {
+      for (int i = 0; i < 4; i += 2) {
+        bounds[i] = bbox[i] / MERCATOR_EXTENT * 180.0;
+        bounds[i + 1] = (2 * atan(exp(bbox[i + 1] / MERCATOR_EXTENT * MS_PI)) - MS_PI / 2) * 180.0 / MS_PI;
+      }
+    }
+    snprintf(value, sizeof(value), "%.6f,%.6f,%.6f,%.6f", bounds[0], bounds[1], bounds[2], bounds[3]);
+    baton->metadata["bounds"] = value;
+  }
+
+  baton->self = self;
+  baton->callback = Persistent<Function>::New(callback);
+  if (progress->IsFunction()) {
+    baton->progress = Persistent<Function>::New(Local<Function>::Cast(progress));
+  }
+  baton->map = self->map;
+  baton->error = NULL;
+  baton->grid = grid;
+  memcpy(baton->bbox, bbox, sizeof(bbox));
+  baton->minzoom = minzoom;
+  baton->maxzoom = maxzoom;
+  baton->metatile = metatile;
+  baton->buffer = buffer;
+  baton->skip_existing = options->Get(String::NewSymbol("skipExisting"))->BooleanValue();
+  baton->store = mbtiles ? TileStore::MBTiles(path, grid) : TileStore::Directory(path, extension);
+  baton->finished = false;
+  baton->start = uv_hrtime();
+  baton->ready = false;
+  baton->aborted = false;
+  baton->written = false;
+  baton->z = minzoom;
+  baton->mx = baton->my = -1;
+  baton->total = 0;
+  baton->rendered = 0;
+  baton->skipped = 0;
+  baton->stored = 0;
+
+  for (int z = minzoom; z <= maxzoom; ++z) {
+    int x0, y0, x1, y1;
+    if (grid.Range(z, bbox, &x0, &y0, &x1, &y1)) {
+      baton->total += (uint64_t) (x1 - x0 + 1) * (y1 - y0 + 1);
+    }
+  }
+
+  int threads = ThreadPoolSize();
+  baton->pending = threads;
+  baton->rendering = threads;
+  uv_mutex_init(&baton->mutex);
+  uv_cond_init(&baton->cond);
+  uv_async_init(uv_default_loop(), &baton->async, SeedProgress);
+  baton->async.data = baton;
+
+  self->Ref(); // increment reference count so map is not garbage collected
+
+  uv_thread_create(&baton->writer, SeedWriter, baton);
+
+  for (int i = 0; i < threads; ++i) {
+    SeedRequest *request = new SeedRequest();
+    request->request.data = request;
+    request->baton = baton;
+
+    uv_queue_work(uv_default_loop(),
+                  &request->request,
+                  SeedWork,
+                  (uv_after_work_cb) SeedAfter);
+  }
+
+  return Undefined();
+}
+
+/**
+ * @details This is called by `SeedAsync` and runs in a different thread to
+ * that function.  Each request renders metatiles using its own copy of the
+ * map until none remain or an error occurs.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::SeedWork(uv_work_t *req) {
+  /* No HandleScope! This is run in a separate thread: *No* contact
+     should be made with the Node/V8 world here. */
+
+  SeedRequest *request = static_cast<SeedRequest*>(req->data);
+  SeedBaton *baton = request->baton;
+  Map *self = baton->self;
+  mapObj *map = NULL;
+  bool proceed;
+
+  // wait for the store to be opened
+  uv_mutex_lock(&baton->mutex);
+  while (!baton->ready) {
+    uv_cond_wait(&baton->cond, &baton->mutex);
+  }
+  proceed = !baton->aborted;
+  uv_mutex_unlock(&baton->mutex);
+
+  if (!proceed) {
+    goto finish;
+  }
+
+  if (msDebugInitFromEnv() != MS_SUCCESS) {
+    SeedError(baton, "Map::SeedWork()");
+    goto finish;
+  }
+
+  uv_rwlock_rdlock(&self->lock);
+  map = CopyMap(self, true, NODE_MAPSERV_MAP_PROJECTION);
+  if (map) {
+    shareMapExpressions(map, self->map);
+  }
+  uv_rwlock_rdunlock(&self->lock);
+
+  if (!map) {
+    SeedError(baton, "Map::SeedWork()");
+    goto finish;
+  }
+
+#ifdef USE_PROJ
+  if (msLoadProjectionString(&(map->projection), baton->grid.srs.c_str()) != 0) {
+    SeedError(baton, "Map::SeedWork()");
+    goto finish;
+  }
+  map->units = GetMapserverUnitUsingProj(&(map->projection));
+#endif
+
+  if ((!baton->all_layers && !SelectLayers(map, baton->layers, "Map::SeedWork()"))
+      || !SelectFormat(map, baton->format, MS_NOOVERRIDE, "Map::SeedWork()")) {
+    SeedError(baton, "Map::SeedWork()");
+    goto finish;
+  }
+
+  for (;;) {
+    int z, minx, miny, maxx, maxy;
+
+    uv_mutex_lock(&baton->mutex);
+    proceed = NextMetatile(baton, &z, &minx, &miny, &maxx, &maxy);
+    uv_mutex_unlock(&baton->mutex);
+
+    if (!proceed) {
+      break;
+    }
+
+    if (!RenderMetatile(map, baton, z, minx, miny, maxx, maxy)) {
+      SeedError(baton, "Map::SeedWork()");
+      break;
+    }
+  }
+
+ finish:
+  if (map) {
+    FreeMap(self, map);
+  }
+  msResetErrorList();
+  msDebugCleanup();
+
+  uv_mutex_lock(&baton->mutex);
+  if (--baton->rendering == 0) {
+    uv_cond_broadcast(&baton->cond); // wake the writer so it can finish
+  }
+  uv_mutex_unlock(&baton->mutex);
+  return;
+}
+
+/**
+ * @details Metatiles are taken in rows from each zoom level in turn and are
+ * clipped to the tiles intersecting the seeded extent.  This must be called
+ * with the baton mutex locked.
+ *
+ * @param baton The seeding context.
+ *
+ * @param z Set to the zoom level of the metatile.
+ *
+ * @param minx, miny, maxx, maxy Set to the inclusive range of tiles.
+ *
+ * @return `false` if there are no more metatiles to render.
+ */
+bool Map::NextMetatile(SeedBaton *baton, int *z, int *minx, int *miny, int *maxx, int *maxy) {
+  int size = baton->metatile;
+
+  while (!baton->aborted && baton->z <= baton->maxzoom) {
+    int x0, y0, x1, y1;
+
+    if (baton->grid.Range(baton->z, baton->bbox, &x0, &y0, &x1, &y1)) {
+      if (baton->mx < 0) {
+        baton->mx = x0 / size;
+        baton->my = y0 / size;
+      }
+
+      if (baton->my <= y1 / size) {
+        *z = baton->z;
+        *minx = MS_MAX(baton->mx * size, x0);
+        *maxx = MS_MIN(baton->mx * size + size - 1, x1);
+        *miny = MS_MAX(baton->my * size, y0);
+        *maxy = MS_MIN(baton->my * size + size - 1, y1);
+
+        if (++baton->mx > x1 / size) {
+          baton->mx = x0 / size;
+          baton->my++;
+        }
+        return true;
+      }
+    }
+
+    baton->z++;
+    baton->mx = baton->my = -1;
+  }
+  return false;
+}
+
+/**
+ * @details The metatile is drawn as a single image, extended by the buffer
+ * on each side, and each tile is encoded from the corresponding region of
+ * its pixels.  Renderers that do not expose their pixels draw each tile
+ * separately instead.
+ *
+ * @param map The map to draw.
+ *
+ * @param baton The seeding context.
+ *
+ * @param z The zoom level.
+ *
+ * @param minx, miny, maxx, maxy The inclusive range of tiles.
+ *
+ * @return `false`, setting a Mapserver error, if the tiles could not be
+ * rendered.
+ */
+bool Map::RenderMetatile(mapObj *map, SeedBaton *baton, int z,
+                         int minx, int miny, int maxx, int maxy) {
+  int size = baton->grid.tile_size;
+  int columns = maxx - minx + 1, rows = maxy - miny + 1;
+  int buffer = (columns == 1 && rows == 1) ? 0 : baton->buffer;
+  std::vector<bool> wanted(columns * rows, true);
+  std::vector<Tile*> tiles;
+  int skipped = 0;
+
+  if (baton->skip_existing) {
+    for (int j = 0; j < rows; ++j) {
+      for (int i = 0; i < columns; ++i) {
+        if (baton->store->Exists(z, minx + i, miny + j)) {
+          wanted[j * columns + i] = false;
+          skipped++;
+        }
+      }
+    }
+
+    uv_mutex_lock(&baton->mutex);
+    baton->skipped += skipped;
+    uv_mutex_unlock(&baton->mutex);
+
+    if (skipped == columns * rows) {
+      return true;
+    }
+  }
+
+  // fall back to drawing tiles individually if they can't be cut out
+  bool single = (columns == 1 && rows == 1 && buffer == 0);
+  if (!single && (!MS_RENDERER_PLUGIN(map->outputformat) || !MS_MAP_RENDERER(map)
+                  || !MS_MAP_RENDERER(map)->supports_pixel_buffer)) {
+    for (int j = 0; j < rows; ++j) {
+      for (int i = 0; i < columns; ++i) {
+        if (wanted[j * columns + i]
+            && !RenderMetatile(map, baton, z, minx + i, miny + j, minx + i, miny + j)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  double res = baton->grid.Resolution(z), extent[4];
+  baton->grid.Extent(z, minx, miny, maxx, maxy, extent);
+
+  if (columns * size + 2 * buffer > map->maxsize || rows * size + 2 * buffer > map->maxsize) {
+    msSetError(MS_WEBERR, "Image size out of range.", "Map::RenderMetatile()");
+    return false;
+  }
+  map->width = columns * size + 2 * buffer;
+  map->height = rows * size + 2 * buffer;
+
+  // Mapserver extents run between the centres of the outer pixels
+  map->extent.minx = extent[0] - buffer * res + res / 2;
+  map->extent.miny = extent[1] - buffer * res + res / 2;
+  map->extent.maxx = extent[2] + buffer * res - res / 2;
+  map->extent.maxy = extent[3] + buffer * res - res / 2;
+
+  imageObj *image = msDrawMap(map, MS_FALSE);
+  if (!image) {
+    return false;
+  }
+
+  if (single) {
+    int length = 0;
+    unsigned char *data = msSaveImageBuffer(image, &length, map->outputformat);
+
+    msFreeImage(image);
+    if (!data) {
+      return false;
+    }
+    tiles.push_back(new Tile(z, minx, miny, data, length));
+    QueueTiles(baton, tiles);
+    return true;
+  }
+
+  rasterBufferObj pixels;
+  if (MS_IMAGE_RENDERER(image)->getRasterBufferHandle(image, &pixels) != MS_SUCCESS
+      || pixels.type != MS_BUFFER_BYTE_RGBA) {
+    msSetError(MS_MISCERR, "The renderer does not provide RGBA pixels", "Map::RenderMetatile()");
+    msFreeImage(image);
+    return false;
+  }
+
+  for (int j = 0; j < rows; ++j) {
+    for (int i = 0; i < columns; ++i) {
+      if (!wanted[j * columns + i]) {
+        continue;
+      }
+
+      // a view of the tile's pixels within the metatile
+      rasterBufferObj tile = pixels;
+      size_t offset = (size_t) (buffer + j * size) * pixels.data.rgba.row_step
+        + (size_t) (buffer + i * size) * pixels.data.rgba.pixel_step;
+      bufferObj encoded;
+
+      tile.width = tile.height = size;
+      tile.data.rgba.pixels += offset;
+      tile.data.rgba.r += offset;
+      tile.data.rgba.g += offset;
+      tile.data.rgba.b += offset;
+      if (tile.data.rgba.a) {
+        tile.data.rgba.a += offset;
+      }
+
+      memset(&encoded, 0, sizeof(encoded));
+      if (msSaveRasterBufferToBuffer(&tile, &encoded, map->outputformat) != MS_SUCCESS) {
+        msBufferFree(&encoded);
+        for (size_t k = 0; k < tiles.size(); ++k) {
+          delete tiles[k];
+        }
+        msFreeImage(image);
+        return false;
+      }
+      tiles.push_back(new Tile(z, minx + i, miny + j, encoded.data, encoded.size));
+    }
+  }
+
+  msFreeImage(image);
+  QueueTiles(baton, tiles);
+  return true;
+}
+
+/**
+ * @details The tiles are handed over to the writer, which then owns them.
+ * Rendering waits while the queue is full so that memory use is bounded
+ * when the store is slower than the renderers.
+ *
+ * @param baton The seeding context.
+ *
+ * @param tiles The rendered tiles, which is emptied.
+ */
+void Map::QueueTiles(SeedBaton *baton, std::vector<Tile*> &tiles) {
+  uv_mutex_lock(&baton->mutex);
+  while (baton->queue.size() >= SEED_QUEUE_SIZE && !baton->aborted) {
+    uv_cond_wait(&baton->cond, &baton->mutex);
+  }
+
+  if (baton->aborted) {
+    for (size_t i = 0; i < tiles.size(); ++i) {
+      delete tiles[i];
+    }
+  } else {
+    baton->queue.insert(baton->queue.end(), tiles.begin(), tiles.end());
+    baton->rendered += tiles.size();
+    uv_cond_broadcast(&baton->cond);
+  }
+  uv_mutex_unlock(&baton->mutex);
+  tiles.clear();
+}
+
+/**
+ * @details The current Mapserver error is used if there is one.  Recording
+ * an error stops the other threads from rendering further tiles.
+ *
+ * @param baton The seeding context.
+ *
+ * @param routine The routine reported if there is no Mapserver error.
+ */
+void Map::SeedError(SeedBaton *baton, const char *routine) {
+  errorObj *error = msGetErrorObj();
+
+  uv_mutex_lock(&baton->mutex);
+  if (!baton->error) {
+    if (!error || error->code == MS_NOERR) {
+      baton->error = new MapserverError("The tiles could not be rendered", routine);
+    } else {
+      baton->error = new MapserverError(error);
+    }
+  }
+  baton->aborted = true;
+  uv_cond_broadcast(&baton->cond);
+  uv_mutex_unlock(&baton->mutex);
+
+  msResetErrorList();
+}
+
+/**
+ * @details This is the entry point of the thread started by `SeedAsync`.  It
+ * opens the store and then writes whatever tiles are queued as a batch until
+ * every work request has stopped rendering, waking the main thread to report
+ * progress after each batch.
+ *
+ * @param arg The seeding context.
+ */
+void Map::SeedWriter(void *arg) {
+  SeedBaton *baton = static_cast<SeedBaton*>(arg);
+  TileStore *store = baton->store;
+  string message;
+  bool opened = store->Open(message) && store->SetMetadata(baton->metadata, message);
+
+  uv_mutex_lock(&baton->mutex);
+  if (!opened) {
+    if (!baton->error) {
+      baton->error = new MapserverError(message.c_str(), "Map::SeedWriter()", MS_IOERR);
+    }
+    baton->aborted = true;
+  }
+  baton->ready = true;
+  uv_cond_broadcast(&baton->cond);
+
+  for (;;) {
+    while (baton->queue.empty() && baton->rendering) {
+      uv_cond_wait(&baton->cond, &baton->mutex);
+    }
+    if (baton->queue.empty()) {
+      break;                    // nothing is left to render
+    }
+
+    std::vector<Tile*> batch;
+    bool aborted = baton->aborted;
+
+    batch.swap(baton->queue);
+    uv_cond_broadcast(&baton->cond); // there is room in the queue
+    uv_mutex_unlock(&baton->mutex);
+
+    bool stored = aborted || store->Write(batch, message);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      delete batch[i];
+    }
+
+    uv_mutex_lock(&baton->mutex);
+    if (!stored) {
+      if (!baton->error) {
+        baton->error = new MapserverError(message.c_str(), "Map::SeedWriter()", MS_IOERR);
+      }
+      baton->aborted = true;
+      uv_cond_broadcast(&baton->cond);
+    } else if (!aborted) {
+      baton->stored += batch.size();
+    }
+    uv_mutex_unlock(&baton->mutex);
+
+    uv_async_send(&baton->async);
+    uv_mutex_lock(&baton->mutex);
+  }
+  uv_mutex_unlock(&baton->mutex);
+
+  store->Close();
+
+  uv_mutex_lock(&baton->mutex);
+  baton->written = true;
+  uv_mutex_unlock(&baton->mutex);
+  uv_async_send(&baton->async);
+}
+
+/**
+ * @details This runs in the main thread whenever the writer has stored a
+ * batch of tiles.  Sends are coalesced by libuv so progress is reported at
+ * most once per turn of the event loop.
+ *
+ * @param handle The async handle of the seeding context.
+ *
+ * @param status Unused.
+ */
+void Map::SeedProgress(uv_async_t *handle, int status) {
+  HandleScope scope;
+  SeedBaton *baton = static_cast<SeedBaton*>(handle->data);
+
+  if (!baton->finished && !baton->progress.IsEmpty()) {
+    Handle<Value> argv[1] = { SeedStatus(baton) };
+
+    TryCatch try_catch;
+    baton->progress->Call(Context::GetCurrent()->Global(), 1, argv);
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+  }
+
+  SeedFinish(baton);
+}
+
+/**
+ * @details This is set by `SeedAsync` to run after each `SeedWork` request
+ * has finished.
+ *
+ * @param req The asynchronous libuv request.
+ */
+void Map::SeedAfter(uv_work_t *req) {
+  HandleScope scope;
+
+  SeedRequest *request = static_cast<SeedRequest*>(req->data);
+  SeedBaton *baton = request->baton;
+  delete request;
+
+  baton->pending--;
+  SeedFinish(baton);
+}
+
+/**
+ * @details Once every work request has completed and the writer has
+ * finished the outcome is passed to the original callback.  This must be
+ * called within a `HandleScope`.
+ *
+ * @param baton The seeding context.
+ */
+void Map::SeedFinish(SeedBaton *baton) {
+  bool written;
+
+  if (baton->finished || baton->pending) {
+    return;
+  }
+
+  uv_mutex_lock(&baton->mutex);
+  written = baton->written;
+  uv_mutex_unlock(&baton->mutex);
+
+  if (!written) {
+    return;
+  }
+
+  baton->finished = true;
+  uv_thread_join(&baton->writer); // it has nothing left to do
+
+  Handle<Value> argv[2];
+
+  if (baton->error) {
+    argv[0] = baton->error->toV8Error();
+    argv[1] = Undefined();
+    delete baton->error;        // we've finished with it
+    baton->error = NULL;
+  } else {
+    argv[0] = Undefined();
+    argv[1] = SeedStatus(baton);
+  }
+
+  // pass the results to the user specified callback function
+  TryCatch try_catch;
+  baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  uv_close((uv_handle_t*) &baton->async, SeedClose);
+}
+
+/**
+ * @param handle The async handle of the seeding context.
+ */
+void Map::SeedClose(uv_handle_t *handle) {
+  SeedBaton *baton = static_cast<SeedBaton*>(handle->data);
+
+  delete baton->store;
+  uv_cond_destroy(&baton->cond);
+  uv_mutex_destroy(&baton->mutex);
+  baton->callback.Dispose();
+  if (!baton->progress.IsEmpty()) {
+    baton->progress.Dispose();
+  }
+  baton->self->Unref(); // decrement the map reference so it can be garbage collected
+  delete baton;
+}
+
+/**
+ * @details This must be called within a `HandleScope`.
+ *
+ * @param baton The seeding context.
+ */
+Local<Object> Map::SeedStatus(SeedBaton *baton) {
+  Local<Object> status = Object::New();
+  double elapsed = (uv_hrtime() - baton->start) / 1e6;
+
+  uv_mutex_lock(&baton->mutex);
+  status->Set(String::NewSymbol("total"), Number::New(baton->total));
+  status->Set(String::NewSymbol("rendered"), Number::New(baton->rendered));
+  status->Set(String::NewSymbol("skipped"), Number::New(baton->skipped));
+  status->Set(String::NewSymbol("stored"), Number::New(baton->stored));
+  status->Set(String::NewSymbol("elapsed"), Number::New(elapsed));
+  status->Set(String::NewSymbol("tilesPerSecond"),
+              Number::New(elapsed > 0 ? baton->stored / (elapsed / 1000) : 0));
+  uv_mutex_unlock(&baton->mutex);
+
+  return status;
+}
+
+/**
+ * @details The key identifies every option that affects the image.
+ *
+ * @param baton The rendering request.
+ */
+string Map::RenderKey(RenderBaton *baton) {
+  char numbers[160];
+  string key;
+
+  snprintf(numbers, sizeof(numbers), "%.17g,%.17g,%.17g,%.17g/%dx%d/%d/",
+           baton->bbox[0], baton->bbox[1], baton->bbox[2], baton->bbox[3],
+           baton->width, baton->height, baton->transparent);
+  key = numbers + baton->srs + "/" + baton->format + "/";
+
+  if (baton->all_layers) {
+    key += "*";
+  } else {
+    for (std::set<string>::iterator it = baton->layers.begin(); it != baton->layers.end(); ++it) {
+      key += *it + ",";         // the set is ordered so equal requests match
+    }
+  }
+  return key;
+}
+
+/**
+ * @details This sets the maximum number of bytes used to cache the images
+ * rendered by `render`.  The cache is disabled by default.  Images are
+ * evicted least recently used first.
+ *
+ * `args` should contain the following parameters:
+ *
+ * @param options An object literal with the integer property `size`, the
+ * maximum size of the cache in bytes: 0 disables the cache.
+ */
+Handle<Value> Map::ConfigureCache(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() != 1) {
+    THROW_CSTR_ERROR(Error, "usage: Map.configureCache(options)");
+  }
+  REQ_OBJ_ARG(0, options);
+
+  Local<Value> size = options->Get(String::NewSymbol("size"));
+  if (!size->IsNumber() || size->NumberValue() < 0) {
+    THROW_CSTR_ERROR(TypeError, "`size` must be a number of bytes");
+  }
+
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  if (self->disposed) {
+    THROW_CSTR_ERROR(Error, "The map has been disposed");
+  }
+  self->cache.Configure((size_t) size->NumberValue());
+
+  return Undefined();
+}
+
+/**
+ * @details This drops images from the render cache after the data they
+ * were drawn from has changed, leaving unaffected images in place.  Without
+ * options every image is dropped.
+ *
+ * The returned object literal has the properties `entries`, the number of
+ * images dropped, and `bytes`, the memory freed.
+ *
+ * `args` should contain the following parameters:
+ *
+ * @param options An optional object literal with the following properties:
+ * - `layers`: an array of layer or group names: only images drawing one of
+ *   these are dropped (optional)
+ * - `bbox`: an array of `[minx, miny, maxx, maxy]`: only images intersecting
+ *   this extent are dropped (optional)
+ * - `srs`: the projection of `bbox` (default that of the map)
+ */
+Handle<Value> Map::Invalidate(const Arguments& args) {
+  HandleScope scope;
+  Local<Object> options;
+  std::set<string> layers;
+  bool by_layer = false, by_extent = false;
+  rectObj extent;
+  string srs;
+
+  switch (args.Length()) {
+  case 0:
+    break;
+  case 1:
+    ASSIGN_OBJ_ARG(0, options);
+
+    if (options->Has(String::NewSymbol("layers"))) {
+      Local<Value> value = options->Get(String::NewSymbol("layers"));
+      if (!value->IsArray()) {
+        THROW_CSTR_ERROR(TypeError, "`layers` must be an array of strings");
+      }
+      Local<Array> names = Local<Array>::Cast(value);
+      for (uint32_t i = 0; i < names->Length(); ++i) {
+        layers.insert(string(*String::Utf8Value(names->Get(i)->ToString())));
+      }
+      by_layer = true;
+    }
+
+    if (options->Has(String::NewSymbol("bbox"))) {
+      double bbox[4];
+      if (!extentOption(options, "bbox", bbox)) {
+        THROW_CSTR_ERROR(TypeError, "`bbox` must be an array of four numbers");
+      }
+      extent.minx = bbox[0];
+      extent.miny = bbox[1];
+      extent.maxx = bbox[2];
+      extent.maxy = bbox[3];
+      by_extent = true;
+    }
+
+    if (options->Has(String::NewSymbol("srs"))) {
+      srs = *String::Utf8Value(options->Get(String::NewSymbol("srs"))->ToString());
+    }
+    break;
+  default:
+    THROW_CSTR_ERROR(Error, "usage: Map.invalidate([options])");
+  }
+
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  if (self->disposed) {
+    THROW_CSTR_ERROR(Error, "The map has been disposed");
+  }
+  std::map<string, rectObj> extents;
+
+  // Express the extent in each projection images are cached in: images in
+  // projections it can't be transformed to are all dropped.
+  if (by_extent) {
+    std::set<string> projections = self->cache.Projections();
+
+    for (std::set<string>::iterator it = projections.begin(); it != projections.end(); ++it) {
+      rectObj projected = extent;
+      if (*it == srs || ProjectExtent(self, srs, *it, &projected)) {
+        extents[*it] = projected;
+      }
+    }
+  }
+
+  size_t bytes;
+  size_t entries = self->cache.Invalidate(by_layer ? &layers : NULL,
+                                          by_extent ? &extents : NULL,
+                                          &bytes);
+
+  Local<Object> result = Object::New();
+  result->Set(String::NewSymbol("entries"), Number::New(entries));
+  result->Set(String::NewSymbol("bytes"), Number::New(bytes));
+  return scope.Close(result);
+}
+
+/**
+ * @param self The map whose projection an empty definition refers to.
+ *
+ * @param from The projection of `extent`.
+ *
+ * @param to The projection to transform `extent` to.
+ *
+ * @param extent The extent, which is transformed in place.
+ *
+ * @return `false` if the extent could not be transformed.
+ */
+bool Map::ProjectExtent(Map *self, const string &from, const string &to, rectObj *extent) {
+#ifdef USE_PROJ
+  projectionObj source, destination;
+  bool projected;
+
+  msInitProjection(&source);
+  msInitProjection(&destination);
+  projected = LoadProjection(self, from, &source)
+    && LoadProjection(self, to, &destination)
+    && msProjectRect(&source, &destination, extent) == MS_SUCCESS;
+  msFreeProjection(&source);
+  msFreeProjection(&destination);
+  msResetErrorList();
+
+  return projected;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @param self The map whose projection an empty definition refers to.
+ *
+ * @param definition The projection definition e.g. `EPSG:4326`.
+ *
+ * @param projection The projection to load the definition into.
+ *
+ * @return `false` if the projection could not be loaded.
+ */
+bool Map::LoadProjection(Map *self, const string &definition, projectionObj *projection) {
+  char *text;
+  bool loaded;
+
+  if (!definition.empty()) {
+    return (msLoadProjectionString(projection, definition.c_str()) == 0);
+  }
+
+  uv_rwlock_rdlock(&self->lock);
+  text = (self->map->projection.numargs > 0) ? msGetProjectionString(&(self->map->projection)) : NULL;
+  uv_rwlock_rdunlock(&self->lock);
+
+  if (!text) {
+    return false;
+  }
+  loaded = (msLoadProjectionString(projection, text) == 0);
+  msFree(text);
+  return loaded;
+}
+
+/**
+ * @details This frees the `mapObj` as soon as no request is using it,
+ * rather than waiting for the garbage collector to finalise the `Map`.
+ * Methods other than `memoryUsage` throw an error once a map has been
+ * disposed.  Disposing of a map more than once has no effect.
+ */
+Handle<Value> Map::Dispose(const Arguments& args) {
+  HandleScope scope;
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+
+  self->disposed = true;
+  if (self->refs_ == 0) {
+    self->FreeMapObj();
+  }
+
+  return Undefined();
+}
+
+/**
+ * @details This returns an object literal with the properties `map`, the
+ * estimated size of the `mapObj` in bytes, `cache`, the bytes used by the
+ * render cache, `variants`, the estimated size of the cached variants,
+ * `pending`, the number of requests using the map, and
+ * `disposed`, whether `dispose` has been called.  `map` is `0` once a
+ * disposed map has been freed.
+ */
+Handle<Value> Map::MemoryUsage(const Arguments& args) {
+  HandleScope scope;
+  Map* self = ObjectWrap::Unwrap<Map>(args.This());
+  Local<Object> result = Object::New();
+
+  result->Set(String::NewSymbol("map"), Number::New(self->external));
+  result->Set(String::NewSymbol("cache"), Number::New(self->cache.Used()));
+  result->Set(String::NewSymbol("variants"), Number::New(self->variants.Used()));
+  result->Set(String::NewSymbol("pending"), Integer::New(self->refs_));
+  result->Set(String::NewSymbol("disposed"), Boolean::New(self->disposed));
+
+  return scope.Close(result);
+}
+
+/**
+ * @details This returns an object literal with the properties `maps`, the
+ * estimated bytes held by every map yet to be freed, `responses`, the bytes
+ * held by response buffers yet to be garbage collected, and `mapCount`, the
+ * number of maps yet to be freed.  These are the amounts reported to V8 as
+ * external memory.
+ */
+Handle<Value> Map::ProcessMemoryUsage(const Arguments& args) {
+  HandleScope scope;
+  Local<Object> result = Object::New();
+
+  result->Set(String::NewSymbol("maps"), Number::New(maps_external));
+  result->Set(String::NewSymbol("responses"), Number::New(responses_external));
+  result->Set(String::NewSymbol("mapCount"), Integer::New(live_maps));
+
+  return scope.Close(result);
+}
+
+/**
+ * @details The render cache is emptied along with the map as its images are
+ * of no use without it.  The memory reported to V8 when the map was created
+ * is given back.
+ */
+void Map::FreeMapObj() {
+  if (!map) {
+    return;
+  }
+
+  std::vector<MapVariant*> unused;
+  variants.Clear(unused);
+  FreeVariants(this, unused);
+
+  cache.Configure(0);
+  freeMapSkeleton(skeleton);
+  PixmapCache::Release(map);
+  msFreeMap(map);
+  skeleton = NULL;
+  map = NULL;
+
+  maps_external -= external;
+  live_maps--;
+  V8::AdjustAmountOfExternalAllocatedMemory(-static_cast<intptr_t>(external));
+  external = 0;
+}
+
+/**
+ * @details Every asynchronous request references the map until it has
+ * finished, so a disposed map is freed by the last request to finish.
+ */
+void Map::Unref() {
+  ObjectWrap::Unref();
+  if (disposed && refs_ == 0) {
+    FreeMapObj();
+  }
+}
+
+/**
+ * @details The estimate covers the structures making up the map, along with
+ * symbol images and inline features, which tend to dominate its size.
+ * Strings and the data held by Mapserver's libraries are not included.
+ *
+ * @param map The map to estimate.
+ *
+ * @return The estimated size in bytes.
+ */
+size_t Map::EstimateMapSize(mapObj *map) {
+  size_t size = sizeof(mapObj);
+
+  if (!map) {
+    return 0;
+  }
+
+  for (int i = 0; i < map->numlayers; i++) {
+    layerObj *layer = GET_LAYER(map, i);
+
+    size += sizeof(layerObj);
+    for (int j = 0; j < layer->numclasses; j++) {
+      classObj *klass = layer->_class[j];
+
+      size += sizeof(classObj)
+        + klass->numstyles * sizeof(styleObj)
+        + klass->numlabels * sizeof(labelObj);
+    }
+
+    for (featureListNodeObjPtr node = layer->features; node; node = node->next) {
+      size += sizeof(featureListNodeObj);
+      for (int j = 0; j < node->shape.numlines; j++) {
+        size += sizeof(lineObj) + node->shape.line[j].numpoints * sizeof(pointObj);
+      }
+    }
+  }
+
+  for (int i = 0; i < map->symbolset.numsymbols; i++) {
+    symbolObj *symbol = map->symbolset.symbol[i];
+
+    size += sizeof(symbolObj);
+    if (symbol->pixmap_buffer) {
+      size += sizeof(rasterBufferObj)
+        + symbol->pixmap_buffer->width * symbol->pixmap_buffer->height * 4;
+    }
+  }
+
+  size += map->numoutputformats * sizeof(outputFormatObj);
+
+  return size;
 }
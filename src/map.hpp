@@ -39,6 +39,8 @@
 // Standard headers
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
 
 // Node headers
 #include <v8.h>
@@ -53,6 +55,20 @@ extern "C" {
 
 // Node-mapserv headers
 #include "error.hpp"
+#include "projcache.hpp"
+#include "pixmaps.hpp"
+#include "compress.hpp"
+#include "trace.h"
+#include "slowlog.hpp"
+#include "profile.hpp"
+#include "tiles.hpp"
+#include "rendercache.hpp"
+#include "perfcounters.hpp"
+#include "features.hpp"
+#include "overrides.hpp"
+#include "variants.hpp"
+#include "analyze.hpp"
+#include "node-mapservutil.h"
 
 /// Throw an exception generated from a `char` string
 #define THROW_CSTR_ERROR(TYPE, STR)                             \
@@ -128,6 +144,39 @@ public:
   /// Wrap the `mapserv` CGI functionality
   static Handle<Value> MapservAsync(const Arguments& args);
 
+  /// Generate a mapserv response for a Node HTTP request
+  static Handle<Value> HandleAsync(const Arguments& args);
+
+  /// Render an image of the map without a CGI request
+  static Handle<Value> RenderAsync(const Arguments& args);
+
+  /// Prime data sources, symbols and fonts on every worker thread
+  static Handle<Value> WarmAsync(const Arguments& args);
+
+  /// Report layer configuration that slows drawing the map
+  static Handle<Value> AnalyzeAsync(const Arguments& args);
+
+  /// Render a tile pyramid into a tile store
+  static Handle<Value> SeedAsync(const Arguments& args);
+
+  /// Set the size of the render cache
+  static Handle<Value> ConfigureCache(const Arguments& args);
+
+  /// Drop images from the render cache
+  static Handle<Value> Invalidate(const Arguments& args);
+
+  /// Free the mapObj once outstanding requests have finished
+  static Handle<Value> Dispose(const Arguments& args);
+
+  /// Report the memory used by the map
+  static Handle<Value> MemoryUsage(const Arguments& args);
+
+  /// Report the memory used by all maps and responses
+  static Handle<Value> ProcessMemoryUsage(const Arguments& args);
+
+  /// Draw several maps in parallel and blend them into one image
+  static Handle<Value> CompositeAsync(const Arguments& args);
+
 private:
 
   /// The function template for creating new `Map` instances.
@@ -141,6 +190,37 @@ private:
   /// The underlying mapserver data structure that the class wraps
   mapObj *map;
 
+  /// A shallow copy of `map` without symbols or fonts used as the source of
+  /// request copies
+  mapObj *skeleton;
+
+  /// Guards `map`: held for reading when copying, for writing when altering
+  uv_rwlock_t lock;
+
+  /// Images rendered by `render`
+  RenderCache cache;
+
+  /// The programs applying the URL overrides seen by `mapserv`
+  OverrideCache overrides;
+
+  /// The copies of `map` prepared for customising `mapserv` requests
+  VariantCache variants;
+
+  /// The estimated size of `map` as reported to V8
+  size_t external;
+
+  /// Has `dispose` been called?
+  bool disposed;
+
+  /// The estimated size of all live maps
+  static int64_t maps_external;
+
+  /// The size of all response buffers yet to be garbage collected
+  static int64_t responses_external;
+
+  /// The number of maps whose mapObj has not been freed
+  static int live_maps;
+
   /// The structure used when performing asynchronous operations
   struct Baton {
     /// The asynchronous request
@@ -167,6 +247,29 @@ private:
     int owns_data;
   };
 
+  /// The options accepted by `mapserv` and `handle`
+  struct MapservOptions {
+    /// Should compressible output be compressed?
+    bool compress;
+    /// The compression level, or 0 to choose one by size
+    int compression_level;
+    /// The minimum size of output worth compressing
+    int compression_threshold;
+    /// Should per layer timings be collected?
+    bool profile;
+    /// Should performance counters be read around each phase?
+    bool counters;
+
+    MapservOptions() :
+      compress(false),
+      compression_level(0),
+      compression_threshold(COMPRESSION_THRESHOLD),
+      profile(false),
+      counters(false)
+    {
+    }
+  };
+
   /// Asynchronous context used in method calls
   struct MapBaton: Baton {
     /// The `Map` object from which the call originated
@@ -175,25 +278,309 @@ private:
     string body;
     /// The Content-Type header
     char *content_type;
+    /// The HTTP status set by Mapserver, or 0 if none was set
+    int status;
     /// The buffer containing the mapserv response
     gdBuffer *buffer;
     /// The CGI environment variables
     std::map<string, string> env;
+    /// The options passed by the client
+    MapservOptions options;
+    /// The Content-Encoding of compressed output
+    const char *content_encoding;
+    /// The trace identifier of the request, or 0 if it is not traced
+    trace_time_t trace_id;
+    /// The time the request was received, or 0 if it is not timed
+    trace_time_t received;
+    /// The time the request was queued, if timed
+    trace_time_t queued;
+    /// The time a worker thread started the request, if timed
+    trace_time_t started;
+    /// The duration of each phase of the request, if timed
+    std::vector< pair<const char *, trace_time_t> > phases;
+    /// The layer timings, if profiled
+    std::vector<LayerProfile> profile;
+    /// The events counted in each phase of the request, if counted
+    std::vector< pair<const char *, PerfSample> > counters;
+    /// The features drawn in place of the data of layers
+    std::vector<FeatureLayer> features;
+  };
+
+  /// How `render` returns the pixels of an image rather than encoding it
+  enum RawOutput {
+    /// The image is encoded in the output format
+    RAW_NONE,
+    /// The pixels are returned as RGBA
+    RAW_RGBA,
+    /// The pixels are returned as RGBA premultiplied by alpha
+    RAW_PREMULTIPLIED
+  };
+
+  /// Pixels zero-copied to a `Buffer` from a rendered image
+  struct RawImage {
+    /// The image owning the pixels
+    imageObj *image;
+    /// The first pixel
+    unsigned char *pixels;
+    /// The number of bytes between the start of each row
+    int stride;
+    /// The size of the pixels in bytes
+    size_t size;
+  };
+
+  /// Asynchronous context used when rendering
+  struct RenderBaton: Baton {
+    /// The `Map` object from which the call originated
+    Map *self;
+    /// The extent to render as `minx, miny, maxx, maxy`
+    double bbox[4];
+    /// The image width in pixels
+    int width;
+    /// The image height in pixels
+    int height;
+    /// The projection of `bbox`, or empty to use that of the map
+    string srs;
+    /// Should the layer status defined by the map be used?
+    bool all_layers;
+    /// The names or groups of the layers to draw
+    std::set<string> layers;
+    /// The output format name or mime type, or empty for the default
+    string format;
+    /// `MS_TRUE`, `MS_FALSE` or `MS_NOOVERRIDE`
+    int transparent;
+    /// The Content-Type of the image
+    char *content_type;
+    /// The encoded image
+    gdBuffer *buffer;
+    /// The key of the image in the render cache, or empty if not cached
+    string key;
+    /// The generation of the render cache when rendering started
+    uint64_t generation;
+    /// The features drawn in place of the data of layers
+    std::vector<FeatureLayer> features;
+    /// Should the pixels be returned rather than an encoded image?
+    RawOutput raw;
+    /// The pixels of the image if `raw` is set
+    RawImage *raw_image;
+    /// The pass to draw when the layers are drawn in several passes
+    int pass;
+    /// The number of passes drawing layers, or 0 to draw the whole map
+    int passes;
+  };
+
+  struct CompositeBaton;
+
+  /// A map drawn as one layer of a composite image
+  struct CompositePart: RenderBaton {
+    /// The composite the part belongs to
+    CompositeBaton *composite;
+    /// The opacity of the part between 0 and 1
+    double opacity;
+    /// A copy of the pixels of the part, once drawn
+    rasterBufferObj pixels;
+    /// Has the part been drawn and copied or stitched?
+    bool drawn;
+    /// The row of the composite that a band starts at
+    int top;
+    /// The rows of overlap drawn above a band
+    int skip;
+    /// The rows of a band kept in the composite
+    int rows;
+  };
+
+  /// Asynchronous context used when compositing maps
+  struct CompositeBaton: Baton {
+    /// The extent, size and output options shared by the parts
+    RenderBaton options;
+    /// The maps to draw, bottom first
+    std::vector<CompositePart*> parts;
+    /// The number of parts still being drawn
+    size_t pending;
+    /// A copy of the output format of the bottom part
+    outputFormatObj *format;
+    /// The resolution of the bottom part
+    double resolution;
+    /// The default resolution of the bottom part
+    double defresolution;
+    /// The Content-Type of the composite
+    char *content_type;
+    /// The encoded composite
+    gdBuffer *buffer;
+    /// The pixels of the composite if raw output was requested
+    RawImage *raw_image;
+    /// Are the parts bands of one image rather than maps to blend?
+    bool banded;
+    /// The image bands are stitched into as they are drawn
+    imageObj *image;
+    /// Guards stitching bands into `image`
+    uv_mutex_t mutex;
+  };
+
+  /// Asynchronous context shared by the requests issued by `warm`
+  struct WarmBaton: Baton {
+    /// The `Map` object from which the call originated
+    Map *self;
+    /// Should a sample be rendered at each configured scale?
+    bool render;
+    /// Should each request wait for its siblings to occupy the other threads?
+    bool spread;
+    /// The width and height of rendered samples in pixels
+    int size;
+    /// The number of work requests issued per round, one per worker thread
+    int threads;
+    /// The number of work requests of the round that have started executing
+    int started;
+    /// The number of work requests of the round that have yet to complete
+    int pending;
+    /// When to stop queuing rounds for threads that have not been warmed
+    uint64_t deadline;
+    /// Delays each round after the first
+    uv_timer_t timer;
+    /// Guards the members below it
+    uv_mutex_t mutex;
+    /// Signalled when all work requests have started executing
+    uv_cond_t cond;
+    /// Have the symbols and fonts been read?
+    bool preloaded;
+    /// The worker threads that have been warmed
+    std::set<unsigned long> thread_ids;
+    /// The layers that were opened successfully
+    std::set<string> layers;
+    /// The layers that could not be opened
+    std::set<string> failed;
+    /// The number of image symbols loaded
+    int symbols;
+    /// The number of font files read
+    int fonts;
+    /// The number of distinct scales rendered
+    int scales;
+  };
+
+  /// An individual work request issued by `warm`
+  struct WarmRequest {
+    /// The asynchronous request
+    uv_work_t request;
+    /// The context shared with the other requests
+    WarmBaton *baton;
+  };
+
+  /// The context used by `analyze`
+  struct AnalyzeBaton: Baton {
+    /// The `Map` object from which the call originated
+    Map *self;
+    /// Should missing shapefile indexes be built?
+    bool fix;
+    /// The problems found
+    std::vector<Finding> findings;
+  };
+
+  /// Asynchronous context shared by the requests issued by `seed`
+  struct SeedBaton: Baton {
+    /// The `Map` object from which the call originated
+    Map *self;
+    /// The tile grid
+    TileGrid grid;
+    /// The extent to seed in the projection of the grid
+    double bbox[4];
+    /// The first zoom level to seed
+    int minzoom;
+    /// The last zoom level to seed
+    int maxzoom;
+    /// The width and height of a metatile in tiles
+    int metatile;
+    /// The number of pixels rendered around each metatile
+    int buffer;
+    /// Should the layer status defined by the map be used?
+    bool all_layers;
+    /// The names or groups of the layers to draw
+    std::set<string> layers;
+    /// The output format name or mime type, or empty for the default
+    string format;
+    /// Should tiles that have already been stored be skipped?
+    bool skip_existing;
+    /// The destination of the tiles
+    TileStore *store;
+    /// The MBTiles metadata to record
+    std::map<string, string> metadata;
+    /// The function receiving progress reports, if any
+    Persistent<Function> progress;
+    /// The number of work requests that have yet to complete
+    int pending;
+    /// Has the callback been called?
+    bool finished;
+    /// When seeding started
+    uint64_t start;
+    /// Wakes the main thread to report progress
+    uv_async_t async;
+    /// The thread writing tiles to the store
+    uv_thread_t writer;
+    /// Guards the members below it
+    uv_mutex_t mutex;
+    /// Signalled when the state of the queue or the writer changes
+    uv_cond_t cond;
+    /// Has the store been opened (or failed to open)?
+    bool ready;
+    /// Should the work stop, following an error?
+    bool aborted;
+    /// The number of work requests still rendering
+    int rendering;
+    /// Has the writer finished?
+    bool written;
+    /// The tiles waiting to be written
+    std::vector<Tile*> queue;
+    /// The zoom level and metatile column and row to render next
+    int z, mx, my;
+    /// The number of tiles in the seeded extent
+    uint64_t total;
+    /// The number of tiles rendered
+    uint64_t rendered;
+    /// The number of existing tiles skipped
+    uint64_t skipped;
+    /// The number of tiles written to the store
+    uint64_t stored;
+  };
+
+  /// An individual work request issued by `seed`
+  struct SeedRequest {
+    /// The asynchronous request
+    uv_work_t request;
+    /// The context shared with the other requests
+    SeedBaton *baton;
   };
 
   /// Instantiate a Map from a mapObj
   Map(mapObj *map) :
-    map(map)
+    map(map),
+    skeleton(NULL),
+    external(0),
+    disposed(false)
   {
     // should throw an error here if !map
+    if (map) {
+      compileMapExpressions(map);
+      PixmapCache::Acquire(map);
+      skeleton = createMapSkeleton(map);
+      external = EstimateMapSize(map);
+      maps_external += external;
+      live_maps++;
+    }
+    uv_rwlock_init(&lock);
   }
 
   /// Clear up the mapObj
   ~Map() {
-    if (map) {
-      msFreeMap(map);
-    }
+    FreeMapObj();
+    uv_rwlock_destroy(&lock);
   }
+
+  /// Free the mapObj, updating the memory reported to V8
+  void FreeMapObj();
+
+  /// Release a reference, freeing a disposed mapObj when none remain
+  virtual void Unref();
+
+  /// Estimate the memory used by a mapObj
+  static size_t EstimateMapSize(mapObj *map);
   
   /// Instantiate an object
   static Handle<Value> New(const Arguments& args);
@@ -216,19 +603,226 @@ private:
   /// Return the mapserv response to the caller
   static void MapservAfter(uv_work_t *req);
 
+  /// Queue a round of requests warming the worker threads
+  static void WarmQueue(WarmBaton *baton);
+
+  /// Queue another round of warming requests in the main thread
+  static void WarmRetry(uv_timer_t *handle, int status);
+
+  /// Asynchronously warm a single worker thread
+  static void WarmWork(uv_work_t *req);
+
+  /// Report on the warming once every worker thread has finished
+  static void WarmAfter(uv_work_t *req);
+
+  /// Free the warming context once its timer has closed
+  static void WarmClose(uv_handle_t *handle);
+
+  /// Open every layer in a map, recording the outcome
+  static void WarmLayers(mapObj *map, WarmBaton *baton);
+
+  /// Draw a raster layer so that its datasets are opened
+  static bool WarmRaster(mapObj *map, layerObj *layer, int size);
+
+  /// Render a sample of a map at each scale used by its layers
+  static void WarmScales(mapObj *map, WarmBaton *baton);
+
+  /// Asynchronously inspect the layers of a map
+  static void AnalyzeWork(uv_work_t *req);
+
+  /// Return the findings of `analyze` to the caller
+  static void AnalyzeAfter(uv_work_t *req);
+
+  /// Read the image symbols referenced by a map
+  static int PreloadSymbols(mapObj *map);
+
+  /// Read the font files referenced by a map
+  static int PreloadFonts(mapObj *map);
+
+  /// Read a file into the operating system cache
+  static bool ReadFile(const char *path);
+
+  /// Get the number of threads in the libuv thread pool
+  static int ThreadPoolSize();
+
   /// Get a CGI environment variable
   static char* GetEnv(const char *name, void* thread_context);
 
   /// Get the mapserver output as a buffer
   static gdBuffer* msIO_getStdoutBufferBytes(void);
 
+  /// Create the javascript response object from mapserver output
+  static Local<Object> CreateResponse(const char *content_type, gdBuffer *buffer,
+                                      const char *content_encoding);
+
+  /// Create the javascript response object from the pixels of an image
+  static Local<Object> CreateRawResponse(RawImage *raw, RawOutput mode);
+
+  /// Take the pixels of an image in RGBA order
+  static RawImage* ExtractPixels(imageObj *image, bool premultiplied, const char *routine);
+
+  /// Create the javascript representation of layer timings
+  static Local<Array> CreateProfile(const std::vector<LayerProfile> &profiles);
+
+  /// Create the javascript representation of performance counters
+  static Local<Array> CreateCounters(const std::vector< pair<const char *, PerfSample> > &counters);
+
+  /// Queue a mapserv request for processing
+  static void QueueMapserv(MapBaton *baton, trace_time_t start);
+
+  /// Record a slow mapserv request
+  static void LogSlowRequest(MapBaton *baton, trace_time_t now);
+
+  /// Parse the options passed to `mapserv` and `handle`
+  static const char* ParseOptions(Local<Object> options, MapservOptions *parsed,
+                                  std::vector<FeatureLayer> *features);
+
+  /// Populate a CGI environment from a Node HTTP request
+  static void CreateEnvironment(Local<Object> req, std::map<string, string> &env);
+
+  /// Compress the output of a mapserv request
+  static void CompressResponse(MapBaton *baton);
+
+  /// Render an image in a separate thread
+  static void RenderWork(uv_work_t *req);
+
+  /// Parse the options of a rendering request
+  static const char* ParseRenderOptions(Local<Object> options, RenderBaton *baton);
+
+  /// Parse the layers of a rendering request
+  static const char* ParseLayers(Local<Object> options, RenderBaton *baton);
+
+  /// Draw the image of a rendering request on a copy of its map
+  static imageObj* RenderImage(RenderBaton *baton, mapObj **copy, const char *routine);
+
+  /// Draw a part of a composite in a separate thread
+  static void CompositePartWork(uv_work_t *req);
+
+  /// Record that a part of a composite has been drawn
+  static void CompositePartAfter(uv_work_t *req);
+
+  /// Blend and encode the parts of a composite in a separate thread
+  static void CompositeWork(uv_work_t *req);
+
+  /// Return the composite to the callback
+  static void CompositeAfter(uv_work_t *req);
+
+  /// Free a composite and release its maps
+  static void FreeComposite(CompositeBaton *baton);
+
+  /// Add a part to a composite
+  static CompositePart* CreatePart(CompositeBaton *baton, Map *self);
+
+  /// Queue the parts of a composite for drawing
+  static void QueueComposite(CompositeBaton *baton, Local<Function> callback);
+
+  /// Draw the layers of a rendering request in parallel passes
+  static void RenderParallel(Map *self, RenderBaton *options, int passes, Local<Function> callback);
+
+  /// Create a composite drawing a `render` request in several parts
+  static CompositeBaton* CreateRenderComposite(RenderBaton *options);
+
+  /// Draw a large image as bands of rows on several threads
+  static void RenderBanded(Map *self, RenderBaton *options, int bands, int buffer, Local<Function> callback);
+
+  /// Copy the kept rows of a drawn band into the banded image
+  static bool StitchBand(CompositePart *part, mapObj *map, rasterBufferObj *buffer);
+
+  /// Select the layers, labels and styles drawn by a pass
+  static void SelectLayerPass(mapObj *map, int pass, int passes, std::vector< pair<int *, int> > &altered);
+
+  /// Return the rendered image to the callback
+  static void RenderAfter(uv_work_t *req);
+
+  /// Get the render cache key of a rendering request
+  static string RenderKey(RenderBaton *baton);
+
+  /// Transform an extent between projections, empty meaning that of the map
+  static bool ProjectExtent(Map *self, const string &from, const string &to, rectObj *extent);
+
+  /// Load a projection, an empty definition meaning that of the map
+  static bool LoadProjection(Map *self, const string &definition, projectionObj *projection);
+
+  /// Set the status of layers from a list of names or groups
+  static bool SelectLayers(mapObj *map, const std::set<string> &layers, const char *routine);
+
+  /// Set the output format of a map
+  static bool SelectFormat(mapObj *map, const string &format, int transparent, const char *routine);
+
+  /// Render tiles in a separate thread
+  static void SeedWork(uv_work_t *req);
+
+  /// Record that a seeding work request has finished
+  static void SeedAfter(uv_work_t *req);
+
+  /// Write rendered tiles to the store
+  static void SeedWriter(void *arg);
+
+  /// Report seeding progress in the main thread
+  static void SeedProgress(uv_async_t *handle, int status);
+
+  /// Return the outcome of seeding once all threads have finished
+  static void SeedFinish(SeedBaton *baton);
+
+  /// Free the seeding context once its handle has closed
+  static void SeedClose(uv_handle_t *handle);
+
+  /// Choose the next metatile to render
+  static bool NextMetatile(SeedBaton *baton, int *z, int *minx, int *miny, int *maxx, int *maxy);
+
+  /// Render a metatile and queue its tiles for writing
+  static bool RenderMetatile(mapObj *map, SeedBaton *baton, int z,
+                             int minx, int miny, int maxx, int maxy);
+
+  /// Queue rendered tiles for writing, waiting if the writer is behind
+  static void QueueTiles(SeedBaton *baton, std::vector<Tile*> &tiles);
+
+  /// Record the first error to occur while seeding
+  static void SeedError(SeedBaton *baton, const char *routine);
+
+  /// Create the javascript representation of seeding progress
+  static Local<Object> SeedStatus(SeedBaton *baton);
+
   /// Create a map object for use in a mapserv request
-  static mapObj* LoadMap(mapservObj *mapserv, mapObj *src);
+  static mapObj* LoadMap(mapservObj *mapserv, Map *self, trace_time_t *wait);
+
+  /// Copy and update a map for a mapserv request
+  static mapObj* PrepareMap(mapservObj *mapserv, Map *self, bool share, int projections, trace_time_t *wait);
+
+  /// Copy a mapserv request from a prepared variant of a map
+  static bool LoadVariant(mapservObj *mapserv, Map *self, const string &key, int projections,
+                          trace_time_t *wait, mapObj **map);
 
-  /// Free data zero-copied to a `Buffer`
+  /// Free variants released by the variant cache
+  static void FreeVariants(Map *self, std::vector<MapVariant*> &variants);
+
+  /// Create a copy of a map that can be altered by a request
+  static mapObj* CopyMap(Map *self, bool share, int projections = 0, mapObj *source = NULL);
+
+  /// Detach shared resources from a copy created by `CopyMap`
+  static void DetachMap(Map *self, mapObj *map);
+
+  /// Free a copy created by `CopyMap`
+  static void FreeMap(Map *self, mapObj *map);
+
+  /// Free data zero-copied to a `Buffer`, `hint` being its size
   static void FreeBuffer(char *data, void *hint) {
+    intptr_t size = reinterpret_cast<intptr_t>(hint);
+
     msFree(data);
     data = NULL;
+    responses_external -= size;
+    V8::AdjustAmountOfExternalAllocatedMemory(-size);
+  }
+
+  /// Free an image whose pixels were zero-copied to a `Buffer`
+  static void FreeRawImage(char *data, void *hint) {
+    RawImage *raw = static_cast<RawImage *>(hint);
+
+    responses_external -= raw->size;
+    V8::AdjustAmountOfExternalAllocatedMemory(-static_cast<intptr_t>(raw->size));
+    msFreeImage(raw->image);
+    delete raw;
   }
 };
 
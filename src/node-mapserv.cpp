@@ -47,6 +47,9 @@
 #include <signal.h>
 #include "map.hpp"
 #include "error.hpp"
+#include "projcache.hpp"
+#include "trace.h"
+#include "slowlog.hpp"
 
 /** Clean up at module exit.
  *
@@ -67,6 +70,7 @@ static void cleanup(void) {
  *
  * - Sets up the `libmapserver` library
  * - Initialises the `Map` class
+ * - Exposes the projection cache statistics
  * - Ensures `libmapserver` has been compiled with thread support
  *
  * @param target The object representing the module.
@@ -99,6 +103,9 @@ extern "C" {
     // initialise module components
     Map::Init(target);
     MapserverError::Init();
+    ProjectionCache::Init(target);
+    TraceInit(target);
+    SlowLog::Init(target);
 
     // versioning information
     Local<Object> versions = Object::New();
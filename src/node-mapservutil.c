@@ -55,7 +55,7 @@ int wrap_loadParams(cgiRequestObj *request, char* (*getenv2)(const char*, void*
   return loadParams(request, getenv2, raw_post_data, raw_post_data_length, thread_context);
 }
 
-int updateMap(mapservObj *mapserv, mapObj *map) {
+int updateMap(mapservObj *mapserv, mapObj *map, int overrides, trace_time_t *wait) {
   int i, j;
 
   if(!msLookupHashTable(&(map->web.validation), "immutable")) {
@@ -72,7 +72,14 @@ int updateMap(mapservObj *mapserv, mapObj *map) {
 
       /* check to see if there are any additions to the mapfile */
       if(strncasecmp(mapserv->request->ParamNames[i],"map_",4) == 0 || strncasecmp(mapserv->request->ParamNames[i],"map.",4) == 0) {
+        trace_time_t start;
+
+        if(!overrides) continue; /* already applied by an override program */
+
+        start = traceNow();
         msAcquireLock( TLOCK_PARSER );
+        *wait += traceNow() - start;
+        if(trace_enabled) traceCurrentSpan("wait TLOCK_PARSER", start);
         if(msUpdateMapFromURL(map, mapserv->request->ParamNames[i], mapserv->request->ParamValues[i]) != MS_SUCCESS) {
           msReleaseLock( TLOCK_PARSER );
           return MS_FAILURE;
@@ -109,6 +116,12 @@ int updateMap(mapservObj *mapserv, mapObj *map) {
     }
   }
 
+  updateMapCookies(mapserv, map);
+
+  return MS_SUCCESS;
+}
+
+void updateMapCookies(mapservObj *mapserv, mapObj *map) {
   /*
    * RFC-42 HTTP Cookie Forwarding
    * Here we set the http_cookie_data metadata to handle the
@@ -121,6 +134,286 @@ int updateMap(mapservObj *mapserv, mapObj *map) {
     msInsertHashTable( &(map->web.metadata), "http_cookie_data",
                        mapserv->request->httpcookiedata );
   }
+}
+
+/**
+ * Case insensitively check whether `needle` occurs in `haystack`
+ */
+static int containsNoCase(const char *haystack, const char *needle)
+{
+  size_t length = strlen(needle);
+
+  if(!haystack) return MS_FALSE;
+
+  for(; *haystack; haystack++) {
+    if(strncasecmp(haystack, needle, length) == 0)
+      return MS_TRUE;
+  }
+  return MS_FALSE;
+}
+
+mapObj* createMapSkeleton(mapObj *map) {
+  int i;
+  mapObj *skeleton = (mapObj *) msSmallMalloc(sizeof(mapObj));
+
+  memcpy(skeleton, map, sizeof(mapObj));
+
+  /* only the default symbol is copied */
+  if(skeleton->symbolset.numsymbols > 1)
+    skeleton->symbolset.numsymbols = 1;
+
+  /* an empty but valid font table */
+  skeleton->fontset.numfonts = 0;
+  if(msInitHashTable(&(skeleton->fontset.fonts)) == NULL) {
+    msFree(skeleton);
+    return NULL;
+  }
+
+  /* projections are attached after copying so are left undefined */
+  skeleton->projection.numargs = 0;
+  skeleton->layers = NULL;
+  skeleton->maxlayers = map->numlayers;
+  if(map->numlayers > 0) {
+    skeleton->layers = (layerObj **) msSmallMalloc(map->numlayers * sizeof(layerObj *));
+    for(i=0; i<map->numlayers; i++) {
+      skeleton->layers[i] = (layerObj *) msSmallMalloc(sizeof(layerObj));
+      memcpy(skeleton->layers[i], GET_LAYER(map, i), sizeof(layerObj));
+      skeleton->layers[i]->projection.numargs = 0;
+    }
+  }
+
+  return skeleton;
+}
+
+void freeMapSkeleton(mapObj *skeleton) {
+  int i;
+
+  if(!skeleton) return;
+
+  for(i=0; i<skeleton->numlayers; i++)
+    msFree(skeleton->layers[i]);
+  msFree(skeleton->layers);
+  msFreeHashItems(&(skeleton->fontset.fonts));
+  msFree(skeleton);
+}
+
+int shareMapResources(mapObj *dst, mapObj *src) {
+  symbolSetObj *set = &(dst->symbolset);
+  int i, count = src->symbolset.numsymbols;
+
+  /* discard anything beyond the default symbol created by the copy */
+  for(i=1; i<set->maxsymbols; i++) {
+    if(!set->symbol[i]) continue;
+    if(i < set->numsymbols) msFreeSymbol(set->symbol[i]);
+    msFree(set->symbol[i]);
+    set->symbol[i] = NULL;
+  }
+  if(set->numsymbols > 1) set->numsymbols = 1;
+
+  if(count > set->maxsymbols) {
+    set->symbol = (symbolObj **) msSmallRealloc(set->symbol, count * sizeof(symbolObj *));
+    for(i=set->maxsymbols; i<count; i++)
+      set->symbol[i] = NULL;
+    set->maxsymbols = count;
+  }
+
+  for(i=1; i<count; i++) {
+    symbolObj *symbol = src->symbolset.symbol[i], stripped;
+
+    if(symbol->type != MS_SYMBOL_PIXMAP && symbol->type != MS_SYMBOL_SVG) {
+      set->symbol[i] = symbol; /* rendering does not alter the symbol */
+      set->numsymbols = i + 1;
+      continue;
+    }
+
+    /* renderers load and cache images in the symbol itself, so each copy
+       has its own, filled from the decoded images of the `PixmapCache` */
+    stripped = *symbol;
+    stripped.pixmap_buffer = NULL;
+    stripped.renderer = NULL;
+    stripped.renderer_cache = NULL;
+
+    set->symbol[i] = (symbolObj *) msSmallMalloc(sizeof(symbolObj));
+    initSymbol(set->symbol[i]);
+    if(msCopySymbol(set->symbol[i], &stripped, dst) != MS_SUCCESS) {
+      msFree(set->symbol[i]);
+      set->symbol[i] = NULL;
+      return MS_FAILURE;
+    }
+    set->numsymbols = i + 1;
+  }
+
+  /* share the font table */
+  msFreeHashItems(&(dst->fontset.fonts));
+  dst->fontset.fonts = src->fontset.fonts;
+  dst->fontset.numfonts = src->fontset.numfonts;
 
   return MS_SUCCESS;
 }
+
+void unshareMapResources(mapObj *dst, mapObj *src) {
+  int i;
+
+  for(i=1; i<dst->symbolset.numsymbols && i<src->symbolset.numsymbols; i++) {
+    if(dst->symbolset.symbol[i] == src->symbolset.symbol[i])
+      dst->symbolset.symbol[i] = NULL;
+  }
+
+  if(dst->fontset.fonts.items == src->fontset.fonts.items) {
+    msInitHashTable(&(dst->fontset.fonts)); /* so it can be freed */
+    dst->fontset.numfonts = 0;
+  }
+}
+
+int requestAltersResources(cgiRequestObj *request) {
+  int i;
+
+  for(i=0; i<request->NumParams; i++) {
+    char *name = request->ParamNames[i];
+
+    if(strcasecmp(name, "context") == 0)
+      return MS_TRUE;
+
+    if(strncasecmp(name, "map_", 4) == 0 || strncasecmp(name, "map.", 4) == 0) {
+      /* e.g. `map.symbolset`, `map.fontset` or a new set in a value */
+      if(containsNoCase(name, "symbol") || containsNoCase(name, "font")
+         || containsNoCase(request->ParamValues[i], "symbolset")
+         || containsNoCase(request->ParamValues[i], "fontset"))
+        return MS_TRUE;
+
+      /* symbols defined inline at the map level */
+      if(strchr(name + 4, '.') == NULL && strchr(name + 4, '[') == NULL
+         && containsNoCase(request->ParamValues[i], "symbol"))
+        return MS_TRUE;
+    }
+  }
+  return MS_FALSE;
+}
+
+int requestAltersProjections(cgiRequestObj *request) {
+  int i, alters = 0;
+
+  for(i=0; i<request->NumParams; i++) {
+    char *name = request->ParamNames[i];
+
+    if(strcasecmp(name, "context") == 0)
+      return NODE_MAPSERV_MAP_PROJECTION | NODE_MAPSERV_LAYER_PROJECTIONS;
+
+    /* OGC requests reproject the map e.g. `SRS`, `CRS` or `SRSNAME` */
+    if(containsNoCase(name, "srs") || containsNoCase(name, "crs"))
+      alters |= NODE_MAPSERV_MAP_PROJECTION;
+
+    if((strncasecmp(name, "map_", 4) == 0 || strncasecmp(name, "map.", 4) == 0)
+       && (containsNoCase(name, "projection")
+           || containsNoCase(request->ParamValues[i], "projection"))) {
+      if(strchr(name + 4, '.') == NULL && strchr(name + 4, '[') == NULL
+         && !containsNoCase(name, "layer"))
+        alters |= NODE_MAPSERV_MAP_PROJECTION;
+      else
+        alters |= NODE_MAPSERV_LAYER_PROJECTIONS;
+    }
+  }
+  return alters;
+}
+
+/* compile a regular expression in the same way as `msEvalExpression()` */
+static void compileExpression(expressionObj *expression) {
+  int flags = MS_REG_EXTENDED|MS_REG_NOSUB;
+
+  if(expression->type != MS_REGEX || expression->compiled || !expression->string)
+    return;
+
+  if(expression->flags & MS_EXP_INSENSITIVE)
+    flags |= MS_REG_ICASE;
+
+  /* invalid expressions are left for Mapserver to report when evaluated */
+  if(ms_regcomp(&(expression->regex), expression->string, flags) == 0)
+    expression->compiled = MS_TRUE;
+}
+
+/* share a compiled expression if the copy has not been altered */
+static void shareExpression(expressionObj *dst, expressionObj *src) {
+  if(src->type != MS_REGEX || !src->compiled
+     || dst->type != MS_REGEX || dst->compiled
+     || dst->flags != src->flags
+     || !dst->string || strcmp(dst->string, src->string) != 0)
+    return;
+
+  dst->regex = src->regex;
+  dst->compiled = MS_TRUE;
+}
+
+/* detach an expression attached by `shareExpression()` */
+static void unshareExpression(expressionObj *dst, expressionObj *src) {
+  if(dst->type == MS_REGEX && dst->compiled && src->compiled
+     && memcmp(&(dst->regex), &(src->regex), sizeof(ms_regex_t)) == 0)
+    dst->compiled = MS_FALSE; /* so it is not freed with the copy */
+}
+
+void compileMapExpressions(mapObj *map) {
+  int i, j;
+
+  for(i=0; i<map->numlayers; i++) {
+    layerObj *layer = GET_LAYER(map, i);
+
+    compileExpression(&(layer->filter));
+    for(j=0; j<layer->numclasses; j++)
+      compileExpression(&(layer->class[j]->expression));
+  }
+}
+
+void shareMapExpressions(mapObj *dst, mapObj *src) {
+  int i, j;
+
+  for(i=0; i<dst->numlayers && i<src->numlayers; i++) {
+    layerObj *dlayer = GET_LAYER(dst, i), *slayer = GET_LAYER(src, i);
+
+    shareExpression(&(dlayer->filter), &(slayer->filter));
+    for(j=0; j<dlayer->numclasses && j<slayer->numclasses; j++)
+      shareExpression(&(dlayer->class[j]->expression), &(slayer->class[j]->expression));
+  }
+}
+
+void unshareMapExpressions(mapObj *dst, mapObj *src) {
+  int i, j;
+
+  for(i=0; i<dst->numlayers && i<src->numlayers; i++) {
+    layerObj *dlayer = GET_LAYER(dst, i), *slayer = GET_LAYER(src, i);
+
+    unshareExpression(&(dlayer->filter), &(slayer->filter));
+    for(j=0; j<dlayer->numclasses && j<slayer->numclasses; j++)
+      unshareExpression(&(dlayer->class[j]->expression), &(slayer->class[j]->expression));
+  }
+}
+
+int stripStdoutBufferStatus(void) {
+  msIOContext *ctx = msIO_getHandler((FILE *) "stdout");
+  msIOBuffer *buf;
+  int start = 0, status = 0;
+
+  if(ctx == NULL || ctx->write_channel == MS_FALSE || strcmp(ctx->label, "buffer") != 0)
+    return 0;
+
+  buf = (msIOBuffer *) ctx->cbData;
+
+  /* look through the header lines, which end at the first empty line */
+  while(start < buf->data_offset) {
+    char *line = (char *) buf->data + start;
+    char *end = memchr(line, '\n', buf->data_offset - start);
+    int length;
+
+    if(!end) break;             /* there are no headers */
+    length = end - line + 1;
+    if(length == 1 || (length == 2 && line[0] == '\r')) break;
+
+    if(length > 7 && strncasecmp(line, "Status:", 7) == 0) {
+      status = atoi(line + 7);
+      memmove(line, line + length, buf->data_offset - start - length);
+      buf->data_offset -= length;
+      continue;
+    }
+    start += length;
+  }
+
+  return status;
+}
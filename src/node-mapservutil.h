@@ -41,6 +41,7 @@
 
 #include "mapserver.h"
 #include "mapthread.h"
+#include "trace.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -63,9 +64,111 @@ int wrap_loadParams(cgiRequestObj *request, char* (*getenv2)(const char*, void*
  *
  * This function is copied verbatim from the latter part of `msCGILoadMap()`
  * with the exception of adding the mutex around `msUpdateMapFromURL()` and
- * altering the return type.
+ * altering the return type.  URL overrides are skipped if `overrides` is
+ * false, having been applied by an override program, and the time spent
+ * waiting for the mutex is added to `wait`.
  */
-int updateMap(mapservObj *mapserv, mapObj *map);
+int updateMap(mapservObj *mapserv, mapObj *map, int overrides, trace_time_t *wait);
+
+/**
+ * Forward the cookies of a request to a map
+ *
+ * This is the last step of `updateMap()`, for maps otherwise prepared for
+ * the request.
+ */
+void updateMapCookies(mapservObj *mapserv, mapObj *map);
+
+/**
+ * Create the source from which request copies of a map are made
+ *
+ * This is a shallow copy of `map` sharing all its members except the symbol
+ * set and font set, which are emptied so that `msCopyMap()` does not
+ * duplicate them.  The layers are shallow copies whose projections are left
+ * undefined so that they can be attached from a cache after copying.  The result is read only and is valid for as long as `map`
+ * is unaltered.
+ */
+mapObj* createMapSkeleton(mapObj *map);
+
+/**
+ * Free a map created by `createMapSkeleton()`
+ */
+void freeMapSkeleton(mapObj *skeleton);
+
+/**
+ * Make a map copied from a skeleton reference the symbols and fonts of the
+ * original
+ *
+ * Symbols whose state is not altered by rendering are shared with `src`.
+ * Image symbols are given a private copy without the image itself, which is
+ * copied from the decoded image held by the `PixmapCache` if the symbol is
+ * drawn.  The font set is shared.
+ */
+int shareMapResources(mapObj *dst, mapObj *src);
+
+/**
+ * Detach the resources attached by `shareMapResources()`
+ *
+ * This must be called before `dst` is freed.  It is safe to call on a map that
+ * shares nothing with `src`.
+ */
+void unshareMapResources(mapObj *dst, mapObj *src);
+
+/**
+ * Check whether a request could alter the symbols or fonts of a map
+ *
+ * Such requests need a private copy of the symbol set and font set.
+ */
+int requestAltersResources(cgiRequestObj *request);
+
+/** The map projection may be redefined by a request */
+#define NODE_MAPSERV_MAP_PROJECTION 1
+/** Layer projections may be redefined by a request */
+#define NODE_MAPSERV_LAYER_PROJECTIONS 2
+
+/**
+ * Check whether a request could redefine the projections of a map
+ *
+ * This returns a combination of `NODE_MAPSERV_MAP_PROJECTION` and
+ * `NODE_MAPSERV_LAYER_PROJECTIONS`.  Projections that may be redefined must
+ * not be shared with a cache as Mapserver frees them when doing so.
+ */
+int requestAltersProjections(cgiRequestObj *request);
+
+/**
+ * Compile the regular expressions used by the layer filters and class
+ * expressions of a map
+ *
+ * This is done once for a map so the copies made for each request do not need
+ * to compile them again.
+ */
+void compileMapExpressions(mapObj *map);
+
+/**
+ * Make a copy of a map use the expressions compiled by
+ * `compileMapExpressions()`
+ *
+ * This must be called after the copy has been updated for a request: an
+ * expression is only shared if it is unchanged from the original.  The
+ * compiled expressions are read only and are evaluated concurrently by all
+ * copies.
+ */
+void shareMapExpressions(mapObj *dst, mapObj *src);
+
+/**
+ * Detach the expressions attached by `shareMapExpressions()`
+ *
+ * This must be called before `dst` is freed.
+ */
+void unshareMapExpressions(mapObj *dst, mapObj *src);
+
+/**
+ * Remove the `Status` header from the buffered stdout of a request
+ *
+ * Mapserver sets this header when a request fails, e.g. with `404 Not
+ * Found`.  This returns the status code, or 0 if there is no such header.
+ * It must be called before the other headers are stripped.
+ */
+int stripStdoutBufferStatus(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,340 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file overrides.cpp
+ * @brief This defines the `OverrideProgram` and `OverrideCache` classes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "overrides.hpp"
+#include "mapthread.h"
+
+using std::string;
+
+/// The maximum number of override programs kept for a map
+#define OVERRIDE_PROGRAMS 256
+
+/// Is a parameter a URL override e.g. `map.layer[roads]`?
+static bool isOverride(const char *name) {
+  return strncasecmp(name, "map_", 4) == 0 || strncasecmp(name, "map.", 4) == 0;
+}
+
+/// Read a keyword followed by a bracketed identifier e.g. `layer[roads]`,
+/// returning what follows it or `NULL`
+static const char* readIndexed(const char *text, const char *keyword, string &id) {
+  size_t length = strlen(keyword);
+  const char *end;
+
+  if (strncasecmp(text, keyword, length) != 0 || text[length] != '[') {
+    return NULL;
+  }
+  if (!(end = strchr(text + length + 1, ']'))) {
+    return NULL;
+  }
+  id.assign(text + length + 1, end);
+  return end + 1;
+}
+
+/// Is an identifier an index rather than a name?
+static bool isIndex(const string &id) {
+  if (id.empty()) {
+    return false;
+  }
+  for (size_t i = 0; i < id.length(); ++i) {
+    if (!isdigit(static_cast<unsigned char>(id[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+OverrideProgram::~OverrideProgram() {
+  for (size_t i = 0; i < steps.size(); ++i) {
+    freeClass(steps[i].replacement);
+    msFree(steps[i].replacement);
+  }
+}
+
+/**
+ * @details A layer is addressed by index or name and a class by index or
+ * name, as Mapserver does.  Anything following the class, such as a style or
+ * label, is part of that class.
+ *
+ * @param map The map the override applies to.
+ *
+ * @param name The name of the override parameter.
+ *
+ * @param layer Set to the index of the layer.
+ *
+ * @param klass Set to the index of the class.
+ *
+ * @return `false` if the override does not address a class of the map.
+ */
+bool OverrideProgram::Target(mapObj *map, const char *name, int *layer, int *klass) {
+  const char *next;
+  string id;
+
+  if (!(next = readIndexed(name + 4, "layer", id))) {
+    return false;
+  }
+  *layer = isIndex(id) ? atoi(id.c_str()) : msGetLayerIndex(map, const_cast<char *>(id.c_str()));
+  if (*layer < 0 || *layer >= map->numlayers) {
+    return false;
+  }
+
+  if ((*next != '_' && *next != '.') || !(next = readIndexed(next + 1, "class", id))) {
+    return false;
+  }
+  if (*next && *next != '_' && *next != '.') {
+    return false;
+  }
+
+  layerObj *lp = GET_LAYER(map, *layer);
+  if (isIndex(id)) {
+    *klass = atoi(id.c_str());
+  } else {
+    for (*klass = 0; *klass < lp->numclasses; ++(*klass)) {
+      if (lp->_class[*klass]->name && id == lp->_class[*klass]->name) {
+        break;
+      }
+    }
+  }
+  return *klass >= 0 && *klass < lp->numclasses;
+}
+
+/**
+ * @details The key is the text of the overrides in the order they are
+ * applied.  No key is produced if the map is immutable, if the request has
+ * no overrides or if any override does not address a class.
+ *
+ * @param map The map the request applies to.
+ *
+ * @param request The request parameters.
+ *
+ * @param key Set to the key.
+ *
+ * @return Can the overrides be compiled?
+ */
+bool OverrideProgram::Key(mapObj *map, cgiRequestObj *request, string &key) {
+  int layer, klass;
+
+  if (msLookupHashTable(&(map->web.validation), "immutable")) {
+    return false;
+  }
+
+  key.clear();
+  for (int i = 0; i < request->NumParams; ++i) {
+    if (!isOverride(request->ParamNames[i])) {
+      continue;
+    }
+    if (!Target(map, request->ParamNames[i], &layer, &klass)) {
+      return false;
+    }
+    key += request->ParamNames[i];
+    key.push_back('\0');
+    key += request->ParamValues[i];
+    key.push_back('\0');
+  }
+
+  return !key.empty();
+}
+
+/**
+ * @details The overrides are applied with `msUpdateMapFromURL` under the
+ * parser lock, exactly as `updateMap` would, and copies of the classes they
+ * altered are kept.  Overrides that add or remove classes are not compiled.
+ *
+ * @param scratch A request copy of the map, altered by the overrides.
+ *
+ * @param request The request parameters, which must have a key.
+ *
+ * @param wait Incremented by the time spent waiting for the parser lock.
+ *
+ * @return The program, or `NULL` if the overrides could not be applied or
+ * compiled.
+ */
+OverrideProgram* OverrideProgram::Compile(mapObj *scratch, cgiRequestObj *request, trace_time_t *wait) {
+  OverrideProgram *program = new OverrideProgram();
+  std::vector<int> numclasses;
+  int layer, klass;
+
+  for (int i = 0; i < scratch->numlayers; ++i) {
+    numclasses.push_back(GET_LAYER(scratch, i)->numclasses);
+  }
+
+  for (int i = 0; i < request->NumParams; ++i) {
+    if (!isOverride(request->ParamNames[i])) {
+      continue;
+    }
+    if (!Target(scratch, request->ParamNames[i], &layer, &klass)) {
+      delete program;
+      return NULL;
+    }
+
+    trace_time_t start = traceNow();
+    int status;
+
+    msAcquireLock(TLOCK_PARSER);
+    *wait += traceNow() - start;
+    if (trace_enabled) {
+      traceCurrentSpan("wait TLOCK_PARSER", start);
+    }
+    status = msUpdateMapFromURL(scratch, request->ParamNames[i], request->ParamValues[i]);
+    msReleaseLock(TLOCK_PARSER);
+
+    if (status != MS_SUCCESS) {
+      delete program;
+      return NULL;
+    }
+
+    bool seen = false;
+    for (size_t s = 0; s < program->steps.size(); ++s) {
+      seen = seen || (program->steps[s].layer == layer && program->steps[s].klass == klass);
+    }
+    if (!seen) {
+      Step step = {layer, klass, NULL};
+      program->steps.push_back(step);
+    }
+  }
+
+  for (int i = 0; i < scratch->numlayers; ++i) {
+    if (i >= (int) numclasses.size() || GET_LAYER(scratch, i)->numclasses != numclasses[i]) {
+      delete program;
+      return NULL;
+    }
+  }
+
+  for (size_t s = 0; s < program->steps.size(); ++s) {
+    Step &step = program->steps[s];
+    classObj *replacement = static_cast<classObj *>(msSmallMalloc(sizeof(classObj)));
+
+    initClass(replacement);
+    if (msCopyClass(replacement, GET_LAYER(scratch, step.layer)->_class[step.klass], NULL) != MS_SUCCESS) {
+      freeClass(replacement);
+      msFree(replacement);
+      program->steps.resize(s);
+      delete program;
+      return NULL;
+    }
+    replacement->layer = NULL; // the scratch layer is freed
+    step.replacement = replacement;
+  }
+
+  return program;
+}
+
+/**
+ * @details Each class altered by the overrides is emptied and refilled with
+ * a copy of its replacement, leaving it owned by the same layer.  No parser
+ * is involved so the lock is not needed.
+ *
+ * @param map A request copy of the map the program was compiled for.
+ *
+ * @return `MS_SUCCESS`, or `MS_FAILURE` with a Mapserver error set, in which
+ * case the copy may be partially altered.
+ */
+int OverrideProgram::Apply(mapObj *map) const {
+  for (size_t s = 0; s < steps.size(); ++s) {
+    const Step &step = steps[s];
+
+    if (step.layer >= map->numlayers || step.klass >= GET_LAYER(map, step.layer)->numclasses) {
+      msSetError(MS_MISCERR, "The map does not match the override program", "OverrideProgram::Apply()");
+      return MS_FAILURE;
+    }
+
+    layerObj *layer = GET_LAYER(map, step.layer);
+    classObj *klass = layer->_class[step.klass];
+
+    freeClass(klass);
+    initClass(klass);
+    if (msCopyClass(klass, step.replacement, layer) != MS_SUCCESS) {
+      return MS_FAILURE;
+    }
+  }
+  return MS_SUCCESS;
+}
+
+OverrideCache::OverrideCache() {
+  uv_mutex_init(&mutex);
+}
+
+OverrideCache::~OverrideCache() {
+  for (std::map<string, OverrideProgram*>::iterator it = programs.begin(); it != programs.end(); ++it) {
+    delete it->second;
+  }
+  uv_mutex_destroy(&mutex);
+}
+
+/**
+ * @param key The key of the overrides.
+ *
+ * @param program Set to the program, which may be `NULL` if the overrides
+ * did not compile.
+ *
+ * @return Has the key been seen?
+ */
+bool OverrideCache::Get(const string &key, const OverrideProgram **program) {
+  bool found;
+
+  uv_mutex_lock(&mutex);
+  std::map<string, OverrideProgram*>::iterator it = programs.find(key);
+  found = (it != programs.end());
+  if (found) {
+    *program = it->second;
+  }
+  uv_mutex_unlock(&mutex);
+
+  return found;
+}
+
+/**
+ * @details A program is not added if the cache is full or if another thread
+ * has added one for the same key.
+ *
+ * @param key The key of the overrides.
+ *
+ * @param program The program, or `NULL` to record that the overrides did not
+ * compile.
+ *
+ * @return `true` if the cache took ownership of the program.
+ */
+bool OverrideCache::Put(const string &key, OverrideProgram *program) {
+  bool added = false;
+
+  uv_mutex_lock(&mutex);
+  if (programs.size() < OVERRIDE_PROGRAMS && programs.find(key) == programs.end()) {
+    programs[key] = program;
+    added = true;
+  }
+  uv_mutex_unlock(&mutex);
+
+  return added;
+}
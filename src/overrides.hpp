@@ -0,0 +1,124 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_OVERRIDES_H__
+#define __NODE_MAPSERV_OVERRIDES_H__
+
+/**
+ * @file overrides.hpp
+ * @brief This declares the programs applying `map_` URL overrides.
+ *
+ * Mapserver parses URL overrides with its global lexer, which must be held
+ * under `TLOCK_PARSER`, so requests with overrides are otherwise serialised
+ * across worker threads.  A program parses a set of overrides once and can
+ * then be applied to any number of request copies without the lock.
+ */
+
+// Standard headers
+#include <string>
+#include <vector>
+#include <map>
+
+// Libuv headers
+#include <uv.h>
+
+// Mapserver headers
+#include "mapserver.h"
+extern "C" {
+#include "mapserv.h"
+}
+
+// Node-mapserv headers
+#include "trace.h"
+
+/**
+ * @brief The classes of a map as altered by a set of URL overrides
+ *
+ * Only overrides addressing a class, such as
+ * `map.layer[roads].class[0].style[0]=COLOR 255 0 0`, can be compiled.  The
+ * overrides are applied in order to a scratch copy of the map by Mapserver
+ * itself and the resulting classes are kept, so applying the program to a
+ * request copy replaces the same classes with copies of them.  A program is
+ * read only once compiled.
+ */
+class OverrideProgram {
+public:
+
+  ~OverrideProgram();
+
+  /// Get the text identifying the overrides of a request if they can be compiled
+  static bool Key(mapObj *map, cgiRequestObj *request, std::string &key);
+
+  /// Apply the overrides of a request to a scratch copy of a map
+  static OverrideProgram* Compile(mapObj *scratch, cgiRequestObj *request, trace_time_t *wait);
+
+  /// Replace the classes of a request copy of the map with those of the program
+  int Apply(mapObj *map) const;
+
+private:
+
+  /// A class altered by the overrides
+  struct Step {
+    int layer;
+    int klass;
+    classObj *replacement;
+  };
+
+  std::vector<Step> steps;
+
+  /// Find the class addressed by an override
+  static bool Target(mapObj *map, const char *name, int *layer, int *klass);
+};
+
+/**
+ * @brief The override programs compiled for a map, keyed by override text
+ *
+ * The number of programs is bounded: once full, new sets of overrides are
+ * applied with the parser lock as before.  Programs are only freed with the
+ * cache.  All methods are thread safe.
+ */
+class OverrideCache {
+public:
+
+  OverrideCache();
+  ~OverrideCache();
+
+  /// Find the program for a key, which may be `NULL` if it did not compile
+  bool Get(const std::string &key, const OverrideProgram **program);
+
+  /// Add a program, returning `false` if the caller still owns it
+  bool Put(const std::string &key, OverrideProgram *program);
+
+private:
+
+  /// Guards `programs`
+  uv_mutex_t mutex;
+  /// The programs by key
+  std::map<std::string, OverrideProgram*> programs;
+};
+
+#endif  /* __NODE_MAPSERV_OVERRIDES_H__ */
@@ -0,0 +1,152 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file perfcounters.cpp
+ * @brief This defines the `PerfCounters` class.
+ */
+
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perfcounters.hpp"
+
+#ifdef __linux__
+
+/// The state of the counters in a thread
+struct ThreadCounters {
+  /// Have the counters been opened?
+  bool opened;
+  /// Is at least one counter available?
+  bool available;
+  /// The counter file descriptors, or -1
+  int fds[PERF_EVENT_COUNT];
+};
+
+/// The counters of the current thread
+static __thread ThreadCounters counters = { false, false, { -1, -1, -1, -1 } };
+
+/// Open a counter for the current thread, returning -1 on failure
+static int openCounter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_kernel = 1;      // allowed when perf_event_paranoid is 2
+  attr.exclude_hv = 1;
+
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/// Open the counters of the current thread once
+static void openCounters() {
+  counters.opened = true;
+  counters.fds[PERF_CYCLES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  counters.fds[PERF_INSTRUCTIONS] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  counters.fds[PERF_CACHE_MISSES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  counters.fds[PERF_CONTEXT_SWITCHES] = openCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+
+  for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+    if (counters.fds[i] >= 0) {
+      counters.available = true;
+    }
+  }
+}
+
+#endif
+
+/**
+ * @details The counters are opened the first time they are read in a thread
+ * and remain open for the life of the thread.  Counters that could not be
+ * opened are marked as invalid in the sample.
+ *
+ * @param sample Populated with the counter values.
+ *
+ * @return `false` if no counters are available in this thread.
+ */
+bool PerfCounters::Read(PerfSample *sample) {
+  memset(sample, 0, sizeof(PerfSample));
+
+#ifdef __linux__
+  if (!counters.opened) {
+    openCounters();
+  }
+  if (!counters.available) {
+    return false;
+  }
+
+  for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+    uint64_t value;
+    if (counters.fds[i] >= 0 && read(counters.fds[i], &value, sizeof(value)) == sizeof(value)) {
+      sample->values[i] = value;
+      sample->valid[i] = true;
+    }
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @param start The earlier reading.
+ *
+ * @param end The later reading.
+ *
+ * @param delta Set to the difference, valid where both readings are.
+ */
+void PerfCounters::Delta(const PerfSample &start, const PerfSample &end, PerfSample *delta) {
+  for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+    delta->valid[i] = start.valid[i] && end.valid[i];
+    delta->values[i] = delta->valid[i] ? end.values[i] - start.values[i] : 0;
+  }
+}
+
+/**
+ * @param event The event.
+ */
+const char* PerfCounters::Name(PerfEvent event) {
+  switch (event) {
+  case PERF_CYCLES:
+    return "cycles";
+  case PERF_INSTRUCTIONS:
+    return "instructions";
+  case PERF_CACHE_MISSES:
+    return "cacheMisses";
+  case PERF_CONTEXT_SWITCHES:
+    return "contextSwitches";
+  default:
+    return "unknown";
+  }
+}
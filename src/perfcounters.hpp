@@ -0,0 +1,78 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_PERFCOUNTERS_H__
+#define __NODE_MAPSERV_PERFCOUNTERS_H__
+
+/**
+ * @file perfcounters.hpp
+ * @brief This declares access to hardware performance counters.
+ *
+ * On Linux the counters are opened for each worker thread using
+ * `perf_event_open` and only count events in user space, which is permitted
+ * by the default `perf_event_paranoid` setting.  Where counters can't be
+ * opened (other platforms, containers without the system call, stricter
+ * settings) none are reported.
+ */
+
+// Standard headers
+#include <stdint.h>
+
+/// The events counted
+enum PerfEvent {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_CONTEXT_SWITCHES,
+  PERF_EVENT_COUNT
+};
+
+/// A reading of the counters
+struct PerfSample {
+  /// The value of each counter
+  uint64_t values[PERF_EVENT_COUNT];
+  /// Was each counter available?
+  bool valid[PERF_EVENT_COUNT];
+};
+
+/**
+ * @brief The performance counters of the current thread
+ */
+class PerfCounters {
+public:
+
+  /// Read the counters of the current thread, returning `false` if there are none
+  static bool Read(PerfSample *sample);
+
+  /// Subtract one reading from a later one
+  static void Delta(const PerfSample &start, const PerfSample &end, PerfSample *delta);
+
+  /// Get the javascript property name of an event
+  static const char* Name(PerfEvent event);
+};
+
+#endif  /* __NODE_MAPSERV_PERFCOUNTERS_H__ */
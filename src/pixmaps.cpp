@@ -0,0 +1,320 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+/**
+ * @file pixmaps.cpp
+ * @brief This defines the `PixmapCache` class.
+ */
+
+#include <string.h>
+#include <string>
+#include <map>
+
+#include <uv.h>
+
+#include "pixmaps.hpp"
+
+/// The signature of the image loader of a renderer
+typedef int (*ImageLoader)(char *path, rasterBufferObj *buffer);
+
+/// An image referenced by the symbols of one or more maps
+struct PixmapImage {
+  /// The number of symbols referencing the image
+  int refs;
+  /// The decoded image, or `NULL` if it has not been decoded
+  rasterBufferObj *buffer;
+};
+
+/// Ensures `mutex` is initialised once
+static uv_once_t mutex_once = UV_ONCE_INIT;
+/// Guards the variables below it
+static uv_mutex_t mutex;
+/// The images keyed by file path
+static std::map<std::string, PixmapImage> images;
+/// The loader of the renderers replaced by `PixmapCache::Load`
+static ImageLoader loader = NULL;
+
+/// Initialise `mutex`
+static void initMutex(void) {
+  uv_mutex_init(&mutex);
+}
+
+/// Is a symbol drawn from an image file?
+static bool isPixmap(symbolObj *symbol) {
+  return symbol && symbol->type == MS_SYMBOL_PIXMAP && symbol->full_pixmap_path;
+}
+
+/// Free a decoded image
+static void freeImage(rasterBufferObj *buffer) {
+  if (buffer) {
+    msFreeRasterBuffer(buffer);
+    msFree(buffer);
+  }
+}
+
+/**
+ * @brief Copy a decoded image into the buffer of a symbol
+ *
+ * The channel pointers of RGBA buffers point into its pixels, so they are
+ * moved to the same offsets in the copy.
+ *
+ * @return `MS_SUCCESS` or `MS_FAILURE`.
+ */
+static int copyImage(const rasterBufferObj *src, rasterBufferObj *dst) {
+  size_t size = (size_t) src->data.rgba.row_step * src->height;
+  unsigned char *pixels = (unsigned char *) malloc(size);
+
+  if (!pixels) {
+    msSetError(MS_MEMERR, "Failed to copy the symbol image", "PixmapCache::Load()");
+    return MS_FAILURE;
+  }
+  memcpy(pixels, src->data.rgba.pixels, size);
+
+  *dst = *src;
+  dst->data.rgba.pixels = pixels;
+#define MOVE_CHANNEL(C) \
+  dst->data.rgba.C = src->data.rgba.C ? pixels + (src->data.rgba.C - src->data.rgba.pixels) : NULL
+  MOVE_CHANNEL(r);
+  MOVE_CHANNEL(g);
+  MOVE_CHANNEL(b);
+  MOVE_CHANNEL(a);
+#undef MOVE_CHANNEL
+
+  return MS_SUCCESS;
+}
+
+/**
+ * @brief Decode an image with the loader of the renderers
+ *
+ * Only RGBA images are kept, as those are the ones that can be copied.
+ *
+ * @return The image, or `NULL` if it could not be decoded.
+ */
+static rasterBufferObj* decodeImage(ImageLoader load, const std::string &path) {
+  rasterBufferObj *buffer = (rasterBufferObj *) msSmallCalloc(1, sizeof(rasterBufferObj));
+  std::string copy(path);       // the loader does not take a const path
+
+  if (load(&copy[0], buffer) != MS_SUCCESS) {
+    msFree(buffer);
+    return NULL;
+  }
+  if (buffer->type != MS_BUFFER_BYTE_RGBA) {
+    freeImage(buffer);
+    return NULL;
+  }
+  return buffer;
+}
+
+/// Find the image loader used by the renderers of a map
+static ImageLoader findLoader(mapObj *map) {
+  for (int i = 0; i < map->numoutputformats; ++i) {
+    outputFormatObj *format = map->outputformatlist[i];
+    if (MS_RENDERER_PLUGIN(format) && format->vtable && format->vtable->loadImageFromFile) {
+      return format->vtable->loadImageFromFile;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @details This should be called once for each template map, when it is
+ * created.
+ *
+ * @param map The map whose symbols are referenced.
+ */
+void PixmapCache::Acquire(mapObj *map) {
+  uv_once(&mutex_once, initMutex);
+  uv_mutex_lock(&mutex);
+  for (int i = 0; i < map->symbolset.numsymbols; ++i) {
+    symbolObj *symbol = map->symbolset.symbol[i];
+    if (isPixmap(symbol)) {
+      PixmapImage &image = images[symbol->full_pixmap_path];
+      if (!image.refs++) {
+        image.buffer = NULL;
+      }
+    }
+  }
+  uv_mutex_unlock(&mutex);
+}
+
+/**
+ * @details Images no longer referenced by any map are freed.
+ *
+ * @param map A map passed to `Acquire`.
+ */
+void PixmapCache::Release(mapObj *map) {
+  uv_once(&mutex_once, initMutex);
+  uv_mutex_lock(&mutex);
+  for (int i = 0; i < map->symbolset.numsymbols; ++i) {
+    symbolObj *symbol = map->symbolset.symbol[i];
+    if (!isPixmap(symbol)) {
+      continue;
+    }
+
+    std::map<std::string, PixmapImage>::iterator it = images.find(symbol->full_pixmap_path);
+    if (it != images.end() && --it->second.refs == 0) {
+      freeImage(it->second.buffer);
+      images.erase(it);
+    }
+  }
+  uv_mutex_unlock(&mutex);
+}
+
+/**
+ * @details Images are otherwise decoded by the first request to draw them.
+ * The images are decoded outside the mutex, and an image decoded by another
+ * thread in the meantime is kept in place of this one.
+ *
+ * @param map A map passed to `Acquire`.
+ *
+ * @return The number of images decoded.
+ */
+int PixmapCache::Preload(mapObj *map) {
+  ImageLoader load = findLoader(map);
+  int count = 0;
+
+  uv_once(&mutex_once, initMutex);
+  uv_mutex_lock(&mutex);
+  if (load == Load) {
+    load = loader;
+  }
+  uv_mutex_unlock(&mutex);
+
+  for (int i = 0; load && i < map->symbolset.numsymbols; ++i) {
+    symbolObj *symbol = map->symbolset.symbol[i];
+    if (!isPixmap(symbol)) {
+      continue;
+    }
+
+    std::string path(symbol->full_pixmap_path);
+    uv_mutex_lock(&mutex);
+    std::map<std::string, PixmapImage>::iterator it = images.find(path);
+    bool pending = (it != images.end() && !it->second.buffer);
+    uv_mutex_unlock(&mutex);
+    if (!pending) {
+      continue;
+    }
+
+    rasterBufferObj *buffer = decodeImage(load, path);
+    if (!buffer) {
+      continue;
+    }
+
+    uv_mutex_lock(&mutex);
+    it = images.find(path);
+    if (it != images.end() && !it->second.buffer) {
+      it->second.buffer = buffer;
+      buffer = NULL;
+      count++;
+    }
+    uv_mutex_unlock(&mutex);
+    freeImage(buffer);
+  }
+
+  msResetErrorList();           // images that cannot be decoded fail when drawn
+  return count;
+}
+
+/**
+ * @details This replaces the image loader of the renderers of the output
+ * formats of `map`, which must be a copy owned by the current request.
+ * Output formats created later by the request keep the loader of their
+ * renderer, as do renderers with a loader other than the first one seen.
+ *
+ * @param map The request copy.
+ */
+void PixmapCache::Attach(mapObj *map) {
+  uv_once(&mutex_once, initMutex);
+  for (int i = 0; i < map->numoutputformats; ++i) {
+    outputFormatObj *format = map->outputformatlist[i];
+    if (!MS_RENDERER_PLUGIN(format) || !format->vtable) {
+      continue;
+    }
+
+    rendererVTableObj *renderer = format->vtable;
+    uv_mutex_lock(&mutex);
+    if (!loader && renderer->loadImageFromFile != Load) {
+      loader = renderer->loadImageFromFile;
+    }
+    if (renderer->loadImageFromFile == loader) {
+      renderer->loadImageFromFile = Load;
+    }
+    uv_mutex_unlock(&mutex);
+  }
+}
+
+/**
+ * @details This is installed as the image loader of the renderers of request
+ * copies.  Images that are referenced by a map are decoded once and then
+ * copied into `buffer`, saving the file being read and decoded again.  The
+ * image cannot be released meanwhile, as the map whose copy is being drawn
+ * still references it.
+ *
+ * @param path The path of the image file.
+ *
+ * @param buffer The buffer of the symbol being drawn.
+ *
+ * @return `MS_SUCCESS` or `MS_FAILURE`.
+ */
+int PixmapCache::Load(char *path, rasterBufferObj *buffer) {
+  ImageLoader load;
+  rasterBufferObj *image = NULL;
+  bool known;
+
+  uv_mutex_lock(&mutex);
+  load = loader;
+  std::map<std::string, PixmapImage>::iterator it = images.find(path);
+  known = (it != images.end());
+  if (known) {
+    image = it->second.buffer;
+  }
+  uv_mutex_unlock(&mutex);
+
+  if (!known) {
+    return load(path, buffer);
+  }
+
+  if (!image) {
+    rasterBufferObj *decoded = decodeImage(load, path);
+    if (!decoded) {
+      return load(path, buffer); // reports the error as usual
+    }
+
+    uv_mutex_lock(&mutex);
+    it = images.find(path);
+    if (!it->second.buffer) {
+      it->second.buffer = decoded;
+      decoded = NULL;
+    }
+    image = it->second.buffer;
+    uv_mutex_unlock(&mutex);
+    freeImage(decoded);
+  }
+
+  return copyImage(image, buffer);
+}
@@ -0,0 +1,75 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+#ifndef __NODE_MAPSERV_PIXMAPS_H__
+#define __NODE_MAPSERV_PIXMAPS_H__
+
+/**
+ * @file pixmaps.hpp
+ * @brief This declares the store of decoded pixmap symbol images.
+ */
+
+// Mapserver headers
+#include "mapserver.h"
+
+/**
+ * @brief The decoded images of the pixmap symbols of all maps
+ *
+ * Renderers decode the image of a pixmap symbol into the symbol itself the
+ * first time it is drawn, so every request copy of a map would otherwise
+ * read and decode each marker it draws.  The images are instead decoded once
+ * into this store, which is keyed by file path and referenced by the maps
+ * whose symbols use them.  The renderers of a request copy are attached to
+ * the store so that they fill each symbol from the decoded image.
+ *
+ * The symbol keeps its own buffer: Mapserver frees it whenever the symbol is
+ * drawn by another renderer, which a shared buffer would not survive.  All
+ * methods are thread safe.
+ */
+class PixmapCache {
+public:
+
+  /// Reference the images of the pixmap symbols of a map
+  static void Acquire(mapObj *map);
+
+  /// Release the images referenced by `Acquire`
+  static void Release(mapObj *map);
+
+  /// Decode the images of a map that have not yet been decoded
+  static int Preload(mapObj *map);
+
+  /// Have the renderers of a map load symbol images from the store
+  static void Attach(mapObj *map);
+
+private:
+
+  /// Load a symbol image from the store, or from the file otherwise
+  static int Load(char *path, rasterBufferObj *buffer);
+};
+
+#endif  /* __NODE_MAPSERV_PIXMAPS_H__ */
@@ -0,0 +1,265 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file profile.cpp
+ * @brief This defines the `LayerProfiler` class.
+ */
+
+#include <map>
+
+#include "profile.hpp"
+
+#ifdef _MSC_VER
+#define PROFILE_TLS __declspec(thread)
+#else
+#define PROFILE_TLS __thread
+#endif
+
+/// The profiling state of a layer
+struct ProfiledLayer {
+  /// The virtual table that was wrapped
+  layerVTableObj *vtable;
+  /// The original virtual table functions
+  layerVTableObj original;
+  /// The timings
+  LayerProfile profile;
+  /// When shapes were last selected, or 0
+  trace_time_t selected;
+  /// The time spent reading shapes since they were selected
+  trace_time_t selected_fetch;
+};
+
+/// The layers being profiled in the current thread
+typedef std::map<layerObj *, ProfiledLayer> ProfiledLayers;
+
+/// The layers being profiled by the current thread
+static PROFILE_TLS ProfiledLayers *profiled = NULL;
+
+/// Find the profiling state of a layer, or `NULL` if the current thread is
+/// not profiling it
+static ProfiledLayer* find(layerObj *layer) {
+  if (!profiled) {
+    return NULL;
+  }
+
+  ProfiledLayers::iterator it = profiled->find(layer);
+  return (it == profiled->end()) ? NULL : &(it->second);
+}
+
+/// Restore the original virtual table of a layer that is not being profiled,
+/// returning it or `NULL` on failure
+static layerVTableObj* unprofiled(layerObj *layer) {
+  if (msInitializeVirtualTable(layer) != MS_SUCCESS) {
+    return NULL;
+  }
+  return layer->vtable;
+}
+
+static int profileOpen(layerObj *layer) {
+  ProfiledLayer *state = find(layer);
+  if (!state) {
+    layerVTableObj *vtable = unprofiled(layer);
+    return vtable ? vtable->LayerOpen(layer) : MS_FAILURE;
+  }
+
+  trace_time_t start = traceNow();
+  int status = state->original.LayerOpen(layer);
+
+  state->profile.open += traceNow() - start;
+  state->profile.opens++;
+  return status;
+}
+
+static int profileWhichShapes(layerObj *layer, rectObj rect, int isQuery) {
+  ProfiledLayer *state = find(layer);
+  if (!state) {
+    layerVTableObj *vtable = unprofiled(layer);
+    return vtable ? vtable->LayerWhichShapes(layer, rect, isQuery) : MS_FAILURE;
+  }
+
+  trace_time_t start = traceNow();
+  int status = state->original.LayerWhichShapes(layer, rect, isQuery);
+
+  state->selected = traceNow();
+  state->selected_fetch = 0;
+  state->profile.which_shapes += state->selected - start;
+  return status;
+}
+
+static int profileNextShape(layerObj *layer, shapeObj *shape) {
+  ProfiledLayer *state = find(layer);
+  if (!state) {
+    layerVTableObj *vtable = unprofiled(layer);
+    return vtable ? vtable->LayerNextShape(layer, shape) : MS_FAILURE;
+  }
+
+  trace_time_t start = traceNow();
+  int status = state->original.LayerNextShape(layer, shape);
+  trace_time_t elapsed = traceNow() - start;
+
+  state->profile.fetch += elapsed;
+  state->selected_fetch += elapsed;
+  if (status == MS_SUCCESS) {
+    state->profile.features++;
+  }
+  return status;
+}
+
+static int profileGetShape(layerObj *layer, shapeObj *shape, resultObj *record) {
+  ProfiledLayer *state = find(layer);
+  if (!state) {
+    layerVTableObj *vtable = unprofiled(layer);
+    return vtable ? vtable->LayerGetShape(layer, shape, record) : MS_FAILURE;
+  }
+
+  trace_time_t start = traceNow();
+  int status = state->original.LayerGetShape(layer, shape, record);
+  trace_time_t elapsed = traceNow() - start;
+
+  state->profile.fetch += elapsed;
+  state->selected_fetch += elapsed;
+  if (status == MS_SUCCESS) {
+    state->profile.features++;
+  }
+  return status;
+}
+
+static int profileClose(layerObj *layer) {
+  ProfiledLayer *state = find(layer);
+  if (!state) {
+    layerVTableObj *vtable = unprofiled(layer);
+    return vtable ? vtable->LayerClose(layer) : MS_FAILURE;
+  }
+
+  trace_time_t start = traceNow();
+  int status;
+
+  if (state->selected) {
+    trace_time_t elapsed = start - state->selected;
+    state->profile.draw += (elapsed > state->selected_fetch) ? elapsed - state->selected_fetch : 0;
+    state->selected = 0;
+  }
+
+  status = state->original.LayerClose(layer);
+  state->profile.close += traceNow() - start;
+  return status;
+}
+
+/**
+ * @details This must be called after the map has been updated for the
+ * request and before it is used, in the thread that will use it.  Errors
+ * arising from initialising the virtual tables of layers are discarded: they
+ * recur if the layer is opened.
+ *
+ * @param map The map to profile.
+ */
+void LayerProfiler::Attach(mapObj *map) {
+  errorObj *error = msGetErrorObj();
+  bool clean = (!error || error->code == MS_NOERR);
+
+  delete profiled;
+  profiled = new ProfiledLayers();
+
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+
+    if (!layer->vtable && msInitializeVirtualTable(layer) != MS_SUCCESS) {
+      continue;
+    }
+
+    ProfiledLayer &state = (*profiled)[layer];
+    state.vtable = layer->vtable;
+    state.original = *(layer->vtable);
+    state.profile = LayerProfile();
+    state.profile.index = i;
+    state.profile.name = layer->name ? layer->name : "";
+    state.selected = 0;
+    state.selected_fetch = 0;
+
+    layer->vtable->LayerOpen = profileOpen;
+    layer->vtable->LayerWhichShapes = profileWhichShapes;
+    layer->vtable->LayerNextShape = profileNextShape;
+    layer->vtable->LayerGetShape = profileGetShape;
+    layer->vtable->LayerClose = profileClose;
+  }
+
+  if (clean) {
+    msResetErrorList();
+  }
+}
+
+/**
+ * @details This restores the original virtual tables and returns the timings
+ * of the layers that were used, in layer order.  It must be called in the
+ * thread that called `Attach`, before the map is freed.
+ *
+ * @param map The profiled map.
+ *
+ * @param profiles Populated with the timings.
+ */
+void LayerProfiler::Detach(mapObj *map, std::vector<LayerProfile> &profiles) {
+  std::map<int, int> labels, placed;
+
+  if (!profiled) {
+    return;
+  }
+
+  // count the labels cached by each layer
+  for (int p = 0; p < MS_MAX_LABEL_PRIORITY; ++p) {
+    labelCacheSlotObj *slot = &(map->labelcache.slots[p]);
+    for (int i = 0; i < slot->numlabels; ++i) {
+      labels[slot->labels[i].layerindex]++;
+      if (slot->labels[i].status == MS_ON) {
+        placed[slot->labels[i].layerindex]++;
+      }
+    }
+  }
+
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+    ProfiledLayers::iterator it = profiled->find(layer);
+
+    if (it == profiled->end()) {
+      continue;
+    }
+
+    ProfiledLayer &state = it->second;
+    if (layer->vtable == state.vtable) {
+      *(layer->vtable) = state.original;
+    }
+
+    state.profile.labels = labels[i];
+    state.profile.labels_placed = placed[i];
+    if (state.profile.opens || state.profile.labels) {
+      profiles.push_back(state.profile);
+    }
+  }
+
+  delete profiled;
+  profiled = NULL;
+}
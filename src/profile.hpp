@@ -0,0 +1,94 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_PROFILE_H__
+#define __NODE_MAPSERV_PROFILE_H__
+
+/**
+ * @file profile.hpp
+ * @brief This declares the per layer profiler.
+ */
+
+// Standard headers
+#include <string>
+#include <vector>
+
+// Mapserver headers
+#include "mapserver.h"
+
+#include "trace.h"
+
+/**
+ * @brief The timings collected for a layer during a request
+ *
+ * Times are in nanoseconds.
+ */
+struct LayerProfile {
+  /// The layer index
+  int index;
+  /// The layer name
+  std::string name;
+  /// The number of times the layer was opened
+  int opens;
+  /// The time spent opening the layer
+  trace_time_t open;
+  /// The time spent selecting shapes
+  trace_time_t which_shapes;
+  /// The time spent reading shapes
+  trace_time_t fetch;
+  /// The time spent processing (i.e. drawing) shapes once read
+  trace_time_t draw;
+  /// The time spent closing the layer
+  trace_time_t close;
+  /// The number of shapes read
+  int features;
+  /// The number of labels added to the label cache
+  int labels;
+  /// The number of cached labels that were placed
+  int labels_placed;
+};
+
+/**
+ * @brief Collects timings for each layer of a map in the current thread
+ *
+ * The data access functions in the virtual table of each layer are wrapped
+ * with functions that time them.  The time spent drawing a layer is the time
+ * between selecting shapes and closing the layer, less the time spent reading
+ * shapes.  Labels are placed for all layers at once so only their number is
+ * reported per layer.
+ */
+class LayerProfiler {
+public:
+
+  /// Start profiling the layers of a map
+  static void Attach(mapObj *map);
+
+  /// Stop profiling and retrieve the timings
+  static void Detach(mapObj *map, std::vector<LayerProfile> &profiles);
+};
+
+#endif  /* __NODE_MAPSERV_PROFILE_H__ */
@@ -0,0 +1,234 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file projcache.cpp
+ * @brief This defines the `ProjectionCache` class.
+ */
+
+#include <string>
+#include <map>
+#include <set>
+
+#include "projcache.hpp"
+#include "mapthread.h"
+
+// The cache relies on POSIX thread specific data
+#if defined(USE_PROJ) && !defined(_WIN32)
+#define PROJECTION_CACHE 1
+#include <pthread.h>
+#endif
+
+/// The maximum number of projections cached by each thread
+#define PROJECTION_CACHE_SIZE 256
+
+volatile long ProjectionCache::hits = 0;
+volatile long ProjectionCache::misses = 0;
+volatile long ProjectionCache::entries = 0;
+
+#ifdef PROJECTION_CACHE
+
+/// The projections cached by a single thread
+struct ThreadCache {
+#if PJ_VERSION >= 480
+  /// The PROJ context used by this thread
+  projCtx context;
+#endif
+  /// The projections keyed by their definition
+  std::map<std::string, projPJ> projections;
+  /// The projections owned by the cache
+  std::set<projPJ> owned;
+};
+
+/// The key used to retrieve the cache for the current thread
+static pthread_key_t cache_key;
+/// Ensures the key is only created once
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/// Free a thread's cache when the thread exits
+static void freeThreadCache(void *data) {
+  ThreadCache *cache = static_cast<ThreadCache *>(data);
+
+  for (std::set<projPJ>::iterator it = cache->owned.begin(); it != cache->owned.end(); ++it) {
+    pj_free(*it);
+  }
+  __sync_fetch_and_sub(&ProjectionCache::entries, cache->owned.size());
+#if PJ_VERSION >= 480
+  pj_ctx_free(cache->context);
+#endif
+  delete cache;
+}
+
+/// Create the thread specific data key
+static void createCacheKey() {
+  pthread_key_create(&cache_key, freeThreadCache);
+}
+
+/// Get the cache for the current thread, creating it if necessary
+static ThreadCache* getThreadCache() {
+  ThreadCache *cache;
+
+  pthread_once(&cache_key_once, createCacheKey);
+  cache = static_cast<ThreadCache *>(pthread_getspecific(cache_key));
+  if (!cache) {
+    cache = new ThreadCache();
+#if PJ_VERSION >= 480
+    cache->context = pj_ctx_alloc();
+#endif
+    pthread_setspecific(cache_key, cache);
+  }
+  return cache;
+}
+
+#endif  /* PROJECTION_CACHE */
+
+/**
+ * @details This is called from the module initialisation function
+ * when the module is first loaded by Node. It should only be called
+ * once per process.
+ *
+ * @param target The object representing the module.
+ */
+void ProjectionCache::Init(Handle<Object> target) {
+  NODE_SET_METHOD(target, "projectionCacheStats", Stats);
+}
+
+/**
+ * @details This copies the definition of `src` into `dst`, which must not
+ * have been initialised, and then initialises `dst`.  If `cache` is `true`
+ * the initialised projection is retrieved from the cache for the current
+ * thread, otherwise it is initialised by Mapserver as usual.  Automatic
+ * projections are never cached as Mapserver replaces them when the data
+ * source is opened.
+ *
+ * @param dst The projection to initialise.
+ *
+ * @param src The projection to copy.
+ *
+ * @param cache Should the cache be used?
+ *
+ * @return `MS_SUCCESS` or `MS_FAILURE`.
+ */
+int ProjectionCache::Attach(projectionObj *dst, projectionObj *src, bool cache) {
+#ifdef USE_PROJ
+  for (int i = 0; i < src->numargs; ++i) {
+    dst->args[i] = msStrdup(src->args[i]);
+  }
+  dst->numargs = src->numargs;
+
+  if (!dst->numargs) {
+    return MS_SUCCESS;
+  }
+
+#ifdef PROJECTION_CACHE
+  if (cache && strcasecmp(dst->args[0], "AUTO")) {
+    ThreadCache *entries = getThreadCache();
+    std::string key;
+
+    for (int i = 0; i < dst->numargs; ++i) {
+      key += (i ? " " : "");
+      key += dst->args[i];
+    }
+
+    std::map<std::string, projPJ>::iterator it = entries->projections.find(key);
+    if (it != entries->projections.end()) {
+      __sync_fetch_and_add(&hits, 1);
+      dst->proj = it->second;
+      return MS_SUCCESS;
+    }
+
+    __sync_fetch_and_add(&misses, 1);
+    if (entries->projections.size() < PROJECTION_CACHE_SIZE) {
+      projPJ proj;
+
+      msAcquireLock(TLOCK_PROJ);
+#if PJ_VERSION >= 480
+      proj = pj_init_ctx(entries->context, dst->numargs, dst->args);
+#else
+      proj = pj_init(dst->numargs, dst->args);
+#endif
+      msReleaseLock(TLOCK_PROJ);
+
+      if (proj) {
+        entries->projections[key] = proj;
+        entries->owned.insert(proj);
+        __sync_fetch_and_add(&ProjectionCache::entries, 1);
+        dst->proj = proj;
+        return MS_SUCCESS;
+      }
+      // fall through and let Mapserver report the error
+    }
+  }
+#endif  /* PROJECTION_CACHE */
+
+  if (msProcessProjection(dst) != 0) {
+    return MS_FAILURE;
+  }
+#endif  /* USE_PROJ */
+  return MS_SUCCESS;
+}
+
+/**
+ * @details This must be called on every projection passed to `Attach`
+ * before it is freed, and in the same thread.  It leaves projections that
+ * are not owned by the cache untouched.
+ *
+ * @param projection The projection to detach.
+ */
+void ProjectionCache::Detach(projectionObj *projection) {
+#ifdef PROJECTION_CACHE
+  ThreadCache *cache;
+
+  if (!projection->proj) {
+    return;
+  }
+
+  pthread_once(&cache_key_once, createCacheKey);
+  cache = static_cast<ThreadCache *>(pthread_getspecific(cache_key));
+  if (cache && cache->owned.count(projection->proj)) {
+    projection->proj = NULL;    // so it is not freed with the map
+  }
+#endif
+}
+
+/**
+ * @details This returns an object literal with the following properties:
+ *
+ * - `hits`: the number of projections retrieved from the cache
+ * - `misses`: the number of projections that had to be initialised
+ * - `entries`: the number of projections currently cached across all threads
+ */
+Handle<Value> ProjectionCache::Stats(const Arguments& args) {
+  HandleScope scope;
+  Local<Object> stats = Object::New();
+
+  stats->Set(String::NewSymbol("hits"), Number::New(hits));
+  stats->Set(String::NewSymbol("misses"), Number::New(misses));
+  stats->Set(String::NewSymbol("entries"), Number::New(entries));
+
+  return scope.Close(stats);
+}
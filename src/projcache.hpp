@@ -0,0 +1,83 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_PROJCACHE_H__
+#define __NODE_MAPSERV_PROJCACHE_H__
+
+/**
+ * @file projcache.hpp
+ * @brief This declares a per thread cache of initialised projections.
+ */
+
+// Node headers
+#include <v8.h>
+#include <node.h>
+
+// Mapserver headers
+#include "mapserver.h"
+
+using namespace v8;
+
+/**
+ * @brief A cache of initialised PROJ projections for each worker thread
+ *
+ * Mapserver initialises a projection with `pj_init` every time a map is
+ * copied, which entails parsing the definition and potentially reading
+ * `init` files such as `epsg`.  This cache allows the copies made for each
+ * request to use projections that have already been initialised by the same
+ * thread.
+ *
+ * Projection objects are not thread safe so each thread has its own cache
+ * (and its own PROJ context where available).  Cached projections belong to
+ * the cache: they must be detached from a map before the map is freed.
+ */
+class ProjectionCache {
+public:
+
+  /// Initialise the class
+  static void Init(Handle<Object> target);
+
+  /// Copy and initialise a projection, optionally using the cache
+  static int Attach(projectionObj *dst, projectionObj *src, bool cache);
+
+  /// Detach a projection that may have been initialised from the cache
+  static void Detach(projectionObj *projection);
+
+  /// Return the cache statistics to javascript
+  static Handle<Value> Stats(const Arguments& args);
+
+private:
+
+  /// The number of projections retrieved from the cache
+  static volatile long hits;
+  /// The number of projections that were not in the cache
+  static volatile long misses;
+  /// The number of projections held by all caches
+  static volatile long entries;
+};
+
+#endif  /* __NODE_MAPSERV_PROJCACHE_H__ */
@@ -0,0 +1,465 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file rendercache.cpp
+ * @brief This defines the `RenderCache` and `QuadTree` classes.
+ */
+
+#include <float.h>
+#include <string.h>
+
+#include "rendercache.hpp"
+
+using std::string;
+
+/// The maximum depth of a quadtree
+#define QUADTREE_MAX_DEPTH 24
+
+/// Does one rectangle contain another?
+static bool contains(const rectObj &outer, const rectObj &inner) {
+  return (inner.minx >= outer.minx && inner.maxx <= outer.maxx
+          && inner.miny >= outer.miny && inner.maxy <= outer.maxy);
+}
+
+/// Are the coordinates of a rectangle finite?  Infinities and NaNs do not
+/// survive subtraction from themselves.
+static bool finite(const rectObj &rect) {
+  return (rect.minx - rect.minx == 0 && rect.miny - rect.miny == 0
+          && rect.maxx - rect.maxx == 0 && rect.maxy - rect.maxy == 0);
+}
+
+/// Do two rectangles intersect?  Touching rectangles do.
+static bool intersects(const rectObj &a, const rectObj &b) {
+  return (a.minx <= b.maxx && a.maxx >= b.minx
+          && a.miny <= b.maxy && a.maxy >= b.miny);
+}
+
+QuadTree::Node::Node(const rectObj &bounds, int depth) :
+  bounds(bounds),
+  depth(depth)
+{
+  memset(children, 0, sizeof(children));
+}
+
+QuadTree::Node::~Node() {
+  for (int i = 0; i < 4; ++i) {
+    delete children[i];
+  }
+}
+
+/**
+ * @param node The node to divide.
+ *
+ * @param rect The rectangle.
+ *
+ * @param bounds Set to the bounds of the quadrant.
+ *
+ * @return The index of the quadrant, or -1 if the rectangle straddles
+ * quadrants.
+ */
+int QuadTree::Quadrant(const Node *node, const rectObj &rect, rectObj *bounds) {
+  double midx = (node->bounds.minx + node->bounds.maxx) / 2;
+  double midy = (node->bounds.miny + node->bounds.maxy) / 2;
+
+  for (int i = 0; i < 4; ++i) {
+    bounds->minx = (i & 1) ? midx : node->bounds.minx;
+    bounds->maxx = (i & 1) ? node->bounds.maxx : midx;
+    bounds->miny = (i & 2) ? midy : node->bounds.miny;
+    bounds->maxy = (i & 2) ? node->bounds.maxy : midy;
+
+    if (contains(*bounds, rect)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void QuadTree::Insert(Node *node, uint64_t id, const rectObj &rect) {
+  rectObj bounds;
+  int quadrant;
+
+  while (node->depth < QUADTREE_MAX_DEPTH && (quadrant = Quadrant(node, rect, &bounds)) >= 0) {
+    if (!node->children[quadrant]) {
+      node->children[quadrant] = new Node(bounds, node->depth + 1);
+    }
+    node = node->children[quadrant];
+  }
+  node->items.push_back(std::make_pair(id, rect));
+}
+
+/**
+ * @details If the rectangle lies outside the tree, the tree is rebuilt with
+ * a root large enough to contain it.  No root can contain a rectangle with
+ * infinite or NaN coordinates, so such rectangles are rejected.
+ *
+ * @param id The identifier of the rectangle.
+ *
+ * @param rect The rectangle.
+ *
+ * @return `false` if the rectangle was not added.
+ */
+bool QuadTree::Insert(uint64_t id, const rectObj &rect) {
+  if (!finite(rect)) {
+    return false;
+  }
+
+  while (!root || !contains(root->bounds, rect)) {
+    std::vector< std::pair<uint64_t, rectObj> > items;
+    rectObj bounds = rect;
+    double size;
+
+    if (root) {
+      Collect(root, items);
+      bounds.minx = MS_MIN(bounds.minx, root->bounds.minx);
+      bounds.miny = MS_MIN(bounds.miny, root->bounds.miny);
+      bounds.maxx = MS_MAX(bounds.maxx, root->bounds.maxx);
+      bounds.maxy = MS_MAX(bounds.maxy, root->bounds.maxy);
+      delete root;
+    }
+
+    // a square with room to grow
+    size = MS_MAX(bounds.maxx - bounds.minx, bounds.maxy - bounds.miny) * 2;
+    if (size <= 0) {
+      size = 1;
+    }
+    bounds.maxx = bounds.minx + size;
+    bounds.maxy = bounds.miny + size;
+
+    root = new Node(bounds, 0);
+    for (size_t i = 0; i < items.size(); ++i) {
+      Insert(root, items[i].first, items[i].second);
+    }
+  }
+
+  Insert(root, id, rect);
+  return true;
+}
+
+/**
+ * @param id The identifier of the rectangle.
+ *
+ * @param rect The rectangle, as passed to `Insert`.
+ */
+void QuadTree::Remove(uint64_t id, const rectObj &rect) {
+  Node *node = root;
+
+  while (node) {
+    for (size_t i = 0; i < node->items.size(); ++i) {
+      if (node->items[i].first == id) {
+        node->items.erase(node->items.begin() + i);
+        return;
+      }
+    }
+
+    rectObj bounds;
+    int quadrant = Quadrant(node, rect, &bounds);
+    node = (quadrant >= 0) ? node->children[quadrant] : NULL;
+  }
+}
+
+void QuadTree::Collect(const Node *node, std::vector< std::pair<uint64_t, rectObj> > &items) {
+  items.insert(items.end(), node->items.begin(), node->items.end());
+  for (int i = 0; i < 4; ++i) {
+    if (node->children[i]) {
+      Collect(node->children[i], items);
+    }
+  }
+}
+
+void QuadTree::Query(const Node *node, const rectObj &rect, std::vector<uint64_t> &ids) {
+  if (!intersects(node->bounds, rect)) {
+    return;
+  }
+
+  for (size_t i = 0; i < node->items.size(); ++i) {
+    if (intersects(node->items[i].second, rect)) {
+      ids.push_back(node->items[i].first);
+    }
+  }
+  for (int i = 0; i < 4; ++i) {
+    if (node->children[i]) {
+      Query(node->children[i], rect, ids);
+    }
+  }
+}
+
+/**
+ * @param rect The extent.
+ *
+ * @param ids Populated with the identifiers of intersecting rectangles.
+ */
+void QuadTree::Query(const rectObj &rect, std::vector<uint64_t> &ids) const {
+  if (root) {
+    Query(root, rect, ids);
+  }
+}
+
+size_t RenderCache::Entry::Footprint() const {
+  size_t footprint = sizeof(Entry) + key.size() + size + content_type.size() + srs.size();
+
+  for (std::set<string>::const_iterator it = layers.begin(); it != layers.end(); ++it) {
+    footprint += it->size();
+  }
+  return footprint;
+}
+
+RenderCache::RenderCache() :
+  capacity(0),
+  used(0),
+  next_id(1),
+  generation(0)
+{
+  uv_mutex_init(&mutex);
+}
+
+RenderCache::~RenderCache() {
+  while (!entries.empty()) {
+    Remove(entries.begin()->second);
+  }
+  for (std::map<string, QuadTree*>::iterator it = indexes.begin(); it != indexes.end(); ++it) {
+    delete it->second;
+  }
+  uv_mutex_destroy(&mutex);
+}
+
+/**
+ * @details The least recently used entries are dropped if the cache no
+ * longer fits.
+ *
+ * @param capacity The maximum size in bytes.
+ */
+void RenderCache::Configure(size_t capacity) {
+  uv_mutex_lock(&mutex);
+  this->capacity = capacity;
+  while (used > capacity && !recent.empty()) {
+    Remove(entries[recent.back()]);
+  }
+  uv_mutex_unlock(&mutex);
+}
+
+bool RenderCache::Enabled() {
+  bool enabled;
+
+  uv_mutex_lock(&mutex);
+  enabled = (capacity > 0);
+  uv_mutex_unlock(&mutex);
+  return enabled;
+}
+
+/**
+ * @details An image rendered from data read before an invalidation may be
+ * stale, so `Put` only caches images rendered within a single generation.
+ */
+uint64_t RenderCache::Generation() {
+  uint64_t current;
+
+  uv_mutex_lock(&mutex);
+  current = generation;
+  uv_mutex_unlock(&mutex);
+  return current;
+}
+
+size_t RenderCache::Used() {
+  size_t bytes;
+
+  uv_mutex_lock(&mutex);
+  bytes = used;
+  uv_mutex_unlock(&mutex);
+  return bytes;
+}
+
+/**
+ * @param key The key identifying the image.
+ *
+ * @param data Set to a copy of the image data.
+ *
+ * @param size Set to the size of the data.
+ *
+ * @param content_type Set to the mime type of the image.
+ *
+ * @return `false` if the image is not cached.
+ */
+bool RenderCache::Get(const string &key, unsigned char **data, size_t *size, string &content_type) {
+  uv_mutex_lock(&mutex);
+  std::map<string, uint64_t>::iterator it = keys.find(key);
+  if (it == keys.end()) {
+    uv_mutex_unlock(&mutex);
+    return false;
+  }
+
+  Entry *entry = entries[it->second];
+  recent.splice(recent.begin(), recent, entry->recent);
+  *data = static_cast<unsigned char *>(msSmallMalloc(entry->size));
+  memcpy(*data, entry->data, entry->size);
+  *size = entry->size;
+  content_type = entry->content_type;
+  uv_mutex_unlock(&mutex);
+  return true;
+}
+
+/**
+ * @param key The key identifying the image.
+ *
+ * @param data The image data, which is copied.
+ *
+ * @param size The size of the data.
+ *
+ * @param content_type The mime type of the image.
+ *
+ * @param srs The projection of `extent`, or empty for that of the map.
+ *
+ * @param extent The extent of the image.
+ *
+ * @param layers The names and groups of the layers drawn.
+ *
+ * @param generation The generation when rendering started.
+ */
+void RenderCache::Put(const string &key, const unsigned char *data, size_t size,
+                      const string &content_type, const string &srs,
+                      const rectObj &extent, const std::set<string> &layers,
+                      uint64_t generation) {
+  if (!finite(extent)) {
+    return;                     // the image could never be invalidated
+  }
+
+  uv_mutex_lock(&mutex);
+  if (!capacity || generation != this->generation || size > capacity) {
+    uv_mutex_unlock(&mutex);
+    return;
+  }
+
+  std::map<string, uint64_t>::iterator existing = keys.find(key);
+  if (existing != keys.end()) {
+    Remove(entries[existing->second]);
+  }
+
+  Entry *entry = new Entry();
+  entry->id = next_id++;
+  entry->key = key;
+  entry->data = static_cast<unsigned char *>(msSmallMalloc(size));
+  memcpy(entry->data, data, size);
+  entry->size = size;
+  entry->content_type = content_type;
+  entry->srs = srs;
+  entry->extent = extent;
+  entry->layers = layers;
+  recent.push_front(entry->id);
+  entry->recent = recent.begin();
+
+  QuadTree *&index = indexes[srs];
+  if (!index) {
+    index = new QuadTree();
+  }
+  index->Insert(entry->id, extent);
+
+  entries[entry->id] = entry;
+  keys[key] = entry->id;
+  used += entry->Footprint();
+
+  while (used > capacity && !recent.empty()) {
+    Remove(entries[recent.back()]);
+  }
+  uv_mutex_unlock(&mutex);
+}
+
+/**
+ * @details An empty projection represents that of the map.
+ */
+std::set<string> RenderCache::Projections() {
+  std::set<string> projections;
+
+  uv_mutex_lock(&mutex);
+  for (std::map<string, QuadTree*>::iterator it = indexes.begin(); it != indexes.end(); ++it) {
+    projections.insert(it->first);
+  }
+  uv_mutex_unlock(&mutex);
+  return projections;
+}
+
+/**
+ * @details This also starts a new generation so that images being rendered
+ * while invalidating are not cached.
+ *
+ * @param layers The layer names or groups, or `NULL` for any layer.
+ *
+ * @param extents The extent to invalidate in each projection, or `NULL` for
+ * everywhere.  Images in projections missing from the map are all dropped.
+ *
+ * @param bytes Set to the number of bytes freed.
+ *
+ * @return The number of images dropped.
+ */
+size_t RenderCache::Invalidate(const std::set<string> *layers,
+                               const std::map<string, rectObj> *extents,
+                               size_t *bytes) {
+  rectObj everywhere = { -DBL_MAX, -DBL_MAX, DBL_MAX, DBL_MAX };
+  std::vector<uint64_t> ids;
+  size_t dropped = 0;
+
+  *bytes = 0;
+  uv_mutex_lock(&mutex);
+  generation++;
+
+  for (std::map<string, QuadTree*>::iterator it = indexes.begin(); it != indexes.end(); ++it) {
+    std::map<string, rectObj>::const_iterator extent;
+    bool limited = extents && (extent = extents->find(it->first)) != extents->end();
+
+    it->second->Query(limited ? extent->second : everywhere, ids);
+  }
+
+  for (size_t i = 0; i < ids.size(); ++i) {
+    Entry *entry = entries[ids[i]];
+    bool drawn = !layers;
+
+    for (std::set<string>::const_iterator it = entry->layers.begin(); !drawn && it != entry->layers.end(); ++it) {
+      drawn = (layers->count(*it) > 0);
+    }
+
+    if (drawn) {
+      *bytes += Remove(entry);
+      dropped++;
+    }
+  }
+  uv_mutex_unlock(&mutex);
+
+  return dropped;
+}
+
+size_t RenderCache::Remove(Entry *entry) {
+  size_t footprint = entry->Footprint();
+
+  indexes[entry->srs]->Remove(entry->id, entry->extent);
+  keys.erase(entry->key);
+  recent.erase(entry->recent);
+  entries.erase(entry->id);
+  used -= footprint;
+
+  msFree(entry->data);
+  delete entry;
+  return footprint;
+}
@@ -0,0 +1,190 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_RENDERCACHE_H__
+#define __NODE_MAPSERV_RENDERCACHE_H__
+
+/**
+ * @file rendercache.hpp
+ * @brief This declares the cache of images rendered by `Map.render`.
+ *
+ * Entries are indexed by the layers they drew and by their extent, so that
+ * when data changes only the images it affects need be dropped.  Each
+ * projection that images are requested in has its own quadtree of extents.
+ */
+
+// Standard headers
+#include <stdint.h>
+#include <string>
+#include <set>
+#include <map>
+#include <list>
+#include <vector>
+
+// Libuv headers
+#include <uv.h>
+
+// Mapserver headers
+#include "mapserver.h"
+
+/**
+ * @brief A quadtree of identified rectangles
+ *
+ * Each rectangle is stored in the deepest node that wholly contains it.  The
+ * root grows to contain rectangles inserted outside it.
+ */
+class QuadTree {
+public:
+
+  QuadTree() :
+    root(NULL)
+  {
+  }
+
+  ~QuadTree() {
+    delete root;
+  }
+
+  /// Add a rectangle, returning `false` if its coordinates are not finite
+  bool Insert(uint64_t id, const rectObj &rect);
+
+  /// Remove a rectangle added by `Insert`
+  void Remove(uint64_t id, const rectObj &rect);
+
+  /// Find the rectangles intersecting an extent
+  void Query(const rectObj &rect, std::vector<uint64_t> &ids) const;
+
+private:
+
+  /// A node in the tree
+  struct Node {
+    rectObj bounds;
+    int depth;
+    std::vector< std::pair<uint64_t, rectObj> > items;
+    Node *children[4];
+
+    Node(const rectObj &bounds, int depth);
+    ~Node();
+  };
+
+  Node *root;
+
+  /// Get the quadrant of a node wholly containing a rectangle, or -1
+  static int Quadrant(const Node *node, const rectObj &rect, rectObj *bounds);
+
+  /// Add a rectangle below a node
+  static void Insert(Node *node, uint64_t id, const rectObj &rect);
+
+  /// Collect the items below a node
+  static void Collect(const Node *node, std::vector< std::pair<uint64_t, rectObj> > &items);
+
+  /// Find the rectangles below a node intersecting an extent
+  static void Query(const Node *node, const rectObj &rect, std::vector<uint64_t> &ids);
+};
+
+/**
+ * @brief A size bounded, least recently used cache of rendered images
+ *
+ * All methods are thread safe.
+ */
+class RenderCache {
+public:
+
+  RenderCache();
+  ~RenderCache();
+
+  /// Set the maximum size of the cache in bytes, 0 disabling it
+  void Configure(size_t capacity);
+
+  /// Is the cache enabled?
+  bool Enabled();
+
+  /// Get the current generation, which changes on every invalidation
+  uint64_t Generation();
+
+  /// Get the number of bytes used by cached images
+  size_t Used();
+
+  /// Copy a cached image into a buffer allocated with `msSmallMalloc`
+  bool Get(const std::string &key, unsigned char **data, size_t *size, std::string &content_type);
+
+  /// Add a copy of an image rendered during a generation
+  void Put(const std::string &key, const unsigned char *data, size_t size,
+           const std::string &content_type, const std::string &srs,
+           const rectObj &extent, const std::set<std::string> &layers,
+           uint64_t generation);
+
+  /// Get the projections in which images are cached
+  std::set<std::string> Projections();
+
+  /// Drop the images intersecting extents and drawing any of some layers
+  size_t Invalidate(const std::set<std::string> *layers,
+                    const std::map<std::string, rectObj> *extents,
+                    size_t *bytes);
+
+private:
+
+  /// A cached image
+  struct Entry {
+    uint64_t id;
+    std::string key;
+    unsigned char *data;
+    size_t size;
+    std::string content_type;
+    std::string srs;
+    rectObj extent;
+    std::set<std::string> layers;
+    std::list<uint64_t>::iterator recent;
+
+    /// The memory used by the entry
+    size_t Footprint() const;
+  };
+
+  /// Guards the members below it
+  uv_mutex_t mutex;
+  /// The maximum size of the cache in bytes
+  size_t capacity;
+  /// The current size of the cache in bytes
+  size_t used;
+  /// The identifier of the next entry
+  uint64_t next_id;
+  /// Incremented on every invalidation
+  uint64_t generation;
+  /// The entries by identifier
+  std::map<uint64_t, Entry*> entries;
+  /// The entry identifiers by key
+  std::map<std::string, uint64_t> keys;
+  /// The entry identifiers, most recently used first
+  std::list<uint64_t> recent;
+  /// The extents of the entries in each projection
+  std::map<std::string, QuadTree*> indexes;
+
+  /// Remove an entry, returning its footprint
+  size_t Remove(Entry *entry);
+};
+
+#endif  /* __NODE_MAPSERV_RENDERCACHE_H__ */
@@ -0,0 +1,521 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file slowlog.cpp
+ * @brief This defines the `SlowLog` class.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "slowlog.hpp"
+#include "mapserver.h"
+
+/// The replacement for redacted values
+#define REDACTED "REDACTED"
+
+/// The maximum number of entries waiting to be written to the log file:
+/// further entries are not written until the writer catches up
+#define PENDING_SIZE 1024
+
+volatile trace_time_t SlowLog::threshold = 0;
+uv_mutex_t SlowLog::mutex;
+std::deque<SlowRequest *> SlowLog::entries;
+size_t SlowLog::size = 100;
+std::vector<std::string> SlowLog::redact;
+std::string SlowLog::path;
+uv_cond_t SlowLog::cond;
+std::deque< std::pair<std::string, std::string> > SlowLog::pending;
+bool SlowLog::writing = false;
+uv_thread_t SlowLog::writer;
+
+/// Add the names that are always redacted to the rules
+static void addDefaultRules(std::vector<std::string> &rules) {
+  rules.push_back("HTTP_COOKIE");
+  rules.push_back("HTTP_AUTHORIZATION");
+}
+
+/// Compare two strings case insensitively
+static bool equalsNoCase(const std::string &a, const std::string &b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (tolower(a[i]) != tolower(b[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Is a name matched by one of the rules?
+static bool matches(const std::vector<std::string> &rules, const std::string &name) {
+  for (std::vector<std::string>::const_iterator it = rules.begin(); it != rules.end(); ++it) {
+    if (equalsNoCase(*it, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Decode a URL encoded parameter name
+static std::string decodeName(const std::string &name) {
+  std::string decoded;
+
+  for (size_t i = 0; i < name.size(); ++i) {
+    if (name[i] == '+') {
+      decoded += ' ';
+    } else if (name[i] == '%' && i + 2 < name.size()
+               && isxdigit(name[i + 1]) && isxdigit(name[i + 2])) {
+      char hex[3] = { name[i + 1], name[i + 2], 0 };
+      decoded += static_cast<char>(strtol(hex, NULL, 16));
+      i += 2;
+    } else {
+      decoded += name[i];
+    }
+  }
+  return decoded;
+}
+
+/// Redact the values of matching parameters in a URL encoded string
+static std::string redactParams(const std::vector<std::string> &rules, const std::string &params) {
+  std::string result;
+  size_t start = 0;
+
+  while (start <= params.size()) {
+    size_t end = params.find('&', start);
+    if (end == std::string::npos) {
+      end = params.size();
+    }
+
+    std::string pair = params.substr(start, end - start);
+    size_t equals = pair.find('=');
+    if (equals != std::string::npos && matches(rules, decodeName(pair.substr(0, equals)))) {
+      pair = pair.substr(0, equals + 1) + REDACTED;
+    }
+
+    result += (start ? "&" : "") + pair;
+    start = end + 1;
+  }
+  return result;
+}
+
+/// Get the name of an XML element or attribute without its namespace prefix
+static std::string localName(const std::string &name) {
+  size_t colon = name.find(':');
+  return (colon == std::string::npos) ? name : name.substr(colon + 1);
+}
+
+/**
+ * Redact the content of elements and the values of attributes named by the
+ * rules in an XML document
+ *
+ * This is a simple scanner rather than a parser: it only needs to find names
+ * in the well formed XML of OGC requests.
+ */
+static std::string redactXml(const std::vector<std::string> &rules, const std::string &xml) {
+  std::string result;
+  size_t pos = 0;
+
+  while (pos < xml.size()) {
+    size_t open = xml.find('<', pos), end;
+    if (open == std::string::npos) {
+      result.append(xml, pos, std::string::npos);
+      break;
+    }
+    result.append(xml, pos, open - pos);
+
+    // pass over comments, CDATA sections, declarations and end tags
+    if (xml.compare(open, 4, "<!--") == 0) {
+      end = xml.find("-->", open);
+      end = (end == std::string::npos) ? xml.size() : end + 3;
+    } else if (xml.compare(open, 9, "<![CDATA[") == 0) {
+      end = xml.find("]]>", open);
+      end = (end == std::string::npos) ? xml.size() : end + 3;
+    } else if (open + 1 < xml.size() && (xml[open + 1] == '!' || xml[open + 1] == '?' || xml[open + 1] == '/')) {
+      end = xml.find('>', open);
+      end = (end == std::string::npos) ? xml.size() : end + 1;
+    } else {
+      end = open;
+    }
+    if (end != open) {
+      result.append(xml, open, end - open);
+      pos = end;
+      continue;
+    }
+
+    // a start tag: redact the values of matching attributes
+    size_t i = xml.find_first_of(" \t\r\n/>", open + 1);
+    if (i == std::string::npos) {
+      i = xml.size();
+    }
+    std::string element = xml.substr(open + 1, i - open - 1);
+    bool empty = false;
+
+    result.append(xml, open, i - open);
+    while (i < xml.size() && xml[i] != '>') {
+      end = xml.find_first_of("= \t\r\n/>\"'", i);
+      if (end == std::string::npos) {
+        end = xml.size();
+      }
+      if (end == i) {
+        empty = (xml[i] == '/');
+        result += xml[i++];
+        continue;
+      }
+
+      std::string attribute = xml.substr(i, end - i);
+      result.append(xml, i, end - i);
+      i = end;
+      if (i + 1 < xml.size() && xml[i] == '=' && (xml[i + 1] == '"' || xml[i + 1] == '\'')) {
+        char quote = xml[i + 1];
+        size_t close = xml.find(quote, i + 2);
+        if (close == std::string::npos) {
+          close = xml.size();
+        }
+
+        result += xml.substr(i, 2);
+        if (matches(rules, localName(attribute))) {
+          result += REDACTED;
+        } else {
+          result.append(xml, i + 2, close - i - 2);
+        }
+        if (close < xml.size()) {
+          result += quote;
+        }
+        i = close + 1;
+      }
+    }
+    if (i < xml.size()) {
+      result += xml[i++];         // the closing `>`
+    }
+    pos = i;
+
+    // redact the content of a matching element
+    if (!empty && matches(rules, localName(element))) {
+      size_t close = xml.find("</" + element, pos);
+      if (close != std::string::npos) {
+        result += REDACTED;
+        pos = close;
+      }
+    }
+  }
+  return result;
+}
+
+/// Escape a string for inclusion in JSON
+static std::string quote(const std::string &value) {
+  std::string result = "\"";
+
+  for (std::string::const_iterator it = value.begin(); it != value.end(); ++it) {
+    unsigned char c = *it;
+    switch (c) {
+    case '"': result += "\\\""; break;
+    case '\\': result += "\\\\"; break;
+    case '\n': result += "\\n"; break;
+    case '\r': result += "\\r"; break;
+    case '\t': result += "\\t"; break;
+    default:
+      if (c < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        result += escaped;
+      } else {
+        result += c;
+      }
+    }
+  }
+  return result + "\"";
+}
+
+/**
+ * @details This is called from the module initialisation function
+ * when the module is first loaded by Node. It should only be called
+ * once per process.
+ *
+ * @param target The object representing the module.
+ */
+void SlowLog::Init(Handle<Object> target) {
+  uv_mutex_init(&mutex);
+  uv_cond_init(&cond);
+  addDefaultRules(redact);
+
+  NODE_SET_METHOD(target, "slowLogConfigure", Configure);
+  NODE_SET_METHOD(target, "slowLogDrain", Drain);
+}
+
+/**
+ * @details This takes ownership of `request`.  It is called from worker
+ * threads: the request is redacted and serialised without holding `mutex`,
+ * and writing it to the log file is left to the writer thread.
+ *
+ * @param request The slow request.
+ */
+void SlowLog::Record(SlowRequest *request) {
+  std::vector<std::string> rules;
+  std::string file;
+
+  uv_mutex_lock(&mutex);
+  rules = redact;
+  file = path;
+  uv_mutex_unlock(&mutex);
+
+  Redact(request, rules);
+  std::string json = file.empty() ? "" : ToJSON(request);
+
+  uv_mutex_lock(&mutex);
+  if (!file.empty() && pending.size() < PENDING_SIZE) {
+    pending.push_back(std::pair<std::string, std::string>(file, json));
+    uv_cond_signal(&cond);
+  }
+
+  entries.push_back(request);
+  while (entries.size() > size) {
+    delete entries.front();
+    entries.pop_front();
+  }
+
+  uv_mutex_unlock(&mutex);
+}
+
+/**
+ * @details This is the entry point of the thread started when a log file is
+ * first configured.  It appends whatever entries are pending as a batch,
+ * opening each file once per batch, and then waits for more.
+ *
+ * @param arg Unused.
+ */
+void SlowLog::Writer(void *arg) {
+  uv_mutex_lock(&mutex);
+  for (;;) {
+    while (pending.empty()) {
+      uv_cond_wait(&cond, &mutex);
+    }
+
+    std::deque< std::pair<std::string, std::string> > batch;
+    batch.swap(pending);
+    uv_mutex_unlock(&mutex);
+
+    FILE *log = NULL;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (!i || batch[i].first != batch[i - 1].first) {
+        if (log) {
+          fclose(log);
+        }
+        log = fopen(batch[i].first.c_str(), "a");
+      }
+      if (log) {
+        fprintf(log, "%s\n", batch[i].second.c_str());
+      }
+    }
+    if (log) {
+      fclose(log);
+    }
+
+    uv_mutex_lock(&mutex);
+  }
+}
+
+/**
+ * @details CGI variables named by a rule are redacted, as are request
+ * parameters named by a rule in the query string and in URL encoded request
+ * bodies, and elements and attributes named by a rule in XML request bodies.
+ * Bodies in any other format are redacted entirely.
+ *
+ * @param request The request to redact.
+ *
+ * @param rules The names whose values are redacted.
+ */
+void SlowLog::Redact(SlowRequest *request, const std::vector<std::string> &rules) {
+  for (std::map<std::string, std::string>::iterator it = request->env.begin(); it != request->env.end(); ++it) {
+    if (matches(rules, it->first)) {
+      it->second = REDACTED;
+    } else if (it->first == "QUERY_STRING") {
+      it->second = redactParams(rules, it->second);
+    }
+  }
+
+  std::map<std::string, std::string>::iterator type = request->env.find("CONTENT_TYPE");
+  if (!request->body.empty()) {
+    if (type != request->env.end()
+        && type->second.find("application/x-www-form-urlencoded") == 0) {
+      request->body = redactParams(rules, request->body);
+    } else if (type != request->env.end() && type->second.find("xml") != std::string::npos) {
+      request->body = redactXml(rules, request->body);
+    } else {
+      request->body = REDACTED; // an unknown format that cannot be inspected
+    }
+  }
+}
+
+/**
+ * @details The result is a single line of JSON with the same properties as
+ * the objects returned by `Drain`.
+ */
+std::string SlowLog::ToJSON(const SlowRequest *request) {
+  std::string json;
+  char number[64];
+
+  snprintf(number, sizeof(number), "{\"time\":%.0f,\"duration\":%.3f,\"queued\":%.3f",
+           request->time, request->duration, request->queued);
+  json += number;
+
+  json += ",\"phases\":{";
+  for (size_t i = 0; i < request->phases.size(); ++i) {
+    snprintf(number, sizeof(number), ":%.3f", request->phases[i].second);
+    json += (i ? "," : "") + quote(request->phases[i].first) + number;
+  }
+  json += "},\"map\":{\"name\":" + quote(request->map_name) + ",\"path\":" + quote(request->map_path) + "}";
+
+  json += ",\"env\":{";
+  for (std::map<std::string, std::string>::const_iterator it = request->env.begin(); it != request->env.end(); ++it) {
+    json += (it == request->env.begin() ? "" : ",") + quote(it->first) + ":" + quote(it->second);
+  }
+  json += "},\"body\":" + quote(request->body);
+
+  snprintf(number, sizeof(number), ",\"size\":%d", request->output_size);
+  json += ",\"contentType\":" + quote(request->content_type) + number;
+  if (!request->error.empty()) {
+    json += ",\"error\":" + quote(request->error);
+  }
+  return json + "}";
+}
+
+/**
+ * @details `args` should contain an object literal with the following
+ * optional properties:
+ *
+ * - `threshold`: the duration in milliseconds above which requests are
+ *   logged, 0 disabling the log
+ * - `size`: the maximum number of entries retained in memory
+ * - `redact`: an array of CGI variable, request parameter and XML element
+ *   or attribute names whose values are redacted in addition to the
+ *   `HTTP_COOKIE` and `HTTP_AUTHORIZATION` variables
+ * - `path`: a file to which entries are appended, or `null`
+ */
+Handle<Value> SlowLog::Configure(const Arguments& args) {
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsObject()) {
+    return ThrowException(Exception::TypeError(String::New("usage: slowRequests.configure(options)")));
+  }
+  Local<Object> options = args[0]->ToObject();
+
+  uv_mutex_lock(&mutex);
+  if (options->Has(String::NewSymbol("size"))) {
+    int value = options->Get(String::NewSymbol("size"))->Int32Value();
+    size = (value > 0) ? value : 1;
+    while (entries.size() > size) {
+      delete entries.front();
+      entries.pop_front();
+    }
+  }
+  if (options->Has(String::NewSymbol("redact"))) {
+    Local<Value> value = options->Get(String::NewSymbol("redact"));
+    redact.clear();
+    addDefaultRules(redact);
+    if (value->IsArray()) {
+      Local<Array> names = Local<Array>::Cast(value);
+      for (uint32_t i = 0; i < names->Length(); ++i) {
+        std::string name = *String::Utf8Value(names->Get(i)->ToString());
+        if (!matches(redact, name)) {
+          redact.push_back(name);
+        }
+      }
+    }
+  }
+  if (options->Has(String::NewSymbol("path"))) {
+    Local<Value> value = options->Get(String::NewSymbol("path"));
+    path = value->IsString() ? *String::Utf8Value(value) : "";
+    if (!path.empty() && !writing) {
+      writing = (uv_thread_create(&writer, Writer, NULL) == 0);
+      if (!writing) {
+        path.clear();
+        uv_mutex_unlock(&mutex);
+        return ThrowException(Exception::Error(String::New("Could not start the slow request log writer")));
+      }
+    }
+  }
+  if (options->Has(String::NewSymbol("threshold"))) {
+    double value = options->Get(String::NewSymbol("threshold"))->NumberValue();
+    threshold = (value > 0) ? (trace_time_t) (value * 1e6) : 0;
+  }
+  uv_mutex_unlock(&mutex);
+
+  return Undefined();
+}
+
+/**
+ * @details This returns an array of the logged requests, oldest first, and
+ * empties the log.
+ */
+Handle<Value> SlowLog::Drain(const Arguments& args) {
+  HandleScope scope;
+  std::deque<SlowRequest *> drained;
+
+  uv_mutex_lock(&mutex);
+  drained.swap(entries);
+  uv_mutex_unlock(&mutex);
+
+  Local<Array> result = Array::New(drained.size());
+  for (size_t i = 0; i < drained.size(); ++i) {
+    SlowRequest *request = drained[i];
+    Local<Object> entry = Object::New();
+    Local<Object> phases = Object::New();
+    Local<Object> map = Object::New();
+    Local<Object> env = Object::New();
+
+    for (size_t j = 0; j < request->phases.size(); ++j) {
+      phases->Set(String::New(request->phases[j].first.c_str()), Number::New(request->phases[j].second));
+    }
+    map->Set(String::NewSymbol("name"), String::New(request->map_name.c_str()));
+    map->Set(String::NewSymbol("path"), String::New(request->map_path.c_str()));
+    for (std::map<std::string, std::string>::iterator it = request->env.begin(); it != request->env.end(); ++it) {
+      env->Set(String::New(it->first.c_str()), String::New(it->second.c_str()));
+    }
+
+    entry->Set(String::NewSymbol("time"), Date::New(request->time));
+    entry->Set(String::NewSymbol("duration"), Number::New(request->duration));
+    entry->Set(String::NewSymbol("queued"), Number::New(request->queued));
+    entry->Set(String::NewSymbol("phases"), phases);
+    entry->Set(String::NewSymbol("map"), map);
+    entry->Set(String::NewSymbol("env"), env);
+    entry->Set(String::NewSymbol("body"), String::New(request->body.c_str(), request->body.size()));
+    entry->Set(String::NewSymbol("contentType"), String::New(request->content_type.c_str()));
+    entry->Set(String::NewSymbol("size"), Integer::New(request->output_size));
+    if (!request->error.empty()) {
+      entry->Set(String::NewSymbol("error"), String::New(request->error.c_str()));
+    }
+    result->Set(i, entry);
+
+    delete request;
+  }
+
+  return scope.Close(result);
+}
@@ -0,0 +1,149 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_SLOWLOG_H__
+#define __NODE_MAPSERV_SLOWLOG_H__
+
+/**
+ * @file slowlog.hpp
+ * @brief This declares the slow request log.
+ */
+
+// Standard headers
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+// Node headers
+#include <v8.h>
+#include <node.h>
+
+#include "trace.h"
+
+using namespace v8;
+
+/**
+ * @brief A request that took longer than the configured threshold
+ *
+ * This holds everything needed to reproduce the request.
+ */
+struct SlowRequest {
+  /// When the request completed, in milliseconds since the epoch
+  double time;
+  /// The time from receipt of the request to its completion in milliseconds
+  double duration;
+  /// The time spent waiting for a worker thread in milliseconds
+  double queued;
+  /// The duration of each phase of the request in milliseconds
+  std::vector< std::pair<std::string, double> > phases;
+  /// The name of the map
+  std::string map_name;
+  /// The directory of the map
+  std::string map_path;
+  /// The CGI environment, redacted
+  std::map<std::string, std::string> env;
+  /// The request body, redacted
+  std::string body;
+  /// The Content-Type of the response
+  std::string content_type;
+  /// The size of the response body in bytes
+  int output_size;
+  /// The error message, if the request failed
+  std::string error;
+};
+
+/**
+ * @brief A bounded log of slow requests
+ *
+ * Requests exceeding the threshold are recorded by the worker thread that
+ * processed them.  Entries are retained in memory, from where they can be
+ * drained by javascript, and are optionally appended to a file as JSON lines
+ * by a dedicated writer thread so that worker threads never wait on the file.
+ * Values of CGI variables and request parameters named by the redaction rules
+ * are replaced before an entry is stored.
+ */
+class SlowLog {
+public:
+
+  /// Initialise the class
+  static void Init(Handle<Object> target);
+
+  /// Is the log enabled?
+  static bool Enabled() {
+    return threshold > 0;
+  }
+
+  /// Should a request of this duration be logged?
+  static bool IsSlow(trace_time_t duration) {
+    return threshold > 0 && duration >= threshold;
+  }
+
+  /// Record a slow request
+  static void Record(SlowRequest *request);
+
+  /// Configure the log from javascript
+  static Handle<Value> Configure(const Arguments& args);
+
+  /// Remove and return the logged requests to javascript
+  static Handle<Value> Drain(const Arguments& args);
+
+private:
+
+  /// The threshold in nanoseconds, or 0 when disabled
+  static volatile trace_time_t threshold;
+
+  /// Guards the members below
+  static uv_mutex_t mutex;
+  /// The logged requests, oldest first
+  static std::deque<SlowRequest *> entries;
+  /// The maximum number of entries retained
+  static size_t size;
+  /// The names whose values are redacted
+  static std::vector<std::string> redact;
+  /// The file entries are appended to, or empty
+  static std::string path;
+  /// Signalled when entries are pending
+  static uv_cond_t cond;
+  /// The file and JSON of each entry waiting to be written
+  static std::deque< std::pair<std::string, std::string> > pending;
+  /// Has the writer thread been started?
+  static bool writing;
+  /// The thread writing entries to the log file
+  static uv_thread_t writer;
+
+  /// Append pending entries to the log file
+  static void Writer(void *arg);
+
+  /// Redact the values in a request
+  static void Redact(SlowRequest *request, const std::vector<std::string> &rules);
+
+  /// Serialise an entry as JSON
+  static std::string ToJSON(const SlowRequest *request);
+};
+
+#endif  /* __NODE_MAPSERV_SLOWLOG_H__ */
@@ -0,0 +1,373 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file tiles.cpp
+ * @brief This defines the tile grid and the directory and MBTiles stores.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+#include <uv.h>
+#include <sqlite3.h>
+
+#include "tiles.hpp"
+
+using std::string;
+
+/**
+ * @param z The zoom level.
+ */
+double TileGrid::Resolution(int z) const {
+  return (extent[2] - extent[0]) / (tile_size * pow(2.0, z));
+}
+
+/**
+ * @param z The zoom level.
+ */
+int TileGrid::Columns(int z) const {
+  return (int) ceil((extent[2] - extent[0]) / (Resolution(z) * tile_size) - 1e-9);
+}
+
+/**
+ * @param z The zoom level.
+ */
+int TileGrid::Rows(int z) const {
+  return (int) ceil((extent[3] - extent[1]) / (Resolution(z) * tile_size) - 1e-9);
+}
+
+/**
+ * @details Tiles that merely touch the edges of `bbox` are excluded.
+ *
+ * @param z The zoom level.
+ *
+ * @param bbox The extent as `minx, miny, maxx, maxy`.
+ *
+ * @param minx, miny, maxx, maxy Set to the tile range.
+ *
+ * @return `false` if no tiles intersect the extent.
+ */
+bool TileGrid::Range(int z, const double *bbox, int *minx, int *miny, int *maxx, int *maxy) const {
+  double span = Resolution(z) * tile_size;
+  const double epsilon = 1e-9;
+
+  *minx = (int) floor((bbox[0] - extent[0]) / span + epsilon);
+  *maxx = (int) ceil((bbox[2] - extent[0]) / span - epsilon) - 1;
+  *miny = (int) floor((extent[3] - bbox[3]) / span + epsilon);
+  *maxy = (int) ceil((extent[3] - bbox[1]) / span - epsilon) - 1;
+
+  if (*minx < 0) *minx = 0;
+  if (*miny < 0) *miny = 0;
+  if (*maxx >= Columns(z)) *maxx = Columns(z) - 1;
+  if (*maxy >= Rows(z)) *maxy = Rows(z) - 1;
+
+  return (*minx <= *maxx && *miny <= *maxy);
+}
+
+/**
+ * @param z The zoom level.
+ *
+ * @param minx, miny, maxx, maxy The inclusive tile range.
+ *
+ * @param bbox Set to the extent of the outer edges of the tiles.
+ */
+void TileGrid::Extent(int z, int minx, int miny, int maxx, int maxy, double *bbox) const {
+  double span = Resolution(z) * tile_size;
+
+  bbox[0] = extent[0] + minx * span;
+  bbox[1] = extent[3] - (maxy + 1) * span;
+  bbox[2] = extent[0] + (maxx + 1) * span;
+  bbox[3] = extent[3] - miny * span;
+}
+
+/// Create a directory and any missing parents
+static bool makeDirectories(const string &path) {
+  struct stat info;
+
+  if (path.empty() || stat(path.c_str(), &info) == 0) {
+    return true;
+  }
+
+  size_t slash = path.find_last_of("/\\");
+  if (slash != string::npos && slash > 0 && !makeDirectories(path.substr(0, slash))) {
+    return false;
+  }
+
+  return (mkdir(path.c_str(), 0777) == 0 || errno == EEXIST);
+}
+
+/**
+ * @brief Writes tiles to `<path>/<z>/<x>/<y>.<extension>`
+ *
+ * Each tile is written to a temporary file which is then renamed, so an
+ * interrupted seed never leaves a partial tile in place.
+ */
+class DirectoryStore: public TileStore {
+public:
+
+  DirectoryStore(const string &path, const string &extension) :
+    path(path),
+    extension(extension)
+  {
+  }
+
+  bool Open(string &error) {
+    if (!makeDirectories(path)) {
+      error = "Could not create directory " + path + ": " + strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  bool Exists(int z, int x, int y) {
+    struct stat info;
+    return (stat(TilePath(z, x, y).c_str(), &info) == 0);
+  }
+
+  bool Write(const std::vector<Tile*> &tiles, string &error) {
+    for (std::vector<Tile*>::const_iterator it = tiles.begin(); it != tiles.end(); ++it) {
+      Tile *tile = *it;
+      string file = TilePath(tile->z, tile->x, tile->y);
+      string temp = file + ".tmp";
+      string parent = file.substr(0, file.find_last_of('/'));
+
+      if (!makeDirectories(parent)) {
+        error = "Could not create directory " + parent + ": " + strerror(errno);
+        return false;
+      }
+
+      FILE *stream = fopen(temp.c_str(), "wb");
+      if (!stream) {
+        error = "Could not open " + temp + ": " + strerror(errno);
+        return false;
+      }
+
+      bool written = (fwrite(tile->data, 1, tile->size, stream) == (size_t) tile->size);
+      if (fclose(stream) != 0 || !written) {
+        error = "Could not write " + temp + ": " + strerror(errno);
+        remove(temp.c_str());
+        return false;
+      }
+
+#ifdef _WIN32
+      remove(file.c_str());       // rename does not replace files
+#endif
+      if (rename(temp.c_str(), file.c_str()) != 0) {
+        error = "Could not rename " + temp + ": " + strerror(errno);
+        remove(temp.c_str());
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Close() {
+  }
+
+private:
+  string path;
+  string extension;
+
+  string TilePath(int z, int x, int y) const {
+    char name[64];
+    snprintf(name, sizeof(name), "/%d/%d/%d.", z, x, y);
+    return path + name + extension;
+  }
+};
+
+/**
+ * @brief Writes tiles to an MBTiles SQLite database
+ *
+ * Tiles are written in one transaction per batch.  The database uses
+ * write-ahead logging so that a second, read only, connection can check for
+ * existing tiles without waiting for the writer.  MBTiles numbers rows from
+ * the bottom of the grid, so rows are flipped using the number of rows at each
+ * zoom level.
+ */
+class MBTilesStore: public TileStore {
+public:
+
+  MBTilesStore(const string &path, const TileGrid &grid) :
+    path(path),
+    grid(grid),
+    db(NULL),
+    reader(NULL),
+    insert(NULL),
+    select(NULL)
+  {
+    uv_mutex_init(&mutex);
+  }
+
+  ~MBTilesStore() {
+    Close();
+    uv_mutex_destroy(&mutex);
+  }
+
+  bool Open(string &error) {
+    const char *schema =
+      "PRAGMA journal_mode = WAL;"
+      "PRAGMA synchronous = NORMAL;"
+      "CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);"
+      "CREATE UNIQUE INDEX IF NOT EXISTS name ON metadata (name);"
+      "CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER,"
+      " tile_row INTEGER, tile_data BLOB);"
+      "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles"
+      " (zoom_level, tile_column, tile_row);";
+
+    if (sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK
+        || sqlite3_exec(db, schema, NULL, NULL, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data)"
+                              " VALUES (?, ?, ?, ?)", -1, &insert, NULL) != SQLITE_OK) {
+      return Failed(db, error);
+    }
+
+    if (sqlite3_open_v2(path.c_str(), &reader, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(reader, "SELECT 1 FROM tiles WHERE zoom_level = ? AND tile_column = ?"
+                              " AND tile_row = ?", -1, &select, NULL) != SQLITE_OK) {
+      return Failed(reader, error);
+    }
+    return true;
+  }
+
+  bool Exists(int z, int x, int y) {
+    bool exists;
+
+    uv_mutex_lock(&mutex);
+    sqlite3_bind_int(select, 1, z);
+    sqlite3_bind_int(select, 2, x);
+    sqlite3_bind_int(select, 3, grid.Rows(z) - 1 - y);
+    exists = (sqlite3_step(select) == SQLITE_ROW);
+    sqlite3_reset(select);
+    uv_mutex_unlock(&mutex);
+
+    return exists;
+  }
+
+  bool Write(const std::vector<Tile*> &tiles, string &error) {
+    if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+      return Failed(db, error);
+    }
+
+    for (std::vector<Tile*>::const_iterator it = tiles.begin(); it != tiles.end(); ++it) {
+      Tile *tile = *it;
+
+      sqlite3_bind_int(insert, 1, tile->z);
+      sqlite3_bind_int(insert, 2, tile->x);
+      sqlite3_bind_int(insert, 3, grid.Rows(tile->z) - 1 - tile->y);
+      sqlite3_bind_blob(insert, 4, tile->data, tile->size, SQLITE_STATIC);
+      int status = sqlite3_step(insert);
+      sqlite3_reset(insert);
+
+      if (status != SQLITE_DONE) {
+        Failed(db, error);
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        return false;
+      }
+    }
+
+    if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+      return Failed(db, error);
+    }
+    return true;
+  }
+
+  bool SetMetadata(const std::map<string, string> &metadata, string &error) {
+    sqlite3_stmt *statement = NULL;
+
+    if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?)",
+                           -1, &statement, NULL) != SQLITE_OK) {
+      return Failed(db, error);
+    }
+
+    for (std::map<string, string>::const_iterator it = metadata.begin(); it != metadata.end(); ++it) {
+      sqlite3_bind_text(statement, 1, it->first.c_str(), -1, SQLITE_STATIC);
+      sqlite3_bind_text(statement, 2, it->second.c_str(), -1, SQLITE_STATIC);
+      int status = sqlite3_step(statement);
+      sqlite3_reset(statement);
+
+      if (status != SQLITE_DONE) {
+        sqlite3_finalize(statement);
+        return Failed(db, error);
+      }
+    }
+
+    sqlite3_finalize(statement);
+    return true;
+  }
+
+  void Close() {
+    sqlite3_finalize(select);
+    sqlite3_finalize(insert);
+    sqlite3_close(reader);
+    sqlite3_close(db);
+    select = insert = NULL;
+    reader = db = NULL;
+  }
+
+private:
+  string path;
+  TileGrid grid;
+  sqlite3 *db;
+  sqlite3 *reader;
+  sqlite3_stmt *insert;
+  sqlite3_stmt *select;
+  /// Guards `select`, which is used by the rendering threads
+  uv_mutex_t mutex;
+
+  bool Failed(sqlite3 *connection, string &error) {
+    error = path + ": " + (connection ? sqlite3_errmsg(connection) : "out of memory");
+    return false;
+  }
+};
+
+/**
+ * @param path The root directory, which is created if necessary.
+ *
+ * @param extension The file extension of the tiles.
+ */
+TileStore* TileStore::Directory(const string &path, const string &extension) {
+  return new DirectoryStore(path, extension);
+}
+
+/**
+ * @param path The database file, which is created if necessary.
+ *
+ * @param grid The grid of the tiles.
+ */
+TileStore* TileStore::MBTiles(const string &path, const TileGrid &grid) {
+  return new MBTilesStore(path, grid);
+}
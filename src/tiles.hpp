@@ -0,0 +1,119 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_TILES_H__
+#define __NODE_MAPSERV_TILES_H__
+
+/**
+ * @file tiles.hpp
+ * @brief This declares the tile grid and tile stores used when seeding.
+ *
+ * Tiles are addressed using the `z/x/y` scheme, with `y` increasing
+ * southwards from the top of the grid.  Tile stores are written to from a
+ * single thread but can be queried for existing tiles from any thread.
+ */
+
+// Standard headers
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+
+/// A grid of square tiles, halving in resolution with each zoom level
+struct TileGrid {
+  /// The projection of the grid e.g. `EPSG:3857`
+  std::string srs;
+  /// The extent of the grid as `minx, miny, maxx, maxy`
+  double extent[4];
+  /// The width and height of a tile in pixels
+  int tile_size;
+
+  /// Get the size of a pixel at a zoom level
+  double Resolution(int z) const;
+
+  /// Get the number of tiles spanning the grid horizontally at a zoom level
+  int Columns(int z) const;
+
+  /// Get the number of tiles spanning the grid vertically at a zoom level
+  int Rows(int z) const;
+
+  /// Get the inclusive range of tiles intersecting an extent
+  bool Range(int z, const double *bbox, int *minx, int *miny, int *maxx, int *maxy) const;
+
+  /// Get the extent of a range of tiles
+  void Extent(int z, int minx, int miny, int maxx, int maxy, double *bbox) const;
+};
+
+/// An encoded tile
+struct Tile {
+  int z, x, y;
+  /// The image data, allocated with `malloc`
+  unsigned char *data;
+  /// The size of the image data in bytes
+  int size;
+
+  Tile(int z, int x, int y, unsigned char *data, int size) :
+    z(z), x(x), y(y), data(data), size(size)
+  {
+  }
+
+  ~Tile() {
+    free(data);
+  }
+};
+
+/// A destination for seeded tiles
+class TileStore {
+public:
+
+  /// Create a store writing a `z/x/y` directory tree
+  static TileStore* Directory(const std::string &path, const std::string &extension);
+
+  /// Create a store writing an MBTiles file
+  static TileStore* MBTiles(const std::string &path, const TileGrid &grid);
+
+  virtual ~TileStore() {}
+
+  /// Open the store for writing, returning `false` and setting `error` on failure
+  virtual bool Open(std::string &error) = 0;
+
+  /// Check whether a tile has already been stored
+  virtual bool Exists(int z, int x, int y) = 0;
+
+  /// Write a batch of tiles, returning `false` and setting `error` on failure
+  virtual bool Write(const std::vector<Tile*> &tiles, std::string &error) = 0;
+
+  /// Record a description of the tiles, where the store supports it
+  virtual bool SetMetadata(const std::map<std::string, std::string> &metadata, std::string &error) {
+    return true;
+  }
+
+  /// Close the store
+  virtual void Close() = 0;
+};
+
+#endif  /* __NODE_MAPSERV_TILES_H__ */
@@ -0,0 +1,285 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file trace.cpp
+ * @brief This defines the request tracing facilities.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+
+#include "trace.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#define TRACE_TLS __declspec(thread)
+#define TRACE_INCREMENT(P) InterlockedIncrement64((volatile LONGLONG *)(P))
+#define TRACE_CAS(P, O, N) (InterlockedCompareExchangePointer((PVOID volatile *)(P), (N), (O)) == (O))
+#define TRACE_BARRIER() MemoryBarrier()
+#else
+#define TRACE_TLS __thread
+#define TRACE_INCREMENT(P) __sync_add_and_fetch((P), 1)
+#define TRACE_CAS(P, O, N) __sync_bool_compare_and_swap((P), (O), (N))
+#define TRACE_BARRIER() __sync_synchronize()
+#endif
+
+using namespace v8;
+
+/// A recorded span
+struct TraceEvent {
+  /// The span name: always a string literal
+  const char *name;
+  /// The request the span belongs to
+  trace_time_t request;
+  /// The start time in nanoseconds
+  trace_time_t start;
+  /// The end time in nanoseconds
+  trace_time_t end;
+  /// Is the span independent of the recording thread?
+  int async;
+};
+
+/// The spans recorded by a single thread
+struct TraceRing {
+  /// The spans, written by the owning thread only
+  TraceEvent events[TRACE_RING_SIZE];
+  /// The number of spans ever written
+  volatile trace_time_t head;
+  /// The identifier used for the thread in the trace
+  int tid;
+  /// Is this the main (javascript) thread?
+  bool main;
+  /// The next ring in the registry
+  TraceRing *next;
+};
+
+volatile int trace_enabled = 0;
+
+/// The registry of rings, added to but never removed from
+static TraceRing * volatile rings = NULL;
+/// The number of rings created
+static volatile trace_time_t ring_count = 0;
+/// The number of requests traced
+static volatile trace_time_t request_count = 0;
+/// Spans starting before this time are not exported
+static volatile trace_time_t trace_since = 0;
+/// The main thread
+static unsigned long main_thread = 0;
+
+/// The ring of the current thread
+static TRACE_TLS TraceRing *thread_ring = NULL;
+/// The request being processed by the current thread
+static TRACE_TLS trace_time_t thread_request = 0;
+
+/// Get the ring for the current thread, creating and registering it if
+/// necessary
+static TraceRing* getRing(void) {
+  TraceRing *ring = thread_ring;
+
+  if (ring) {
+    return ring;
+  }
+
+  ring = static_cast<TraceRing *>(calloc(1, sizeof(TraceRing)));
+  if (!ring) {
+    return NULL;
+  }
+  ring->tid = (int) TRACE_INCREMENT(&ring_count);
+  ring->main = (uv_thread_self() == main_thread);
+
+  do {
+    ring->next = rings;
+  } while (!TRACE_CAS(&rings, ring->next, ring));
+
+  thread_ring = ring;
+  return ring;
+}
+
+/// Write a span to the ring of the current thread
+static void record(const char *name, trace_time_t request, trace_time_t start, trace_time_t end, int async) {
+  TraceRing *ring = getRing();
+
+  if (!ring) {
+    return;
+  }
+
+  TraceEvent *event = &(ring->events[ring->head % TRACE_RING_SIZE]);
+  event->name = name;
+  event->request = request;
+  event->start = start;
+  event->end = end;
+  event->async = async;
+
+  TRACE_BARRIER();              // publish the event before the new head
+  ring->head = ring->head + 1;
+}
+
+trace_time_t traceNow(void) {
+  return uv_hrtime();
+}
+
+trace_time_t traceNewRequest(void) {
+  return TRACE_INCREMENT(&request_count);
+}
+
+void traceSetRequest(trace_time_t request) {
+  thread_request = request;
+}
+
+void traceSpan(const char *name, trace_time_t request, trace_time_t start, trace_time_t end) {
+  record(name, request, start, end, 0);
+}
+
+void traceAsyncSpan(const char *name, trace_time_t request, trace_time_t start, trace_time_t end) {
+  record(name, request, start, end, 1);
+}
+
+void traceCurrentSpan(const char *name, trace_time_t start) {
+  if (thread_request) {
+    record(name, thread_request, start, traceNow(), 0);
+  }
+}
+
+/// Append a formatted string to `json`
+static void append(std::string &json, const char *format, ...) {
+  char buffer[512];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  json += buffer;
+}
+
+/**
+ * @details This serialises the spans retained by every thread to a Chrome
+ * trace event JSON document.  Rings are read while other threads may be
+ * writing to them: spans overwritten during the read are discarded.
+ */
+static std::string dump(void) {
+  std::string json = "{\"traceEvents\":[";
+  int pid = getpid();
+  bool first = true;
+
+  for (TraceRing *ring = rings; ring; ring = ring->next) {
+    std::vector<TraceEvent> events;
+    trace_time_t head, from, valid;
+
+    head = ring->head;
+    TRACE_BARRIER();
+    from = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    for (trace_time_t i = from; i < head; ++i) {
+      events.push_back(ring->events[i % TRACE_RING_SIZE]);
+    }
+    TRACE_BARRIER();
+    valid = (ring->head > TRACE_RING_SIZE) ? ring->head - TRACE_RING_SIZE : 0;
+
+    append(json, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+           "\"args\":{\"name\":\"%s %d\"}}",
+           first ? "" : ",", pid, ring->tid, ring->main ? "main" : "worker", ring->tid);
+    first = false;
+
+    for (trace_time_t i = from; i < head; ++i) {
+      const TraceEvent &event = events[i - from];
+
+      if (i < valid || event.start < trace_since) {
+        continue;               // overwritten while reading, or cleared
+      }
+
+      if (event.async) {
+        append(json, ",{\"name\":\"%s\",\"cat\":\"mapserv\",\"ph\":\"b\",\"id\":%llu,"
+               "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+               event.name, (unsigned long long) event.request,
+               event.start / 1000.0, pid, ring->tid);
+        append(json, ",{\"name\":\"%s\",\"cat\":\"mapserv\",\"ph\":\"e\",\"id\":%llu,"
+               "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+               event.name, (unsigned long long) event.request,
+               event.end / 1000.0, pid, ring->tid);
+      } else {
+        append(json, ",{\"name\":\"%s\",\"cat\":\"mapserv\",\"ph\":\"X\","
+               "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"request\":%llu}}",
+               event.name, event.start / 1000.0, (event.end - event.start) / 1000.0,
+               pid, ring->tid, (unsigned long long) event.request);
+      }
+    }
+  }
+
+  json += "],\"displayTimeUnit\":\"ms\"}";
+  return json;
+}
+
+/// Enable or disable tracing from javascript
+static Handle<Value> Enable(const Arguments& args) {
+  HandleScope scope;
+
+  trace_enabled = (args.Length() > 0 && args[0]->BooleanValue()) ? 1 : 0;
+  return Undefined();
+}
+
+/// Discard the spans recorded so far
+static Handle<Value> Clear(const Arguments& args) {
+  HandleScope scope;
+
+  trace_since = traceNow();
+  return Undefined();
+}
+
+/// Return the recorded spans as a Chrome trace event JSON string
+static Handle<Value> Dump(const Arguments& args) {
+  HandleScope scope;
+  std::string json = dump();
+
+  return scope.Close(String::New(json.c_str(), json.size()));
+}
+
+/**
+ * @details This is called from the module initialisation function in the
+ * main thread, which it records.
+ *
+ * @param target The object representing the module.
+ */
+void TraceInit(Handle<Object> target) {
+  main_thread = uv_thread_self();
+
+  NODE_SET_METHOD(target, "traceEnable", Enable);
+  NODE_SET_METHOD(target, "traceClear", Clear);
+  NODE_SET_METHOD(target, "traceDump", Dump);
+}
@@ -0,0 +1,95 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef NODE_MAPSERV_TRACE_H
+#define NODE_MAPSERV_TRACE_H
+
+/**
+ * @file trace.h
+ * @brief This declares the request tracing facilities.
+ *
+ * When tracing is enabled the lifecycle of each request is recorded as a
+ * series of timed spans: the time spent queued for a worker thread, the
+ * phases of the work performed in that thread and the callback run in the
+ * main thread.  Spans are written without locking to a ring buffer owned by
+ * the recording thread and can be exported in the Chrome trace event format
+ * (as read by `chrome://tracing` and Perfetto).
+ *
+ * The functions are C so they can be used by `node-mapservutil.c`.  When
+ * tracing is disabled the cost of instrumentation is a single test of
+ * `trace_enabled`.
+ */
+
+#ifdef __cplusplus
+#include <v8.h>
+#include <node.h>
+#endif
+
+/* `uint64_t` without requiring C99 headers under MSVC */
+#ifdef _MSC_VER
+typedef unsigned __int64 trace_time_t;
+#else
+#include <stdint.h>
+typedef uint64_t trace_time_t;
+#endif
+
+/** The number of spans retained by each thread */
+#define TRACE_RING_SIZE 8192
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Non-zero when spans are being recorded */
+extern volatile int trace_enabled;
+
+/** Get the current time in nanoseconds */
+trace_time_t traceNow(void);
+
+/** Allocate an identifier for a new request */
+trace_time_t traceNewRequest(void);
+
+/** Set the request being processed by the current thread (0 for none) */
+void traceSetRequest(trace_time_t request);
+
+/** Record a span for a request in the current thread */
+void traceSpan(const char *name, trace_time_t request, trace_time_t start, trace_time_t end);
+
+/** Record a span for a request that is not tied to a thread e.g. queueing */
+void traceAsyncSpan(const char *name, trace_time_t request, trace_time_t start, trace_time_t end);
+
+/** Record a span ending now for the request set by `traceSetRequest` */
+void traceCurrentSpan(const char *name, trace_time_t start);
+
+#ifdef __cplusplus
+}
+
+/** Initialise the javascript tracing functions */
+void TraceInit(v8::Handle<v8::Object> target);
+#endif
+
+#endif /* NODE_MAPSERV_TRACE_H */
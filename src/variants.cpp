@@ -0,0 +1,343 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * @file variants.cpp
+ * @brief This defines the `VariantCache` class.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+#include "variants.hpp"
+
+using std::string;
+
+/// The maximum number of variants cached for a map
+#define MAP_VARIANTS 16
+
+/// The number of keys seen once that are remembered
+#define MAP_VARIANTS_SEEN (4 * MAP_VARIANTS)
+
+/// Does a parameter alter the map as a URL override or class group?
+static bool isCustomisation(const char *name) {
+  return (strncasecmp(name, "map_", 4) == 0 || strncasecmp(name, "map.", 4) == 0
+          || strncasecmp(name, "classgroup", 10) == 0);
+}
+
+/// Can a character appear in a runtime substitution tag?
+static bool isTagChar(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == '.' || c == ':';
+}
+
+/// Get a string in lower case
+static string lowerCase(const string &text) {
+  string lower(text);
+  for (size_t i = 0; i < lower.length(); ++i) {
+    lower[i] = tolower(static_cast<unsigned char>(lower[i]));
+  }
+  return lower;
+}
+
+VariantCache::VariantCache() :
+  scanned(false),
+  scanning(false),
+  used(0)
+{
+  uv_mutex_init(&mutex);
+}
+
+VariantCache::~VariantCache() {
+  uv_mutex_destroy(&mutex);
+}
+
+/// Add the candidate runtime substitution tags in some text to a set
+static void findTags(const char *text, std::set<string> &tags) {
+  const char *start = text ? strchr(text, '%') : NULL;
+
+  while (start) {
+    const char *end = strchr(start + 1, '%');
+    if (!end) {
+      break;
+    }
+
+    const char *i = start + 1;
+    while (i < end && isTagChar(*i)) {
+      ++i;
+    }
+    if (i == end && end > start + 1) {
+      tags.insert(lowerCase(string(start + 1, end - start - 1)));
+      start = strchr(end + 1, '%');
+    } else {
+      start = end;              // the closing `%` may open a tag
+    }
+  }
+}
+
+/// Add the candidate runtime substitution tags in the values of a hash table
+static void findTags(hashTableObj *table, std::set<string> &tags) {
+  for (const char *key = msFirstKeyFromHashTable(table); key; key = msNextKeyFromHashTable(table, key)) {
+    findTags(msLookupHashTable(table, key), tags);
+  }
+}
+
+/**
+ * @details The map is searched for text enclosed by `%` characters in the
+ * settings that `msApplySubstitutions` rewrites: the data, tile index,
+ * connection, filter and bind values of layers, the expressions, text and
+ * titles of their classes, the options of output formats and the templates
+ * of the map.  The layer processing directives are also searched.  Every
+ * candidate is kept, so some may not be tags, but no tag is missed.
+ *
+ * @param map The map to search.
+ *
+ * @param tags Populated with the tags, in lower case.
+ */
+void VariantCache::Scan(mapObj *map, std::set<string> &tags) {
+  for (int i = 0; i < map->numlayers; ++i) {
+    layerObj *layer = GET_LAYER(map, i);
+
+    findTags(layer->data, tags);
+    findTags(layer->tileindex, tags);
+    findTags(layer->connection, tags);
+    findTags(layer->filter.string, tags);
+    findTags(&(layer->bindvals), tags);
+    for (int p = 0; p < layer->numprocessing; ++p) {
+      findTags(layer->processing[p], tags);
+    }
+
+    for (int c = 0; c < layer->numclasses; ++c) {
+      classObj *klass = layer->_class[c];
+
+      findTags(klass->expression.string, tags);
+      findTags(klass->text.string, tags);
+      findTags(klass->title, tags);
+    }
+  }
+
+  for (int i = 0; i < map->numoutputformats; ++i) {
+    outputFormatObj *format = map->outputformatlist[i];
+
+    for (int o = 0; o < format->numformatoptions; ++o) {
+      findTags(format->formatoptions[o], tags);
+    }
+  }
+
+  findTags(map->web._template, tags); // `template` in C
+  findTags(map->web.header, tags);
+  findTags(map->web.footer, tags);
+}
+
+/**
+ * @details The key is made of the URL overrides, class groups and the
+ * parameters named by runtime substitution tags in the map, in the order
+ * they are applied.  Any other parameter leaves the prepared map unchanged.
+ * No key is produced for immutable maps, whose copies are not customised,
+ * for requests that do not customise the map, for overrides of projections
+ * or while the map is searched for tags.  The map is searched by the
+ * first request, outside the mutex as every layer and class is visited, and
+ * requests made meanwhile do not use variants.
+ *
+ * @param map The map the request applies to.
+ *
+ * @param request The request parameters.
+ *
+ * @param key Set to the key.
+ *
+ * @return Can the request use a variant?
+ */
+bool VariantCache::Key(mapObj *map, cgiRequestObj *request, string &key) {
+  if (msLookupHashTable(&(map->web.validation), "immutable")) {
+    return false;
+  }
+
+  uv_mutex_lock(&mutex);
+  bool scan = !scanned && !scanning, usable = scanned;
+  scanning = scanning || scan;
+  uv_mutex_unlock(&mutex);
+
+  if (scan) {
+    // other requests do not wait on the search
+    std::set<string> found;
+    Scan(map, found);
+    usable = true;
+
+    uv_mutex_lock(&mutex);
+    tags.swap(found);
+    scanned = true;
+    scanning = false;
+    uv_mutex_unlock(&mutex);
+  }
+
+  if (!usable) {
+    return false;               // also while another request is scanning
+  }
+
+  key.clear();
+  for (int i = 0; i < request->NumParams; ++i) {
+    const char *name = request->ParamNames[i];
+
+    if (isCustomisation(name)
+        && (lowerCase(name).find("projection") != string::npos
+            || lowerCase(request->ParamValues[i]).find("projection") != string::npos)) {
+      return false;             // copies attach the projections of the map itself
+    }
+    if (!isCustomisation(name) && !tags.count(lowerCase(name))) {
+      continue;
+    }
+    key += name;
+    key.push_back('\0');
+    key += request->ParamValues[i];
+    key.push_back('\0');
+  }
+  return !key.empty();          // uncustomised requests copy the map itself
+}
+
+/**
+ * @param key The key of the variant.
+ *
+ * @param prepare Set to `true` if the variant is not cached but its key has
+ * been seen before, in which case the caller should prepare it.
+ *
+ * @return The variant, or `NULL` if it is not cached.
+ */
+MapVariant* VariantCache::Acquire(const string &key, bool *prepare) {
+  MapVariant *variant = NULL;
+
+  *prepare = false;
+  uv_mutex_lock(&mutex);
+  std::map<string, MapVariant*>::iterator it = variants.find(key);
+  if (it != variants.end()) {
+    variant = it->second;
+    variant->refs++;
+    recent.remove(variant);
+    recent.push_front(variant);
+  } else {
+    std::list<string>::iterator found = std::find(seen.begin(), seen.end(), key);
+    if (found != seen.end()) {
+      seen.erase(found);
+      *prepare = true;
+    } else {
+      seen.push_front(key);
+      if (seen.size() > MAP_VARIANTS_SEEN) {
+        seen.pop_back();
+      }
+    }
+  }
+  uv_mutex_unlock(&mutex);
+
+  return variant;
+}
+
+/**
+ * @details If another request has added a variant with the same key in the
+ * meantime, that one is referenced instead and `variant` is unused.  The
+ * least recently used variants are evicted to make room.
+ *
+ * @param variant The prepared variant, which the cache takes ownership of.
+ *
+ * @param unused Populated with the variants to be freed by the caller.
+ *
+ * @return The cached variant.
+ */
+MapVariant* VariantCache::Add(MapVariant *variant, std::vector<MapVariant*> &unused) {
+  uv_mutex_lock(&mutex);
+  std::map<string, MapVariant*>::iterator it = variants.find(variant->key);
+  if (it != variants.end()) {
+    unused.push_back(variant);
+    variant = it->second;
+  } else {
+    variant->evicted = false;
+    variant->refs = 0;
+    variants[variant->key] = variant;
+    used += variant->size;
+  }
+  variant->refs++;
+  recent.remove(variant);
+  recent.push_front(variant);
+
+  while (recent.size() > MAP_VARIANTS) {
+    Evict(recent.back(), unused);
+  }
+  uv_mutex_unlock(&mutex);
+
+  return variant;
+}
+
+/**
+ * @param variant A variant returned by `Acquire` or `Add`.
+ *
+ * @param unused Populated with the variant if it should now be freed.
+ */
+void VariantCache::Release(MapVariant *variant, std::vector<MapVariant*> &unused) {
+  uv_mutex_lock(&mutex);
+  if (--variant->refs == 0 && variant->evicted) {
+    unused.push_back(variant);
+  }
+  uv_mutex_unlock(&mutex);
+}
+
+/**
+ * @param unused Populated with the variants to be freed by the caller.
+ */
+void VariantCache::Clear(std::vector<MapVariant*> &unused) {
+  uv_mutex_lock(&mutex);
+  while (!recent.empty()) {
+    Evict(recent.back(), unused);
+  }
+  seen.clear();
+  uv_mutex_unlock(&mutex);
+}
+
+size_t VariantCache::Used() {
+  size_t size;
+
+  uv_mutex_lock(&mutex);
+  size = used;
+  uv_mutex_unlock(&mutex);
+
+  return size;
+}
+
+/**
+ * @details A variant still referenced by a request is freed when it is
+ * released.  The mutex must be held.
+ *
+ * @param variant The variant to remove.
+ *
+ * @param unused Populated with the variant if it should now be freed.
+ */
+void VariantCache::Evict(MapVariant *variant, std::vector<MapVariant*> &unused) {
+  recent.remove(variant);
+  variants.erase(variant->key);
+  used -= variant->size;
+  variant->evicted = true;
+  if (variant->refs == 0) {
+    unused.push_back(variant);
+  }
+}
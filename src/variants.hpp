@@ -0,0 +1,132 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+#ifndef __NODE_MAPSERV_VARIANTS_H__
+#define __NODE_MAPSERV_VARIANTS_H__
+
+/**
+ * @file variants.hpp
+ * @brief This declares the cache of customised copies of a map.
+ *
+ * Requests carrying the same URL overrides, `classgroup` or runtime
+ * substitutions customise their copy of a map in the same way.  The cache
+ * keeps such copies once prepared, so that later requests are copied from
+ * one instead of being copied from the map and updated again.
+ */
+
+// Standard headers
+#include <string>
+#include <set>
+#include <map>
+#include <list>
+#include <vector>
+
+// Libuv headers
+#include <uv.h>
+
+// Mapserver headers
+#include "mapserver.h"
+extern "C" {
+#include "mapserv.h"
+}
+
+/// A map as prepared for requests with the same customising parameters
+struct MapVariant {
+  /// The customising parameters
+  std::string key;
+  /// The prepared map, which is read only
+  mapObj *map;
+  /// A skeleton of `map` from which request copies are made
+  mapObj *skeleton;
+  /// The estimated size of `map`
+  size_t size;
+  /// The number of requests copying the variant
+  int refs;
+  /// Has the variant been removed from the cache?
+  bool evicted;
+};
+
+/**
+ * @brief A least recently used cache of the variants of a map
+ *
+ * A variant is only prepared the second time its key is seen, so that
+ * requests whose customisations are never repeated do not pay for it.
+ * Variants are reference counted while requests copy them: those no longer
+ * cached or referenced are handed back to the caller to be freed, as freeing
+ * them involves the map.  All methods are thread safe.
+ */
+class VariantCache {
+public:
+
+  VariantCache();
+  ~VariantCache();
+
+  /// Get the key of the parameters of a request that customise a map
+  bool Key(mapObj *map, cgiRequestObj *request, std::string &key);
+
+  /// Find a variant and reference it, noting whether it should be prepared
+  MapVariant* Acquire(const std::string &key, bool *prepare);
+
+  /// Add a prepared variant and reference it
+  MapVariant* Add(MapVariant *variant, std::vector<MapVariant*> &unused);
+
+  /// Release a reference to a variant
+  void Release(MapVariant *variant, std::vector<MapVariant*> &unused);
+
+  /// Remove all variants, which must not be referenced
+  void Clear(std::vector<MapVariant*> &unused);
+
+  /// Get the estimated size of the cached variants
+  size_t Used();
+
+private:
+
+  /// Guards the members below it
+  uv_mutex_t mutex;
+  /// Has the map been searched for runtime substitution tags?
+  bool scanned;
+  /// Is a request searching the map for tags?
+  bool scanning;
+  /// The runtime substitution tags of the map, in lower case
+  std::set<std::string> tags;
+  /// The estimated size of the cached variants
+  size_t used;
+  /// The variants by key
+  std::map<std::string, MapVariant*> variants;
+  /// The cached variants, most recently used first
+  std::list<MapVariant*> recent;
+  /// The keys seen once, most recently seen first
+  std::list<std::string> seen;
+
+  /// Find the runtime substitution tags of a map
+  static void Scan(mapObj *map, std::set<std::string> &tags);
+
+  /// Remove a variant from the cache
+  void Evict(MapVariant *variant, std::vector<MapVariant*> &unused);
+};
+
+#endif  /* __NODE_MAPSERV_VARIANTS_H__ */
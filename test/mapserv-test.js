@@ -41,8 +41,12 @@
 var vows = require('vows'),
     assert = require('assert'),
     fs = require('fs'),
+    os = require('os'),
     path = require('path'),
     buffer = require('buffer'),
+    zlib = require('zlib'),
+    http = require('http'),
+    child_process = require('child_process'),
     mapserv;
 
 // Load node-mapserv.  We cause a failure the first time to ensure that certain
@@ -86,6 +90,20 @@ function dummyRequest() {
     return req;
 }
 
+// Ensure two raw images have the same pixels, allowing for the rounding of
+// antialiased edges drawn in separate pieces
+function assertSamePixels(expected, actual) {
+    var i, diff = 0;
+    assert.equal(actual.width, expected.width);
+    assert.equal(actual.height, expected.height);
+    assert.equal(actual.stride, expected.stride);
+    assert.equal(actual.data.length, expected.data.length);
+    for (i = 0; i < expected.data.length; i++) {
+        diff = Math.max(diff, Math.abs(expected.data[i] - actual.data[i]));
+    }
+    assert.isTrue(diff <= 2, 'pixels differ by up to ' + diff);
+}
+
 // Ensure a Mapserver error has the expected interface
 function assertMapserverError(expected, actual, stack) {
     assert.instanceOf(actual, Error);
@@ -147,6 +165,62 @@ vows.describe('mapserv').addBatch({
                     assert.isFunction(mapserv);
                 }
             },
+            'which has the prototype property `handle`': {
+                topic: function (Mapserv) {
+                    return Mapserv.prototype.handle || false;
+                },
+                'which is a method': function (handle) {
+                    assert.isFunction(handle);
+                }
+            },
+            'which has the prototype property `render`': {
+                topic: function (Mapserv) {
+                    return Mapserv.prototype.render || false;
+                },
+                'which is a method': function (render) {
+                    assert.isFunction(render);
+                }
+            },
+            'which has the prototype property `warm`': {
+                topic: function (Mapserv) {
+                    return Mapserv.prototype.warm || false;
+                },
+                'which is a method': function (warm) {
+                    assert.isFunction(warm);
+                }
+            },
+            'which has the prototype property `analyze`': {
+                topic: function (Mapserv) {
+                    return Mapserv.prototype.analyze || false;
+                },
+                'which is a method': function (analyze) {
+                    assert.isFunction(analyze);
+                }
+            },
+            'which has the prototype property `invalidate`': {
+                topic: function (Mapserv) {
+                    return Mapserv.prototype.invalidate || false;
+                },
+                'which is a method': function (invalidate) {
+                    assert.isFunction(invalidate);
+                }
+            },
+            'which has the prototype property `seed`': {
+                topic: function (Mapserv) {
+                    return Mapserv.prototype.seed || false;
+                },
+                'which is a method': function (seed) {
+                    assert.isFunction(seed);
+                }
+            },
+            'which has the prototype property `dispose`': {
+                topic: function (Mapserv) {
+                    return Mapserv.prototype.dispose || false;
+                },
+                'which is a method': function (dispose) {
+                    assert.isFunction(dispose);
+                }
+            },
             'which acts as a constructor': {
                 'requiring at least one argument': function (Map) {
                     var err;
@@ -234,6 +308,39 @@ vows.describe('mapserv').addBatch({
             }
         },
 
+        'should have a `createHandler` property': {
+            topic: function (mapserv) {
+                return mapserv.createHandler;
+            },
+            'which is a function': function (func) {
+                assert.isFunction(func);
+            }
+        },
+
+        'should have a `tracing` property': {
+            topic: function (mapserv) {
+                return mapserv.tracing;
+            },
+            'which is an object': function (tracing) {
+                assert.isObject(tracing);
+                assert.isFunction(tracing.enable);
+                assert.isFunction(tracing.disable);
+                assert.isFunction(tracing.clear);
+                assert.isFunction(tracing.dump);
+            }
+        },
+
+        'should have a `slowRequests` property': {
+            topic: function (mapserv) {
+                return mapserv.slowRequests;
+            },
+            'which is an object': function (slowRequests) {
+                assert.isObject(slowRequests);
+                assert.isFunction(slowRequests.configure);
+                assert.isFunction(slowRequests.drain);
+            }
+        },
+
         'should have a `createCGIEnvironment` property': {
             topic: function (mapserv) {
                 return mapserv.createCGIEnvironment;
@@ -241,6 +348,22 @@ vows.describe('mapserv').addBatch({
             'which is a function': function (func) {
                 assert.isFunction(func);
             }
+        },
+
+        'should have a `projectionCacheStats` property': {
+            topic: function (mapserv) {
+                return mapserv.projectionCacheStats;
+            },
+            'which is a function': function (func) {
+                assert.isFunction(func);
+            },
+            'which returns the cache statistics': function (func) {
+                var stats = func();
+                assert.isObject(stats);
+                assert.isNumber(stats.hits);
+                assert.isNumber(stats.misses);
+                assert.isNumber(stats.entries);
+            }
         }
     }
 }).addBatch({
@@ -628,20 +751,60 @@ END",
             },
             'throwing an error': function (err) {
                 assert.instanceOf(err, Error);
-                assert.equal(err.message, 'usage: Map.mapserv(env, [body], callback)');
+                assert.equal(err.message, 'usage: Map.mapserv(env, [body], [options], callback)');
+            }
+        },
+        'works with options': {
+            topic: function (map) {
+                return typeof(map.mapserv({}, null, {compression: true}, function(err, response) {
+                    // do nothing
+                }));
+            },
+            'returning undefined when called': function (retval) {
+                assert.equal(retval, 'undefined');
             }
         },
-        'fails with four arguments': {
+        'requires an object for the options': {
             topic: function (map) {
                 try {
-                    return map.mapserv('1st', '2nd', '3rd', '4th');
+                    return map.mapserv({}, null, 'options', function(err, response) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, 'Argument 2 must be an object');
+            }
+        },
+        'requires a valid `compressionLevel` option': {
+            topic: function (map) {
+                try {
+                    return map.mapserv({}, null, {compressionLevel: 10}, function(err, response) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`compressionLevel` must be an integer between 1 and 9');
+            }
+        },
+        'fails with five arguments': {
+            topic: function (map) {
+                try {
+                    return map.mapserv('1st', '2nd', '3rd', '4th', '5th');
                 } catch (e) {
                     return e;
                 }
             },
             'throwing an error': function (err) {
                 assert.instanceOf(err, Error);
-                assert.equal(err.message, 'usage: Map.mapserv(env, [body], callback)');
+                assert.equal(err.message, 'usage: Map.mapserv(env, [body], [options], callback)');
             }
         },
         'requires an object for the first argument': {
@@ -742,6 +905,64 @@ END",
                 assertMapserverError('Layer to be modified not valid.', err);
             }
         },
+        'via `GET` with repeated class overrides': {
+            topic: function (map) {
+                var callback = this.callback,
+                    env = {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits&map.layer[credits].class[1]=NAME+%22overridden%22'
+                    };
+                // the second request applies the compiled overrides
+                map.mapserv(env, function (err, response) {
+                    if (err) return callback(err);
+                    map.mapserv(env, callback);
+                });
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.isTrue(response.data.length > 0);
+            }
+        },
+        'via `GET` repeatedly with the same class group': {
+            topic: function (map) {
+                var callback = this.callback,
+                    env = {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits&classgroup=group2'
+                    };
+                // the second request prepares a variant which the third copies
+                map.mapserv(env, function (err) {
+                    if (err) return callback(err);
+                    map.mapserv(env, function (err) {
+                        if (err) return callback(err);
+                        map.mapserv(env, function (err, response) {
+                            callback(err, response, map.memoryUsage());
+                        });
+                    });
+                });
+            },
+            'returns an image': function (err, response, usage) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.isTrue(response.data.length > 0);
+            },
+            'keeps the variant': function (err, response, usage) {
+                assert.isTrue(usage.variants > 0);
+            }
+        },
+        'via `GET` overriding a class that does not exist': {
+            topic: function (map) {
+                return map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits&map.layer[credits].class[5]=NAME+%22oops%22'
+                    }, this.callback);
+            },
+            'returns an error': function (err, response) {
+                assert.instanceOf(err, Error);
+            }
+        },
         'via `POST`': {
             'using a string': {
                 topic: function (map) {
@@ -885,6 +1106,1524 @@ END",
             }
         }
     }
+}).addBatch({
+    // Ensure symbols shared between requests render as expected
+    'requesting a map with symbols': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'symbols.map'), this.callback);
+        },
+        'which shares the symbols': {
+            topic: function (map) {
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=points'
+                    },
+                    this.callback);
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.isTrue(response.data.length > 0);
+            }
+        },
+        'which draws pixmap symbols from the decoded images': {
+            topic: function (map) {
+                var callback = this.callback,
+                    options = {bbox: [0, 0, 400, 300], width: 400, height: 300, layers: ['markers'], raw: 'rgba'};
+                // the first request decodes the image which the second copies
+                map.render(options, function (err, first) {
+                    if (err) return callback(err);
+                    map.render(options, function (err, second) {
+                        callback(err, first, second);
+                    });
+                });
+            },
+            'does not return an error': function (err, first, second) {
+                assert.isNull(err);
+            },
+            'draws the marker each time': function (err, first, second) {
+                // the marker is a green square centred on 50 250
+                var i = 50 * first.stride + 50 * 4;
+                assert.deepEqual([first.data[i], first.data[i + 1], first.data[i + 2], first.data[i + 3]],
+                                 [0, 255, 0, 255]);
+                assertSamePixels(first, second);
+            }
+        },
+        'which shares the symbols concurrently': {
+            topic: function (map) {
+                var body = 'mode=map&layer=points';
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'POST',
+                        'CONTENT_TYPE': 'application/x-www-form-urlencoded',
+                        'CONTENT_LENGTH': body.length
+                    },
+                    body,
+                    this.callback);
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.isTrue(response.data.length > 0);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure compiled expressions are shared with requests
+
+    'A map with regular expressions': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'expressions.map'), this.callback);
+        },
+        'which shares the expressions': {
+            topic: function (map) {
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=points'
+                    },
+                    this.callback);
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.isTrue(response.data.length > 0);
+            }
+        },
+        'which has an expression altered by the request': {
+            topic: function (map) {
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=points&map.layer[0].filter=%2F%5Eg%2F'
+                    },
+                    this.callback);
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.isTrue(response.data.length > 0);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure projections are shared with requests through the projection cache
+
+    'A map with a reprojected layer': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'projections.map'), this.callback);
+        },
+        'rendered repeatedly': {
+            topic: function (map) {
+                var callback = this.callback,
+                    before = mapserv.projectionCacheStats(),
+                    images = [],
+                    count = 8;
+
+                // more renders than threads, so some copies are made by the same thread
+                function next() {
+                    if (images.length == count) {
+                        return callback(null, images, before, mapserv.projectionCacheStats());
+                    }
+                    map.render({bbox: [-180, -90, 180, 90], width: 36, height: 18, raw: 'rgba'},
+                               function (err, image) {
+                        if (err) return callback(err);
+                        images.push(image);
+                        next();
+                    });
+                }
+                next();
+            },
+            'does not return an error': function (err, images, before, after) {
+                assert.isNull(err);
+            },
+            'draws the layer each time': function (err, images, before, after) {
+                images.forEach(function (image) {
+                    var centre = 9 * image.stride + 18 * 4, corner = image.stride + 4;
+                    assert.deepEqual([image.data[centre], image.data[centre + 1], image.data[centre + 2]],
+                                     [255, 0, 0]);
+                    assert.deepEqual([image.data[corner], image.data[corner + 1], image.data[corner + 2]],
+                                     [255, 255, 255]);
+                });
+            },
+            'retrieves projections from the cache': function (err, images, before, after) {
+                assert.isTrue(after.hits > before.hits);
+                assert.isTrue(after.entries > 0);
+            }
+        },
+        'requested with private projections': {
+            topic: function (map) {
+                var callback = this.callback,
+                    mercator = '+proj=merc +a=6378137 +b=6378137 +lat_ts=0 +lon_0=0 +x_0=0 +y_0=0 +k=1 +units=m +nadgrids=@null +no_defs',
+                    responses = {};
+
+                // requests altering projections initialise their own, which are
+                // freed with their copies, before the cached ones are used again
+                map.render({bbox: [-20037508, -10018754, 20037508, 10018754], width: 40, height: 20,
+                            srs: mercator, raw: 'rgba'}, function (err, image) {
+                    if (err) return callback(err);
+                    responses.srs = image;
+                    map.mapserv({
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&LAYERS=mercator&STYLES=' +
+                            '&SRS=EPSG:4326&BBOX=-180,-90,180,90&WIDTH=36&HEIGHT=18&FORMAT=image/png'
+                    }, function (err, response) {
+                        if (err) return callback(err);
+                        responses.wms = response;
+                        map.mapserv({
+                            'REQUEST_METHOD': 'GET',
+                            'QUERY_STRING': 'mode=map&map.projection=' + encodeURIComponent(mercator)
+                        }, function (err, response) {
+                            if (err) return callback(err);
+                            responses.override = response;
+                            map.render({bbox: [-180, -90, 180, 90], width: 36, height: 18, raw: 'rgba'},
+                                       function (err, image) {
+                                responses.cached = image;
+                                callback(err, responses);
+                            });
+                        });
+                    });
+                });
+            },
+            'does not return an error': function (err, responses) {
+                assert.isNull(err);
+            },
+            'draws the layer for an `srs`': function (err, responses) {
+                var image = responses.srs,
+                    centre = 10 * image.stride + 20 * 4, corner = image.stride + 4;
+                assert.deepEqual([image.data[centre], image.data[centre + 1], image.data[centre + 2]],
+                                 [255, 0, 0]);
+                assert.deepEqual([image.data[corner], image.data[corner + 1], image.data[corner + 2]],
+                                 [255, 255, 255]);
+            },
+            'returns an image for an `SRS`': function (err, responses) {
+                assert.deepEqual(responses.wms.headers['Content-Type'], [ 'image/png' ]);
+                assert.isTrue(responses.wms.data.length > 0);
+            },
+            'returns an image for a `map.projection` override': function (err, responses) {
+                assert.deepEqual(responses.override.headers['Content-Type'], [ 'image/png' ]);
+                assert.isTrue(responses.override.data.length > 0);
+            },
+            'keeps the cached projections': function (err, responses) {
+                var image = responses.cached,
+                    centre = 9 * image.stride + 18 * 4;
+                assert.deepEqual([image.data[centre], image.data[centre + 1], image.data[centre + 2]],
+                                 [255, 0, 0]);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure map variants are kept apart by their runtime substitutions
+
+    'A map with runtime substitutions': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'substitutions.map'), this.callback);
+        },
+        'requested repeatedly with different values': {
+            topic: function (map) {
+                var callback = this.callback,
+                    responses = [],
+                    colours = ['red', 'red', 'red', 'blue', 'blue', 'blue'];
+
+                // the second request for a value prepares a variant which the third copies
+                function next() {
+                    if (!colours.length) return callback(null, responses);
+                    map.mapserv(
+                        {
+                            'REQUEST_METHOD': 'GET',
+                            'QUERY_STRING': 'mode=map&layer=square&colour=' + colours.shift()
+                        }, function (err, response) {
+                            if (err) return callback(err);
+                            responses.push(response.data);
+                            next();
+                        });
+                }
+                next();
+            },
+            'does not return an error': function (err, responses) {
+                assert.isNull(err);
+                assert.lengthOf(responses, 6);
+            },
+            'returns the same image for the same value': function (err, responses) {
+                assert.equal(responses[2].toString('base64'), responses[0].toString('base64'));
+                assert.equal(responses[5].toString('base64'), responses[3].toString('base64'));
+            },
+            'returns different images for different values': function (err, responses) {
+                assert.notEqual(responses[3].toString('base64'), responses[0].toString('base64'));
+                assert.notEqual(responses[5].toString('base64'), responses[2].toString('base64'));
+            }
+        }
+    }
+}).addBatch({
+    // Ensure `Map.warm` has the expected interface
+
+    'the `Map.warm` method': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), this.callback);
+        },
+
+        'works with a callback': {
+            topic: function (map) {
+                return typeof(map.warm(function(err, result) {
+                    // do nothing
+                }));
+            },
+            'returning undefined when called': function (retval) {
+                assert.equal(retval, 'undefined');
+            }
+        },
+        'fails with no arguments': {
+            topic: function (map) {
+                try {
+                    return map.warm();
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error': function (err) {
+                assert.instanceOf(err, Error);
+                assert.equal(err.message, 'usage: Map.warm([options], callback)');
+            }
+        },
+        'requires an object for the options': {
+            topic: function (map) {
+                try {
+                    return map.warm('options', function(err, result) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, 'Argument 0 must be an object');
+            }
+        },
+        'requires a positive `size` option': {
+            topic: function (map) {
+                try {
+                    return map.warm({size: 0}, function(err, result) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`size` must be a positive integer');
+            }
+        },
+        'when warming a valid map': {
+            topic: function (map) {
+                map.warm({render: true, size: 64}, this.callback);
+            },
+            'does not return an error': function (err, result) {
+                assert.isNull(err);
+            },
+            'returns a summary': function (err, result) {
+                assert.isObject(result);
+                assert.isTrue(result.threads > 0);
+                assert.equal(result.layers, 1);
+                assert.isNumber(result.symbols);
+                assert.isNumber(result.fonts);
+                assert.isTrue(result.scales > 0);
+                assert.deepEqual(result.failed, []);
+            },
+            'warms every thread': function (err, result) {
+                assert.isTrue(result.ready);
+            }
+        },
+        'when warming a map with raster layers': {
+            topic: function () {
+                var callback = this.callback;
+                mapserv.Map.FromFile(path.join(__dirname, 'raster.map'), function (err, map) {
+                    if (err) return callback(err);
+                    map.warm(callback);
+                });
+            },
+            'does not return an error': function (err, result) {
+                assert.isNull(err);
+            },
+            'opens the readable rasters': function (err, result) {
+                assert.equal(result.layers, 1);
+                assert.deepEqual(result.failed, ['missing']);
+            },
+            'warms every thread': function (err, result) {
+                assert.isTrue(result.ready);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure `Map.analyze` has the expected interface
+
+    'the `Map.analyze` method': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), this.callback);
+        },
+
+        'fails with no arguments': {
+            topic: function (map) {
+                try {
+                    return map.analyze();
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error': function (err) {
+                assert.instanceOf(err, Error);
+                assert.equal(err.message, 'usage: Map.analyze([options], callback)');
+            }
+        },
+        'when analysing a valid map': {
+            topic: function (map) {
+                map.analyze(this.callback);
+            },
+            'does not return an error': function (err, findings) {
+                assert.isNull(err);
+            },
+            'returns an array of findings': function (err, findings) {
+                assert.isArray(findings);
+                findings.forEach(function (finding) {
+                    assert.isString(finding.layer);
+                    assert.isString(finding.type);
+                    assert.include(['warning', 'info'], finding.severity);
+                    assert.isString(finding.message);
+                });
+            }
+        }
+    }
+}).addBatch({
+    // Ensure `Map.seed` renders tile pyramids
+
+    'the `Map.seed` method': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), this.callback);
+        },
+
+        'fails with no arguments': {
+            topic: function (map) {
+                try {
+                    return map.seed();
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error': function (err) {
+                assert.instanceOf(err, Error);
+                assert.equal(err.message, 'usage: Map.seed(options, callback)');
+            }
+        },
+        'requires a destination': {
+            topic: function (map) {
+                try {
+                    return map.seed({maxzoom: 1}, function(err, result) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, 'one of `mbtiles` or `directory` must be given');
+            }
+        },
+        'requires a valid zoom range': {
+            topic: function (map) {
+                try {
+                    return map.seed({minzoom: 2, maxzoom: 1, directory: os.tmpdir()}, function(err, result) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`minzoom` and `maxzoom` must be integers between 0 and 30');
+            }
+        },
+        'when seeding a directory': {
+            topic: function (map) {
+                var directory = path.join(os.tmpdir(), 'node-mapserv-test-' + process.pid + '-tiles'),
+                    callback = this.callback,
+                    progress = 0;
+                map.seed({
+                    grid: {srs: 'EPSG:3857', extent: [0, 0, 4000, 4000], tileSize: 256},
+                    minzoom: 0,
+                    maxzoom: 2,
+                    metatile: 2,
+                    buffer: 16,
+                    directory: directory,
+                    progress: function (status) {
+                        progress++;
+                    }
+                }, function (err, result) {
+                    callback(err, {directory: directory, result: result, progress: progress});
+                });
+            },
+            'returns a summary': function (err, seeded) {
+                assert.isNull(err);
+                assert.equal(seeded.result.total, 21);
+                assert.equal(seeded.result.rendered, 21);
+                assert.equal(seeded.result.stored, 21);
+                assert.equal(seeded.result.skipped, 0);
+                assert.isNumber(seeded.result.tilesPerSecond);
+                assert.isTrue(seeded.progress > 0);
+            },
+            'writes the tiles': function (err, seeded) {
+                assert.isTrue(fs.statSync(path.join(seeded.directory, '0', '0', '0.png')).size > 0);
+                assert.isTrue(fs.statSync(path.join(seeded.directory, '2', '3', '3.png')).size > 0);
+            },
+            'and seeding again skipping existing tiles': {
+                topic: function (seeded, map) {
+                    map.seed({
+                        grid: {srs: 'EPSG:3857', extent: [0, 0, 4000, 4000], tileSize: 256},
+                        maxzoom: 2,
+                        directory: seeded.directory,
+                        skipExisting: true
+                    }, this.callback);
+                },
+                'renders nothing': function (err, result) {
+                    assert.isNull(err);
+                    assert.equal(result.rendered, 0);
+                    assert.equal(result.skipped, 21);
+                }
+            }
+        },
+        'when seeding an MBTiles file': {
+            topic: function (map) {
+                var file = path.join(os.tmpdir(), 'node-mapserv-test-' + process.pid + '.mbtiles'),
+                    callback = this.callback;
+                map.seed({
+                    grid: {srs: 'EPSG:3857', extent: [0, 0, 4000, 4000], tileSize: 256},
+                    maxzoom: 1,
+                    mbtiles: file
+                }, function (err, result) {
+                    callback(err, {file: file, result: result});
+                });
+            },
+            teardown: function (seeded) {
+                fs.unlinkSync(seeded.file);
+            },
+            'stores the tiles': function (err, seeded) {
+                assert.isNull(err);
+                assert.equal(seeded.result.stored, 5);
+                assert.isTrue(fs.statSync(seeded.file).size > 0);
+            }
+        },
+        'when seeding an MBTiles file with a non-square grid': {
+            topic: function (map) {
+                var file = path.join(os.tmpdir(), 'node-mapserv-test-' + process.pid + '-tall.mbtiles'),
+                    callback = this.callback;
+                map.seed({
+                    grid: {srs: 'EPSG:3857', extent: [0, 0, 1000, 4000], tileSize: 256},
+                    maxzoom: 0,
+                    mbtiles: file
+                }, function (err, result) {
+                    if (err) {
+                        return callback(err);
+                    }
+                    // the sqlite3 shell is installed alongside the library
+                    child_process.execFile('sqlite3', [file, 'SELECT tile_row FROM tiles ORDER BY tile_row'], function (err, stdout) {
+                        fs.unlinkSync(file);
+                        callback(err, stdout.trim().split('\n'));
+                    });
+                });
+            },
+            'numbers the rows from the bottom of the grid': function (err, rows) {
+                assert.isNull(err);
+                assert.deepEqual(rows, ['0', '1', '2', '3']);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure requests can be handled without a CGI environment object
+
+    'handling a request': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), this.callback);
+        },
+        'fails with the wrong number of arguments': {
+            topic: function (map) {
+                try {
+                    return map.handle(dummyRequest(), null, function(err, response) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error': function (err) {
+                assert.instanceOf(err, Error);
+                assert.equal(err.message, 'usage: Map.handle(req, body, options, callback)');
+            }
+        },
+        'from a request object': {
+            topic: function (map) {
+                map.handle(dummyRequest(), 'mode=map&layer=credits', {}, this.callback);
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.instanceOf(response.data, buffer.Buffer);
+            }
+        },
+        'using `createHandler`': {
+            topic: function (map) {
+                var callback = this.callback,
+                    server = http.createServer(mapserv.createHandler(map));
+
+                server.listen(0, '127.0.0.1', function onListen() {
+                    http.get({
+                        host: '127.0.0.1',
+                        port: server.address().port,
+                        path: '/?mode=map&layer=credits'
+                    }, function onResponse(res) {
+                        var length = 0;
+                        res.on('data', function (chunk) {
+                            length += chunk.length;
+                        });
+                        res.on('end', function () {
+                            server.close();
+                            callback(null, res, length);
+                        });
+                    }).on('error', callback);
+                });
+            },
+            'writes the response': function (err, res, length) {
+                assert.isNull(err);
+                assert.equal(res.statusCode, 200);
+                assert.equal(res.headers['content-type'], 'image/png');
+                assert.equal(res.headers['content-length'], length);
+                assert.isTrue(length > 0);
+            }
+        },
+        'using `createHandler` with a failing request': {
+            topic: function (map) {
+                var callback = this.callback,
+                    errors = [],
+                    server = http.createServer(mapserv.createHandler(map, {
+                        onError: function (err) {
+                            errors.push(err);
+                        }
+                    }));
+
+                server.listen(0, '127.0.0.1', function onListen() {
+                    http.get({
+                        host: '127.0.0.1',
+                        port: server.address().port,
+                        path: '/?mode=map&layer=credits&zoomdir=2' // bad zoomdir
+                    }, function onResponse(res) {
+                        res.resume();
+                        res.on('end', function () {
+                            server.close();
+                            callback(null, res, errors);
+                        });
+                    }).on('error', callback);
+                });
+            },
+            'passes the error to `onError`': function (err, res, errors) {
+                assert.isNull(err);
+                assert.equal(errors.length, 1);
+                assertMapserverError('Zoom direction must be 1, 0 or -1.', errors[0]);
+            }
+        },
+        'using `createHandler` with a disposed map': {
+            topic: function () {
+                var callback = this.callback,
+                    errors = [];
+
+                mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                    if (err) return callback(err);
+                    var server = http.createServer(mapserv.createHandler(map, {
+                        onError: function (err) {
+                            errors.push(err);
+                        }
+                    }));
+
+                    map.dispose();
+                    server.listen(0, '127.0.0.1', function onListen() {
+                        http.get({
+                            host: '127.0.0.1',
+                            port: server.address().port,
+                            path: '/?mode=map&layer=credits'
+                        }, function onResponse(res) {
+                            res.resume();
+                            res.on('end', function () {
+                                server.close();
+                                callback(null, res, errors);
+                            });
+                        }).on('error', callback);
+                    });
+                });
+            },
+            'sends a plain error': function (err, res, errors) {
+                assert.isNull(err);
+                assert.equal(res.statusCode, 500);
+                assert.equal(res.headers['content-type'], 'text/plain');
+            },
+            'passes the error to `onError`': function (err, res, errors) {
+                assert.equal(errors.length, 1);
+                assert.equal(errors[0].message, 'The map has been disposed');
+            }
+        },
+        'using `createHandler` with invalid options': {
+            topic: function (map) {
+                try {
+                    return mapserv.createHandler(map, {compressionLevel: 10});
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throws an error when the handler is created': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`compressionLevel` must be an integer between 1 and 9');
+            }
+        }
+    }
+}).addBatch({
+    // Ensure requests can be traced
+
+    'tracing requests': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) {
+                    return callback(err);
+                }
+                mapserv.tracing.enable();
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits&map.name=traced'
+                    },
+                    function (err, response) {
+                        mapserv.tracing.disable();
+                        callback(err, JSON.parse(mapserv.tracing.dump()));
+                    });
+            });
+        },
+        'produces a Chrome trace': function (err, trace) {
+            assert.isNull(err);
+            assert.isArray(trace.traceEvents);
+        },
+        'which contains the request phases': function (err, trace) {
+            var names = trace.traceEvents.map(function (event) {
+                return event.name;
+            });
+            ['receive', 'queued', 'loadParams', 'loadMap', 'wait TLOCK_PARSER', 'dispatch', 'output'].forEach(function (name) {
+                assert.include(names, name);
+            });
+        },
+        'which names the threads': function (err, trace) {
+            var threads = trace.traceEvents.filter(function (event) {
+                return event.ph === 'M';
+            }).map(function (event) {
+                return event.args.name.split(' ')[0];
+            });
+            assert.include(threads, 'main');
+            assert.include(threads, 'worker');
+        }
+    }
+}).addBatch({
+    // Ensure slow requests are captured
+
+    'capturing slow requests': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) {
+                    return callback(err);
+                }
+                mapserv.slowRequests.drain(); // discard anything already logged
+                mapserv.slowRequests.configure({
+                    threshold: 0.000001,  // every request is slow
+                    redact: ['token']     // in addition to the defaults
+                });
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits&token=secret',
+                        'HTTP_COOKIE': 'session=secret',
+                        'HTTP_AUTHORIZATION': 'Basic c2VjcmV0'
+                    },
+                    function (err, response) {
+                        mapserv.slowRequests.configure({threshold: 0});
+                        callback(err, mapserv.slowRequests.drain());
+                    });
+            });
+        },
+        'records the request': function (err, entries) {
+            assert.isNull(err);
+            assert.lengthOf(entries, 1);
+        },
+        'with the reproduction context': function (err, entries) {
+            var entry = entries[0];
+            assert.instanceOf(entry.time, Date);
+            assert.isTrue(entry.duration > 0);
+            assert.isNumber(entry.queued);
+            assert.include(entry.phases, 'dispatch');
+            assert.equal(entry.map.name, 'valid');
+            assert.equal(entry.env.REQUEST_METHOD, 'GET');
+            assert.equal(entry.contentType, 'image/png');
+            assert.isTrue(entry.size > 0);
+        },
+        'with values redacted': function (err, entries) {
+            var entry = entries[0];
+            assert.equal(entry.env.QUERY_STRING, 'mode=map&layer=credits&token=REDACTED');
+            assert.equal(entry.env.HTTP_COOKIE, 'REDACTED');
+            assert.equal(entry.env.HTTP_AUTHORIZATION, 'REDACTED');
+        }
+    },
+    'capturing slow XML requests': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) {
+                    return callback(err);
+                }
+                mapserv.slowRequests.drain();
+                mapserv.slowRequests.configure({
+                    threshold: 0.000001,
+                    redact: ['token']
+                });
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'POST',
+                        'CONTENT_TYPE': 'text/xml'
+                    },
+                    '<GetMap token="secret"><ows:Token>secret</ows:Token><Layer>credits</Layer></GetMap>',
+                    function (err, response) {
+                        mapserv.slowRequests.configure({threshold: 0});
+                        callback(null, mapserv.slowRequests.drain());
+                    });
+            });
+        },
+        'redacts matching elements and attributes': function (err, entries) {
+            assert.lengthOf(entries, 1);
+            assert.equal(entries[0].body, '<GetMap token="REDACTED"><ows:Token>REDACTED</ows:Token><Layer>credits</Layer></GetMap>');
+        }
+    }
+}).addBatch({
+    // Ensure responses are compressed as requested
+
+    'requesting compressed output': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), this.callback);
+        },
+        'for an image': {
+            topic: function (map) {
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits',
+                        'HTTP_ACCEPT_ENCODING': 'gzip, deflate'
+                    },
+                    null,
+                    {compression: true, compressionThreshold: 0},
+                    this.callback);
+            },
+            'does not compress the image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.isUndefined(response.headers['Content-Encoding']);
+            }
+        },
+        'for text that the client accepts compressed': {
+            topic: function (map) {
+                var callback = this.callback;
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits&zoomdir=2', // generates an HTML error
+                        'HTTP_ACCEPT_ENCODING': 'deflate;q=0.5, gzip'
+                    },
+                    null,
+                    {compression: true, compressionThreshold: 0},
+                    function (err, response) {
+                        callback(null, response);
+                    });
+            },
+            'compresses the text': function (err, response) {
+                assert.equal(response.headers['Content-Type'][0].substr(0, 9), 'text/html');
+                assert.deepEqual(response.headers['Content-Encoding'], [ 'gzip' ]);
+                assert.deepEqual(response.headers['Vary'], [ 'Accept-Encoding' ]);
+                assert.deepEqual(response.headers['Content-Length'], [ response.data.length ]);
+            },
+            'which can be decompressed': {
+                topic: function (response) {
+                    zlib.gunzip(response.data, this.callback);
+                },
+                'to the original text': function (err, data) {
+                    assert.isNull(err);
+                    assert.include(data.toString(), 'Zoom direction must be 1, 0 or -1.');
+                }
+            }
+        },
+        'for text that the client does not accept compressed': {
+            topic: function (map) {
+                var callback = this.callback;
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits&zoomdir=2',
+                        'HTTP_ACCEPT_ENCODING': 'gzip;q=0, identity'
+                    },
+                    null,
+                    {compression: true, compressionThreshold: 0},
+                    function (err, response) {
+                        callback(null, response);
+                    });
+            },
+            'does not compress the text': function (err, response) {
+                assert.isUndefined(response.headers['Content-Encoding']);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure layers are profiled as requested
+
+    'requesting a profile': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), this.callback);
+        },
+        'of a map': {
+            topic: function (map) {
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits'
+                    },
+                    null,
+                    {profile: true},
+                    this.callback);
+            },
+            'returns the layer timings': function (err, response) {
+                assert.isNull(err);
+                assert.isArray(response.profile);
+                assert.lengthOf(response.profile, 1);
+
+                var layer = response.profile[0];
+                assert.equal(layer.layer, 'credits');
+                assert.equal(layer.index, 0);
+                assert.isTrue(layer.opens > 0);
+                assert.equal(layer.features, 1);
+                assert.equal(layer.labels, 1);
+                ['open', 'whichShapes', 'fetch', 'draw', 'close'].forEach(function (name) {
+                    assert.isNumber(layer[name]);
+                    assert.isTrue(layer[name] >= 0);
+                });
+            }
+        },
+        'when not requested': {
+            topic: function (map) {
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits'
+                    },
+                    this.callback);
+            },
+            'returns no timings': function (err, response) {
+                assert.isNull(err);
+                assert.isUndefined(response.profile);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure performance counters are read when requested and available
+
+    'requesting performance counters': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) return callback(err);
+                map.mapserv(
+                    {
+                        'REQUEST_METHOD': 'GET',
+                        'QUERY_STRING': 'mode=map&layer=credits'
+                    },
+                    null,
+                    {counters: true},
+                    callback);
+            });
+        },
+        'does not prevent the response': function (err, response) {
+            assert.isNull(err);
+            assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+        },
+        'returns the events counted in each phase if available': function (err, response) {
+            if (response.counters === undefined) {
+                return;         // counters are not available on this system
+            }
+            assert.deepEqual(response.counters.map(function (phase) {
+                return phase.phase;
+            }), ['loadParams', 'loadMap', 'dispatch', 'output']);
+            response.counters.forEach(function (phase) {
+                ['cycles', 'instructions', 'cacheMisses', 'contextSwitches'].forEach(function (name) {
+                    if (name in phase) {
+                        assert.isNumber(phase[name]);
+                    }
+                });
+            });
+        }
+    }
+}).addBatch({
+    // Ensure `Map.render` has the expected interface
+
+    'the `Map.render` method': {
+        topic: function () {
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), this.callback);
+        },
+
+        'fails with no arguments': {
+            topic: function (map) {
+                try {
+                    return map.render();
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error': function (err) {
+                assert.instanceOf(err, Error);
+                assert.equal(err.message, 'usage: Map.render(options, callback)');
+            }
+        },
+        'requires a `bbox` option': {
+            topic: function (map) {
+                try {
+                    return map.render({width: 10, height: 10}, function(err, response) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`bbox` must be an array of four numbers');
+            }
+        },
+        'requires a finite `bbox`': {
+            topic: function (map) {
+                try {
+                    return map.render({bbox: [0, 0, Infinity, 3000], width: 10, height: 10}, function(err, response) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`bbox` must contain finite numbers');
+            }
+        },
+        'requires positive `width` and `height` options': {
+            topic: function (map) {
+                try {
+                    return map.render({bbox: [0, 0, 4000, 3000], width: 0, height: 10}, function(err, response) {
+                        // do nothing
+                    });
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`width` and `height` must be positive integers');
+            }
+        },
+        'returns an error for an unknown layer': {
+            topic: function (map) {
+                map.render({bbox: [0, 0, 4000, 3000], width: 40, height: 30, layers: ['oops']}, this.callback);
+            },
+            'of the expected type': function (err, response) {
+                assertMapserverError('Invalid layer: oops', err);
+            }
+        },
+        'when rendering a valid map': {
+            topic: function (map) {
+                map.render({
+                    bbox: [0, 0, 4000, 3000],
+                    width: 40,
+                    height: 30,
+                    layers: ['credits'],
+                    format: 'png',
+                    transparent: true
+                }, this.callback);
+            },
+            'does not return an error': function (err, response) {
+                assert.isNull(err);
+            },
+            'returns an image': function (err, response) {
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.instanceOf(response.data, buffer.Buffer);
+                assert.deepEqual(response.headers['Content-Length'],  [ response.data.length ]);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure raw pixels can be rendered
+
+    'rendering raw pixels': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) return callback(err);
+                callback(null, map);
+            });
+        },
+        'as RGBA': {
+            topic: function (map) {
+                map.render({bbox: [0, 0, 4000, 3000], width: 40, height: 30, raw: 'rgba'}, this.callback);
+            },
+            'returns the pixels': function (err, image) {
+                assert.isNull(err);
+                assert.instanceOf(image.data, buffer.Buffer);
+                assert.equal(image.width, 40);
+                assert.equal(image.height, 30);
+                assert.isTrue(image.stride >= 40 * 4);
+                assert.equal(image.data.length, image.stride * 30);
+                assert.isFalse(image.premultiplied);
+            },
+            'in RGBA order': function (err, image) {
+                // the map has an `IMAGECOLOR` of 200 255 255
+                assert.deepEqual([image.data[0], image.data[1], image.data[2], image.data[3]],
+                                 [200, 255, 255, 255]);
+            }
+        },
+        'premultiplied': {
+            topic: function (map) {
+                map.render({bbox: [0, 0, 4000, 3000], width: 40, height: 30, raw: 'premultiplied'}, this.callback);
+            },
+            'returns the pixels': function (err, image) {
+                assert.isNull(err);
+                assert.isTrue(image.premultiplied);
+            }
+        },
+        'requires a known mode': {
+            topic: function (map) {
+                try {
+                    return map.render({bbox: [0, 0, 4000, 3000], width: 40, height: 30, raw: 'argb'}, function () {});
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, "`raw` must be one of 'rgba'; 'premultiplied'");
+            }
+        }
+    }
+}).addBatch({
+    // Ensure maps can be composited
+
+    'compositing maps': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) return callback(err);
+                callback(null, map);
+            });
+        },
+        'as an encoded image': {
+            topic: function (map) {
+                mapserv.composite([
+                    {map: map},
+                    {map: map, opacity: 0.5, layers: ['credits']}
+                ], {bbox: [0, 0, 4000, 3000], width: 40, height: 30}, this.callback);
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.instanceOf(response.data, buffer.Buffer);
+            }
+        },
+        'as raw pixels': {
+            topic: function (map) {
+                mapserv.composite([
+                    {map: map},
+                    {map: map}
+                ], {bbox: [0, 0, 4000, 3000], width: 40, height: 30, raw: 'rgba'}, this.callback);
+            },
+            'returns the pixels': function (err, image) {
+                assert.isNull(err);
+                assert.equal(image.width, 40);
+                assert.equal(image.height, 30);
+                assert.equal(image.data.length, image.stride * 30);
+            }
+        },
+        'with a part drawing an unknown layer': {
+            topic: function (map) {
+                mapserv.composite([
+                    {map: map},
+                    {map: map, layers: ['missing']}
+                ], {bbox: [0, 0, 4000, 3000], width: 40, height: 30}, this.callback);
+            },
+            'returns an error': function (err, response) {
+                assert.instanceOf(err, Error);
+            }
+        },
+        'requires a valid number of bands': {
+            topic: function (map) {
+                try {
+                    return map.render({bbox: [0, 0, 4000, 3000], width: 40, height: 30, bands: 0}, function () {});
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`bands` must be an integer between 1 and 1024');
+            }
+        },
+        'requires each part to have a map': {
+            topic: function (map) {
+                try {
+                    return mapserv.composite([{map: {}}], {bbox: [0, 0, 4000, 3000], width: 40, height: 30}, function () {});
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, 'the `map` of each part must be a `Map`');
+            }
+        }
+    }
+}).addBatch({
+    // Ensure layers drawn in parallel give the same image as a serial draw
+
+    'rendering layers in parallel': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'layers.map'), function (err, map) {
+                if (err) return callback(err);
+                callback(null, map);
+            });
+        },
+        'compared with a serial render': {
+            topic: function (map) {
+                var callback = this.callback,
+                    options = {bbox: [0, 0, 4000, 3000], width: 40, height: 30, raw: 'rgba'};
+                map.render(options, function (err, serial) {
+                    if (err) return callback(err);
+                    options.parallel = 2;
+                    map.render(options, function (err, parallel) {
+                        callback(err, serial, parallel);
+                    });
+                });
+            },
+            'does not return an error': function (err, serial, parallel) {
+                assert.isNull(err);
+            },
+            'keeps the layer order': function (err, serial, parallel) {
+                // "blue" follows the non parallel "green" layer so must be on top
+                var i = 15 * parallel.stride + 20 * 4;
+                assert.deepEqual([parallel.data[i], parallel.data[i + 1], parallel.data[i + 2], parallel.data[i + 3]],
+                                 [0, 0, 255, 255]);
+            },
+            'returns the same pixels': function (err, serial, parallel) {
+                assertSamePixels(serial, parallel);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure an image drawn in bands is the same as one drawn in one piece
+
+    'rendering in bands': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'layers.map'), function (err, map) {
+                if (err) return callback(err);
+                callback(null, map);
+            });
+        },
+        'compared with an unbanded render': {
+            topic: function (map) {
+                // labels may be placed differently at the seams so are left out
+                var callback = this.callback,
+                    options = {bbox: [0, 0, 4000, 3000], width: 40, height: 30, raw: 'rgba',
+                               layers: ['grey', 'red', 'green', 'blue']};
+                map.render(options, function (err, whole) {
+                    if (err) return callback(err);
+                    options.bands = 3;
+                    options.bandBuffer = 4;
+                    map.render(options, function (err, banded) {
+                        callback(err, whole, banded);
+                    });
+                });
+            },
+            'does not return an error': function (err, whole, banded) {
+                assert.isNull(err);
+            },
+            'returns the same pixels': function (err, whole, banded) {
+                assertSamePixels(whole, banded);
+            }
+        },
+        'above a `bandThreshold`': {
+            topic: function (map) {
+                // labels may be placed differently at the seams so are left out
+                var callback = this.callback,
+                    options = {bbox: [0, 0, 4000, 3000], width: 40, height: 30, raw: 'rgba',
+                               layers: ['grey', 'red', 'green', 'blue']};
+                map.render(options, function (err, whole) {
+                    if (err) return callback(err);
+                    options.bandThreshold = 100;
+                    options.bandBuffer = 4;
+                    map.render(options, function (err, banded) {
+                        callback(err, whole, banded);
+                    });
+                });
+            },
+            'does not return an error': function (err, whole, banded) {
+                assert.isNull(err);
+            },
+            'returns the same pixels': function (err, whole, banded) {
+                assertSamePixels(whole, banded);
+            }
+        },
+        'requires a valid `bandThreshold`': {
+            topic: function (map) {
+                try {
+                    return map.render({bbox: [0, 0, 4000, 3000], width: 40, height: 30, bandThreshold: -1}, function () {});
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`bandThreshold` must be a non-negative integer');
+            }
+        }
+    }
+}).addBatch({
+    // Ensure features can be drawn from typed arrays
+
+    'rendering features passed from javascript': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) return callback(err);
+                callback(null, map);
+            });
+        },
+        'for an existing layer': {
+            topic: function (map) {
+                map.render({
+                    bbox: [0, 0, 4000, 3000],
+                    width: 200,
+                    height: 150,
+                    features: {
+                        credits: {
+                            coordinates: new Float64Array([100, 100, 2000, 1500, 3900, 2900]),
+                            attributes: {
+                                speed: new Float32Array([1, 2, 3]),
+                                name: ['a', 'b', 'c']
+                            }
+                        }
+                    }
+                }, this.callback);
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+                assert.instanceOf(response.data, buffer.Buffer);
+            }
+        },
+        'for an unknown layer': {
+            topic: function (map) {
+                map.render({
+                    bbox: [0, 0, 4000, 3000],
+                    width: 200,
+                    height: 150,
+                    features: {
+                        missing: {coordinates: new Float64Array([100, 100])}
+                    }
+                }, this.callback);
+            },
+            'returns an error': function (err, response) {
+                assert.instanceOf(err, Error);
+                assert.match(err.message, /unknown layer 'missing'/);
+            }
+        },
+        'with attributes of the wrong length': {
+            topic: function (map) {
+                map.render({
+                    bbox: [0, 0, 4000, 3000],
+                    width: 200,
+                    height: 150,
+                    features: {
+                        credits: {
+                            coordinates: new Float64Array([100, 100, 200, 200]),
+                            attributes: {speed: new Float64Array([1])}
+                        }
+                    }
+                }, this.callback);
+            },
+            'returns an error': function (err, response) {
+                assert.instanceOf(err, Error);
+                assert.match(err.message, /one value per feature/);
+            }
+        },
+        'requires coordinates in a Float64Array': {
+            topic: function (map) {
+                try {
+                    return map.render({
+                        bbox: [0, 0, 4000, 3000],
+                        width: 200,
+                        height: 150,
+                        features: {credits: {coordinates: [100, 100]}}
+                    }, function () {});
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`coordinates` must be a Float64Array of x, y pairs');
+            }
+        },
+        'when passed to mapserv': {
+            topic: function (map) {
+                map.mapserv({
+                    REQUEST_METHOD: 'GET',
+                    QUERY_STRING: 'mode=map&layer=credits'
+                }, null, {
+                    features: {
+                        credits: {coordinates: new Float64Array([100, 100])}
+                    }
+                }, this.callback);
+            },
+            'returns an image': function (err, response) {
+                assert.isNull(err);
+                assert.deepEqual(response.headers['Content-Type'],  [ 'image/png' ]);
+            }
+        }
+    }
+}).addBatch({
+    // Ensure cached renders can be invalidated by layer and extent
+
+    'a map caching rendered images': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) return callback(err);
+                map.configureCache({size: 1024 * 1024});
+                map.render({bbox: [0, 0, 2000, 1500], width: 200, height: 150}, function (err) {
+                    if (err) return callback(err);
+                    map.render({bbox: [2000, 1500, 4000, 3000], width: 200, height: 150}, function (err) {
+                        callback(err, map);
+                    });
+                });
+            });
+        },
+        'when invalidating': {
+            topic: function (map) {
+                return {
+                    otherLayer: map.invalidate({layers: ['other']}),
+                    elsewhere: map.invalidate({bbox: [5000, 5000, 6000, 6000]}),
+                    region: map.invalidate({layers: ['credits'], bbox: [0, 0, 1000, 1000]}),
+                    everything: map.invalidate()
+                };
+            },
+            'drops only the affected images': function (result) {
+                assert.equal(result.otherLayer.entries, 0);
+                assert.equal(result.elsewhere.entries, 0);
+                assert.equal(result.region.entries, 1);
+                assert.isTrue(result.region.bytes > 0);
+                assert.equal(result.everything.entries, 1);
+            }
+        },
+        'requires an array of layers': {
+            topic: function (map) {
+                try {
+                    return map.invalidate({layers: 'credits'});
+                } catch (e) {
+                    return e;
+                }
+            },
+            'throwing an error otherwise': function (err) {
+                assert.instanceOf(err, TypeError);
+                assert.equal(err.message, '`layers` must be an array of strings');
+            }
+        }
+    }
+}).addBatch({
+    // Ensure the memory held by maps is reported and can be freed on demand
+
+    'a map being disposed': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) return callback(err);
+                var before = map.memoryUsage(),
+                    maps = mapserv.memoryUsage().mapCount;
+                map.dispose();
+                callback(null, {
+                    map: map,
+                    before: before,
+                    after: map.memoryUsage(),
+                    freed: maps - mapserv.memoryUsage().mapCount
+                });
+            });
+        },
+        'reports its memory before being disposed': function (result) {
+            assert.isTrue(result.before.map > 0);
+            assert.equal(result.before.pending, 0);
+            assert.isFalse(result.before.disposed);
+        },
+        'frees its memory immediately when idle': function (result) {
+            assert.equal(result.after.map, 0);
+            assert.isTrue(result.after.disposed);
+            assert.equal(result.freed, 1);
+        },
+        'throws an error when used afterwards': function (result) {
+            var err;
+            try {
+                result.map.mapserv({}, function () {});
+            } catch (e) {
+                err = e;
+            }
+            assert.instanceOf(err, Error);
+            assert.equal(err.message, 'The map has been disposed');
+        }
+    },
+    'a map disposed during a request': {
+        topic: function () {
+            var callback = this.callback;
+            mapserv.Map.FromFile(path.join(__dirname, 'valid.map'), function (err, map) {
+                if (err) return callback(err);
+                var during;
+                map.render({bbox: [0, 0, 2000, 1500], width: 50, height: 50}, function (err, response) {
+                    callback(err, {during: during, after: map.memoryUsage(), response: response});
+                });
+                map.dispose();
+                during = map.memoryUsage();
+            });
+        },
+        'completes the request': function (result) {
+            assert.instanceOf(result.response.data, buffer.Buffer);
+        },
+        'keeps the map until the request finishes': function (result) {
+            assert.isTrue(result.during.map > 0);
+            assert.equal(result.during.pending, 1);
+            assert.equal(result.after.map, 0);
+        }
+    },
+    'the process memory usage': {
+        topic: mapserv.memoryUsage(),
+        'reports maps and responses': function (usage) {
+            assert.isNumber(usage.maps);
+            assert.isNumber(usage.responses);
+            assert.isNumber(usage.mapCount);
+        }
+    }
 }).addBatch({
     // Ensure `createCGIEnvironment` works as expected
     'calling `createCGIEnvironment`': {
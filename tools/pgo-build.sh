@@ -0,0 +1,62 @@
+#!/bin/bash
+
+##
+# Build an optimised Release binding using profile guided and link time
+# optimisation
+#
+# This builds and benchmarks a plain Release binding, builds an instrumented
+# binding, trains it by running `tools/pgo-train.js`, then rebuilds the
+# binding using the recorded profiles and link time optimisation.  Finally
+# the optimised binding is benchmarked and the speedup over the plain build
+# is reported.  The optimised binding is left in `build/Release`.
+#
+# Example:
+#
+#    npm_config_mapserv_build_dir=/tmp/mapserver-6.2 ./tools/pgo-build.sh
+#
+# The number of training and benchmark iterations can be set using the
+# `PGO_ITERATIONS` and `BENCH_ITERATIONS` environment variables.  This
+# requires GCC.
+#
+
+set -e
+
+NODE_MAPSERV_DIR="$( dirname "$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )" )" # where is the node-mapserv root directory?
+PGO_DIR=${PGO_DIR:-"${NODE_MAPSERV_DIR}/build-pgo"}  # where are profiles written?
+PGO_ITERATIONS=${PGO_ITERATIONS:-200}
+BENCH_ITERATIONS=${BENCH_ITERATIONS:-500}
+
+# The location of the `node-gyp` module builder
+NODE_GYP=${NODE_GYP:-$(which node-gyp || echo "${NODE_MAPSERV_DIR}/node_modules/.bin/node-gyp")}
+
+if [ -z "${npm_config_mapserv_build_dir}" ]; then
+    export npm_config_mapserv_build_dir=$(npm config get mapserv:build_dir)
+fi
+
+cd $NODE_MAPSERV_DIR
+
+# Output the requests per second reported by the training workload
+benchmark() {
+    node tools/pgo-train.js $BENCH_ITERATIONS | \
+        node -e "var s = ''; process.stdin.on('data', function (d) { s += d; }).on('end', function () { console.log(JSON.parse(s).requestsPerSecond.toFixed(1)); });"
+}
+
+echo "Building and benchmarking the plain Release binding..."
+$NODE_GYP rebuild
+BASELINE=$(benchmark)
+
+echo "Building the instrumented binding..."
+rm -rf $PGO_DIR
+mkdir -p $PGO_DIR
+$NODE_GYP rebuild -- -Dpgo=generate -Dpgo_dir=$PGO_DIR
+
+echo "Training..."
+node tools/pgo-train.js $PGO_ITERATIONS
+
+echo "Building the optimised binding..."
+$NODE_GYP rebuild -- -Dpgo=use -Dpgo_dir=$PGO_DIR -Dlto=true
+
+echo "Benchmarking the optimised binding..."
+OPTIMISED=$(benchmark)
+
+node -e "console.log('Plain: %s requests/s; optimised: %s requests/s; speedup: %sx', $BASELINE, $OPTIMISED, ($OPTIMISED / $BASELINE).toFixed(2));"
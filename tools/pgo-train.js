@@ -0,0 +1,188 @@
+/******************************************************************************
+ * Copyright (c) 2014, GeoData Institute (www.geodata.soton.ac.uk)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * Profile guided optimisation training workload
+ *
+ * This exercises the code paths used in production so that the compiler can
+ * optimise for them: WMS GetMap, WFS GetFeature and WMS GetCapabilities
+ * requests are made against a map of generated polygons, lines and labelled
+ * points.  The requests are issued concurrently so that every worker thread
+ * is used.
+ *
+ * When run with an instrumented build (see `tools/pgo-build.sh`) the
+ * profile is written on exit.  The throughput is printed as JSON so that
+ * builds can be compared:
+ *
+ *     node tools/pgo-train.js [iterations]
+ */
+
+var mapserv = require('../lib/mapserv'),
+    iterations = parseInt(process.argv[2], 10) || 200,
+    concurrency = 8;
+
+/**
+ * Generate a mapfile with a deterministic set of inline features
+ */
+function mapfile() {
+    var seed = 1,
+        polygons = [],
+        lines = [],
+        points = [],
+        i, j, x, y, coords;
+
+    // a simple linear congruential generator so every run is identical
+    function random() {
+        seed = (seed * 1103515245 + 12345) % 2147483648;
+        return seed / 2147483648;
+    }
+
+    for (i = 0; i < 200; i++) {
+        x = random() * 340 - 170;
+        y = random() * 160 - 80;
+        coords = [];
+        for (j = 0; j < 24; j++) {
+            coords.push((x + Math.cos(j / 24 * 2 * Math.PI) * (1 + random() * 4)).toFixed(4) + ' ' +
+                        (y + Math.sin(j / 24 * 2 * Math.PI) * (1 + random() * 4)).toFixed(4));
+        }
+        coords.push(coords[0]);
+        polygons.push('FEATURE POINTS ' + coords.join(' ') + ' END ITEMS "' + i + ';zone ' + i + '" END');
+
+        coords = [];
+        for (j = 0; j < 50; j++) {
+            coords.push((x + j * 0.5).toFixed(4) + ' ' + (y + Math.sin(j / 5) * 3).toFixed(4));
+        }
+        lines.push('FEATURE POINTS ' + coords.join(' ') + ' END ITEMS "' + i + ';road ' + i + '" END');
+
+        points.push('FEATURE POINTS ' + x.toFixed(4) + ' ' + y.toFixed(4) + ' END ITEMS "' + i + ';place ' + i + '" END');
+    }
+
+    function layer(name, type, features, style) {
+        return [
+            'LAYER',
+            '  NAME "' + name + '"',
+            '  TYPE ' + type,
+            '  STATUS ON',
+            '  PROJECTION "init=epsg:4326" END',
+            '  PROCESSING "ITEMS=id,name"',
+            '  TEMPLATE "ttt"',
+            '  METADATA "ows_title" "' + name + '" "gml_include_items" "all" END',
+            '  LABELITEM "name"',
+            '  CLASS',
+            style,
+            '  END',
+            features.join('\n'),
+            'END'
+        ].join('\n');
+    }
+
+    return [
+        'MAP',
+        '  NAME "training"',
+        '  EXTENT -180 -90 180 90',
+        '  SIZE 256 256',
+        '  PROJECTION "init=epsg:4326" END',
+        '  IMAGETYPE png',
+        '  WEB METADATA',
+        '    "ows_title" "training"',
+        '    "ows_onlineresource" "http://localhost/"',
+        '    "ows_srs" "EPSG:4326 EPSG:3857"',
+        '    "ows_enable_request" "*"',
+        '  END END',
+        layer('zones', 'POLYGON', polygons,
+              'STYLE COLOR 180 200 160 OUTLINECOLOR 80 100 60 WIDTH 1 END'),
+        layer('roads', 'LINE', lines,
+              'STYLE COLOR 200 80 40 WIDTH 2 END STYLE COLOR 255 220 120 WIDTH 1 END'),
+        layer('places', 'POINT', points,
+              'STYLE SYMBOL 0 SIZE 5 COLOR 0 0 0 END LABEL TYPE BITMAP SIZE SMALL COLOR 0 0 0 POSITION AUTO END'),
+        'END'
+    ].join('\n');
+}
+
+/**
+ * The requests making up the workload, weighted towards GetMap
+ */
+function requests() {
+    var list = [], i, x, y;
+
+    for (i = 0; i < 16; i++) {
+        x = (i % 4) * 90 - 180;
+        y = Math.floor(i / 4) * 45 - 90;
+        list.push('SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&LAYERS=zones,roads,places&STYLES=' +
+                  '&SRS=EPSG:4326&BBOX=' + [x, y, x + 90, y + 45].join(',') +
+                  '&WIDTH=256&HEIGHT=256&FORMAT=image/png');
+    }
+    list.push('SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&LAYERS=zones,roads,places&STYLES=' +
+              '&SRS=EPSG:3857&BBOX=-20037508,-10000000,20037508,10000000&WIDTH=512&HEIGHT=256&FORMAT=image/png');
+    list.push('SERVICE=WFS&VERSION=1.0.0&REQUEST=GetFeature&TYPENAME=places&BBOX=-90,-45,90,45');
+    list.push('SERVICE=WFS&VERSION=1.0.0&REQUEST=GetFeature&TYPENAME=roads&MAXFEATURES=50');
+    list.push('SERVICE=WMS&VERSION=1.1.1&REQUEST=GetCapabilities');
+
+    return list;
+}
+
+mapserv.Map.FromString(mapfile(), function (err, map) {
+    if (err) throw err;
+
+    var queries = requests(),
+        total = iterations * queries.length,
+        issued = 0,
+        completed = 0,
+        failed = 0,
+        start = process.hrtime();
+
+    function next() {
+        if (issued >= total) {
+            return;
+        }
+
+        var query = queries[issued++ % queries.length];
+        map.mapserv({
+            'REQUEST_METHOD': 'GET',
+            'QUERY_STRING': query
+        }, function (err, response) {
+            if (err || !response.data) failed++;
+
+            if (++completed === total) {
+                var elapsed = process.hrtime(start),
+                    seconds = elapsed[0] + elapsed[1] / 1e9;
+                console.log(JSON.stringify({
+                    requests: total,
+                    failed: failed,
+                    seconds: seconds,
+                    requestsPerSecond: total / seconds
+                }));
+                return;
+            }
+            next();
+        });
+    }
+
+    for (var i = 0; i < concurrency; i++) {
+        next();
+    }
+});